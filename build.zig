@@ -22,14 +22,19 @@ pub fn build(b: *Build) void {
     // Default build options.
     const target = b.standardTargetOptions(.{});
     const optimize = b.standardOptimizeOption(.{});
+    const alsa = b.option(
+        bool,
+        "alsa",
+        "Play FLAC and WAV files natively through ALSA (requires alsa-lib)",
+    ) orelse false;
+    const stats = b.option(
+        bool,
+        "stats",
+        "Record timings and counters for --stats and --trace",
+    ) orelse false;
 
     // Main program.
-    const exe = b.addExecutable(.{
-        .name = "play-music",
-        .root_source_file = b.path("src/main.zig"),
-        .target = target,
-        .optimize = optimize,
-    });
+    const exe = addProgram(b, "play-music", target, optimize, alsa, stats, false);
     b.installArtifact(exe);
 
     // Run program command.
@@ -42,4 +47,66 @@ pub fn build(b: *Build) void {
     }
     const run_step = b.step("run", "Run play-music");
     run_step.dependOn(&run_cmd.step);
+
+    // Benchmarks. Always optimized, so that their numbers are comparable
+    // between runs.
+    const bench_exe = addProgram(b, "play-music-bench", target, .ReleaseFast, alsa, false, true);
+    const bench_cmd = b.addRunArtifact(bench_exe);
+    if (b.args) |args| {
+        // Selects the benchmarks to run, like `zig build bench -- scan regex`.
+        bench_cmd.addArgs(args);
+    }
+    const bench_step = b.step("bench", "Run benchmarks");
+    bench_step.dependOn(&bench_cmd.step);
+
+    // Unit tests, of the program and of the regular expressions it uses.
+    const test_step = b.step("test", "Run unit tests");
+    const main_tests = b.addTest(.{
+        .root_source_file = b.path("src/main.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+    addBuildOptions(main_tests, alsa, stats, false);
+    test_step.dependOn(&b.addRunArtifact(main_tests).step);
+    const exre_tests = b.addTest(.{
+        .root_source_file = b.path("src/zig-exre/exre.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+    test_step.dependOn(&b.addRunArtifact(exre_tests).step);
+}
+
+/// The program, or its benchmarks if `bench` is set.
+fn addProgram(
+    b: *Build,
+    name: []const u8,
+    target: Build.ResolvedTarget,
+    optimize: std.builtin.OptimizeMode,
+    alsa: bool,
+    stats: bool,
+    bench: bool,
+) *Build.Step.Compile {
+    const exe = b.addExecutable(.{
+        .name = name,
+        .root_source_file = b.path("src/main.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+    addBuildOptions(exe, alsa, stats, bench);
+    return exe;
+}
+
+/// Gives `compile`, which is built from src/main.zig, the build options it
+/// reads, and the libraries they need.
+fn addBuildOptions(compile: *Build.Step.Compile, alsa: bool, stats: bool, bench: bool) void {
+    const options = compile.step.owner.addOptions();
+    options.addOption(bool, "alsa", alsa);
+    options.addOption(bool, "stats", stats);
+    options.addOption(bool, "bench", bench);
+
+    compile.root_module.addOptions("build_options", options);
+    if (alsa) {
+        compile.linkLibC();
+        compile.linkSystemLibrary("asound");
+    }
 }
@@ -15,46 +15,109 @@
 //! You should have received a copy of the GNU General Public License along with
 //! play-music. If not, see <https://www.gnu.org/licenses/>.
 
+const build_options = @import("build_options");
+const builtin = @import("builtin");
 const std = @import("std");
 const debug = std.debug;
 const fs = std.fs;
+const heap = std.heap;
 const io = std.io;
+const json = std.json;
+const linux = std.os.linux;
+const math = std.math;
 const mem = std.mem;
+const net = std.net;
+const posix = std.posix;
 const process = std.process;
 const time = std.time;
 const Allocator = std.mem.Allocator;
 const ArgIterator = std.process.ArgIterator;
 const ArrayListUnmanaged = std.ArrayListUnmanaged;
 const AutoHashMapUnmanaged = std.hash_map.AutoHashMapUnmanaged;
+const BufferedReader = std.io.BufferedReader;
 const BufferedWriter = std.io.BufferedWriter;
 const Child = std.process.Child;
+const DynamicBitSetUnmanaged = std.DynamicBitSetUnmanaged;
+const EnumArray = std.EnumArray;
+const EnumSet = std.EnumSet;
 const File = std.fs.File;
 const GeneralPurposeAllocator = std.heap.GeneralPurposeAllocator;
 const Random = std.Random;
 const StaticStringMap = std.StaticStringMap;
+const StringHashMapUnmanaged = std.StringHashMapUnmanaged;
+const Stream = std.net.Stream;
+const Thread = std.Thread;
+const WaitGroup = std.Thread.WaitGroup;
+const Wyhash = std.hash.Wyhash;
 const BufferedFileWriter = BufferedWriter(4096, File.Writer);
+const BufferedStreamReader = BufferedReader(4096, Stream.Reader);
 const RandomPrng = Random.DefaultPrng;
 
 fn bufferedFileWriter(writer: File.Writer) BufferedFileWriter {
     return .{ .unbuffered_writer = writer };
 }
 
+/// Buffers output to standard output or error, and hands it to `EventLog`
+/// on `flush`, or once the buffer is full. Only whole lines are handed over
+/// when the buffer fills, so that the log drops whole lines if it must.
+const ConsoleWriter = struct {
+    const Self = @This();
+
+    stream: EventLog.Stream,
+    buffer: [buffer_size]u8 = undefined,
+    end: usize = 0,
+
+    const buffer_size = 4096;
+    const Writer = io.Writer(*Self, error{}, write);
+
+    fn writer(self: *Self) Writer {
+        return .{ .context = self };
+    }
+
+    /// Never blocks (see `EventLog`.)
+    fn flush(self: *Self) error{}!void {
+        EventLog.append(self.stream, self.buffer[0..self.end]);
+        self.end = 0;
+    }
+
+    fn write(self: *Self, bytes: []const u8) error{}!usize {
+        if (self.buffer.len - self.end < bytes.len) {
+            const lines_end = if (mem.lastIndexOfScalar(u8, self.buffer[0..self.end], '\n')) |index|
+                index + 1
+            else
+                self.end;
+            EventLog.append(self.stream, self.buffer[0..lines_end]);
+            mem.copyForwards(u8, &self.buffer, self.buffer[lines_end..self.end]);
+            self.end -= lines_end;
+        }
+        const length = @min(bytes.len, self.buffer.len - self.end);
+        @memcpy(self.buffer[self.end..][0..length], bytes[0..length]);
+        self.end += length;
+        return length;
+    }
+};
+
 const exre = @import("zig-exre/exre.zig");
 const RegexMatchConfig = exre.RegexMatchConfig;
-const Regex = exre.Regex(.{});
+const Regex = exre.WideRegex;
 
 ////////////////////////////////////////////////////////////////////////////////
 // CLI                                                                        //
 ////////////////////////////////////////////////////////////////////////////////
 
 pub fn main() !void {
-    var stderr = bufferedFileWriter(io.getStdErr().writer());
+    if (build_options.bench) return Benchmarks.run();
+
+    // Stopped last, so that all output is written.
+    try EventLog.init();
+    defer EventLog.deinit();
+    var stderr = ConsoleWriter{ .stream = .stderr };
     defer stderr.flush() catch {};
-    var stdout = bufferedFileWriter(io.getStdOut().writer());
+    var stdout = ConsoleWriter{ .stream = .stdout };
     defer stdout.flush() catch {};
 
     var gpa = GeneralPurposeAllocator(.{}){};
-    const allocator = gpa.allocator();
+    const allocator = if (Stats.enabled) Stats.countAllocations(gpa.allocator()) else gpa.allocator();
     defer _ = gpa.deinit();
 
     ParsedArguments.init(
@@ -67,39 +130,221 @@ pub fn main() !void {
     };
     defer ParsedArguments.deinit();
 
+    try Stats.init(&stderr);
+    defer Stats.deinit();
+
     var prng = RandomPrng.init(@as(u64, @bitCast(time.milliTimestamp())));
     const random = prng.random();
 
+    const players_mark = Stats.begin();
     try SoundSystem.init(allocator);
     defer SoundSystem.deinit();
+    Stats.end(.players, players_mark);
 
-    const regex: ?Regex = if (ParsedArguments.match) |pattern|
-        Regex.compile(allocator, pattern) catch |err| {
-            switch (err) {
-                error.RegexInvalid => try stderr.writer().print(
-                    "ERROR: Match pattern '{s}' is invalid (no more information, sorry)\n",
-                    .{pattern},
-                ),
-                error.RegexTooComplex => try stderr.writer().print(
-                    "ERROR: Match pattern '{s}' is too complex (no more information, sorry.)\n",
-                    .{pattern},
-                ),
-                error.OutOfMemory => {},
-            }
-            return err;
-        }
-    else
-        null;
-    defer if (regex) |r| r.deinit();
+    try ReadAhead.init(allocator);
+    defer ReadAhead.deinit();
+
+    try TagReader.init(allocator);
+    defer TagReader.deinit();
+
+    const patterns_mark = Stats.begin();
+    var filter = try compilePatterns(allocator, &stderr);
+    defer if (filter) |f| f.deinit();
+    Stats.end(.patterns, patterns_mark);
+
+    const index_mark = Stats.begin();
+    try LibraryIndex.init(allocator);
+    defer LibraryIndex.deinit();
+    Stats.end(.index, index_mark);
+
+    try LoudnessAnalyzer.init(allocator);
+    defer LoudnessAnalyzer.deinit();
 
     var playlist = Playlist.init(allocator);
     defer playlist.deinit();
+
+    if (ParsedArguments.stream or ParsedArguments.daemon or ParsedArguments.watch) {
+        var feed = PlaylistFeed{
+            .playlist = &playlist,
+            .random = if (ParsedArguments.shuffle) random else null,
+        };
+        defer feed.deinit();
+        if (ParsedArguments.daemon) {
+            // Applied while playing instead, so that they can be changed.
+            feed.filter = filter;
+            filter = null;
+        }
+        // Stopped after the control server, since directories added with it
+        // are watched too.
+        if (DirectoryWatcher.supported and ParsedArguments.watch) {
+            try DirectoryWatcher.init(allocator, &stderr, &stdout, filter, &feed);
+        }
+        defer if (DirectoryWatcher.supported and DirectoryWatcher.initialized) DirectoryWatcher.deinit();
+        if (ParsedArguments.daemon) try ControlServer.init(allocator, &stderr, &stdout, &feed);
+        defer if (ControlServer.initialized) ControlServer.deinit();
+        const loader = try Thread.spawn(
+            .{},
+            loadPlaylistFeed,
+            .{ &stderr, &stdout, filter, &feed },
+        );
+        defer loader.join();
+
+        playPlaylistFeed(&stderr, &stdout, &feed) catch |err| switch (err) {
+            error.Quit => return,
+            else => return err,
+        };
+        return;
+    }
+
+    try loadPlaylist(&stderr, &stdout, filter, &playlist, null);
+
+    {
+        const songs_loaded = playlist.songs.len;
+        if (0 == songs_loaded) {
+            try stderr.writer().print("ERROR: No songs were found\n", .{});
+            return error.NoSongsLoaded;
+        }
+        try stdout.writer().print(
+            "INFO: {d} song(s) loaded in total\n",
+            .{songs_loaded},
+        );
+    }
+
+    const shuffle_random = if (ParsedArguments.shuffle) random else null;
+    const songs = playlist.songs.slice();
+    const failed = songs.items(.failed);
+    const shuffle_mark = Stats.begin();
+    var order = PlayOrder.init(songs.len, shuffle_random);
+    Stats.end(.shuffle, shuffle_mark);
+    if (ParsedArguments.export_path) |path| {
+        return exportPlaylist(&stderr, &stdout, &playlist, order, path);
+    }
+    var path_buffer: [fs.max_path_bytes]u8 = undefined;
+    while (true) {
+        // Drawn in advance so that songs can be read ahead across cycles.
+        const next_order = PlayOrder.init(songs.len, shuffle_random);
+        var songs_played: usize = 0;
+        for (0..songs.len) |position| {
+            const index = order.at(position);
+            if (failed[index]) continue;
+            const song = songs.get(index);
+            const path = try playlist.songPath(song, &path_buffer);
+            try stdout.writer().print("INFO: Now playing: {s}\n", .{path});
+            try stderr.flush();
+            try stdout.flush();
+            try ReadAhead.request(
+                &playlist,
+                order,
+                if (ParsedArguments.repeat) next_order else null,
+                position + 1,
+            );
+            try LoudnessAnalyzer.request(
+                &playlist,
+                order,
+                if (ParsedArguments.repeat) next_order else null,
+                position,
+            );
+            if (try SoundSystem.playSong(path, song.format)) {
+                songs_played += 1;
+            } else {
+                failed[index] = true;
+                try reportFailedSong(stderr, path);
+            }
+        }
+
+        if (!ParsedArguments.repeat) break;
+        if (0 == songs_played) return noSongsPlayed(stderr);
+        order = next_order;
+    }
+}
+
+/// Writes the songs of `playlist` to the file at `path` as an M3U playlist,
+/// in `order` (see `--export`.)
+fn exportPlaylist(
+    stderr: *ConsoleWriter,
+    stdout: *ConsoleWriter,
+    playlist: *const Playlist,
+    order: PlayOrder,
+    path: []const u8,
+) !void {
+    // So that the playlist can be played from anywhere.
+    const cwd = try process.getCwdAlloc(playlist.allocator);
+    defer playlist.allocator.free(cwd);
+
+    var file = fs.cwd().atomicFile(path, .{}) catch |err| {
+        try stderr.writer().print(
+            "ERROR: Unable to export playlist ({s}): {s}\n",
+            .{ @errorName(err), path },
+        );
+        return err;
+    };
+    defer file.deinit();
+
+    var buffered_writer = bufferedFileWriter(file.file.writer());
+    const writer = buffered_writer.writer();
+    try writer.writeAll("#EXTM3U\n");
+    var path_buffer: [fs.max_path_bytes]u8 = undefined;
+    for (0..playlist.songs.len) |position| {
+        const song_path = try playlist.songPath(playlist.songs.get(order.at(position)), &path_buffer);
+        if (!fs.path.isAbsolute(song_path)) try writer.print("{s}{c}", .{ cwd, fs.path.sep });
+        try writer.print("{s}\n", .{song_path});
+    }
+    try buffered_writer.flush();
+    file.finish() catch |err| {
+        try stderr.writer().print(
+            "ERROR: Unable to export playlist ({s}): {s}\n",
+            .{ @errorName(err), path },
+        );
+        return err;
+    };
+
+    try stdout.writer().print(
+        "INFO: {d} song(s) exported to: {s}\n",
+        .{ playlist.songs.len, path },
+    );
+}
+
+/// Called when a song could not be played. It is skipped from then on,
+/// unless `--no-skip-unplayable` was passed, in which case this fails.
+fn reportFailedSong(stderr: *ConsoleWriter, path: []const u8) !void {
+    if (!ParsedArguments.skip_unplayable) {
+        try stderr.writer().print("ERROR: Unable to play song: {s}\n", .{path});
+        return error.SongFailed;
+    }
+    try stderr.writer().print(
+        "WARN: Unable to play song, skipping it from now on: {s}\n",
+        .{path},
+    );
+}
+
+/// Called when none of the songs could be played in a whole cycle, to avoid
+/// trying them again in an endless loop.
+fn noSongsPlayed(stderr: *ConsoleWriter) !void {
+    try stderr.writer().print("ERROR: None of the songs could be played\n", .{});
+    return error.NoSongsPlayed;
+}
+
+/// Loads the songs from the directories and playlist files passed on the
+/// command line. If `feed` is not `null`, songs are being played while this
+/// runs, and output is synchronized with it.
+fn loadPlaylist(
+    stderr: *ConsoleWriter,
+    stdout: *ConsoleWriter,
+    filter: ?SongFilter,
+    playlist: *Playlist,
+    feed: ?*PlaylistFeed,
+) !void {
+    const scan_mark = Stats.begin();
     for (ParsedArguments.directories.items) |directory| {
+        const directory_mark = Stats.begin();
         const songs_loaded = playlist.appendFromDirectory(
-            &stderr,
-            regex,
+            stderr,
+            filter,
             directory,
+            feed,
         ) catch |err| {
+            if (feed) |f| f.mutex.lock();
+            defer if (feed) |f| f.mutex.unlock();
             switch (err) {
                 error.FileNotFound => try stdout.writer().print(
                     "ERROR: Directory does not exist: {s}\n",
@@ -109,42 +354,137 @@ pub fn main() !void {
             }
             return err;
         };
+
+        Stats.loaded(.directory, directory, songs_loaded, directory_mark);
+        if (feed) |f| f.mutex.lock();
+        defer if (feed) |f| f.mutex.unlock();
         try stdout.writer().print(
             "INFO: {d} song(s) loaded from directory: {s}\n",
             .{ songs_loaded, directory },
         );
     }
-    if (ParsedArguments.shuffle) playlist.shuffle(random);
 
-    {
-        const songs_loaded = playlist.songs.items.len;
-        if (0 == songs_loaded) {
-            try stderr.writer().print("ERROR: No songs were found\n", .{});
-            return error.NoSongsLoaded;
-        }
+    for (ParsedArguments.playlist_files.items) |path| {
+        const playlist_mark = Stats.begin();
+        const songs_loaded = PlaylistFile.load(
+            playlist,
+            stderr,
+            filter,
+            path,
+            feed,
+        ) catch |err| {
+            if (feed) |f| f.mutex.lock();
+            defer if (feed) |f| f.mutex.unlock();
+            switch (err) {
+                error.OutOfMemory, error.PlaylistTooLarge, error.UnplayableFormat => {},
+                else => try stdout.writer().print(
+                    "ERROR: Unable to read playlist ({s}): {s}\n",
+                    .{ @errorName(err), path },
+                ),
+            }
+            return err;
+        };
+
+        Stats.loaded(.playlist, path, songs_loaded, playlist_mark);
+        if (feed) |f| f.mutex.lock();
+        defer if (feed) |f| f.mutex.unlock();
         try stdout.writer().print(
-            "INFO: {d} song(s) loaded in total\n",
-            .{songs_loaded},
+            "INFO: {d} song(s) loaded from playlist: {s}\n",
+            .{ songs_loaded, path },
         );
     }
+    Stats.end(.scan, scan_mark);
+    defer Stats.reportTotals();
+    {
+        if (feed) |f| f.mutex.lock();
+        defer if (feed) |f| f.mutex.unlock();
+        try EventLog.reportCoalesced(stderr.writer());
+    }
+
+    LibraryIndex.save() catch |err| {
+        if (feed) |f| f.mutex.lock();
+        defer if (feed) |f| f.mutex.unlock();
+        try stderr.writer().print(
+            "WARN: Unable to save library index: {s}\n",
+            .{@errorName(err)},
+        );
+    };
+}
+
+/// Entry point of the thread that loads the playlist with `--stream`.
+fn loadPlaylistFeed(
+    stderr: *ConsoleWriter,
+    stdout: *ConsoleWriter,
+    filter: ?SongFilter,
+    feed: *PlaylistFeed,
+) void {
+    const result = loadPlaylist(stderr, stdout, filter, feed.playlist, feed);
+
+    feed.mutex.lock();
+    defer feed.mutex.unlock();
+    if (result) |_| {
+        const songs_loaded = feed.playlist.songs.len;
+        if (0 < songs_loaded) stdout.writer().print(
+            "INFO: {d} song(s) loaded in total\n",
+            .{songs_loaded},
+        ) catch {};
+    } else |_| {}
+    feed.finish(result);
+}
 
+/// Plays songs as they are loaded with `--stream`.
+fn playPlaylistFeed(
+    stderr: *ConsoleWriter,
+    stdout: *ConsoleWriter,
+    feed: *PlaylistFeed,
+) !void {
+    var path_buffer: [fs.max_path_bytes]u8 = undefined;
     while (true) {
-        for (playlist.songs.items) |song| {
-            try stdout.writer().print("INFO: Now playing: {s}\n", .{song.file_path});
-            try stderr.flush();
-            try stdout.flush();
-            try SoundSystem.playSong(song);
+        const changes = feed.changeCount();
+        var songs_played: usize = 0;
+        while (try feed.take(&path_buffer)) |entry| {
+            {
+                feed.mutex.lock();
+                defer feed.mutex.unlock();
+                try stdout.writer().print("INFO: Now playing: {s}\n", .{entry.path});
+                try stderr.flush();
+                try stdout.flush();
+                // Songs after the next ones may still be shuffled, so this
+                // does not wrap around.
+                try ReadAhead.request(feed.playlist, feed.playOrder(), null, feed.next);
+                try LoudnessAnalyzer.request(feed.playlist, feed.playOrder(), null, feed.next - 1);
+            }
+            if (try SoundSystem.playSong(entry.path, entry.format)) {
+                songs_played += 1;
+            } else {
+                feed.mutex.lock();
+                defer feed.mutex.unlock();
+                feed.playlist.songs.items(.failed)[entry.index] = true;
+                try reportFailedSong(stderr, entry.path);
+            }
         }
 
-        if (!ParsedArguments.repeat) break;
+        // Loading has finished by now.
+        if ((ParsedArguments.daemon or ParsedArguments.watch) and 0 == songs_played) {
+            // Until songs are added or the filter is changed.
+            try feed.waitForChange(changes);
+        } else if (0 == feed.playlist.songs.len) {
+            try stderr.writer().print("ERROR: No songs were found\n", .{});
+            return error.NoSongsLoaded;
+        } else if (!ParsedArguments.repeat) {
+            break;
+        } else if (0 == songs_played) {
+            return noSongsPlayed(stderr);
+        }
+        feed.restart();
     }
 }
 
-fn printVersion(to: *BufferedFileWriter) !void {
+fn printVersion(to: *ConsoleWriter) !void {
     try to.writer().print("{s} 0.2.0\n", .{ParsedArguments.program_name});
 }
 
-fn printLicensing(to: *BufferedFileWriter) !void {
+fn printLicensing(to: *ConsoleWriter) !void {
     try to.writer().print(
         \\Copyright (c) 2025 ona-li-toki-e-jan-Epiphany-tawa-mi
         \\
@@ -178,16 +518,21 @@ fn printLicensing(to: *BufferedFileWriter) !void {
     , .{});
 }
 
-fn printHelp(to: *BufferedFileWriter) !void {
+fn printHelp(to: *ConsoleWriter) !void {
     try to.writer().print(
         \\Usages:
-        \\  {s} [OPTION...] [--] DIRECTORY...
+        \\  {0s} [OPTION...] [--] DIRECTORY...
+        \\  {0s} [OPTION...] --playlist FILE [[--] DIRECTORY...]
         \\
-        \\Plays the music files located in DIRECTORY.
+        \\Plays the music files located in DIRECTORY, and those listed in FILE.
         \\
         \\Available play strategies (in order of priority):
-        \\  1. With mpv, if present.
-        \\  2. With cvlc, if present.
+        \\  1. For FLAC and WAV, decoded in-process and played through ALSA, if
+        \\     built with -Dalsa and a sound card is present.
+        \\  2. With mpv, if present.
+        \\  3. With cvlc, if present.
+        \\If a player fails to play a song, the next one is tried. Songs that
+        \\none of them can play are skipped in later repeats.
         \\
         \\Options:
         \\  -h, --help       Display help and exit.
@@ -197,11 +542,49 @@ fn printHelp(to: *BufferedFileWriter) !void {
         \\  -m, --match REGEX
         \\    Only plays songs whose file name matches REGEX. REGEX is not case
         \\    sensitive and succeeds on a partial match. Uses zig-exre
-        \\    <https://sr.ht/~leon_plickat/zig-exre/>.
+        \\    <https://sr.ht/~leon_plickat/zig-exre/>. May be given multiple
+        \\    times, to play songs matching any of them. REGEX may start with
+        \\    'artist:', 'album:', 'title:' or 'genre:' to match that tag
+        \\    instead, which implies --tags.
+        \\
+        \\  --exclude REGEX
+        \\    Does not play songs whose file name matches REGEX, even if they
+        \\    match --match. May be given multiple times, and may match tags
+        \\    like --match.
+        \\
+        \\  --tags
+        \\    Reads the artist, album, title and genre of each song from its
+        \\    ID3, Vorbis comment or RIFF INFO tags while scanning, in
+        \\    parallel. The tags are cached with the directory listings, and
+        \\    read again from the files that change.
+        \\
+        \\  -r, --recursive
+        \\    Also plays the songs in the subdirectories of DIRECTORY.
+        \\    Directories are scanned in parallel. Symbolic links to
+        \\    directories are not followed.
+        \\
+        \\  --playlist FILE
+        \\    Also plays the songs listed in the M3U or PLS playlist FILE, in
+        \\    the order they are listed with --no-shuffle. Relative paths are
+        \\    relative to FILE, and URLs other than 'file://' are skipped. May
+        \\    be given multiple times.
+        \\
+        \\  --export FILE
+        \\    Writes the songs that would be played, once --match and
+        \\    --exclude are applied and in the order of the first cycle, to
+        \\    FILE as an M3U playlist, and exits instead of playing them.
+        \\    Cannot be combined with --stream, --daemon or --watch.
+        \\
+        \\  --stream
+        \\    Starts playing songs while the directories are still being
+        \\    scanned. Songs found later are shuffled into the ones that have
+        \\    not been played yet. With --recursive and --no-shuffle, songs are
+        \\    played in the order they are found.
         \\
         \\  --no-shuffle
         \\    Plays the songs in the order they appear in the directory,
-        \\    instead of randomly shuffling them.
+        \\    instead of randomly shuffling them. When shuffling, each repeat
+        \\    plays the songs in a new order.
         \\
         \\  --no-repeat
         \\    Exits once all the songs have been played, instead of repeating
@@ -211,10 +594,127 @@ fn printHelp(to: *BufferedFileWriter) !void {
         \\    Exits if some of the songs cannot be played, instead of skipping
         \\    them.
         \\
+        \\  --read-ahead COUNT
+        \\    Reads the next COUNT songs into memory while the current one
+        \\    plays, so that they start without waiting on slow storage. Uses
+        \\    at most 256 MiB. 0 disables it. Defaults to 2.
+        \\
+        \\  --sniff
+        \\    Checks the first bytes of each song for its format, instead of only
+        \\    trusting file extensions. Files that do not look like songs are
+        \\    skipped. The results are cached with the directory listings, and
+        \\    the files that change are checked again.
+        \\
+        \\  --queue-depth DEPTH
+        \\    The most requests for file metadata and, with --sniff, contents
+        \\    made at once while scanning directories, on Linux. Higher values
+        \\    help with network filesystems. Defaults to 64.
+        \\
+        \\  --sample-rate RATE
+        \\    Converts songs played natively (see above) to RATE Hz, instead of
+        \\    playing each at its own rate. Avoids reopening the sound card
+        \\    between songs of different rates.
+        \\
+        \\  --resample-quality QUALITY
+        \\    How carefully --sample-rate converts songs: 'low', 'medium' or
+        \\    'high'. Higher qualities take more processing. Defaults to
+        \\    'medium'.
+        \\
+        \\  --normalize
+        \\    Plays songs at the same loudness. FLAC and WAV songs are measured
+        \\    (EBU R128) a few songs ahead of the one playing, in the
+        \\    background and only while the computer is otherwise idle. The
+        \\    results are cached. Other songs are adjusted by mpv or cvlc from
+        \\    their ReplayGain tags, if they have them.
+        \\
+        \\  --daemon
+        \\    Keeps running once the songs are loaded, and accepts commands
+        \\    over a Unix socket. Commands are lines of text, and each is
+        \\    answered with a line starting with 'OK' or 'ERROR':
+        \\      skip            Stops the song being played.
+        \\      pause, resume   Pauses or resumes playing.
+        \\      match [REGEX]   Only plays songs whose file name matches
+        \\                      REGEX from now on, in place of --match,
+        \\                      or all songs without REGEX. Songs
+        \\                      matching --exclude are still left out.
+        \\      add DIRECTORY   Loads the songs in DIRECTORY too.
+        \\      quit            Exits.
+        \\    Implies --stream. --match and --exclude are applied as songs are
+        \\    played, instead of while loading them.
+        \\
+        \\  --socket PATH
+        \\    The socket to create with --daemon. Defaults to
+        \\    $XDG_RUNTIME_DIR/play-music.sock, or /tmp/play-music.sock.
+        \\
+        \\  --watch
+        \\    Keeps running once the songs are loaded, and adds and removes
+        \\    songs as they are added to and removed from DIRECTORY, and,
+        \\    with --recursive, its subdirectories. Linux only. Implies
+        \\    --stream.
+        \\
+        \\  --stats
+        \\    Prints how long each phase of loading took and for each directory
+        \\    and playlist, how many files were scanned and rejected, how much
+        \\    was allocated, and how long each song took to start, on lines
+        \\    starting with 'STATS:'. Requires building with -Dstats.
+        \\
+        \\  --trace FILE
+        \\    Writes the same timings and counters as --stats to FILE, as JSON
+        \\    lines. Requires building with -Dstats.
+        \\
+        \\  --no-cache
+        \\    Does not read or write cache files, which remember the players
+        \\    that are available and the contents of directories between runs.
+        \\    The cache is stored in $XDG_CACHE_HOME/play-music, or
+        \\    ~/.cache/play-music.
+        \\
     , .{ParsedArguments.program_name});
 }
 
-fn printShortHelp(to: *BufferedFileWriter) !void {
+/// Compiles the `--match` and `--exclude` patterns (see `SongFilter`), or
+/// returns `null` if there are none.
+fn compilePatterns(allocator: Allocator, stderr: *ConsoleWriter) !?SongFilter {
+    const patterns = ParsedArguments.patterns.items;
+    if (patterns.len == 0) return null;
+    if (patterns.len > exre.max_set_patterns) {
+        try stderr.writer().print(
+            "ERROR: At most {} match and exclude patterns are supported\n",
+            .{exre.max_set_patterns},
+        );
+        return error.RegexTooComplex;
+    }
+
+    // Compile the patterns on their own first, so that errors can name the
+    // offending one.
+    for (patterns) |pattern| {
+        _, const regex = SongFilter.splitPattern(pattern);
+        const r = Regex.compile(allocator, regex) catch |err| {
+            switch (err) {
+                error.RegexInvalid => try stderr.writer().print(
+                    "ERROR: Match pattern '{s}' is invalid (no more information, sorry)\n",
+                    .{pattern},
+                ),
+                error.RegexTooComplex => try stderr.writer().print(
+                    "ERROR: Match pattern '{s}' is too complex (no more information, sorry.)\n",
+                    .{pattern},
+                ),
+                error.OutOfMemory => {},
+            }
+            return err;
+        };
+        r.deinit();
+    }
+
+    return SongFilter.compile(allocator, patterns, ParsedArguments.match_count) catch |err| {
+        if (err == error.RegexTooComplex) try stderr.writer().print(
+            "ERROR: Match and exclude patterns are too complex together (no more information, sorry.)\n",
+            .{},
+        );
+        return err;
+    };
+}
+
+fn printShortHelp(to: *ConsoleWriter) !void {
     try to.writer().print(
         "Try '{s} -h' for more information\n",
         .{ParsedArguments.program_name},
@@ -227,29 +727,82 @@ const ParsedArguments = struct {
 
     var program_name: []const u8 = undefined;
     var directories: ArrayListUnmanaged([]u8) = undefined;
-    var match: ?[]u8 = undefined;
+    /// The `--playlist` files.
+    var playlist_files: ArrayListUnmanaged([]u8) = undefined;
+    /// Owned. The `--export` file, or `null` to play the songs.
+    var export_path: ?[]u8 = undefined;
+    /// The `--match` patterns, followed by the `--exclude` patterns.
+    var patterns: ArrayListUnmanaged([]u8) = undefined;
+    var match_count: usize = undefined;
     var shuffle: bool = undefined;
     var repeat: bool = undefined;
     var skip_unplayable: bool = undefined;
+    var cache: bool = undefined;
+    var recursive: bool = undefined;
+    var stream: bool = undefined;
+    var sniff: bool = undefined;
+    var tags: bool = undefined;
+    var read_ahead: u8 = undefined;
+    const max_read_ahead = 16;
+    var queue_depth: u16 = undefined;
+    const max_queue_depth = 4096;
+    /// 0 keeps the sample rate of each song.
+    var sample_rate: u32 = undefined;
+    const min_sample_rate = 8000;
+    const max_sample_rate = 384000;
+    var resample_quality: Resampler.Quality = undefined;
+    var normalize: bool = undefined;
+    var daemon: bool = undefined;
+    /// Owned. `null` uses the default (see `ControlServer`.)
+    var socket_path: ?[]u8 = undefined;
+    var watch: bool = undefined;
+    var stats: bool = undefined;
+    /// Owned. The `--trace` file, or `null` for none.
+    var trace_path: ?[]u8 = undefined;
 
     /// Deinitialize with `deinit`.
     fn init(
         allocatorr: Allocator,
-        stderr: *BufferedFileWriter,
-        stdout: *BufferedFileWriter,
+        stderr: *ConsoleWriter,
+        stdout: *ConsoleWriter,
     ) !void {
+        initDefaults(allocatorr);
+        errdefer deinit();
+        try parseArguments(stderr, stdout);
+    }
+
+    /// Like `init`, without parsing the command line, for `Benchmarks`.
+    /// Deinitialize with `deinit`.
+    fn initDefaults(allocatorr: Allocator) void {
         debug.assert(!initialized);
 
         allocator = allocatorr;
+        program_name = "play-music";
         directories = ArrayListUnmanaged([]u8).empty;
-        match = null;
+        playlist_files = ArrayListUnmanaged([]u8).empty;
+        export_path = null;
+        patterns = ArrayListUnmanaged([]u8).empty;
+        match_count = 0;
         shuffle = true;
         repeat = true;
         skip_unplayable = true;
-        errdefer deinit();
+        cache = true;
+        recursive = false;
+        stream = false;
+        sniff = false;
+        tags = false;
+        read_ahead = 2;
+        queue_depth = 64;
+        sample_rate = 0;
+        resample_quality = .medium;
+        normalize = false;
+        daemon = false;
+        socket_path = null;
+        watch = false;
+        stats = false;
+        trace_path = null;
 
         initialized = true;
-        try parseArguments(stderr, stdout);
     }
 
     fn deinit() void {
@@ -257,7 +810,13 @@ const ParsedArguments = struct {
 
         for (directories.items) |directory| allocator.free(directory);
         directories.deinit(allocator);
-        if (match) |pattern| allocator.free(pattern);
+        for (playlist_files.items) |path| allocator.free(path);
+        playlist_files.deinit(allocator);
+        if (export_path) |path| allocator.free(path);
+        for (patterns.items) |pattern| allocator.free(pattern);
+        patterns.deinit(allocator);
+        if (socket_path) |path| allocator.free(path);
+        if (trace_path) |path| allocator.free(path);
 
         initialized = false;
     }
@@ -270,17 +829,36 @@ const ParsedArguments = struct {
         try directories.append(allocator, path_copy);
     }
 
-    fn setMatch(pattern: []const u8) !void {
+    fn appendPlaylistFile(path: []const u8) !void {
+        debug.assert(initialized);
+
+        const path_copy = try allocator.dupe(u8, path);
+        errdefer allocator.free(path_copy);
+        try playlist_files.append(allocator, path_copy);
+    }
+
+    fn appendMatch(pattern: []const u8) !void {
+        debug.assert(initialized);
+
+        const pattern_copy = try allocator.dupe(u8, pattern);
+        errdefer allocator.free(pattern_copy);
+        try patterns.insert(allocator, match_count, pattern_copy);
+        match_count += 1;
+        if (.name != SongFilter.splitPattern(pattern)[0]) tags = true;
+    }
+
+    fn appendExclude(pattern: []const u8) !void {
         debug.assert(initialized);
 
         const pattern_copy = try allocator.dupe(u8, pattern);
-        if (match) |old_pattern| allocator.free(old_pattern);
-        match = pattern_copy;
+        errdefer allocator.free(pattern_copy);
+        try patterns.append(allocator, pattern_copy);
+        if (.name != SongFilter.splitPattern(pattern)[0]) tags = true;
     }
 
     fn parseArguments(
-        stderr: *BufferedFileWriter,
-        stdout: *BufferedFileWriter,
+        stderr: *ConsoleWriter,
+        stdout: *ConsoleWriter,
     ) !void {
         debug.assert(initialized);
 
@@ -304,11 +882,19 @@ const ParsedArguments = struct {
             } else if (mem.eql(u8, argument, "--version")) {
                 try printVersion(stdout);
                 return error.ExitSuccess;
+            } else if (mem.eql(u8, argument, "--recursive")) {
+                recursive = true;
+            } else if (mem.eql(u8, argument, "--stream")) {
+                stream = true;
             } else if (mem.eql(u8, argument, "--no-shuffle")) {
                 shuffle = false;
-            } else if (mem.eql(u8, argument, "--match")) {
+            } else if (mem.eql(u8, argument, "--match") or mem.eql(u8, argument, "--exclude")) {
                 if (arguments.next()) |pattern| {
-                    try setMatch(pattern);
+                    if (mem.eql(u8, argument, "--match")) {
+                        try appendMatch(pattern);
+                    } else {
+                        try appendExclude(pattern);
+                    }
                 } else {
                     try stderr.writer().print(
                         "ERROR: Option '{s}' expects a regular expression as an argument\n",
@@ -317,15 +903,164 @@ const ParsedArguments = struct {
                     try printShortHelp(stderr);
                     return error.MissingMatchMattern;
                 }
+            } else if (mem.eql(u8, argument, "--read-ahead")) {
+                const count = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a number as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingReadAhead;
+                };
+                read_ahead = std.fmt.parseInt(u8, count, 10) catch max_read_ahead + 1;
+                if (max_read_ahead < read_ahead) {
+                    try stderr.writer().print(
+                        "ERROR: Read-ahead must be a number from 0 to {}, got '{s}'\n",
+                        .{ max_read_ahead, count },
+                    );
+                    try printShortHelp(stderr);
+                    return error.InvalidReadAhead;
+                }
+            } else if (mem.eql(u8, argument, "--playlist")) {
+                const path = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a path as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingPlaylistPath;
+                };
+                try appendPlaylistFile(path);
+            } else if (mem.eql(u8, argument, "--export")) {
+                const path = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a path as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingExportPath;
+                };
+                if (export_path) |old_path| allocator.free(old_path);
+                export_path = null;
+                export_path = try allocator.dupe(u8, path);
+            } else if (mem.eql(u8, argument, "--sniff")) {
+                sniff = true;
+            } else if (mem.eql(u8, argument, "--tags")) {
+                tags = true;
+            } else if (mem.eql(u8, argument, "--queue-depth")) {
+                const depth = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a number as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingQueueDepth;
+                };
+                queue_depth = std.fmt.parseInt(u16, depth, 10) catch 0;
+                if (queue_depth < 1 or max_queue_depth < queue_depth) {
+                    try stderr.writer().print(
+                        "ERROR: Queue depth must be a number from 1 to {}, got '{s}'\n",
+                        .{ max_queue_depth, depth },
+                    );
+                    try printShortHelp(stderr);
+                    return error.InvalidQueueDepth;
+                }
+            } else if (mem.eql(u8, argument, "--sample-rate")) {
+                const rate = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a number as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingSampleRate;
+                };
+                sample_rate = std.fmt.parseInt(u32, rate, 10) catch 0;
+                if (sample_rate < min_sample_rate or max_sample_rate < sample_rate) {
+                    try stderr.writer().print(
+                        "ERROR: Sample rate must be a number from {} to {}, got '{s}'\n",
+                        .{ min_sample_rate, max_sample_rate, rate },
+                    );
+                    try printShortHelp(stderr);
+                    return error.InvalidSampleRate;
+                }
+            } else if (mem.eql(u8, argument, "--resample-quality")) {
+                const quality = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects 'low', 'medium' or 'high' as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingResampleQuality;
+                };
+                resample_quality = std.meta.stringToEnum(Resampler.Quality, quality) orelse {
+                    try stderr.writer().print(
+                        "ERROR: Resample quality must be 'low', 'medium' or 'high', got '{s}'\n",
+                        .{quality},
+                    );
+                    try printShortHelp(stderr);
+                    return error.InvalidResampleQuality;
+                };
+            } else if (mem.eql(u8, argument, "--normalize")) {
+                normalize = true;
             } else if (mem.eql(u8, argument, "--no-repeat")) {
                 repeat = false;
             } else if (mem.eql(u8, argument, "--no-skip-unplayable")) {
                 skip_unplayable = false;
+            } else if (mem.eql(u8, argument, "--daemon")) {
+                daemon = true;
+            } else if (mem.eql(u8, argument, "--socket")) {
+                const path = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a path as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingSocketPath;
+                };
+                if (socket_path) |old_path| allocator.free(old_path);
+                socket_path = null;
+                socket_path = try allocator.dupe(u8, path);
+            } else if (mem.eql(u8, argument, "--watch")) {
+                if (!DirectoryWatcher.supported) {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' is only supported on Linux\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.UnsupportedOption;
+                }
+                watch = true;
+            } else if (mem.eql(u8, argument, "--stats") or mem.eql(u8, argument, "--trace")) {
+                if (!Stats.enabled) {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' requires building with -Dstats\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.UnsupportedOption;
+                }
+                if (mem.eql(u8, argument, "--stats")) {
+                    stats = true;
+                    continue;
+                }
+                const path = arguments.next() orelse {
+                    try stderr.writer().print(
+                        "ERROR: Option '{s}' expects a path as an argument\n",
+                        .{argument},
+                    );
+                    try printShortHelp(stderr);
+                    return error.MissingTracePath;
+                };
+                if (trace_path) |old_path| allocator.free(old_path);
+                trace_path = null;
+                trace_path = try allocator.dupe(u8, path);
+            } else if (mem.eql(u8, argument, "--no-cache")) {
+                cache = false;
             } else if (mem.eql(u8, argument, "--")) {
                 while (arguments.next()) |next_argument| {
                     try appendDirectory(next_argument);
                 }
-                return;
+                break;
             } else if (2 < argument.len and mem.eql(u8, argument[0..2], "--")) {
                 try stderr.writer().print(
                     "ERROR: Unknown long option '{s}'\n",
@@ -333,7 +1068,7 @@ const ParsedArguments = struct {
                 );
                 try printShortHelp(stderr);
                 return error.UnknownLongOption;
-            } else if (2 < argument.len and '-' == argument[0]) {
+            } else if (1 < argument.len and '-' == argument[0]) {
                 try parseShortOptions(stderr, stdout, argument[1..], &arguments);
             } else {
                 try appendDirectory(argument);
@@ -344,11 +1079,20 @@ const ParsedArguments = struct {
             try printHelp(stdout);
             return error.ExitSuccess;
         }
+
+        if (null != export_path and (stream or daemon or watch)) {
+            try stderr.writer().print(
+                "ERROR: Option '--export' cannot be combined with '--stream', '--daemon' or '--watch'\n",
+                .{},
+            );
+            try printShortHelp(stderr);
+            return error.ConflictingOptions;
+        }
     }
 
     fn parseShortOptions(
-        stderr: *BufferedFileWriter,
-        stdout: *BufferedFileWriter,
+        stderr: *ConsoleWriter,
+        stdout: *ConsoleWriter,
         options: []const u8, // Without the trailing `-`.
         remaining_arguments: *ArgIterator,
     ) !void {
@@ -370,12 +1114,13 @@ const ParsedArguments = struct {
                     try printVersion(stdout);
                     return error.ExitSuccess;
                 },
+                'r' => recursive = true,
                 'm' => {
                     if (i < options.len - 1) {
                         // If leftover text in options, it is the argument to -m.
-                        try setMatch(options[i + 1 ..]);
+                        try appendMatch(options[i + 1 ..]);
                     } else if (remaining_arguments.next()) |pattern| {
-                        try setMatch(pattern);
+                        try appendMatch(pattern);
                     } else {
                         try stderr.writer().print(
                             "ERROR: Option '-{c}' expects a regular expression as an argument\n",
@@ -399,285 +1144,8239 @@ const ParsedArguments = struct {
     }
 };
 
-////////////////////////////////////////////////////////////////////////////////
-// Songs and Playlists                                                        //
-////////////////////////////////////////////////////////////////////////////////
+/// Writes the output of play-music to standard output and error on a
+/// thread of its own, so that a slow terminal, pipe or logging agent never
+/// holds up scanning or playing songs. Output is queued by `ConsoleWriter`
+/// without blocking: if it comes faster than it can be written and the queue
+/// fills up, it is dropped and counted instead, and a warning saying how many
+/// lines were dropped is written once the queue has emptied.
+const EventLog = struct {
+    var initialized = false;
 
-const FileFormat = enum {
-    const Self = @This();
+    var thread: Thread = undefined;
+    /// Protects the fields below.
+    var mutex: Thread.Mutex = .{};
+    /// Signaled when output is queued, and when stopping.
+    var condition: Thread.Condition = .{};
+    var stopping: bool = undefined;
+    /// A ring buffer of records, each a `Stream` byte, a native-endian `u32`
+    /// length and that many bytes of output.
+    var queue: [queue_size]u8 = undefined;
+    var queue_start: usize = undefined;
+    var queue_length: usize = undefined;
+    var dropped_lines: u64 = undefined;
 
-    flac,
-    mp3,
-    opus,
+    /// How many warnings about unplayable files were written of each
+    /// format since the last `reportCoalesced` (see `coalesceUnplayable`.)
+    var unplayable_warnings = EnumArray(FileFormat, std.atomic.Value(u64)).initFill(std.atomic.Value(u64).init(0));
+
+    const Stream = enum(u8) { stdout, stderr };
+
+    const queue_size = 256 * 1024;
+    const record_header_size = 1 + @sizeOf(u32);
+    const max_record_size = 16 * 1024;
+    /// How many warnings about unplayable files of each format are written
+    /// before the rest are only counted.
+    const coalesce_limit = 8;
+
+    /// Until this is called, and after `deinit`, output is written right
+    /// away. Deinitialize with `deinit`.
+    fn init() !void {
+        debug.assert(!initialized);
+
+        stopping = false;
+        queue_start = 0;
+        queue_length = 0;
+        dropped_lines = 0;
+        thread = try Thread.spawn(.{}, work, .{});
+
+        initialized = true;
+    }
+
+    /// Waits for the queued output to be written.
+    fn deinit() void {
+        debug.assert(initialized);
+
+        {
+            mutex.lock();
+            defer mutex.unlock();
+            stopping = true;
+            condition.signal();
+        }
+        thread.join();
+
+        initialized = false;
+    }
+
+    /// Queues `bytes` to be written to `stream`, or drops them if the queue
+    /// is full.
+    fn append(stream: Stream, bytes: []const u8) void {
+        debug.assert(bytes.len <= max_record_size);
+        if (0 == bytes.len) return;
+        if (!initialized) {
+            file(stream).writeAll(bytes) catch {};
+            return;
+        }
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        if (queue_size - queue_length < record_header_size + bytes.len) {
+            dropped_lines +|= @max(1, mem.count(u8, bytes, "\n"));
+            return;
+        }
+        const length: u32 = @intCast(bytes.len);
+        push(&[_]u8{@intFromEnum(stream)});
+        push(mem.asBytes(&length));
+        push(bytes);
+        condition.signal();
+    }
+
+    /// Returns whether to write a warning that a file of `format` is skipped
+    /// for being unplayable. Only the first `coalesce_limit` warnings for a
+    /// format are written; `reportCoalesced` reports the rest.
+    fn coalesceUnplayable(format: FileFormat) bool {
+        return unplayable_warnings.getPtr(format).fetchAdd(1, .monotonic) < coalesce_limit;
+    }
+
+    /// Writes how many warnings were left out by `coalesceUnplayable`, and
+    /// starts counting them again.
+    fn reportCoalesced(writer: anytype) !void {
+        for (std.enums.values(FileFormat)) |format| {
+            const count = unplayable_warnings.getPtr(format).swap(0, .monotonic);
+            if (count <= coalesce_limit) continue;
+            try writer.print(
+                "WARN: No available strategy to play {s} files. Skipped {d} more of them\n",
+                .{ @tagName(format), count - coalesce_limit },
+            );
+        }
+    }
+
+    fn file(stream: Stream) File {
+        return switch (stream) {
+            .stdout => io.getStdOut(),
+            .stderr => io.getStdErr(),
+        };
+    }
+
+    /// Must be called with `mutex` held, and with room in the queue.
+    fn push(bytes: []const u8) void {
+        const index = (queue_start + queue_length) % queue_size;
+        const first_length = @min(bytes.len, queue_size - index);
+        @memcpy(queue[index..][0..first_length], bytes[0..first_length]);
+        @memcpy(queue[0 .. bytes.len - first_length], bytes[first_length..]);
+        queue_length += bytes.len;
+    }
+
+    /// Must be called with `mutex` held, and with as many bytes queued.
+    fn pop(bytes: []u8) void {
+        const first_length = @min(bytes.len, queue_size - queue_start);
+        @memcpy(bytes[0..first_length], queue[queue_start..][0..first_length]);
+        @memcpy(bytes[first_length..], queue[0 .. bytes.len - first_length]);
+        queue_start = (queue_start + bytes.len) % queue_size;
+        queue_length -= bytes.len;
+    }
+
+    /// Entry point of the thread.
+    fn work() void {
+        var buffer: [max_record_size]u8 = undefined;
+
+        mutex.lock();
+        defer mutex.unlock();
+        while (true) {
+            if (0 == queue_length) {
+                if (0 < dropped_lines) {
+                    const message = std.fmt.bufPrint(
+                        &buffer,
+                        "WARN: {d} line(s) of output were dropped, since they could not be written fast enough\n",
+                        .{dropped_lines},
+                    ) catch unreachable;
+                    dropped_lines = 0;
+                    mutex.unlock();
+                    defer mutex.lock();
+                    io.getStdErr().writeAll(message) catch {};
+                    continue;
+                }
+                if (stopping) return;
+                condition.wait(&mutex);
+                continue;
+            }
+
+            var header: [record_header_size]u8 = undefined;
+            pop(&header);
+            const stream: Stream = @enumFromInt(header[0]);
+            const length = mem.bytesToValue(u32, header[1..]);
+            const bytes = buffer[0..length];
+            pop(bytes);
+
+            mutex.unlock();
+            defer mutex.lock();
+            // Nothing else to do with the output.
+            file(stream).writeAll(bytes) catch {};
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Songs and Playlists                                                        //
+////////////////////////////////////////////////////////////////////////////////
+
+const FileFormat = enum {
+    const Self = @This();
+
+    flac,
+    mp3,
+    opus,
     vorbis,
     wav,
 
-    const extensions_formats_map = StaticStringMap(FileFormat).initComptime(.{
+    const extensions_formats = [_]struct { []const u8, FileFormat }{
         .{ ".flac", .flac },
         .{ ".mp3", .mp3 },
         .{ ".opus", .opus },
         .{ ".ogg", .vorbis },
         .{ ".wav", .wav },
-    });
+    };
+    const extensions_formats_map = StaticStringMap(FileFormat).initComptime(extensions_formats);
 
-    // TODO: mimetypes?
     fn fromFile(path: []const u8) ?Self {
         return extensions_formats_map.get(fs.path.extension(path));
     }
+
+    /// The amount of bytes `fromHeader` needs from the start of a file.
+    const header_size = 64;
+
+    /// Returns the format of a file from its first bytes, or `null` if it
+    /// does not look like a song. `header` may be shorter than
+    /// `header_size` for short files. `extension_format` is the format the
+    /// file's extension claims, used where the header is not conclusive.
+    fn fromHeader(header: []const u8, extension_format: Self) ?Self {
+        if (mem.startsWith(u8, header, "fLaC")) return .flac;
+        if (mem.startsWith(u8, header, "RIFF") and
+            12 <= header.len and mem.eql(u8, header[8..12], "WAVE"))
+        {
+            return .wav;
+        }
+        // An ID3v2 tag may preceed MP3 frames or, rarely, FLAC metadata.
+        if (mem.startsWith(u8, header, "ID3")) {
+            return if (.flac == extension_format) .flac else .mp3;
+        }
+        // MPEG audio frame sync, with a layer other than the reserved one
+        // (which is used by AAC.)
+        if (2 <= header.len and 0xff == header[0] and
+            0xe0 == header[1] & 0xe0 and 0 != header[1] & 0x06)
+        {
+            return .mp3;
+        }
+        if (mem.startsWith(u8, header, "OggS") and 27 <= header.len and
+            27 + @as(usize, header[26]) <= header.len)
+        {
+            // The first packet follows the segment table of the first page.
+            const packet = header[27 + @as(usize, header[26]) ..];
+            if (mem.startsWith(u8, packet, "OpusHead")) return .opus;
+            if (mem.startsWith(u8, packet, "\x01vorbis")) return .vorbis;
+            if (mem.startsWith(u8, packet, "\x7fFLAC")) return .flac;
+        }
+        return null;
+    }
+
+    /// The amount of names `fromTails` classifies at once.
+    const batch_size = 16;
+    const Tails = @Vector(batch_size, u64);
+    const Shifts = @Vector(batch_size, u6);
+
+    /// Returns the last 8 bytes of a file name (see `fromTails`,) padded
+    /// with leading zeros if it is shorter.
+    fn nameTail(name: []const u8) u64 {
+        var tail = [_]u8{0} ** 8;
+        const length = @min(name.len, tail.len);
+        @memcpy(tail[tail.len - length ..], name[name.len - length ..]);
+        return mem.readInt(u64, &tail, .little);
+    }
+
+    /// Same as `fromFile` for a batch of file names given by their tails
+    /// (see `nameTail`,) but compares all of them with each extension at
+    /// once instead of branching on each name. Returns 0 for names without
+    /// a known extension, and otherwise the file format plus one.
+    ///
+    /// A name has an extension if it ends with it and is longer than it,
+    /// since a leading dot starts a hidden file rather than an extension. As
+    /// file names cannot contain NUL bytes, the latter holds if the byte
+    /// before the extension in the tail is not zero.
+    fn fromTails(tails: Tails) @Vector(batch_size, u8) {
+        var tags: @Vector(batch_size, u8) = @splat(0);
+        inline for (extensions_formats) |extension_format| {
+            const extension, const format = extension_format;
+            comptime debug.assert(extension.len < 8);
+
+            const shift = 8 * (8 - extension.len);
+            const suffix = comptime mem.readVarInt(u64, extension, .little);
+            const ends_with = (tails >> @as(Shifts, @splat(shift))) == @as(Tails, @splat(suffix));
+            const before = (tails >> @as(Shifts, @splat(shift - 8))) & @as(Tails, @splat(0xff));
+            const is_longer = before != @as(Tails, @splat(0));
+            const matches = @select(bool, ends_with, is_longer, @as(@Vector(batch_size, bool), @splat(false)));
+            tags = @select(u8, matches, @as(@Vector(batch_size, u8), @splat(@intFromEnum(format) + 1)), tags);
+        }
+        return tags;
+    }
 };
 
+/// A song in a `Playlist`. The path is stored in the playlist, as the name of
+/// the file and the directory it is in, so that songs are small and the path
+/// of each directory is only stored once. Playlists store each field in its
+/// own array (see `Playlist.songs`,) so further data about songs can be added
+/// here without slowing down the code that does not use it.
 const Song = struct {
     const Self = @This();
 
-    file_path: []u8,
+    /// Index into `Playlist.directories`.
+    directory: u32,
+    /// Location of the file name in `Playlist.strings`.
+    name_offset: u32,
+    name_length: u16,
+    /// Length of the song's tags (see `SongTags`,) which follow its name in
+    /// `Playlist.strings`. Only read with `--tags`.
+    tags_length: u16 = 0,
     format: FileFormat,
+    /// Set once the song could not be played, so that it is skipped in later
+    /// cycles of the playlist.
+    failed: bool = false,
+    /// Set while the file is gone, with `--watch`.
+    removed: bool = false,
+};
 
-    /// Takes ownership of passed in `path`.
-    fn initFromOwnedPath(path: []u8) !Self {
-        if (FileFormat.fromFile(path)) |format| {
-            return .{
-                .file_path = path,
-                .format = format,
-            };
-        } else {
-            return error.NotAnAudioFile;
-        }
-    }
+/// Songs found in a single directory, gathered before being added to a
+/// playlist (see `Playlist.appendBatch`.) The songs' name offsets are into
+/// `names`, which holds their tags too, and their directories are not yet
+/// set.
+const SongBatch = struct {
+    const Self = @This();
+
+    names: ArrayListUnmanaged(u8) = .empty,
+    songs: ArrayListUnmanaged(Song) = .empty,
 
     fn deinit(self: *Self, allocator: Allocator) void {
-        allocator.free(self.file_path);
+        self.names.deinit(allocator);
+        self.songs.deinit(allocator);
         self.* = undefined;
     }
+
+    fn append(
+        self: *Self,
+        allocator: Allocator,
+        name: []const u8,
+        tags: SongTags,
+        format: FileFormat,
+    ) !void {
+        if (math.maxInt(u32) - self.names.items.len < name.len + tags.bytes.len) {
+            return error.PlaylistTooLarge;
+        }
+        try self.songs.ensureUnusedCapacity(allocator, 1);
+        try self.names.ensureUnusedCapacity(allocator, name.len + tags.bytes.len);
+        const name_offset: u32 = @intCast(self.names.items.len);
+        self.names.appendSliceAssumeCapacity(name);
+        self.names.appendSliceAssumeCapacity(tags.bytes);
+        self.songs.appendAssumeCapacity(.{
+            .directory = undefined,
+            .name_offset = name_offset,
+            .name_length = @intCast(name.len),
+            .tags_length = @intCast(tags.bytes.len),
+            .format = format,
+        });
+    }
 };
 
 const Playlist = struct {
     const Self = @This();
 
     allocator: Allocator,
-    songs: ArrayListUnmanaged(Song),
+    /// Songs are referred to by their index, which fits in a `u32`. They are
+    /// not moved once appended, except by `sortSongs`; orders of play are
+    /// kept apart from them (see `PlayOrder`.)
+    songs: std.MultiArrayList(Song),
+    /// File names and directory paths of the songs.
+    strings: ArrayListUnmanaged(u8),
+    directories: ArrayListUnmanaged(StringSlice),
+
+    /// A location in `strings`.
+    const StringSlice = struct {
+        offset: u32,
+        length: u32,
+    };
 
     /// Deinitialize with `deinit`.
     fn init(allocator: Allocator) Self {
         return .{
             .allocator = allocator,
-            .songs = ArrayListUnmanaged(Song).empty,
+            .songs = .empty,
+            .strings = ArrayListUnmanaged(u8).empty,
+            .directories = ArrayListUnmanaged(StringSlice).empty,
         };
     }
 
     fn deinit(self: *Self) void {
-        for (self.songs.items) |*song| song.deinit(self.allocator);
         self.songs.deinit(self.allocator);
+        self.strings.deinit(self.allocator);
+        self.directories.deinit(self.allocator);
         self.* = undefined;
     }
 
-    /// Requires the sound system to be initialized (see `SoundSystem`.)
-    /// If `regex` is not `null`, only files whose name match `regex` will be
+    /// Requires the sound system and library index to be initialized (see
+    /// `SoundSystem` and `LibraryIndex`.)
+    /// If `filter` is not `null`, only songs it accepts will be appended.
+    /// Also appends songs from subdirectories if `--recursive` was passed. If
+    /// `feed` is not `null`, it is notified of the songs as they are
     /// appended.
     fn appendFromDirectory(
         self: *Self,
-        stderr: *BufferedFileWriter,
-        regex: ?Regex,
+        stderr: *ConsoleWriter,
+        filter: ?SongFilter,
         path: []const u8,
+        feed: ?*PlaylistFeed,
     ) !u64 {
-        var songs_appended: u64 = 0;
+        return Scanner.run(self, stderr, filter, path, feed);
+    }
 
-        var directory = try fs.cwd().openDir(path, .{
-            .iterate = true,
+    /// Does not take ownership of `batch`.
+    fn appendBatch(self: *Self, directory: []const u8, batch: SongBatch) !void {
+        if (0 == batch.songs.items.len) return;
+
+        if (math.maxInt(u32) - self.strings.items.len <
+            directory.len + batch.names.items.len)
+        {
+            return error.PlaylistTooLarge;
+        }
+        if (math.maxInt(u32) == self.directories.items.len or
+            math.maxInt(u32) - self.songs.len < batch.songs.items.len)
+        {
+            return error.PlaylistTooLarge;
+        }
+        try self.directories.ensureUnusedCapacity(self.allocator, 1);
+        try self.songs.ensureUnusedCapacity(self.allocator, batch.songs.items.len);
+        try self.strings.ensureUnusedCapacity(
+            self.allocator,
+            directory.len + batch.names.items.len,
+        );
+
+        const directory_index: u32 = @intCast(self.directories.items.len);
+        self.directories.appendAssumeCapacity(.{
+            .offset = @intCast(self.strings.items.len),
+            .length = @intCast(directory.len),
         });
-        defer directory.close();
+        self.strings.appendSliceAssumeCapacity(directory);
+        const names_offset: u32 = @intCast(self.strings.items.len);
+        self.strings.appendSliceAssumeCapacity(batch.names.items);
 
-        var iterator = directory.iterate();
-        while (try iterator.next()) |entry| {
-            if (regex) |r| {
-                const match_mode = RegexMatchConfig{
-                    .mode = .substring,
-                    .case = .ignore,
-                };
-                if (!r.match(match_mode, entry.name)) continue;
+        for (batch.songs.items) |song| {
+            var appended_song = song;
+            appended_song.directory = directory_index;
+            appended_song.name_offset += names_offset;
+            self.songs.appendAssumeCapacity(appended_song);
+        }
+    }
+
+    /// Appends a single song, to the songs from `directory` that have
+    /// already been appended if there are any.
+    fn appendSong(
+        self: *Self,
+        directory: []const u8,
+        name: []const u8,
+        tags: SongTags,
+        format: FileFormat,
+    ) !void {
+        const existing_index = for (self.directories.items, 0..) |slice, index| {
+            if (mem.eql(u8, self.string(slice), directory)) break index;
+        } else null;
+        const directory_index: u32 = if (existing_index) |index|
+            @intCast(index)
+        else
+            try self.appendDirectory(directory);
+        try self.appendSongTo(directory_index, name, tags, format);
+    }
+
+    /// Appends a directory without songs, and returns its index for
+    /// `appendSongTo`.
+    fn appendDirectory(self: *Self, directory: []const u8) !u32 {
+        if (math.maxInt(u32) - self.strings.items.len < directory.len or
+            math.maxInt(u32) == self.directories.items.len)
+        {
+            return error.PlaylistTooLarge;
+        }
+        try self.directories.ensureUnusedCapacity(self.allocator, 1);
+        try self.strings.ensureUnusedCapacity(self.allocator, directory.len);
+
+        const index: u32 = @intCast(self.directories.items.len);
+        self.directories.appendAssumeCapacity(.{
+            .offset = @intCast(self.strings.items.len),
+            .length = @intCast(directory.len),
+        });
+        self.strings.appendSliceAssumeCapacity(directory);
+        return index;
+    }
+
+    /// Appends a single song to the directory at `directory_index`.
+    fn appendSongTo(
+        self: *Self,
+        directory_index: u32,
+        name: []const u8,
+        tags: SongTags,
+        format: FileFormat,
+    ) !void {
+        debug.assert(directory_index < self.directories.items.len);
+
+        const strings_length = name.len + tags.bytes.len;
+        if (math.maxInt(u32) - self.strings.items.len < strings_length or
+            math.maxInt(u32) == self.songs.len)
+        {
+            return error.PlaylistTooLarge;
+        }
+        try self.songs.ensureUnusedCapacity(self.allocator, 1);
+        try self.strings.ensureUnusedCapacity(self.allocator, strings_length);
+
+        const name_offset: u32 = @intCast(self.strings.items.len);
+        self.strings.appendSliceAssumeCapacity(name);
+        self.strings.appendSliceAssumeCapacity(tags.bytes);
+        self.songs.appendAssumeCapacity(.{
+            .directory = directory_index,
+            .name_offset = name_offset,
+            .name_length = @intCast(name.len),
+            .tags_length = @intCast(tags.bytes.len),
+            .format = format,
+        });
+    }
+
+    fn string(self: Self, slice: StringSlice) []const u8 {
+        return self.strings.items[slice.offset..][0..slice.length];
+    }
+
+    fn songDirectory(self: Self, song: Song) []const u8 {
+        return self.string(self.directories.items[song.directory]);
+    }
+
+    fn songName(self: Self, song: Song) []const u8 {
+        return self.strings.items[song.name_offset..][0..song.name_length];
+    }
+
+    fn songTags(self: Self, song: Song) SongTags {
+        const offset = song.name_offset + song.name_length;
+        return .{ .bytes = self.strings.items[offset..][0..song.tags_length] };
+    }
+
+    /// Writes the path of the song into `buffer`.
+    fn songPath(self: Self, song: Song, buffer: *[fs.max_path_bytes]u8) ![]u8 {
+        return joinPath(buffer, self.songDirectory(song), self.songName(song));
+    }
+
+    fn songLessThan(self: *const Self, a: Song, b: Song) bool {
+        if (a.directory != b.directory) {
+            return mem.lessThan(u8, self.songDirectory(a), self.songDirectory(b));
+        }
+        return mem.lessThan(u8, self.songName(a), self.songName(b));
+    }
+
+    /// Sorts the songs from index `start` on by their path.
+    fn sortSongs(self: *Self, start: usize) void {
+        const Context = struct {
+            playlist: *const Self,
+            songs: std.MultiArrayList(Song).Slice,
+
+            pub fn lessThan(context: @This(), a: usize, b: usize) bool {
+                return context.playlist.songLessThan(context.songs.get(a), context.songs.get(b));
             }
+        };
+        self.songs.sortSpan(start, self.songs.len, Context{
+            .playlist = self,
+            .songs = self.songs.slice(),
+        });
+    }
+};
 
-            var song = blk: {
-                const file = try fs.path.join(
-                    self.allocator,
-                    &.{ path, entry.name },
-                );
-                errdefer self.allocator.free(file);
-                break :blk Song.initFromOwnedPath(file) catch |err| switch (err) {
-                    error.NotAnAudioFile => {
-                        self.allocator.free(file);
-                        continue;
-                    },
-                    else => return err,
-                };
-            };
-            errdefer song.deinit(self.allocator);
+/// The order the songs of a playlist are played in during one cycle.
+const PlayOrder = struct {
+    const Self = @This();
 
-            if (!SoundSystem.isPlayable(song.format)) {
-                if (ParsedArguments.skip_unplayable) {
-                    try stderr.writer().print(
-                        "WARN: No available strategy to play {s} files. Skipping: {s}\n",
-                        .{ @tagName(song.format), song.file_path },
-                    );
-                    song.deinit(self.allocator);
-                    continue;
-                } else {
-                    try stderr.writer().print(
-                        "ERROR: No available strategy to play {s} files. Offending file: {s}\n",
-                        .{ @tagName(song.format), song.file_path },
-                    );
-                    return error.UnplayableFormat;
-                }
+    /// `null` plays the songs in the order of the playlist.
+    permutation: ?Permutation,
+    /// If not `null`, the songs are played in this order, after
+    /// `permutation`.
+    indices: ?[]const u32 = null,
+
+    /// If `random` is not `null`, the songs are shuffled.
+    fn init(song_count: usize, random: ?Random) Self {
+        const r = random orelse return .{ .permutation = null };
+        if (0 == song_count) return .{ .permutation = null };
+        return .{ .permutation = Permutation.init(song_count, r.int(u64)) };
+    }
+
+    /// Returns the index of the song played at `position` in the cycle.
+    fn at(self: Self, position: usize) usize {
+        const permuted = if (self.permutation) |p| p.at(position) else position;
+        return if (self.indices) |indices| indices[permuted] else permuted;
+    }
+};
+
+/// The songs coming up from position `position` in `order` on, continuing
+/// with the start of `next_order` if it is not `null`. Songs that failed to
+/// play or were removed are left out, and no song is visited twice.
+const UpcomingSongs = struct {
+    songs: std.MultiArrayList(Song).Slice,
+    order: PlayOrder,
+    next_order: ?PlayOrder,
+    position: usize,
+    visited: usize = 0,
+
+    fn next(self: *UpcomingSongs) ?Song {
+        while (self.visited < self.songs.len) : (self.visited += 1) {
+            if (self.songs.len <= self.position) {
+                self.order = self.next_order orelse return null;
+                self.next_order = null;
+                self.position = 0;
             }
+            const song = self.songs.get(self.order.at(self.position));
+            self.position += 1;
+            if (song.failed or song.removed) continue;
+            self.visited += 1;
+            return song;
+        }
+        return null;
+    }
+};
+
+/// A pseudo-random permutation of the numbers less than `count`, computed
+/// one number at a time instead of being stored, so that shuffling takes
+/// neither time nor memory up front.
+///
+/// Positions are encrypted with a balanced Feistel network over the smallest
+/// power of four that is at least `count`. Results outside the range are
+/// encrypted again (i.e. cycle walking,) which takes less than four rounds
+/// of the network on average.
+const Permutation = struct {
+    const Self = @This();
+
+    count: u64,
+    half_bits: u6,
+    round_keys: [rounds]u64,
+
+    /// More rounds than the four needed for a pseudo-random permutation, to
+    /// mix small playlists thoroughly.
+    const rounds = 6;
+
+    /// Asserts that `count` is not 0.
+    fn init(count: usize, key: u64) Self {
+        debug.assert(0 < count);
 
-            try self.songs.append(self.allocator, song);
-            songs_appended +|= 1;
+        var half_bits: u6 = 1;
+        while (@as(u64, 1) << (2 * half_bits) < count) half_bits += 1;
+        var round_keys: [rounds]u64 = undefined;
+        var state = key;
+        for (&round_keys) |*round_key| round_key.* = mix(&state);
+        return .{ .count = count, .half_bits = half_bits, .round_keys = round_keys };
+    }
+
+    /// Asserts that `position` is less than `count`.
+    fn at(self: Self, position: usize) usize {
+        debug.assert(position < self.count);
+
+        var value: u64 = position;
+        while (true) {
+            value = self.encrypt(value);
+            if (value < self.count) return @intCast(value);
         }
+    }
 
-        return songs_appended;
+    fn encrypt(self: Self, value: u64) u64 {
+        const mask = (@as(u64, 1) << self.half_bits) - 1;
+        var left = value >> self.half_bits;
+        var right = value & mask;
+        for (self.round_keys) |round_key| {
+            var state = round_key ^ right;
+            const next_right = left ^ (mix(&state) & mask);
+            left = right;
+            right = next_right;
+        }
+        return left << self.half_bits | right;
     }
 
-    fn shuffle(self: *Self, random: Random) void {
-        random.shuffle(Song, self.songs.items);
+    /// SplitMix64 <https://prng.di.unimi.it/splitmix64.c>.
+    fn mix(state: *u64) u64 {
+        state.* +%= 0x9e3779b97f4a7c15;
+        var z = state.*;
+        z = (z ^ (z >> 30)) *% 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) *% 0x94d049bb133111eb;
+        return z ^ (z >> 31);
     }
 };
 
-////////////////////////////////////////////////////////////////////////////////
-// Sound System                                                               //
-////////////////////////////////////////////////////////////////////////////////
+test "Permutation" {
+    const testing = std.testing;
+    const counts = [_]usize{ 1, 2, 3, 4, 5, 16, 17, 100, 1000, 4097 };
+    const keys = [_]u64{ 0, 1, 0xdeadbeef, math.maxInt(u64) };
+    for (counts) |count| {
+        for (keys) |key| {
+            var seen = try DynamicBitSetUnmanaged.initEmpty(testing.allocator, count);
+            defer seen.deinit(testing.allocator);
+            const permutation = Permutation.init(count, key);
+            for (0..count) |position| {
+                const value = permutation.at(position);
+                try testing.expect(value < count);
+                try testing.expect(!seen.isSet(value));
+                seen.set(value);
+            }
+        }
+    }
+}
 
-// TODO: develop ability to load audio from files and pass to system's sound servers/other.
+/// Joins the paths like `fs.path.join`, but into `buffer`.
+fn joinPath(
+    buffer: *[fs.max_path_bytes]u8,
+    directory: []const u8,
+    name: []const u8,
+) ![]u8 {
+    var fixed_buffer_allocator = heap.FixedBufferAllocator.init(buffer);
+    return fs.path.join(
+        fixed_buffer_allocator.allocator(),
+        &.{ directory, name },
+    ) catch return error.NameTooLong;
+}
 
-const SoundSystem = struct {
-    var initialized = false;
-    var allocator: Allocator = undefined;
+/// How song names and tags are matched against `--match` and `--exclude`.
+const regex_match_config = RegexMatchConfig{
+    .mode = .substring,
+    .case = .ignore,
+};
 
-    var formats_play_strategies_map: AutoHashMapUnmanaged(
-        FileFormat,
-        PlayStrategy,
-    ) = undefined;
+/// What `--match` and `--exclude` patterns can match. All but `name` are
+/// read from the tags of songs (see `--tags` and `SongTags`.)
+const SongField = enum(u8) {
+    name,
+    artist,
+    album,
+    title,
+    genre,
+};
 
-    /// Deinitialize with `deinit`.
-    fn init(allocatorr: Allocator) !void {
-        debug.assert(!initialized);
+/// Patterns that songs are matched against, as compiled by
+/// `compilePatterns`. The patterns matching each field are compiled into one
+/// set, so each field is read once no matter how many patterns there are.
+const SongFilter = struct {
+    const Self = @This();
 
-        allocator = allocatorr;
-        formats_play_strategies_map = AutoHashMapUnmanaged(
-            FileFormat,
-            PlayStrategy,
-        ).empty;
-        errdefer formats_play_strategies_map.deinit(allocator);
+    /// The patterns matching each field, or `null` if none do.
+    sets: EnumArray(SongField, ?FieldSet),
+    /// The amount of match patterns, which come before the exclude patterns.
+    match_count: usize,
 
-        // Per-format strategy selection.
-        inline for (@typeInfo(FileFormat).@"enum".fields) |field| blk: {
-            const format: FileFormat = @enumFromInt(field.value);
+    const FieldSet = struct {
+        regex: Regex,
+        /// Bit `i` is set if pattern `i` of all of them is in the set.
+        patterns: u64,
+    };
 
-            switch (format) {
-                .flac => {},
-                .mp3 => {},
-                .opus => {},
-                .vorbis => {},
-                .wav => {},
-            }
+    /// A cache for matching each field (see `Regex.Cache`.)
+    const Caches = EnumArray(SongField, ?Regex.Cache);
 
-            if (isProgramAvailable(allocator, &.{"mpv"})) {
-                try formats_play_strategies_map.put(
-                    allocator,
-                    format,
-                    mpvPlayStrategy,
-                );
-                break :blk;
-            }
-            if (isProgramAvailable(allocator, &.{ "cvlc", "-h" })) {
-                try formats_play_strategies_map.put(
-                    allocator,
-                    format,
-                    cvlcPlayStrategy,
-                );
-                break :blk;
+    /// Compiles `patterns`, the first `match_count` of which are match
+    /// patterns and the rest exclude patterns. Patterns match the file name
+    /// unless they start with another field (see `splitPattern`.)
+    /// Deinitialize with `deinit`.
+    fn compile(allocator: Allocator, patterns: []const []const u8, match_count: usize) !Self {
+        debug.assert(patterns.len <= exre.max_set_patterns);
+
+        var self = Self{
+            .sets = EnumArray(SongField, ?FieldSet).initFill(null),
+            .match_count = match_count,
+        };
+        errdefer self.deinit();
+        var field_patterns = ArrayListUnmanaged([]const u8).empty;
+        defer field_patterns.deinit(allocator);
+        for (std.enums.values(SongField)) |field| {
+            field_patterns.clearRetainingCapacity();
+            var positions: u64 = 0;
+            for (patterns, 0..) |pattern, index| {
+                const pattern_field, const regex = splitPattern(pattern);
+                if (field != pattern_field) continue;
+                try field_patterns.append(allocator, regex);
+                positions |= @as(u64, 1) << @intCast(index);
             }
+            if (0 == positions) continue;
+            self.sets.set(field, .{
+                .regex = try Regex.compileSet(allocator, field_patterns.items),
+                .patterns = positions,
+            });
         }
+        return self;
+    }
 
-        initialized = true;
+    fn deinit(self: Self) void {
+        for (self.sets.values) |set| {
+            if (set) |s| s.regex.deinit();
+        }
     }
 
-    fn deinit() void {
-        debug.assert(initialized);
+    /// Splits the field a pattern matches off it, if it starts with one and
+    /// a colon (i.e. `artist:Burial`.)
+    fn splitPattern(pattern: []const u8) struct { SongField, []const u8 } {
+        if (mem.indexOfScalar(u8, pattern, ':')) |colon| {
+            if (std.meta.stringToEnum(SongField, pattern[0..colon])) |field| {
+                return .{ field, pattern[colon + 1 ..] };
+            }
+        }
+        return .{ .name, pattern };
+    }
 
-        formats_play_strategies_map.deinit(allocator);
+    fn usesTags(self: Self) bool {
+        for (std.enums.values(SongField)) |field| {
+            if (.name != field and null != self.sets.get(field)) return true;
+        }
+        return false;
+    }
 
-        initialized = false;
+    /// Deinitialize with `deinitCaches`.
+    fn initCaches(self: Self) Caches {
+        var caches = Caches.initFill(null);
+        for (std.enums.values(SongField)) |field| {
+            const set = self.sets.get(field) orelse continue;
+            caches.set(field, set.regex.initCache(
+                regex_match_config,
+                Regex.Cache.default_max_states,
+            ));
+        }
+        return caches;
     }
 
-    fn isPlayable(format: FileFormat) bool {
-        debug.assert(initialized);
+    fn deinitCaches(caches: *Caches, allocator: Allocator) void {
+        for (&caches.values) |*cache| {
+            if (cache.*) |*c| c.deinit(allocator);
+        }
+        caches.* = undefined;
+    }
 
-        return formats_play_strategies_map.contains(format);
+    /// Returns whether the song matches one of the match patterns (if any)
+    /// and none of the exclude patterns. Tags the song does not have match
+    /// as empty. `caches` speed up matching if they are not `null`, and must
+    /// have been made for this filter.
+    fn accepts(self: Self, caches: ?*Caches, name: []const u8, tags: SongTags) bool {
+        var matched: u64 = 0;
+        for (std.enums.values(SongField)) |field| {
+            const set = self.sets.get(field) orelse continue;
+            const value = if (.name == field) name else tags.get(field) orelse "";
+            const set_matched = if (caches) |c|
+                set.regex.matchSetCached(&c.getPtr(field).*.?, value)
+            else
+                set.regex.matchSet(regex_match_config, value);
+            matched |= scatter(set_matched, set.patterns);
+        }
+        const matches = ~math.shl(u64, ~@as(u64, 0), self.match_count);
+        if (self.match_count > 0 and matched & matches == 0) return false;
+        return matched & ~matches == 0;
     }
 
-    fn playSong(song: Song) !void {
-        debug.assert(initialized);
+    /// Moves bit `i` of `bits` to where the `i`th set bit of `positions` is.
+    fn scatter(bits: u64, positions: u64) u64 {
+        var result: u64 = 0;
+        var remaining_bits = bits;
+        var remaining_positions = positions;
+        while (0 != remaining_positions) : (remaining_bits >>= 1) {
+            const lowest = remaining_positions & -%remaining_positions;
+            if (0 != remaining_bits & 1) result |= lowest;
+            remaining_positions ^= lowest;
+        }
+        return result;
+    }
+};
+
+/// Requires the sound system to be initialized (see `SoundSystem`.)
+/// Returns whether the audio file belongs in the playlist. If `filter` is
+/// not `null`, only songs it accepts are. `caches` speed up matching if they
+/// are not `null`, and must have been made for `filter`.
+fn acceptSong(
+    warnings: anytype,
+    filter: ?SongFilter,
+    caches: ?*SongFilter.Caches,
+    directory: []const u8,
+    name: []const u8,
+    tags: SongTags,
+    format: FileFormat,
+) !bool {
+    if (filter) |f| {
+        if (!f.accepts(caches, name, tags)) {
+            Stats.add(.rejected_pattern, 1);
+            return false;
+        }
+    }
 
-        if (formats_play_strategies_map.get(song.format)) |strategy| {
-            try strategy(allocator, song);
+    if (!SoundSystem.isPlayable(format)) {
+        Stats.add(.unplayable, 1);
+        var path_buffer: [fs.max_path_bytes]u8 = undefined;
+        if (ParsedArguments.skip_unplayable) {
+            // Only the first few are written, and the rest counted.
+            if (EventLog.coalesceUnplayable(format)) {
+                const path = try joinPath(&path_buffer, directory, name);
+                try warnings.print(
+                    "WARN: No available strategy to play {s} files. Skipping: {s}\n",
+                    .{ @tagName(format), path },
+                );
+            }
+            return false;
         } else {
+            const path = try joinPath(&path_buffer, directory, name);
+            try warnings.print(
+                "ERROR: No available strategy to play {s} files. Offending file: {s}\n",
+                .{ @tagName(format), path },
+            );
             return error.UnplayableFormat;
         }
     }
-};
 
-// TODO: find a better way to determine if a program is available.
-/// Must have program as index 0 in `arguments`, and program should exit
-/// immediately with supplied `arguments`.
-fn isProgramAvailable(
-    allocator: Allocator,
-    arguments: []const []const u8,
-) bool {
-    var child = Child.init(arguments, allocator);
-    // Blackholes program output.
-    child.stdin_behavior = .Ignore;
-    child.stdout_behavior = .Ignore;
-    child.stderr_behavior = .Ignore;
-
-    // If errored out, the program is *probably* not available.
-    _ = child.spawnAndWait() catch return false;
     return true;
 }
 
-const PlayStrategy = *const fn (
+/// Scans a directory for songs. With `--recursive`, subdirectories are
+/// scanned too, on a pool of threads: each directory is scanned by a separate
+/// job, and the subdirectories found while scanning it are queued as new jobs,
+/// so that many directories are read at once.
+const Scanner = struct {
+    const Self = @This();
+
     allocator: Allocator,
-    song: Song,
-) PlayStrategyError!void;
+    filter: ?SongFilter,
+    /// Only initialized with `--recursive`.
+    pool: Thread.Pool,
+    wait_group: WaitGroup,
 
-const PlayStrategyError = Child.SpawnError;
+    /// Protects the fields below. Points to the feed's mutex if there is one.
+    mutex: *Thread.Mutex,
+    playlist: *Playlist,
+    stderr: *ConsoleWriter,
+    feed: ?*PlaylistFeed,
+    songs_appended: u64,
+    /// The first error encountered by any job. Remaining jobs stop early.
+    err: ?anyerror,
+    /// Regex caches not in use by any job (see `acquireCache`.)
+    idle_caches: ArrayListUnmanaged(*SongFilter.Caches),
+    /// I/O batches not in use by any job (see `acquireBatch`.)
+    idle_batches: ArrayListUnmanaged(*IoBatch),
 
-fn mpvPlayStrategy(allocator: Allocator, song: Song) PlayStrategyError!void {
-    switch (song.format) {
-        .flac, .mp3, .vorbis, .wav, .opus => {
-            const arguments = [_][]const u8{
-                "mpv",
-                "--no-audio-display", // Prevents display of cover art.
-                song.file_path,
-            };
+    /// Requires the sound system and library index to be initialized (see
+    /// `SoundSystem` and `LibraryIndex`.) If `feed` is not `null`, it is
+    /// notified of the songs as they are appended.
+    fn run(
+        playlist: *Playlist,
+        stderr: *ConsoleWriter,
+        filter: ?SongFilter,
+        path: []const u8,
+        feed: ?*PlaylistFeed,
+    ) !u64 {
+        var mutex = Thread.Mutex{};
+        var self = Self{
+            .allocator = playlist.allocator,
+            .filter = filter,
+            .pool = undefined,
+            .wait_group = .{},
+            .mutex = if (feed) |f| &f.mutex else &mutex,
+            .playlist = playlist,
+            .stderr = stderr,
+            .feed = feed,
+            .songs_appended = 0,
+            .err = null,
+            .idle_caches = .empty,
+            .idle_batches = .empty,
+        };
+        defer {
+            for (self.idle_caches.items) |cache| self.destroyCache(cache);
+            self.idle_caches.deinit(self.allocator);
+            for (self.idle_batches.items) |io_batch| self.destroyBatch(io_batch);
+            self.idle_batches.deinit(self.allocator);
+        }
 
-            var child = Child.init(&arguments, allocator);
-            // TODO: handle exit code.
-            _ = try child.spawnAndWait();
-        },
-    }
-}
+        const songs_start = playlist.songs.len;
 
-fn cvlcPlayStrategy(allocator: Allocator, song: Song) PlayStrategyError!void {
-    switch (song.format) {
-        .flac, .mp3, .vorbis, .wav, .opus => {
-            const arguments = [_][]const u8{
-                "cvlc",
-                "--play-and-exit", // Makes exit after the song ends.
-                song.file_path,
+        const root_key = try fs.cwd().realpathAlloc(self.allocator, path);
+        const root = self.allocator.dupe(u8, path) catch |err| {
+            self.allocator.free(root_key);
+            return err;
+        };
+        if (ParsedArguments.recursive) {
+            self.pool.init(.{ .allocator = self.allocator }) catch |err| {
+                self.allocator.free(root);
+                self.allocator.free(root_key);
+                return err;
+            };
+            defer self.pool.deinit();
+
+            self.pool.spawnWg(
+                &self.wait_group,
+                scanDirectory,
+                .{ &self, root, root_key, true },
+            );
+            self.pool.waitAndWork(&self.wait_group);
+        } else {
+            self.scanDirectory(root, root_key, true);
+        }
+        if (self.err) |err| return err;
+
+        // Jobs finish in no particular order. Songs from a feed may already
+        // be playing, so they are left alone.
+        if (ParsedArguments.recursive and !ParsedArguments.shuffle and null == feed) {
+            playlist.sortSongs(songs_start);
+        }
+
+        return self.songs_appended;
+    }
+
+    /// Takes ownership of `path` and `key` (see `LibraryIndex`.)
+    fn scanDirectory(self: *Self, path: []u8, key: []u8, is_root: bool) void {
+        defer self.allocator.free(path);
+        defer self.allocator.free(key);
+
+        {
+            self.mutex.lock();
+            defer self.mutex.unlock();
+            if (null != self.err) return;
+        }
+
+        // Collected locally to avoid contention.
+        var warnings = ArrayListUnmanaged(u8).empty;
+        defer warnings.deinit(self.allocator);
+        var batch = SongBatch{};
+        defer batch.deinit(self.allocator);
+
+        const result = self.scanDirectoryEntries(
+            path,
+            key,
+            is_root,
+            &batch,
+            warnings.writer(self.allocator),
+        );
+
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        self.stderr.writer().writeAll(warnings.items) catch {};
+        result catch |err| {
+            if (null == self.err) self.err = err;
+            return;
+        };
+        const first_appended = self.playlist.songs.len;
+        self.playlist.appendBatch(path, batch) catch |err| {
+            if (null == self.err) self.err = err;
+            return;
+        };
+        self.songs_appended +|= batch.songs.items.len;
+        if (self.feed) |feed| feed.appended(first_appended) catch |err| {
+            if (null == self.err) self.err = err;
+        };
+    }
+
+    fn scanDirectoryEntries(
+        self: *Self,
+        path: []const u8,
+        key: []const u8,
+        is_root: bool,
+        batch: *SongBatch,
+        warnings: anytype,
+    ) !void {
+        // Before reading the directory, so that no change goes unnoticed in
+        // between.
+        if (DirectoryWatcher.supported and DirectoryWatcher.initialized) {
+            DirectoryWatcher.watch(path, key) catch |err| switch (err) {
+                error.OutOfMemory => return err,
+                // Reported once reading the directory fails too.
+                error.FileNotFound, error.NotDir, error.AccessDenied => {},
+                else => try warnings.print(
+                    "WARN: Unable to watch directory ({s}): {s}\n",
+                    .{ @errorName(err), path },
+                ),
+            };
+        }
+
+        const io_batch = try self.acquireBatch();
+        defer self.releaseBatch(io_batch);
+        var listing = DirectoryListing.list(
+            self.allocator,
+            io_batch,
+            path,
+            key,
+        ) catch |err| switch (err) {
+            error.OutOfMemory => return err,
+            else => {
+                if (is_root) return err;
+                try warnings.print(
+                    "WARN: Unable to read directory ({s}). Skipping: {s}\n",
+                    .{ @errorName(err), path },
+                );
+                return;
+            },
+        };
+        defer listing.deinit(self.allocator);
+        const cache = try self.acquireCache();
+        defer self.releaseCache(cache);
+
+        var entries = listing.iterator();
+        var entries_scanned: u64 = 0;
+        defer Stats.add(.entries_scanned, entries_scanned);
+        while (entries.next()) |entry| {
+            entries_scanned += 1;
+            const format = entry.format orelse {
+                if (!ParsedArguments.recursive) continue;
+
+                const subdirectory = try fs.path.join(
+                    self.allocator,
+                    &.{ path, entry.name },
+                );
+                errdefer self.allocator.free(subdirectory);
+                const subdirectory_key = try fs.path.join(
+                    self.allocator,
+                    &.{ key, entry.name },
+                );
+                self.pool.spawnWg(
+                    &self.wait_group,
+                    scanDirectory,
+                    .{ self, subdirectory, subdirectory_key, false },
+                );
+                continue;
+            };
+
+            const tags = if (ParsedArguments.tags) entry.tags else SongTags{};
+            if (!try acceptSong(warnings, self.filter, cache, path, entry.name, tags, format)) {
+                continue;
+            }
+            try batch.append(self.allocator, entry.name, tags, format);
+        }
+    }
+
+    /// Returns caches for matching songs against the filter, or `null` if
+    /// there is no filter. Caches are reused between jobs, so that the
+    /// states learned from one directory speed up the next. Must be handed
+    /// back with `releaseCache`.
+    fn acquireCache(self: *Self) !?*SongFilter.Caches {
+        if (null == self.filter) return null;
+        {
+            self.mutex.lock();
+            defer self.mutex.unlock();
+            if (self.idle_caches.pop()) |cache| return cache;
+        }
+
+        const cache = try self.allocator.create(SongFilter.Caches);
+        cache.* = self.filter.?.initCaches();
+        return cache;
+    }
+
+    fn releaseCache(self: *Self, cache: ?*SongFilter.Caches) void {
+        const released = cache orelse return;
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        self.idle_caches.append(self.allocator, released) catch
+            self.destroyCache(released);
+    }
+
+    fn destroyCache(self: *Self, cache: *SongFilter.Caches) void {
+        SongFilter.deinitCaches(cache, self.allocator);
+        self.allocator.destroy(cache);
+    }
+
+    /// Returns an I/O batch for reading directories. Batches are reused
+    /// between jobs, so that there is one ring per job running at once,
+    /// rather than per directory. Must be handed back with `releaseBatch`.
+    fn acquireBatch(self: *Self) !*IoBatch {
+        {
+            self.mutex.lock();
+            defer self.mutex.unlock();
+            if (self.idle_batches.pop()) |io_batch| return io_batch;
+        }
+
+        const io_batch = try self.allocator.create(IoBatch);
+        errdefer self.allocator.destroy(io_batch);
+        io_batch.* = try IoBatch.init(self.allocator);
+        return io_batch;
+    }
+
+    fn releaseBatch(self: *Self, io_batch: *IoBatch) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+        self.idle_batches.append(self.allocator, io_batch) catch
+            self.destroyBatch(io_batch);
+    }
+
+    fn destroyBatch(self: *Self, io_batch: *IoBatch) void {
+        io_batch.deinit(self.allocator);
+        self.allocator.destroy(io_batch);
+    }
+};
+
+/// Reads the songs listed in M3U and PLS playlist files (see `--playlist`.)
+/// The file is memory-mapped, and its lines are parsed in place, a chunk at a
+/// time: the songs are gathered in buffers that are reused for each chunk,
+/// and the directories they are in are only copied once each.
+const PlaylistFile = struct {
+    /// How many entries are parsed, and their tags read, before the songs
+    /// are appended all at once. With `--stream`, the feed is only locked
+    /// while they are appended.
+    const chunk_entries = 256;
+
+    /// A song parsed from a playlist file, yet to be appended. Its directory,
+    /// name and tags are stored one after another, in that order.
+    const ParsedSong = struct {
+        directory_length: usize,
+        name_length: usize,
+        tags_length: usize,
+        format: FileFormat,
+    };
+
+    /// Requires the sound system to be initialized (see `SoundSystem`.)
+    /// Appends the songs listed in the playlist file at `path` to `playlist`,
+    /// in the order they are listed, and returns how many were appended. If
+    /// `filter` is not `null`, only songs it accepts are. If `feed` is not
+    /// `null`, it is notified of the songs as they are appended.
+    fn load(
+        playlist: *Playlist,
+        stderr: *ConsoleWriter,
+        filter: ?SongFilter,
+        path: []const u8,
+        feed: ?*PlaylistFeed,
+    ) !u64 {
+        const allocator = playlist.allocator;
+        const file = try fs.cwd().openFile(path, .{});
+        defer file.close();
+        const size = (try file.stat()).size;
+        if (0 == size) return 0;
+        const bytes = try posix.mmap(
+            null,
+            size,
+            posix.PROT.READ,
+            .{ .TYPE = .PRIVATE },
+            file.handle,
+            0,
+        );
+        defer posix.munmap(bytes);
+
+        // The indices in `playlist` of the directories appended so far, so
+        // that songs from the same directory share one.
+        var directories = StringHashMapUnmanaged(u32).empty;
+        defer {
+            var keys = directories.keyIterator();
+            while (keys.next()) |key| allocator.free(key.*);
+            directories.deinit(allocator);
+        }
+        var caches = if (filter) |f| f.initCaches() else null;
+        defer if (caches) |*c| SongFilter.deinitCaches(c, allocator);
+        var parsed_songs = ArrayListUnmanaged(ParsedSong).empty;
+        defer parsed_songs.deinit(allocator);
+        var strings = ArrayListUnmanaged(u8).empty;
+        defer strings.deinit(allocator);
+
+        const base = fs.path.dirname(path) orelse ".";
+        var songs_appended: u64 = 0;
+        var entries_skipped: u64 = 0;
+        var entries_parsed: usize = 0;
+
+        var entries = Entries.init(bytes);
+        var parsed_all = false;
+        while (!parsed_all) {
+            parsed_songs.clearRetainingCapacity();
+            strings.clearRetainingCapacity();
+            for (0..chunk_entries) |_| {
+                const entry = entries.next() orelse {
+                    parsed_all = true;
+                    break;
+                };
+                entries_parsed += 1;
+                if (!try parseEntry(allocator, base, entry, &parsed_songs, &strings)) {
+                    entries_skipped += 1;
+                }
+            }
+
+            if (feed) |f| f.mutex.lock();
+            defer if (feed) |f| f.mutex.unlock();
+            const first_appended = playlist.songs.len;
+
+            var offset: usize = 0;
+            for (parsed_songs.items) |song| {
+                const directory = strings.items[offset..][0..song.directory_length];
+                offset += song.directory_length;
+                const name = strings.items[offset..][0..song.name_length];
+                offset += song.name_length;
+                const song_tags = SongTags{ .bytes = strings.items[offset..][0..song.tags_length] };
+                offset += song.tags_length;
+
+                const cache = if (caches) |*c| c else null;
+                if (!try acceptSong(stderr.writer(), filter, cache, directory, name, song_tags, song.format)) {
+                    continue;
+                }
+
+                const directory_entry = try directories.getOrPut(allocator, directory);
+                if (!directory_entry.found_existing) {
+                    errdefer directories.removeByPtr(directory_entry.key_ptr);
+                    const directory_copy = try allocator.dupe(u8, directory);
+                    errdefer allocator.free(directory_copy);
+                    directory_entry.value_ptr.* = try playlist.appendDirectory(directory);
+                    directory_entry.key_ptr.* = directory_copy;
+                }
+                try playlist.appendSongTo(directory_entry.value_ptr.*, name, song_tags, song.format);
+                songs_appended += 1;
+            }
+            // Lets the songs appended so far be played.
+            if (feed) |f| if (first_appended < playlist.songs.len) try f.appended(first_appended);
+        }
+
+        Stats.add(.entries_scanned, entries_parsed);
+        Stats.add(.rejected_format, entries_skipped);
+        if (0 < entries_skipped) {
+            if (feed) |f| f.mutex.lock();
+            defer if (feed) |f| f.mutex.unlock();
+            try stderr.writer().print(
+                "WARN: Skipped {d} entries that are not song files in playlist: {s}\n",
+                .{ entries_skipped, path },
+            );
+        }
+        return songs_appended;
+    }
+
+    /// Helper for `load`. Appends the song `entry` refers to to
+    /// `parsed_songs`, reading its tags with `--tags`, or returns `false` if
+    /// it does not refer to a song file. `base` is the directory of the
+    /// playlist file.
+    fn parseEntry(
+        allocator: Allocator,
+        base: []const u8,
+        entry: []const u8,
+        parsed_songs: *ArrayListUnmanaged(ParsedSong),
+        strings: *ArrayListUnmanaged(u8),
+    ) !bool {
+        var entry_buffer: [fs.max_path_bytes]u8 = undefined;
+        const entry_path = entryPath(entry, &entry_buffer) orelse return false;
+        const name = fs.path.basename(entry_path);
+        const format = FileFormat.fromFile(name) orelse return false;
+        var directory_buffer: [fs.max_path_bytes]u8 = undefined;
+        const directory = entryDirectory(
+            base,
+            fs.path.dirname(entry_path),
+            &directory_buffer,
+        ) catch return false;
+        var song_path_buffer: [fs.max_path_bytes]u8 = undefined;
+        const song_path = joinPath(&song_path_buffer, directory, name) catch return false;
+
+        const strings_length = strings.items.len;
+        errdefer strings.shrinkRetainingCapacity(strings_length);
+        try strings.appendSlice(allocator, directory);
+        try strings.appendSlice(allocator, name);
+        if (ParsedArguments.tags) {
+            TagReader.readFile(allocator, fs.cwd(), song_path, strings) catch |err| {
+                if (error.OutOfMemory == err) return err;
+            };
+        }
+        try parsed_songs.append(allocator, .{
+            .directory_length = directory.len,
+            .name_length = name.len,
+            .tags_length = strings.items.len - strings_length - directory.len - name.len,
+            .format = format,
+        });
+        return true;
+    }
+
+    /// Returns the path of the song `entry` refers to, or `null` if it is a
+    /// URL other than `file://`. `file://` URLs are decoded into `buffer`.
+    fn entryPath(entry: []const u8, buffer: *[fs.max_path_bytes]u8) ?[]const u8 {
+        const file_scheme = "file://";
+        if (std.ascii.startsWithIgnoreCase(entry, file_scheme)) {
+            // Only local files, i.e. `file:///path` or
+            // `file://localhost/path`.
+            var url_path = entry[file_scheme.len..];
+            if (std.ascii.startsWithIgnoreCase(url_path, "localhost/")) {
+                url_path = url_path["localhost".len..];
+            }
+            if (!mem.startsWith(u8, url_path, "/")) return null;
+            if (buffer.len < url_path.len) return null;
+            const decoded = buffer[0..url_path.len];
+            @memcpy(decoded, url_path);
+            return std.Uri.percentDecodeInPlace(decoded);
+        }
+        if (null != mem.indexOf(u8, entry, "://")) return null;
+        return entry;
+    }
+
+    /// Returns the directory of a song, from the directory `entry_directory`
+    /// its entry names, relative to the directory of the playlist `base`.
+    fn entryDirectory(
+        base: []const u8,
+        entry_directory: ?[]const u8,
+        buffer: *[fs.max_path_bytes]u8,
+    ) ![]const u8 {
+        const directory = entry_directory orelse return base;
+        if (fs.path.isAbsolute(directory) or mem.eql(u8, base, ".")) return directory;
+        return joinPath(buffer, base, directory);
+    }
+
+    /// The entries of a playlist file, as they are written in it. M3U files
+    /// list one path or URL per line, with comments and extended
+    /// information on lines starting with `#`. PLS files start with a
+    /// `[playlist]` line, and list them as `FileN=` keys.
+    const Entries = struct {
+        lines: mem.SplitIterator(u8, .scalar),
+        pls: bool,
+
+        fn init(bytes: []const u8) Entries {
+            const byte_order_mark = "\xef\xbb\xbf";
+            const text = if (mem.startsWith(u8, bytes, byte_order_mark))
+                bytes[byte_order_mark.len..]
+            else
+                bytes;
+            var lines = mem.splitScalar(u8, text, '\n');
+            const first_line = mem.trim(u8, lines.peek() orelse "", " \t\r");
+            return .{
+                .lines = lines,
+                .pls = std.ascii.eqlIgnoreCase(first_line, "[playlist]"),
+            };
+        }
+
+        fn next(self: *Entries) ?[]const u8 {
+            while (self.lines.next()) |raw_line| {
+                const line = mem.trim(u8, raw_line, " \t\r");
+                if (0 == line.len) continue;
+                if (!self.pls) {
+                    if ('#' == line[0]) continue;
+                    return line;
+                }
+
+                const equals = mem.indexOfScalar(u8, line, '=') orelse continue;
+                const key = mem.trimRight(u8, line[0..equals], " \t");
+                if (key.len <= "File".len or
+                    !std.ascii.startsWithIgnoreCase(key, "File"))
+                {
+                    continue;
+                }
+                for (key["File".len..]) |c| {
+                    if (!std.ascii.isDigit(c)) break;
+                } else return mem.trimLeft(u8, line[equals + 1 ..], " \t");
+            }
+            return null;
+        }
+    };
+};
+
+/// Lets songs be played from a playlist while it is still being loaded by
+/// another thread (see `--stream`.)
+const PlaylistFeed = struct {
+    const Self = @This();
+
+    playlist: *Playlist,
+    /// If not `null`, songs are shuffled into the part of the playlist that
+    /// has not been played yet as they are appended.
+    random: ?Random,
+
+    /// Protects the fields below, `playlist`, stdout and stderr.
+    mutex: Thread.Mutex = .{},
+    /// Signaled when songs are appended or loading finishes.
+    condition: Thread.Condition = .{},
+    /// Position of the next song to play in the current cycle.
+    next: usize = 0,
+    /// The indices of the songs, shuffled as songs are appended. The songs
+    /// themselves are never moved.
+    indices: ArrayListUnmanaged(u32) = .empty,
+    /// Shuffles `indices` again in later cycles of the playlist.
+    permutation: ?Permutation = null,
+    /// If not `null`, only songs it accepts are played, with `--daemon`.
+    /// Owned.
+    filter: ?SongFilter = null,
+    /// Counts appends and filter changes.
+    changes: usize = 0,
+    loading: bool = true,
+    /// Set if loading failed.
+    err: ?anyerror = null,
+
+    const Entry = struct {
+        /// Index into the songs of the playlist.
+        index: usize,
+        path: []const u8,
+        format: FileFormat,
+    };
+
+    fn deinit(self: *Self) void {
+        self.indices.deinit(self.playlist.allocator);
+        if (self.filter) |filter| filter.deinit();
+        self.* = undefined;
+    }
+
+    /// Must be called with `mutex` held, after songs were appended to the
+    /// playlist from index `first` on.
+    fn appended(self: *Self, first: usize) !void {
+        const shuffle_mark = Stats.begin();
+        defer Stats.accumulate(.shuffle, shuffle_mark);
+        const allocator = self.playlist.allocator;
+        const count = self.playlist.songs.len;
+        try self.indices.ensureTotalCapacity(allocator, count);
+        if (self.permutation) |permutation| {
+            // Songs added during a later cycle, with `--daemon`, are
+            // shuffled into the rest of it, which needs its order laid out.
+            const permuted = try allocator.alloc(u32, permutation.count);
+            defer allocator.free(permuted);
+            for (permuted, 0..) |*index, position| {
+                index.* = self.indices.items[permutation.at(position)];
+            }
+            @memcpy(self.indices.items, permuted);
+            self.permutation = null;
+        }
+        for (first..count) |index| self.indices.appendAssumeCapacity(@intCast(index));
+        if (self.random) |random| {
+            // Inside-out Fisher-Yates shuffle of the songs not yet played.
+            const indices = self.indices.items;
+            for (first..count) |i| {
+                const j = random.intRangeAtMost(usize, self.next, i);
+                mem.swap(u32, &indices[i], &indices[j]);
+            }
+        }
+        self.changed();
+    }
+
+    /// Must be called with `mutex` held, after songs were changed in ways
+    /// that may make them playable (see `waitForChange`.)
+    fn changed(self: *Self) void {
+        self.changes +%= 1;
+        self.condition.broadcast();
+    }
+
+    /// Must be called with `mutex` held. Only valid until songs are
+    /// appended.
+    fn playOrder(self: *const Self) PlayOrder {
+        return .{ .permutation = self.permutation, .indices = self.indices.items };
+    }
+
+    /// Must be called with `mutex` held, once loading has finished.
+    fn finish(self: *Self, result: anyerror!void) void {
+        self.loading = false;
+        result catch |err| {
+            self.err = err;
+        };
+        self.condition.broadcast();
+    }
+
+    /// Waits for loading to finish, then marks the playlist as being loaded
+    /// again until `endLoad` is called, so that later loads (see
+    /// `ControlServer` and `DirectoryWatcher`) do not overlap. Fails if
+    /// loading failed or `quit` was called.
+    fn beginLoad(self: *Self) !void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        while (true) {
+            if (self.err) |err| return err;
+            if (!self.loading) break;
+            self.condition.wait(&self.mutex);
+        }
+        self.loading = true;
+    }
+
+    fn endLoad(self: *Self) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        self.loading = false;
+        self.condition.broadcast();
+    }
+
+    /// Blocks until a song is available and writes its path into `buffer`.
+    /// Returns `null` once all the songs have been played. Skips the songs
+    /// that failed to play before or were removed.
+    fn take(self: *Self, buffer: *[fs.max_path_bytes]u8) !?Entry {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        while (true) {
+            if (self.err) |err| return err;
+
+            if (self.next < self.indices.items.len) {
+                const index = self.playOrder().at(self.next);
+                const song = self.playlist.songs.get(index);
+                self.next += 1;
+                if (song.failed or song.removed) continue;
+                if (self.filter) |filter| {
+                    const name = self.playlist.songName(song);
+                    if (!filter.accepts(null, name, self.playlist.songTags(song))) continue;
+                }
+                return .{
+                    .index = index,
+                    .path = try self.playlist.songPath(song, buffer),
+                    .format = song.format,
+                };
+            }
+            if (!self.loading) return null;
+
+            self.condition.wait(&self.mutex);
+        }
+    }
+
+    /// Replaces the filter, taking ownership of `filter`. Applies from the
+    /// next song on.
+    fn setFilter(self: *Self, filter: ?SongFilter) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        if (self.filter) |old_filter| old_filter.deinit();
+        self.filter = filter;
+        self.changed();
+    }
+
+    /// Makes `take` and `waitForChange` fail with `error.Quit`.
+    fn quit(self: *Self) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        if (null == self.err) self.err = error.Quit;
+        self.condition.broadcast();
+    }
+
+    fn changeCount(self: *Self) usize {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        return self.changes;
+    }
+
+    /// Blocks until songs are appended or the filter is changed after
+    /// `changeCount` returned `since` (see `changed`,) or `quit` is called.
+    fn waitForChange(self: *Self, since: usize) !void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        while (true) {
+            if (self.err) |err| return err;
+            if (since != self.changes) return;
+            self.condition.wait(&self.mutex);
+        }
+    }
+
+    /// Starts the next cycle of the playlist, in a new order if shuffling.
+    fn restart(self: *Self) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        self.next = 0;
+        self.permutation = PlayOrder.init(self.indices.items.len, self.random).permutation;
+    }
+};
+
+/// Reads the songs coming up into the page cache while the current one plays
+/// (see `--read-ahead`,) on a background thread, so that they start without
+/// waiting on slow storage.
+const ReadAhead = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var thread: ?Thread = undefined;
+    /// Protects the fields below.
+    var mutex: Thread.Mutex = .{};
+    /// Signaled when `paths` is replaced or when stopping.
+    var condition: Thread.Condition = .{};
+    /// Paths of the songs to read ahead, owned. Replaced by each request.
+    var paths: ArrayListUnmanaged([]u8) = undefined;
+    var stopping: bool = undefined;
+
+    /// The most memory read ahead at once, split between the songs.
+    const budget_bytes = 256 * 1024 * 1024;
+
+    /// Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        paths = ArrayListUnmanaged([]u8).empty;
+        stopping = false;
+        thread = null;
+        if (0 < ParsedArguments.read_ahead) thread = try Thread.spawn(.{}, work, .{});
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        if (thread) |t| {
+            {
+                mutex.lock();
+                defer mutex.unlock();
+                stopping = true;
+                condition.signal();
+            }
+            t.join();
+        }
+        freePaths();
+        paths.deinit(allocator);
+
+        initialized = false;
+    }
+
+    /// Asks for the songs from position `first` in `order` on to be read
+    /// ahead, superseding earlier requests. Songs that failed to play or
+    /// were removed are left out. If `next_order` is not `null`, continues with the start of
+    /// the next cycle. Must be called with the playlist protected from
+    /// changes.
+    fn request(
+        playlist: *const Playlist,
+        order: PlayOrder,
+        next_order: ?PlayOrder,
+        first: usize,
+    ) !void {
+        debug.assert(initialized);
+        if (null == thread) return;
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        freePaths();
+        var songs = UpcomingSongs{
+            .songs = playlist.songs.slice(),
+            .order = order,
+            .next_order = next_order,
+            .position = first,
+        };
+        var path_buffer: [fs.max_path_bytes]u8 = undefined;
+        while (paths.items.len < ParsedArguments.read_ahead) {
+            const song = songs.next() orelse break;
+            const path = try allocator.dupe(u8, try playlist.songPath(song, &path_buffer));
+            errdefer allocator.free(path);
+            try paths.append(allocator, path);
+        }
+        condition.signal();
+    }
+
+    fn freePaths() void {
+        for (paths.items) |path| allocator.free(path);
+        paths.clearRetainingCapacity();
+    }
+
+    /// Entry point of the thread.
+    fn work() void {
+        mutex.lock();
+        defer mutex.unlock();
+
+        while (!stopping) {
+            if (0 == paths.items.len) {
+                condition.wait(&mutex);
+                continue;
+            }
+            // The next song first.
+            const path = paths.orderedRemove(0);
+            defer allocator.free(path);
+            const budget = budget_bytes / ParsedArguments.read_ahead;
+
+            mutex.unlock();
+            defer mutex.lock();
+            readFile(path, budget);
+        }
+    }
+
+    /// Gets up to `budget` bytes from the start of the file into the page
+    /// cache. On Linux the kernel is asked to read them in the background,
+    /// elsewhere they are read here.
+    fn readFile(path: []const u8, budget: u64) void {
+        const file = fs.cwd().openFile(path, .{}) catch return;
+        defer file.close();
+
+        if (.linux == builtin.os.tag) {
+            const size = (file.stat() catch return).size;
+            _ = linux.fadvise(
+                file.handle,
+                0,
+                @intCast(@min(size, budget)),
+                linux.POSIX_FADV.WILLNEED,
+            );
+            return;
+        }
+
+        var buffer: [64 * 1024]u8 = undefined;
+        var read: u64 = 0;
+        while (read < budget) {
+            const length = file.read(&buffer) catch return;
+            if (0 == length) return;
+            read += length;
+        }
+    }
+};
+
+/// Keeps the playlist up to date with the directories it was loaded from,
+/// with `--watch`, through inotify. `Scanner` watches each directory it
+/// reads, and the changes reported for them are applied to the playlist one
+/// song at a time on a background thread, instead of reading the
+/// directories again. Only new subdirectories are scanned, with
+/// `--recursive`.
+///
+/// Changes are applied between loads (see `PlaylistFeed.beginLoad`,) so
+/// that songs are not appended twice when a directory changes while it is
+/// being scanned. The listings of changed directories are recorded in the
+/// library index once they have been left alone for long enough (see
+/// `LibraryIndex.minimum_age_ns`,) so that the next run does not have to
+/// read them either.
+const DirectoryWatcher = struct {
+    const supported = .linux == builtin.os.tag;
+
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var stderr: *ConsoleWriter = undefined;
+    var stdout: *ConsoleWriter = undefined;
+    var filter: ?SongFilter = undefined;
+    var feed: *PlaylistFeed = undefined;
+    var inotify_fd: i32 = undefined;
+    /// Written to by `deinit` to stop the thread.
+    var stop_fd: i32 = undefined;
+    var thread: Thread = undefined;
+    /// Protects `watches`.
+    var mutex: Thread.Mutex = .{};
+    /// The watched directories, by watch descriptor.
+    var watches: AutoHashMapUnmanaged(i32, Watch) = undefined;
+    /// Watch descriptors of the directories changed since their listings
+    /// were last recorded. Only used by the thread.
+    var unrecorded: AutoHashMapUnmanaged(i32, void) = undefined;
+
+    const Watch = struct {
+        /// The path of the directory in the playlist.
+        path: []u8,
+        /// The absolute path of the directory (see `LibraryIndex`.)
+        key: []u8,
+    };
+
+    const watch_mask = linux.IN.CREATE | linux.IN.DELETE | linux.IN.CLOSE_WRITE |
+        linux.IN.MOVED_FROM | linux.IN.MOVED_TO | linux.IN.DELETE_SELF |
+        linux.IN.MOVE_SELF | linux.IN.ONLYDIR | linux.IN.DONT_FOLLOW |
+        linux.IN.EXCL_UNLINK;
+    const record_delay_ms = LibraryIndex.minimum_age_ns / time.ns_per_ms;
+
+    /// Deinitialize with `deinit`. Does not take ownership of `filterr`.
+    fn init(
+        allocatorr: Allocator,
+        stderrr: *ConsoleWriter,
+        stdoutt: *ConsoleWriter,
+        filterr: ?SongFilter,
+        feedd: *PlaylistFeed,
+    ) !void {
+        debug.assert(!initialized);
+        comptime debug.assert(supported);
+
+        allocator = allocatorr;
+        stderr = stderrr;
+        stdout = stdoutt;
+        filter = filterr;
+        feed = feedd;
+        watches = AutoHashMapUnmanaged(i32, Watch).empty;
+        unrecorded = AutoHashMapUnmanaged(i32, void).empty;
+
+        inotify_fd = try posix.inotify_init1(linux.IN.NONBLOCK | linux.IN.CLOEXEC);
+        errdefer posix.close(inotify_fd);
+        stop_fd = try posix.eventfd(0, linux.EFD.CLOEXEC);
+        errdefer posix.close(stop_fd);
+        thread = try Thread.spawn(.{}, work, .{});
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        // Wakes the thread up if it is waiting for a load to finish.
+        feed.quit();
+        _ = posix.write(stop_fd, &mem.toBytes(@as(u64, 1))) catch {};
+        thread.join();
+        posix.close(stop_fd);
+        posix.close(inotify_fd);
+        var iterator = watches.valueIterator();
+        while (iterator.next()) |directory| {
+            allocator.free(directory.path);
+            allocator.free(directory.key);
+        }
+        watches.deinit(allocator);
+        unrecorded.deinit(allocator);
+
+        initialized = false;
+    }
+
+    /// Starts watching the directory at `path`, whose absolute path is `key`.
+    fn watch(path: []const u8, key: []const u8) !void {
+        debug.assert(initialized);
+
+        // So that they can be copied out (see `copyWatch`.)
+        if (fs.max_path_bytes < path.len or fs.max_path_bytes < key.len) {
+            return error.NameTooLong;
+        }
+        const wd = try posix.inotify_add_watch(inotify_fd, path, watch_mask);
+        errdefer {
+            mutex.lock();
+            defer mutex.unlock();
+            // Unless it was already watched, through another path.
+            if (!watches.contains(wd)) _ = linux.inotify_rm_watch(inotify_fd, wd);
+        }
+        const path_copy = try allocator.dupe(u8, path);
+        errdefer allocator.free(path_copy);
+        const key_copy = try allocator.dupe(u8, key);
+        errdefer allocator.free(key_copy);
+
+        mutex.lock();
+        defer mutex.unlock();
+        const entry = try watches.getOrPut(allocator, wd);
+        if (entry.found_existing) {
+            // Already watched, through another path.
+            allocator.free(path_copy);
+            allocator.free(key_copy);
+            return;
+        }
+        entry.value_ptr.* = .{ .path = path_copy, .key = key_copy };
+    }
+
+    /// Must be called with `mutex` held. Forgets the directory watched by
+    /// `wd`, without removing the watch.
+    fn removeWatch(wd: i32) void {
+        const entry = watches.fetchRemove(wd) orelse return;
+        allocator.free(entry.value.path);
+        allocator.free(entry.value.key);
+    }
+
+    /// Copies the paths of the directory watched by `wd` into the buffers,
+    /// or returns `null` if it is no longer watched.
+    fn copyWatch(
+        wd: i32,
+        path_buffer: *[fs.max_path_bytes]u8,
+        key_buffer: *[fs.max_path_bytes]u8,
+    ) ?Watch {
+        mutex.lock();
+        defer mutex.unlock();
+
+        const directory = watches.get(wd) orelse return null;
+        const path = path_buffer[0..directory.path.len];
+        const key = key_buffer[0..directory.key.len];
+        @memcpy(path, directory.path);
+        @memcpy(key, directory.key);
+        return .{ .path = path, .key = key };
+    }
+
+    fn isWatched(path: []const u8) bool {
+        mutex.lock();
+        defer mutex.unlock();
+
+        var iterator = watches.valueIterator();
+        while (iterator.next()) |directory| {
+            if (mem.eql(u8, directory.path, path)) return true;
+        }
+        return false;
+    }
+
+    /// Whether `path` is `directory` or is in it.
+    fn isWithin(path: []const u8, directory: []const u8) bool {
+        if (!mem.startsWith(u8, path, directory)) return false;
+        return path.len == directory.len or
+            mem.endsWith(u8, directory, fs.path.sep_str) or
+            fs.path.sep == path[directory.len];
+    }
+
+    /// Entry point of the thread.
+    fn work() void {
+        var buffer: [4096]u8 align(@alignOf(linux.inotify_event)) = undefined;
+        var fds = [_]posix.pollfd{
+            .{ .fd = inotify_fd, .events = posix.POLL.IN, .revents = 0 },
+            .{ .fd = stop_fd, .events = posix.POLL.IN, .revents = 0 },
+        };
+
+        while (true) {
+            // Until no more changes come for long enough.
+            const timeout: i32 = if (0 == unrecorded.count()) -1 else record_delay_ms;
+            const ready = posix.poll(&fds, timeout) catch {
+                time.sleep(100 * time.ns_per_ms);
+                continue;
+            };
+            if (0 != fds[1].revents) return;
+            if (0 == ready) {
+                recordListings();
+                continue;
+            }
+
+            // Fails once exiting.
+            feed.beginLoad() catch return;
+            defer feed.endLoad();
+            while (true) {
+                const length = posix.read(inotify_fd, &buffer) catch break;
+                var index: usize = 0;
+                while (index < length) {
+                    const event: *const linux.inotify_event = @ptrCast(@alignCast(&buffer[index]));
+                    index += @sizeOf(linux.inotify_event);
+                    const name = mem.sliceTo(buffer[index..][0..event.len], 0);
+                    index += event.len;
+
+                    apply(event.wd, event.mask, name) catch |err| {
+                        feed.mutex.lock();
+                        defer feed.mutex.unlock();
+                        stderr.writer().print(
+                            "WARN: Unable to apply change to the playlist: {s}\n",
+                            .{@errorName(err)},
+                        ) catch {};
+                    };
+                }
+            }
+        }
+    }
+
+    /// Applies an event for the directory watched by `wd`. `name` is that of
+    /// the entry in the directory the event is about, if any.
+    fn apply(wd: i32, mask: u32, name: []const u8) !void {
+        if (0 != mask & linux.IN.Q_OVERFLOW) {
+            {
+                feed.mutex.lock();
+                defer feed.mutex.unlock();
+                try stderr.writer().print(
+                    "WARN: Too many changes to the directories at once, reading them again\n",
+                    .{},
+                );
+            }
+            return rescan();
+        }
+        if (0 != mask & linux.IN.IGNORED) {
+            mutex.lock();
+            defer mutex.unlock();
+            removeWatch(wd);
+            return;
+        }
+
+        var path_buffer: [fs.max_path_bytes]u8 = undefined;
+        var key_buffer: [fs.max_path_bytes]u8 = undefined;
+        const directory = copyWatch(wd, &path_buffer, &key_buffer) orelse return;
+        if (0 != mask & (linux.IN.DELETE_SELF | linux.IN.MOVE_SELF)) {
+            return forget(directory.path);
+        }
+        if (ParsedArguments.cache) try unrecorded.put(allocator, wd, {});
+        if (0 == name.len) return;
+
+        if (0 != mask & linux.IN.ISDIR) {
+            var subdirectory_buffer: [fs.max_path_bytes]u8 = undefined;
+            const subdirectory = try joinPath(&subdirectory_buffer, directory.path, name);
+            if (0 != mask & (linux.IN.DELETE | linux.IN.MOVED_FROM)) {
+                try forget(subdirectory);
+            } else if (ParsedArguments.recursive) {
+                try load(subdirectory);
+            }
+        } else if (0 != mask & (linux.IN.DELETE | linux.IN.MOVED_FROM)) {
+            try removeSong(directory.path, name);
+        } else if (0 != mask & (linux.IN.CLOSE_WRITE | linux.IN.MOVED_TO)) {
+            try addSong(directory.path, name);
+        }
+    }
+
+    /// Appends the file `name` in the directory at `path` to the playlist if
+    /// it is a song, or marks it as no longer removed if it is already in
+    /// the playlist.
+    fn addSong(path: []const u8, name: []const u8) !void {
+        const extension_format = FileFormat.fromFile(name) orelse return;
+        var song_path_buffer: [fs.max_path_bytes]u8 = undefined;
+        const song_path = try joinPath(&song_path_buffer, path, name);
+        const format = if (ParsedArguments.sniff) sniffed: {
+            const file = fs.cwd().openFile(song_path, .{}) catch return;
+            defer file.close();
+            var header: [FileFormat.header_size]u8 = undefined;
+            const header_length = file.read(&header) catch return;
+            break :sniffed FileFormat.fromHeader(header[0..header_length], extension_format) orelse return;
+        } else extension_format;
+        var tags = ArrayListUnmanaged(u8).empty;
+        defer tags.deinit(allocator);
+        if (ParsedArguments.tags) {
+            TagReader.readFile(allocator, fs.cwd(), song_path, &tags) catch |err| {
+                if (error.OutOfMemory == err) return err;
+            };
+        }
+
+        feed.mutex.lock();
+        defer feed.mutex.unlock();
+
+        if (try markSongs(path, name, false)) |restored| {
+            // Otherwise it was only written to.
+            if (0 == restored) return;
+            feed.changed();
+        } else {
+            // Errors are reported by `acceptSong`, and only stop scans.
+            const song_tags = SongTags{ .bytes = tags.items };
+            if (!(acceptSong(stderr.writer(), filter, null, path, name, song_tags, format) catch false)) {
+                return;
+            }
+            const first = feed.playlist.songs.len;
+            try feed.playlist.appendSong(path, name, song_tags, format);
+            try feed.appended(first);
+        }
+        try stdout.writer().print("INFO: Song added: {s}\n", .{song_path});
+        try stderr.flush();
+        try stdout.flush();
+    }
+
+    fn removeSong(path: []const u8, name: []const u8) !void {
+        feed.mutex.lock();
+        defer feed.mutex.unlock();
+
+        const songs_removed = try markSongs(path, name, true) orelse 0;
+        if (0 == songs_removed) return;
+        var song_path_buffer: [fs.max_path_bytes]u8 = undefined;
+        try stdout.writer().print(
+            "INFO: Song removed: {s}\n",
+            .{try joinPath(&song_path_buffer, path, name)},
+        );
+        try stdout.flush();
+    }
+
+    /// Appends the songs in the new directory at `path` to the playlist.
+    fn load(path: []const u8) !void {
+        // Already scanned if it was made while its parent was being scanned.
+        if (isWatched(path)) return;
+
+        const songs_loaded = try feed.playlist.appendFromDirectory(stderr, filter, path, feed);
+        const saved = LibraryIndex.save();
+
+        feed.mutex.lock();
+        defer feed.mutex.unlock();
+        try stdout.writer().print(
+            "INFO: {d} song(s) loaded from directory: {s}\n",
+            .{ songs_loaded, path },
+        );
+        saved catch |err| try stderr.writer().print(
+            "WARN: Unable to save library index: {s}\n",
+            .{@errorName(err)},
+        );
+        try stderr.flush();
+        try stdout.flush();
+    }
+
+    /// Brings the playlist up to date with all the watched directories, for
+    /// when changes were missed. Their listings are read again, and songs
+    /// are appended, removed, or no longer removed to match them. Goes
+    /// through all the songs once.
+    fn rescan() !void {
+        // Copied, since `forget` and `load` change `watches`.
+        var directories = ArrayListUnmanaged(Watch).empty;
+        defer {
+            for (directories.items) |directory| {
+                allocator.free(directory.path);
+                allocator.free(directory.key);
+            }
+            directories.deinit(allocator);
+        }
+        {
+            mutex.lock();
+            defer mutex.unlock();
+
+            try directories.ensureTotalCapacity(allocator, watches.count());
+            var iterator = watches.valueIterator();
+            while (iterator.next()) |directory| {
+                const path = try allocator.dupe(u8, directory.path);
+                errdefer allocator.free(path);
+                directories.appendAssumeCapacity(.{
+                    .path = path,
+                    .key = try allocator.dupe(u8, directory.key),
+                });
+            }
+        }
+
+        // Indices in `directories`, by path.
+        var watched = StringHashMapUnmanaged(usize).empty;
+        defer watched.deinit(allocator);
+        for (directories.items, 0..) |directory, index| {
+            try watched.put(allocator, directory.path, index);
+        }
+
+        const Listed = struct {
+            entry: DirectoryListing.Entry,
+            in_playlist: bool = false,
+        };
+        // `null` for directories that could not be read.
+        const listings = try allocator.alloc(?DirectoryListing, directories.items.len);
+        @memset(listings, null);
+        defer {
+            for (listings) |*listing| {
+                if (listing.*) |*l| l.deinit(allocator);
+            }
+            allocator.free(listings);
+        }
+        // The songs in each directory, by name.
+        const songs_listed = try allocator.alloc(StringHashMapUnmanaged(Listed), directories.items.len);
+        @memset(songs_listed, .empty);
+        defer {
+            for (songs_listed) |*songs| songs.deinit(allocator);
+            allocator.free(songs_listed);
+        }
+        var new_subdirectories = ArrayListUnmanaged([]u8).empty;
+        defer {
+            for (new_subdirectories.items) |subdirectory| allocator.free(subdirectory);
+            new_subdirectories.deinit(allocator);
+        }
+
+        var io_batch = try IoBatch.init(allocator);
+        defer io_batch.deinit(allocator);
+        for (directories.items, listings, songs_listed) |directory, *listing, *songs| {
+            listing.* = DirectoryListing.list(
+                allocator,
+                &io_batch,
+                directory.path,
+                directory.key,
+            ) catch |err| switch (err) {
+                error.OutOfMemory => return err,
+                // Forgotten below.
+                else => continue,
+            };
+            var entries = listing.*.?.iterator();
+            while (entries.next()) |entry| {
+                if (null != entry.format) {
+                    try songs.put(allocator, entry.name, .{ .entry = entry });
+                } else if (ParsedArguments.recursive) {
+                    var subdirectory_buffer: [fs.max_path_bytes]u8 = undefined;
+                    const subdirectory = try joinPath(&subdirectory_buffer, directory.path, entry.name);
+                    if (watched.contains(subdirectory)) continue;
+                    const subdirectory_copy = try allocator.dupe(u8, subdirectory);
+                    errdefer allocator.free(subdirectory_copy);
+                    try new_subdirectories.append(allocator, subdirectory_copy);
+                }
+            }
+        }
+
+        {
+            feed.mutex.lock();
+            defer feed.mutex.unlock();
+
+            const playlist = feed.playlist;
+            // Indices in `directories` of the playlist's directories, if
+            // they are watched and could be read.
+            const directory_indices = try allocator.alloc(?usize, playlist.directories.items.len);
+            defer allocator.free(directory_indices);
+            for (playlist.directories.items, directory_indices) |slice, *directory_index| {
+                directory_index.* = watched.get(playlist.string(slice));
+                if (directory_index.*) |index| {
+                    if (null == listings[index]) directory_index.* = null;
+                }
+            }
+
+            var songs_removed: usize = 0;
+            var songs_restored: usize = 0;
+            const songs = playlist.songs.slice();
+            for (songs.items(.directory), songs.items(.removed), 0..) |directory, *removed, song_index| {
+                const index = directory_indices[directory] orelse continue;
+                const name = playlist.songName(songs.get(song_index));
+                if (songs_listed[index].getPtr(name)) |listed| {
+                    listed.in_playlist = true;
+                    if (!removed.*) continue;
+                    removed.* = false;
+                    songs_restored += 1;
+                } else if (!removed.*) {
+                    removed.* = true;
+                    songs_removed += 1;
+                }
+            }
+            if (0 < songs_restored) feed.changed();
+
+            const first = playlist.songs.len;
+            for (directories.items, songs_listed) |directory, listed_songs| {
+                var iterator = listed_songs.iterator();
+                while (iterator.next()) |listed| {
+                    if (listed.value_ptr.in_playlist) continue;
+                    const entry = listed.value_ptr.entry;
+                    const format = entry.format.?;
+                    const tags = if (ParsedArguments.tags) entry.tags else SongTags{};
+                    // Errors are reported by `acceptSong`, and only stop scans.
+                    const accepted = acceptSong(
+                        stderr.writer(),
+                        filter,
+                        null,
+                        directory.path,
+                        entry.name,
+                        tags,
+                        format,
+                    ) catch false;
+                    if (!accepted) continue;
+                    try playlist.appendSong(directory.path, entry.name, tags, format);
+                }
+            }
+            if (first < playlist.songs.len) try feed.appended(first);
+
+            try stdout.writer().print(
+                "INFO: {d} song(s) added, {d} removed and {d} restored after reading the directories again\n",
+                .{ playlist.songs.len - first, songs_removed, songs_restored },
+            );
+            try stderr.flush();
+            try stdout.flush();
+        }
+
+        for (directories.items, listings) |directory, listing| {
+            if (null == listing) try forget(directory.path);
+        }
+        for (new_subdirectories.items) |subdirectory| try load(subdirectory);
+    }
+
+    /// Removes the songs in the directory at `path` and its subdirectories
+    /// from the playlist, and stops watching them.
+    fn forget(path: []const u8) !void {
+        {
+            mutex.lock();
+            defer mutex.unlock();
+
+            var forgotten = ArrayListUnmanaged(i32).empty;
+            defer forgotten.deinit(allocator);
+            var iterator = watches.iterator();
+            while (iterator.next()) |entry| {
+                if (isWithin(entry.value_ptr.path, path)) {
+                    try forgotten.append(allocator, entry.key_ptr.*);
+                }
+            }
+            for (forgotten.items) |wd| {
+                // Fails if the watch is already gone along with the
+                // directory, which is fine.
+                _ = linux.inotify_rm_watch(inotify_fd, wd);
+                removeWatch(wd);
+            }
+        }
+
+        feed.mutex.lock();
+        defer feed.mutex.unlock();
+
+        const songs_removed = try markSongs(path, null, true) orelse 0;
+        if (0 == songs_removed) return;
+        try stdout.writer().print(
+            "INFO: {d} song(s) removed with directory: {s}\n",
+            .{ songs_removed, path },
+        );
+        try stdout.flush();
+    }
+
+    /// Must be called with the feed's mutex held. Sets whether the songs
+    /// named `name` in the directory at `path` are removed, or all the songs
+    /// in it and its subdirectories if `name` is `null`. Returns how many
+    /// songs changed, or `null` if there are no such songs.
+    ///
+    /// Goes through all the songs, which is fine for the odd change.
+    fn markSongs(path: []const u8, name: ?[]const u8, removed: bool) !?usize {
+        const playlist = feed.playlist;
+        var directories = try DynamicBitSetUnmanaged.initEmpty(
+            allocator,
+            playlist.directories.items.len,
+        );
+        defer directories.deinit(allocator);
+        for (playlist.directories.items, 0..) |slice, index| {
+            const directory = playlist.string(slice);
+            directories.setValue(index, if (null == name)
+                isWithin(directory, path)
+            else
+                mem.eql(u8, directory, path));
+        }
+
+        const songs = playlist.songs.slice();
+        var found = false;
+        var marked: usize = 0;
+        for (songs.items(.directory), songs.items(.removed), 0..) |directory, *song_removed, index| {
+            if (!directories.isSet(directory)) continue;
+            if (name) |n| {
+                if (!mem.eql(u8, playlist.songName(songs.get(index)), n)) continue;
+            }
+            found = true;
+            if (removed == song_removed.*) continue;
+            song_removed.* = removed;
+            marked += 1;
+        }
+        return if (found) marked else null;
+    }
+
+    /// Records the listings of the directories that changed in the library
+    /// index. They are read again to get them, as only the last few changes
+    /// may be known.
+    fn recordListings() void {
+        var path_buffer: [fs.max_path_bytes]u8 = undefined;
+        var key_buffer: [fs.max_path_bytes]u8 = undefined;
+        record: {
+            var io_batch = IoBatch.init(allocator) catch break :record;
+            defer io_batch.deinit(allocator);
+            var iterator = unrecorded.keyIterator();
+            while (iterator.next()) |wd| {
+                const directory = copyWatch(wd.*, &path_buffer, &key_buffer) orelse continue;
+                var listing = DirectoryListing.list(
+                    allocator,
+                    &io_batch,
+                    directory.path,
+                    directory.key,
+                ) catch continue;
+                listing.deinit(allocator);
+            }
+        }
+        unrecorded.clearRetainingCapacity();
+
+        LibraryIndex.save() catch |err| {
+            feed.mutex.lock();
+            defer feed.mutex.unlock();
+            stderr.writer().print(
+                "WARN: Unable to save library index: {s}\n",
+                .{@errorName(err)},
+            ) catch {};
+        };
+    }
+};
+
+/// The audio files and subdirectories of a directory, in the format stored in
+/// the library index (see `LibraryIndex`.)
+///
+/// Each entry is a tag byte (0 for subdirectories, otherwise the file format
+/// plus one,) followed by the lengths of the name and of the song's tags (see
+/// `SongTags`, only read with `--tags`) as little-endian `u16`s, the file's
+/// modification time as a little-endian `i64` and its size as a
+/// little-endian `u64` (see `FileStat`, only with `--sniff` or `--tags`,)
+/// followed by the name and the tags.
+///
+/// With `--sniff`, files named like songs that are not songs are kept too,
+/// tagged with `not_song_tag`, so that they are sniffed again if they change.
+/// They are skipped when iterating.
+const DirectoryListing = struct {
+    const Self = @This();
+
+    bytes: []const u8,
+    /// Whether `bytes` is owned, rather than borrowed from the library index.
+    owned: bool,
+
+    const Entry = struct {
+        name: []const u8,
+        /// `null` for subdirectories.
+        format: ?FileFormat,
+        tags: SongTags,
+    };
+
+    const entry_header_size = 1 + 2 + 2 + 8 + 8;
+    /// Where the `FileStat` is in an entry.
+    const stat_offset = 1 + 2 + 2;
+    /// Only used while reading a directory, for files that are not songs.
+    const unknown_file_tag = 0xff;
+    /// For files named like songs that turned out not to be songs.
+    const not_song_tag = 0xfe;
+
+    /// The modification time and size of a file. The format and tags of a
+    /// file are read again when they change, since writing to a file does
+    /// not change its directory.
+    const FileStat = struct {
+        /// In nanoseconds, wrapping around.
+        modification_time: i64,
+        size: u64,
+
+        /// For files that could not be stat-ed, and files modified too
+        /// recently for further changes to show in their modification time
+        /// (see `LibraryIndex.minimum_age_ns`.) Never the same as any stat.
+        const unknown = FileStat{ .modification_time = math.minInt(i64), .size = math.maxInt(u64) };
+
+        /// `modification_time` is in nanoseconds.
+        fn init(modification_time: i128, size: u64) FileStat {
+            if (time.nanoTimestamp() - modification_time < LibraryIndex.minimum_age_ns) return unknown;
+            return .{ .modification_time = @truncate(modification_time), .size = size };
+        }
+
+        fn eql(self: FileStat, other: FileStat) bool {
+            const is_unknown = unknown.modification_time == self.modification_time and
+                unknown.size == self.size;
+            return !is_unknown and
+                self.modification_time == other.modification_time and self.size == other.size;
+        }
+    };
+
+    /// Requires the library index to be initialized (see `LibraryIndex`.)
+    /// Reads the directory from disk only if it has changed since it was
+    /// last recorded in the library index. The formats and tags of the files
+    /// that have changed since are read again (see `refresh`.) `key` is the
+    /// directory's absolute path. `io_batch` is used for the files that need
+    /// to be stat-ed or sniffed. Deinitialize with `deinit`.
+    fn list(allocator: Allocator, io_batch: *IoBatch, path: []const u8, key: []const u8) !Self {
+        if (!ParsedArguments.cache) return read(allocator, io_batch, path);
+
+        const stat = try fs.cwd().statFile(path);
+        if (LibraryIndex.lookup(key, stat)) |record| {
+            const changed = if (record.sniffed or record.tagged)
+                try refresh(allocator, io_batch, path, record)
+            else
+                null;
+            if (changed) |refreshed| {
+                var listing = refreshed;
+                errdefer listing.deinit(allocator);
+                try LibraryIndex.update(key, stat, listing.bytes);
+                return listing;
+            }
+            Stats.add(.directories_cached, 1);
+            return .{ .bytes = record.listing, .owned = false };
+        }
+
+        var listing = try read(allocator, io_batch, path);
+        errdefer listing.deinit(allocator);
+        try LibraryIndex.update(key, stat, listing.bytes);
+        return listing;
+    }
+
+    /// Deinitialize with `deinit`.
+    fn read(allocator: Allocator, io_batch: *IoBatch, path: []const u8) !Self {
+        Stats.add(.directories_read, 1);
+        var directory = try fs.cwd().openDir(path, .{
+            .iterate = true,
+        });
+        defer directory.close();
+
+        var bytes = ArrayListUnmanaged(u8).empty;
+        errdefer bytes.deinit(allocator);
+
+        // Files are appended with a placeholder tag and classified in
+        // batches (see `FileFormat.fromTails`,) then the ones that are not
+        // named like songs are removed.
+        var tails = [_]u64{0} ** FileFormat.batch_size;
+        var tag_indices: [FileFormat.batch_size]usize = undefined;
+        var pending: usize = 0;
+        // Indices of the entries that need to be stat-ed.
+        var unknown_kinds = ArrayListUnmanaged(usize).empty;
+        defer unknown_kinds.deinit(allocator);
+
+        var iterator = directory.iterate();
+        while (try iterator.next()) |entry| {
+            try bytes.ensureUnusedCapacity(
+                allocator,
+                entry_header_size + entry.name.len,
+            );
+            if (.directory == entry.kind) {
+                bytes.appendAssumeCapacity(0);
+            } else {
+                // Some filesystems, like NFS, may not report the kind of
+                // entry. These are classified like files and checked for
+                // being directories afterwards, all at once.
+                if (.unknown == entry.kind) {
+                    try unknown_kinds.append(allocator, bytes.items.len);
+                }
+                tails[pending] = FileFormat.nameTail(entry.name);
+                tag_indices[pending] = bytes.items.len;
+                pending += 1;
+                bytes.appendAssumeCapacity(undefined);
+            }
+            bytes.appendSliceAssumeCapacity(&mem.toBytes(
+                mem.nativeToLittle(u16, @intCast(entry.name.len)),
+            ));
+            // No tags, and no stat (see `statFiles`) yet.
+            bytes.appendNTimesAssumeCapacity(0, entry_header_size - (1 + 2));
+            bytes.appendSliceAssumeCapacity(entry.name);
+
+            if (FileFormat.batch_size == pending) {
+                applyTags(bytes.items, &tails, &tag_indices, pending);
+                pending = 0;
+            }
+        }
+        applyTags(bytes.items, &tails, &tag_indices, pending);
+        try tagDirectories(allocator, io_batch, directory, bytes.items, unknown_kinds.items);
+        bytes.shrinkRetainingCapacity(removeUnknownFiles(bytes.items));
+
+        // The stats tell `refresh` which files to read again, so they are
+        // taken before the files are read.
+        if (ParsedArguments.sniff or ParsedArguments.tags) {
+            var files = ArrayListUnmanaged(usize).empty;
+            defer files.deinit(allocator);
+            var index: usize = 0;
+            while (index < bytes.items.len) : (index += entrySize(bytes.items, index)) {
+                if (0 != bytes.items[index]) try files.append(allocator, index);
+            }
+            try statFiles(allocator, io_batch, directory, bytes.items, files.items);
+            if (ParsedArguments.sniff) try sniffFormats(allocator, io_batch, directory, bytes.items, files.items);
+            if (ParsedArguments.tags) try readTags(allocator, directory, &bytes, files.items);
+        }
+
+        return .{
+            .bytes = try bytes.toOwnedSlice(allocator),
+            .owned = true,
+        };
+    }
+
+    /// Returns the listing recorded in `record` with the formats and tags of
+    /// the files that have changed since read again, or `null` if none have.
+    /// The files are read again as they were for `record`, so if that was
+    /// with other options than `--sniff` and `--tags` are now, the whole
+    /// directory is. Deinitialize with `deinit`.
+    fn refresh(
+        allocator: Allocator,
+        io_batch: *IoBatch,
+        path: []const u8,
+        record: LibraryIndex.Record,
+    ) !?Self {
+        const recorded = record.listing;
+        var directory = try fs.cwd().openDir(path, .{});
+        defer directory.close();
+
+        var files = ArrayListUnmanaged(usize).empty;
+        defer files.deinit(allocator);
+        var index: usize = 0;
+        while (index < recorded.len) : (index += entrySize(recorded, index)) {
+            if (0 != recorded[index]) try files.append(allocator, index);
+        }
+        if (0 == files.items.len) return null;
+
+        var names = try EntryNames.init(allocator, recorded, files.items);
+        defer names.deinit(allocator);
+        const stats = try allocator.alloc(FileStat, files.items.len);
+        defer allocator.free(stats);
+        try io_batch.statFiles(directory, names.pointers, stats);
+
+        var changed = ArrayListUnmanaged(usize).empty;
+        defer changed.deinit(allocator);
+        for (files.items, stats, 0..) |file_index, stat, i| {
+            if (!entryStat(recorded, file_index).eql(stat)) try changed.append(allocator, i);
+        }
+        if (0 == changed.items.len) return null;
+        if (record.sniffed != ParsedArguments.sniff or record.tagged != ParsedArguments.tags) {
+            return try read(allocator, io_batch, path);
+        }
+
+        // The changed files are copied without their tags, and tagged with
+        // the formats their extensions claim again.
+        var bytes = try ArrayListUnmanaged(u8).initCapacity(allocator, recorded.len);
+        errdefer bytes.deinit(allocator);
+        var tails = [_]u64{0} ** FileFormat.batch_size;
+        var tag_indices: [FileFormat.batch_size]usize = undefined;
+        var pending: usize = 0;
+        var next_changed: usize = 0;
+        index = 0;
+        while (index < recorded.len) {
+            const entry_size = entrySize(recorded, index);
+            const entry = recorded[index..][0..entry_size];
+            index += entry_size;
+            const is_changed = next_changed < changed.items.len and
+                index - entry_size == files.items[changed.items[next_changed]];
+            if (!is_changed) {
+                bytes.appendSliceAssumeCapacity(entry);
+                continue;
+            }
+
+            const file_index = bytes.items.len;
+            const name_length = mem.readInt(u16, entry[1..3], .little);
+            const name = entry[entry_header_size..][0..name_length];
+            bytes.appendSliceAssumeCapacity(entry[0..3]);
+            bytes.appendNTimesAssumeCapacity(0, entry_header_size - (1 + 2));
+            bytes.appendSliceAssumeCapacity(name);
+            setEntryStat(bytes.items, file_index, stats[changed.items[next_changed]]);
+            // Now the index of the entry in `bytes`.
+            changed.items[next_changed] = file_index;
+            next_changed += 1;
+
+            tails[pending] = FileFormat.nameTail(name);
+            tag_indices[pending] = file_index;
+            pending += 1;
+            if (FileFormat.batch_size == pending) {
+                applyTags(bytes.items, &tails, &tag_indices, pending);
+                pending = 0;
+            }
+        }
+        applyTags(bytes.items, &tails, &tag_indices, pending);
+
+        if (ParsedArguments.sniff) try sniffFormats(allocator, io_batch, directory, bytes.items, changed.items);
+        if (ParsedArguments.tags) try readTags(allocator, directory, &bytes, changed.items);
+
+        return .{
+            .bytes = try bytes.toOwnedSlice(allocator),
+            .owned = true,
+        };
+    }
+
+    /// Helper for `read` and `refresh`. Writes the tags for the first `count`
+    /// of `tails` to the entries starting at `tag_indices`, using
+    /// `unknown_file_tag` for files that are not songs.
+    fn applyTags(
+        bytes: []u8,
+        tails: *const [FileFormat.batch_size]u64,
+        tag_indices: *const [FileFormat.batch_size]usize,
+        count: usize,
+    ) void {
+        if (0 == count) return;
+        const tags: [FileFormat.batch_size]u8 = FileFormat.fromTails(tails.*);
+        for (tag_indices[0..count], tags[0..count]) |index, tag| {
+            bytes[index] = if (0 == tag) unknown_file_tag else tag;
+        }
+    }
+
+    /// Helper for `read`. Tags the entries at `indices` that are directories
+    /// as such, without following symbolic links (to avoid loops.)
+    fn tagDirectories(
+        allocator: Allocator,
+        io_batch: *IoBatch,
+        directory: fs.Dir,
+        bytes: []u8,
+        indices: []const usize,
+    ) !void {
+        if (0 == indices.len) return;
+
+        var names = try EntryNames.init(allocator, bytes, indices);
+        defer names.deinit(allocator);
+        const is_directories = try allocator.alloc(bool, indices.len);
+        defer allocator.free(is_directories);
+        try io_batch.statDirectories(directory, names.pointers, is_directories);
+
+        for (indices, is_directories) |index, is_directory| {
+            if (is_directory) bytes[index] = 0;
+        }
+    }
+
+    /// Helper for `read` and `refresh`. Records the stat of the files at
+    /// `indices` in their entries.
+    fn statFiles(
+        allocator: Allocator,
+        io_batch: *IoBatch,
+        directory: fs.Dir,
+        bytes: []u8,
+        indices: []const usize,
+    ) !void {
+        if (0 == indices.len) return;
+
+        var names = try EntryNames.init(allocator, bytes, indices);
+        defer names.deinit(allocator);
+        const stats = try allocator.alloc(FileStat, indices.len);
+        defer allocator.free(stats);
+        try io_batch.statFiles(directory, names.pointers, stats);
+
+        for (indices, stats) |index, stat| setEntryStat(bytes, index, stat);
+    }
+
+    /// Helper for `read` and `refresh`. Replaces the tags of the files at
+    /// `indices`, which are those of the formats their extensions claim,
+    /// with the format their first bytes show (see `FileFormat.fromHeader`,)
+    /// or with `not_song_tag` if they do not look like songs.
+    fn sniffFormats(
+        allocator: Allocator,
+        io_batch: *IoBatch,
+        directory: fs.Dir,
+        bytes: []u8,
+        indices: []const usize,
+    ) !void {
+        if (0 == indices.len) return;
+
+        var names = try EntryNames.init(allocator, bytes, indices);
+        defer names.deinit(allocator);
+        const headers = try allocator.alloc([FileFormat.header_size]u8, indices.len);
+        defer allocator.free(headers);
+        const header_lengths = try allocator.alloc(usize, indices.len);
+        defer allocator.free(header_lengths);
+        try io_batch.readHeaders(directory, names.pointers, headers, header_lengths);
+
+        for (indices, headers, header_lengths) |tag_index, *header, header_length| {
+            const extension_format: FileFormat = @enumFromInt(bytes[tag_index] - 1);
+            if (FileFormat.fromHeader(header[0..header_length], extension_format)) |format| {
+                bytes[tag_index] = @as(u8, @intFromEnum(format)) + 1;
+            } else {
+                bytes[tag_index] = not_song_tag;
+                Stats.add(.rejected_format, 1);
+            }
+        }
+    }
+
+    /// Helper for `read` and `refresh`. Reads the tags of the songs at
+    /// `indices` (see `TagReader`) and moves them into their entries, which
+    /// are assumed to have none yet. The indices of the entries after them
+    /// change.
+    fn readTags(
+        allocator: Allocator,
+        directory: fs.Dir,
+        bytes: *ArrayListUnmanaged(u8),
+        file_indices: []const usize,
+    ) !void {
+        var indices = ArrayListUnmanaged(usize).empty;
+        defer indices.deinit(allocator);
+        for (file_indices) |index| {
+            if (not_song_tag != bytes.items[index]) try indices.append(allocator, index);
+        }
+        if (0 == indices.items.len) return;
+
+        var names = try EntryNames.init(allocator, bytes.items, indices.items);
+        defer names.deinit(allocator);
+        const tags_lists = try allocator.alloc(ArrayListUnmanaged(u8), indices.items.len);
+        defer allocator.free(tags_lists);
+        @memset(tags_lists, .empty);
+        defer for (tags_lists) |*tags| tags.deinit(allocator);
+        try TagReader.readAll(allocator, directory, names.pointers, tags_lists);
+
+        var tags_size: usize = 0;
+        for (tags_lists) |tags| tags_size += tags.items.len;
+        var tagged = try ArrayListUnmanaged(u8).initCapacity(allocator, bytes.items.len + tags_size);
+        errdefer tagged.deinit(allocator);
+
+        var next_song: usize = 0;
+        var index: usize = 0;
+        while (index < bytes.items.len) {
+            const entry_size = entrySize(bytes.items, index);
+            const entry = bytes.items[index..][0..entry_size];
+            if (next_song < indices.items.len and index == indices.items[next_song]) {
+                const tags = tags_lists[next_song].items;
+                next_song += 1;
+                tagged.appendSliceAssumeCapacity(entry[0..3]);
+                tagged.appendSliceAssumeCapacity(&mem.toBytes(
+                    mem.nativeToLittle(u16, @intCast(tags.len)),
+                ));
+                tagged.appendSliceAssumeCapacity(entry[stat_offset..]);
+                tagged.appendSliceAssumeCapacity(tags);
+            } else {
+                tagged.appendSliceAssumeCapacity(entry);
+            }
+            index += entry_size;
+        }
+        bytes.deinit(allocator);
+        bytes.* = tagged;
+    }
+
+    /// The size of the entry at `index`, including its header.
+    fn entrySize(bytes: []const u8, index: usize) usize {
+        const name_length = mem.readInt(u16, bytes[index + 1 ..][0..2], .little);
+        const tags_length = mem.readInt(u16, bytes[index + 3 ..][0..2], .little);
+        return entry_header_size + name_length + tags_length;
+    }
+
+    fn entryStat(bytes: []const u8, index: usize) FileStat {
+        const stat = bytes[index + stat_offset ..];
+        return .{
+            .modification_time = mem.readInt(i64, stat[0..8], .little),
+            .size = mem.readInt(u64, stat[8..16], .little),
+        };
+    }
+
+    fn setEntryStat(bytes: []u8, index: usize, stat: FileStat) void {
+        const stat_bytes = bytes[index + stat_offset ..];
+        mem.writeInt(i64, stat_bytes[0..8], stat.modification_time, .little);
+        mem.writeInt(u64, stat_bytes[8..16], stat.size, .little);
+    }
+
+    /// NUL-terminated copies of the names of some entries, for system calls.
+    const EntryNames = struct {
+        buffer: []u8,
+        pointers: [][*:0]const u8,
+
+        /// Deinitialize with `deinit`.
+        fn init(allocator: Allocator, bytes: []const u8, indices: []const usize) !EntryNames {
+            var buffer_size: usize = 0;
+            for (indices) |index| {
+                buffer_size += mem.readInt(u16, bytes[index + 1 ..][0..2], .little) + 1;
+            }
+            const buffer = try allocator.alloc(u8, buffer_size);
+            errdefer allocator.free(buffer);
+            const pointers = try allocator.alloc([*:0]const u8, indices.len);
+
+            var offset: usize = 0;
+            for (indices, pointers) |index, *pointer| {
+                const name_length = mem.readInt(u16, bytes[index + 1 ..][0..2], .little);
+                @memcpy(buffer[offset..][0..name_length], bytes[index + entry_header_size ..][0..name_length]);
+                buffer[offset + name_length] = 0;
+                pointer.* = buffer[offset..][0..name_length :0];
+                offset += name_length + 1;
+            }
+            return .{ .buffer = buffer, .pointers = pointers };
+        }
+
+        fn deinit(self: *EntryNames, allocator: Allocator) void {
+            allocator.free(self.buffer);
+            allocator.free(self.pointers);
+            self.* = undefined;
+        }
+    };
+
+    /// Helper for `read`. Removes the entries tagged with `unknown_file_tag`
+    /// in place and returns the length of the remaining entries.
+    fn removeUnknownFiles(bytes: []u8) usize {
+        var read_index: usize = 0;
+        var write_index: usize = 0;
+        while (read_index < bytes.len) {
+            const entry_size = entrySize(bytes, read_index);
+            if (unknown_file_tag != bytes[read_index]) {
+                mem.copyForwards(
+                    u8,
+                    bytes[write_index..][0..entry_size],
+                    bytes[read_index..][0..entry_size],
+                );
+                write_index += entry_size;
+            } else {
+                Stats.add(.rejected_format, 1);
+            }
+            read_index += entry_size;
+        }
+        return write_index;
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        if (self.owned) allocator.free(self.bytes);
+        self.* = undefined;
+    }
+
+    fn iterator(self: Self) Iterator {
+        return .{ .bytes = self.bytes };
+    }
+
+    /// Whether `bytes` can be iterated over without going out of bounds or
+    /// running into invalid file formats or tags.
+    fn isValid(bytes: []const u8) bool {
+        var index: usize = 0;
+        while (index < bytes.len) {
+            if (bytes.len - index < entry_header_size) return false;
+            const tag = bytes[index];
+            if (@typeInfo(FileFormat).@"enum".fields.len < tag and not_song_tag != tag) return false;
+            const name_length = mem.readInt(u16, bytes[index + 1 ..][0..2], .little);
+            const tags_length = mem.readInt(u16, bytes[index + 3 ..][0..2], .little);
+            index += entry_header_size;
+            if (bytes.len - index < name_length) return false;
+            index += name_length;
+            if (bytes.len - index < tags_length) return false;
+            if (!SongTags.isValid(bytes[index..][0..tags_length])) return false;
+            index += tags_length;
+        }
+        return true;
+    }
+
+    const Iterator = struct {
+        bytes: []const u8,
+        index: usize = 0,
+
+        fn next(self: *Iterator) ?Entry {
+            while (self.index < self.bytes.len and not_song_tag == self.bytes[self.index]) {
+                self.index += entrySize(self.bytes, self.index);
+            }
+            if (self.bytes.len <= self.index) return null;
+
+            const tag = self.bytes[self.index];
+            const name_length = mem.readInt(
+                u16,
+                self.bytes[self.index + 1 ..][0..2],
+                .little,
+            );
+            const tags_length = mem.readInt(
+                u16,
+                self.bytes[self.index + 3 ..][0..2],
+                .little,
+            );
+            self.index += entry_header_size;
+            const name = self.bytes[self.index..][0..name_length];
+            self.index += name_length;
+            const tags = self.bytes[self.index..][0..tags_length];
+            self.index += tags_length;
+
+            return .{
+                .name = name,
+                .format = if (0 == tag) null else @as(FileFormat, @enumFromInt(tag - 1)),
+                .tags = .{ .bytes = tags },
+            };
+        }
+    };
+};
+
+test "DirectoryListing" {
+    const testing = std.testing;
+    ParsedArguments.sniff = true;
+    ParsedArguments.tags = true;
+    ParsedArguments.queue_depth = 4;
+    try TagReader.init(testing.allocator);
+    defer TagReader.deinit();
+    var io_batch = try IoBatch.init(testing.allocator);
+    defer io_batch.deinit(testing.allocator);
+
+    const Expected = struct { name: []const u8, format: FileFormat, artist: []const u8 };
+    const helpers = struct {
+        /// Writes a file starting with `header`, with `artist` in its ID3v1
+        /// tag.
+        fn write(directory: fs.Dir, name: []const u8, header: []const u8, artist: []const u8) !void {
+            var bytes = [_]u8{0} ** (FileFormat.header_size + 128);
+            @memcpy(bytes[0..header.len], header);
+            const tag = bytes[FileFormat.header_size..];
+            @memcpy(tag[0..3], "TAG");
+            @memcpy(tag[33..][0..artist.len], artist);
+            tag[127] = 0xff;
+            try directory.writeFile(.{ .sub_path = name, .data = &bytes });
+        }
+
+        /// Makes the file old enough for its stat to be recorded.
+        fn age(directory: fs.Dir, name: []const u8) !void {
+            const file = try directory.openFile(name, .{});
+            defer file.close();
+            const past = time.nanoTimestamp() - time.ns_per_hour;
+            try file.updateTimes(past, past);
+        }
+
+        fn expectSongs(listing: DirectoryListing, expected: []const Expected) !void {
+            var entries = listing.iterator();
+            var count: usize = 0;
+            while (entries.next()) |entry| : (count += 1) {
+                const song = for (expected) |candidate| {
+                    if (mem.eql(u8, candidate.name, entry.name)) break candidate;
+                } else return error.TestUnexpectedResult;
+                try std.testing.expectEqual(song.format, entry.format);
+                try std.testing.expectEqualStrings(song.artist, entry.tags.get(.artist) orelse "");
+            }
+            try std.testing.expectEqual(expected.len, count);
+        }
+    };
+    const mp3 = "\xff\xfb\x90\x00";
+    const flac = "fLaC\x80\x00\x00\x00";
+
+    var tmp = testing.tmpDir(.{});
+    defer tmp.cleanup();
+    try helpers.write(tmp.dir, "a.mp3", mp3, "First");
+    try helpers.write(tmp.dir, "b.mp3", "noise", "Second");
+    try helpers.write(tmp.dir, "c.mp3", mp3, "Third");
+    for ([_][]const u8{ "a.mp3", "b.mp3", "c.mp3" }) |name| try helpers.age(tmp.dir, name);
+    const path = try tmp.dir.realpathAlloc(testing.allocator, ".");
+    defer testing.allocator.free(path);
+
+    var listing = try DirectoryListing.read(testing.allocator, &io_batch, path);
+    defer listing.deinit(testing.allocator);
+    try helpers.expectSongs(listing, &.{
+        .{ .name = "a.mp3", .format = .mp3, .artist = "First" },
+        .{ .name = "c.mp3", .format = .mp3, .artist = "Third" },
+    });
+    const record = LibraryIndex.Record{
+        .modification_time = 0,
+        .inode = 0,
+        .listing = listing.bytes,
+        .sniffed = true,
+        .tagged = true,
+    };
+    try testing.expect(null == try DirectoryListing.refresh(testing.allocator, &io_batch, path, record));
+
+    // Written to in place, which does not change the directory.
+    try helpers.write(tmp.dir, "a.mp3", flac, "Fourth");
+    try helpers.write(tmp.dir, "b.mp3", mp3, "Fifth");
+    var refreshed = try DirectoryListing.refresh(testing.allocator, &io_batch, path, record) orelse
+        return error.TestUnexpectedResult;
+    defer refreshed.deinit(testing.allocator);
+    try helpers.expectSongs(refreshed, &.{
+        .{ .name = "a.mp3", .format = .flac, .artist = "Fourth" },
+        .{ .name = "b.mp3", .format = .mp3, .artist = "Fifth" },
+        .{ .name = "c.mp3", .format = .mp3, .artist = "Third" },
+    });
+}
+
+/// Makes many requests for the metadata of files at once. On Linux they are
+/// submitted through io_uring, with up to `--queue-depth` of them in flight,
+/// which hides the latency of network filesystems. Elsewhere, or if io_uring
+/// is not available (it may be disabled,) they are made one after another.
+const IoBatch = struct {
+    const Self = @This();
+    const have_io_uring = .linux == builtin.os.tag;
+
+    ring: if (have_io_uring) ?linux.IoUring else void,
+    /// One buffer per request in flight.
+    statx_buffers: if (have_io_uring) []linux.Statx else void,
+    /// One file descriptor per request in flight, -1 for files that could
+    /// not be opened.
+    fds: if (have_io_uring) []linux.fd_t else void,
+
+    /// Deinitialize with `deinit`.
+    fn init(allocator: Allocator) !Self {
+        if (!have_io_uring) return .{ .ring = {}, .statx_buffers = {}, .fds = {} };
+
+        const depth = ParsedArguments.queue_depth;
+        const statx_buffers = try allocator.alloc(linux.Statx, depth);
+        errdefer allocator.free(statx_buffers);
+        const fds = try allocator.alloc(linux.fd_t, depth);
+        errdefer allocator.free(fds);
+        return .{
+            .ring = linux.IoUring.init(math.ceilPowerOfTwoAssert(u16, depth), 0) catch null,
+            .statx_buffers = statx_buffers,
+            .fds = fds,
+        };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        if (have_io_uring) {
+            if (self.ring) |*ring| ring.deinit();
+            allocator.free(self.statx_buffers);
+            allocator.free(self.fds);
+        }
+        self.* = undefined;
+    }
+
+    /// Sets `is_directories[i]` to whether `names[i]` in `directory` is a
+    /// directory. Symbolic links are not followed. Files that cannot be
+    /// stat-ed are not directories.
+    fn statDirectories(
+        self: *Self,
+        directory: fs.Dir,
+        names: []const [*:0]const u8,
+        is_directories: []bool,
+    ) !void {
+        debug.assert(names.len == is_directories.len);
+
+        if (have_io_uring) {
+            if (self.ring) |*ring| {
+                var start: usize = 0;
+                while (start < names.len) {
+                    const count = @min(names.len - start, self.statx_buffers.len);
+                    for (0..count) |i| {
+                        _ = try ring.statx(
+                            i,
+                            directory.fd,
+                            names[start + i],
+                            linux.AT.SYMLINK_NOFOLLOW,
+                            linux.STATX_TYPE,
+                            &self.statx_buffers[i],
+                        );
+                    }
+                    _ = try ring.submit_and_wait(@intCast(count));
+                    for (0..count) |_| {
+                        const cqe = try ring.copy_cqe();
+                        const i: usize = @intCast(cqe.user_data);
+                        is_directories[start + i] = switch (cqe.err()) {
+                            .SUCCESS => posix.S.ISDIR(self.statx_buffers[i].mode),
+                            // Kernels before 5.6 do not support statx
+                            // requests, and some filesystems do not
+                            // support statx at all.
+                            .INVAL, .OPNOTSUPP => isDirectory(directory, names[start + i]),
+                            else => false,
+                        };
+                    }
+                    start += count;
+                }
+                return;
+            }
+        }
+
+        for (names, is_directories) |name, *is_directory| {
+            is_directory.* = isDirectory(directory, name);
+        }
+    }
+
+    /// Helper for `statDirectories`.
+    fn isDirectory(directory: fs.Dir, name: [*:0]const u8) bool {
+        const stat = posix.fstatatZ(
+            directory.fd,
+            name,
+            posix.AT.SYMLINK_NOFOLLOW,
+        ) catch return false;
+        return posix.S.ISDIR(stat.mode);
+    }
+
+    /// Sets `stats[i]` to the stat of `names[i]` in `directory`, following
+    /// symbolic links. Files that cannot be stat-ed get
+    /// `DirectoryListing.FileStat.unknown`.
+    fn statFiles(
+        self: *Self,
+        directory: fs.Dir,
+        names: []const [*:0]const u8,
+        stats: []DirectoryListing.FileStat,
+    ) !void {
+        debug.assert(names.len == stats.len);
+
+        if (have_io_uring) {
+            if (self.ring) |*ring| {
+                var start: usize = 0;
+                while (start < names.len) {
+                    const count = @min(names.len - start, self.statx_buffers.len);
+                    for (0..count) |i| {
+                        _ = try ring.statx(
+                            i,
+                            directory.fd,
+                            names[start + i],
+                            0,
+                            linux.STATX_MTIME | linux.STATX_SIZE,
+                            &self.statx_buffers[i],
+                        );
+                    }
+                    _ = try ring.submit_and_wait(@intCast(count));
+                    for (0..count) |_| {
+                        const cqe = try ring.copy_cqe();
+                        const i: usize = @intCast(cqe.user_data);
+                        const statx = &self.statx_buffers[i];
+                        stats[start + i] = switch (cqe.err()) {
+                            .SUCCESS => DirectoryListing.FileStat.init(
+                                @as(i128, statx.mtime.sec) * time.ns_per_s + statx.mtime.nsec,
+                                statx.size,
+                            ),
+                            // See `statDirectories`.
+                            .INVAL, .OPNOTSUPP => fileStat(directory, names[start + i]),
+                            else => DirectoryListing.FileStat.unknown,
+                        };
+                    }
+                    start += count;
+                }
+                return;
+            }
+        }
+
+        for (names, stats) |name, *stat| {
+            stat.* = fileStat(directory, name);
+        }
+    }
+
+    /// Helper for `statFiles`.
+    fn fileStat(directory: fs.Dir, name: [*:0]const u8) DirectoryListing.FileStat {
+        const stat = directory.statFile(mem.span(name)) catch return DirectoryListing.FileStat.unknown;
+        return DirectoryListing.FileStat.init(stat.mtime, stat.size);
+    }
+
+    /// Reads the start of each of `names` in `directory` into `headers`,
+    /// with a single read each, and sets `lengths` to the amount of bytes
+    /// read. Files that cannot be read get a length of 0.
+    fn readHeaders(
+        self: *Self,
+        directory: fs.Dir,
+        names: []const [*:0]const u8,
+        headers: [][FileFormat.header_size]u8,
+        lengths: []usize,
+    ) !void {
+        debug.assert(names.len == headers.len and names.len == lengths.len);
+        const flags: posix.O = .{ .ACCMODE = .RDONLY, .CLOEXEC = true, .NOCTTY = true };
+
+        if (have_io_uring) {
+            if (self.ring) |*ring| {
+                var start: usize = 0;
+                while (start < names.len) {
+                    const count = @min(names.len - start, self.fds.len);
+
+                    // Files opened so far are closed here if a request
+                    // fails, from `closing` on, as the ones before it have
+                    // had their close requested already.
+                    @memset(self.fds[0..count], -1);
+                    var closing: usize = 0;
+                    errdefer for (self.fds[closing..count]) |fd| {
+                        if (fd >= 0) posix.close(fd);
+                    };
+
+                    for (0..count) |i| {
+                        _ = try ring.openat(i, directory.fd, names[start + i], flags, 0);
+                    }
+                    _ = try ring.submit_and_wait(@intCast(count));
+                    for (0..count) |_| {
+                        const cqe = try ring.copy_cqe();
+                        self.fds[@intCast(cqe.user_data)] = if (.SUCCESS == cqe.err()) cqe.res else -1;
+                    }
+
+                    var opened: u32 = 0;
+                    for (0..count) |i| {
+                        lengths[start + i] = 0;
+                        if (self.fds[i] < 0) continue;
+                        _ = try ring.read(i, self.fds[i], .{ .buffer = &headers[start + i] }, 0);
+                        opened += 1;
+                    }
+                    _ = try ring.submit_and_wait(opened);
+                    for (0..opened) |_| {
+                        const cqe = try ring.copy_cqe();
+                        if (.SUCCESS != cqe.err()) continue;
+                        lengths[start + @as(usize, @intCast(cqe.user_data))] = @intCast(cqe.res);
+                    }
+
+                    for (0..count) |i| {
+                        if (self.fds[i] >= 0) _ = try ring.close(i, self.fds[i]);
+                        closing = i + 1;
+                    }
+                    _ = try ring.submit_and_wait(opened);
+                    for (0..opened) |_| _ = try ring.copy_cqe();
+
+                    start += count;
+                }
+                return;
+            }
+        }
+
+        for (names, headers, lengths) |name, *header, *length| {
+            length.* = 0;
+            const fd = posix.openatZ(directory.fd, name, flags, 0) catch continue;
+            defer posix.close(fd);
+            length.* = posix.pread(fd, header, 0) catch 0;
+        }
+    }
+};
+
+/// A cache of directory listings (see `DirectoryListing`,) keyed by the
+/// absolute path of the directory, so that directories that have not changed
+/// since the last run do not have to be read again. A directory is considered
+/// unchanged if its inode and modification time are the same. The formats and
+/// tags of its files are checked separately (see `DirectoryListing.refresh`.)
+///
+/// The index file is memory-mapped, and the listings from it are used
+/// directly from the mapping.
+///
+/// The file starts with `magic`, followed by the records. Each record is the
+/// length of the key and of the listing as little-endian `u32`s, the
+/// modification time as a little-endian `i128`, the inode as a little-endian
+/// `u64` and a byte of flags, followed by the key and the listing. The flags
+/// are whether the formats in the listing were sniffed (see `--sniff`) in the
+/// lowest bit, and whether the tags of the songs were read (see `--tags`) in
+/// the next one.
+///
+/// With `--normalize`, the index also records the loudness of songs (see
+/// `LoudnessAnalyzer`,) keyed by their absolute path. These records are
+/// marked by the third bit of the flags, and hold a `Loudness` instead of a
+/// listing.
+const LibraryIndex = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var mapping: ?[]align(heap.page_size_min) const u8 = undefined;
+    /// Records from the last run, pointing into `mapping`. Read-only, so it
+    /// can be used from multiple threads.
+    var records: StringHashMapUnmanaged(Record) = undefined;
+
+    var mutex: Thread.Mutex = .{};
+    /// Records from this run. Owns its keys and listings. Protected by
+    /// `mutex`.
+    var updated: StringHashMapUnmanaged(Record) = undefined;
+
+    const Record = struct {
+        modification_time: i128,
+        inode: u64,
+        /// For songs, their loudness (see `Loudness.toBytes`.)
+        listing: []const u8,
+        sniffed: bool = false,
+        tagged: bool = false,
+        song: bool = false,
+    };
+
+    const file_name = "library";
+    const magic = "play-music library 5\n";
+    const record_header_size = 4 + 4 + 16 + 8 + 1;
+    /// Directories modified more recently than this are not recorded, since
+    /// further changes within the resolution of the filesystem's timestamps
+    /// would go unnoticed.
+    const minimum_age_ns = 2 * time.ns_per_s;
+
+    /// Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        mapping = null;
+        records = StringHashMapUnmanaged(Record).empty;
+        updated = StringHashMapUnmanaged(Record).empty;
+
+        if (ParsedArguments.cache) load() catch |err| {
+            // A missing or broken index is simply rebuilt.
+            unload();
+            if (error.OutOfMemory == err) return err;
+        };
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        unload();
+        var iterator = updated.iterator();
+        while (iterator.next()) |entry| {
+            allocator.free(entry.key_ptr.*);
+            allocator.free(entry.value_ptr.listing);
+        }
+        updated.deinit(allocator);
+
+        initialized = false;
+    }
+
+    fn load() !void {
+        var directory = try openCacheDirectory(allocator);
+        defer directory.close();
+        const file = try directory.openFile(file_name, .{});
+        defer file.close();
+
+        const size = (try file.stat()).size;
+        if (size < magic.len) return error.InvalidLibraryIndex;
+        const bytes = try posix.mmap(
+            null,
+            size,
+            posix.PROT.READ,
+            .{ .TYPE = .PRIVATE },
+            file.handle,
+            0,
+        );
+        mapping = bytes;
+
+        if (!mem.eql(u8, bytes[0..magic.len], magic)) return error.InvalidLibraryIndex;
+        var index: usize = magic.len;
+        while (index < bytes.len) {
+            if (bytes.len - index < record_header_size) return error.InvalidLibraryIndex;
+            const header = bytes[index..][0..record_header_size];
+            const key_length = mem.readInt(u32, header[0..4], .little);
+            const listing_length = mem.readInt(u32, header[4..8], .little);
+            index += record_header_size;
+
+            if (bytes.len - index < @as(usize, key_length) + listing_length) {
+                return error.InvalidLibraryIndex;
+            }
+            const key = bytes[index..][0..key_length];
+            index += key_length;
+            const listing = bytes[index..][0..listing_length];
+            index += listing_length;
+            const song = 0 != header[32] & 4;
+            const valid = if (song)
+                Loudness.size == listing.len
+            else
+                DirectoryListing.isValid(listing);
+            if (!valid) return error.InvalidLibraryIndex;
+
+            try records.put(allocator, key, .{
+                .modification_time = mem.readInt(i128, header[8..24], .little),
+                .inode = mem.readInt(u64, header[24..32], .little),
+                .listing = listing,
+                .sniffed = 0 != header[32] & 1,
+                .tagged = 0 != header[32] & 2,
+                .song = song,
+            });
+        }
+    }
+
+    fn unload() void {
+        records.deinit(allocator);
+        records = StringHashMapUnmanaged(Record).empty;
+        if (mapping) |bytes| posix.munmap(bytes);
+        mapping = null;
+    }
+
+    /// Returns the record of the directory, if its listing is still valid.
+    /// With `--sniff`, listings that were not sniffed are not valid, while
+    /// sniffed listings are always good enough. The same goes for `--tags`.
+    fn lookup(key: []const u8, stat: File.Stat) ?Record {
+        debug.assert(initialized);
+
+        const record = records.get(key) orelse return null;
+        if (stat.mtime != record.modification_time or stat.inode != record.inode) {
+            return null;
+        }
+        if (record.song) return null;
+        if (ParsedArguments.sniff and !record.sniffed) return null;
+        if (ParsedArguments.tags and !record.tagged) return null;
+        return record;
+    }
+
+    /// Returns the recorded loudness of the song at the absolute path `key`,
+    /// if the song has not changed since.
+    fn lookupLoudness(key: []const u8, stat: File.Stat) ?Loudness {
+        debug.assert(initialized);
+
+        const record = records.get(key) orelse return null;
+        if (stat.mtime != record.modification_time or stat.inode != record.inode) {
+            return null;
+        }
+        if (!record.song) return null;
+        return Loudness.fromBytes(record.listing[0..Loudness.size]);
+    }
+
+    /// Records a listing read from disk in this run, replacing the one
+    /// recorded before, if any (see `DirectoryWatcher`.) Does not take
+    /// ownership of the arguments.
+    fn update(key: []const u8, stat: File.Stat, listing: []const u8) !void {
+        try put(key, .{
+            .modification_time = stat.mtime,
+            .inode = stat.inode,
+            .listing = listing,
+            .sniffed = ParsedArguments.sniff,
+            .tagged = ParsedArguments.tags,
+        });
+    }
+
+    /// Records the loudness of the song at the absolute path `key`, measured
+    /// in this run. Does not take ownership of `key`.
+    fn updateLoudness(key: []const u8, stat: File.Stat, loudness: Loudness) !void {
+        const bytes = loudness.toBytes();
+        try put(key, .{
+            .modification_time = stat.mtime,
+            .inode = stat.inode,
+            .listing = &bytes,
+            .song = true,
+        });
+    }
+
+    /// Helper for `update` and `updateLoudness`. Copies the key and the
+    /// listing of the record.
+    fn put(key: []const u8, record: Record) !void {
+        debug.assert(initialized);
+
+        if (!ParsedArguments.cache) return;
+        if (time.nanoTimestamp() - record.modification_time < minimum_age_ns) return;
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        const listing_copy = try allocator.dupe(u8, record.listing);
+        errdefer allocator.free(listing_copy);
+        const entry = try updated.getOrPut(allocator, key);
+        if (entry.found_existing) {
+            allocator.free(entry.value_ptr.listing);
+        } else {
+            entry.key_ptr.* = allocator.dupe(u8, key) catch |err| {
+                updated.removeByPtr(entry.key_ptr);
+                return err;
+            };
+        }
+        entry.value_ptr.* = record;
+        entry.value_ptr.listing = listing_copy;
+    }
+
+    /// Writes out the records from this run, along with the ones from the
+    /// last run that were not superseded. Does nothing if no directory had
+    /// to be read from disk.
+    fn save() !void {
+        debug.assert(initialized);
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        if (!ParsedArguments.cache or 0 == updated.count()) return;
+
+        var directory = try openCacheDirectory(allocator);
+        defer directory.close();
+        var file = try directory.atomicFile(file_name, .{});
+        defer file.deinit();
+
+        var buffered_writer = bufferedFileWriter(file.file.writer());
+        const writer = buffered_writer.writer();
+        try writer.writeAll(magic);
+        var updated_iterator = updated.iterator();
+        while (updated_iterator.next()) |entry| {
+            try writeRecord(writer, entry.key_ptr.*, entry.value_ptr.*);
+        }
+        var records_iterator = records.iterator();
+        while (records_iterator.next()) |entry| {
+            if (updated.contains(entry.key_ptr.*)) continue;
+            try writeRecord(writer, entry.key_ptr.*, entry.value_ptr.*);
+        }
+        try buffered_writer.flush();
+        try file.finish();
+    }
+
+    fn writeRecord(writer: anytype, key: []const u8, record: Record) !void {
+        try writer.writeInt(u32, @intCast(key.len), .little);
+        try writer.writeInt(u32, @intCast(record.listing.len), .little);
+        try writer.writeInt(i128, record.modification_time, .little);
+        try writer.writeInt(u64, record.inode, .little);
+        try writer.writeByte(@as(u8, @intFromBool(record.sniffed)) |
+            @as(u8, @intFromBool(record.tagged)) << 1 |
+            @as(u8, @intFromBool(record.song)) << 2);
+        try writer.writeAll(key);
+        try writer.writeAll(record.listing);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Tags                                                                       //
+////////////////////////////////////////////////////////////////////////////////
+
+/// The tags of a song that patterns can match (see `SongField`,) as read by
+/// `TagReader`. Each tag is the field as a byte and the length of the value
+/// as a byte, followed by the value in UTF-8. Each field is there at most
+/// once.
+const SongTags = struct {
+    bytes: []const u8 = "",
+
+    const max_value_length = 255;
+
+    fn get(self: SongTags, field: SongField) ?[]const u8 {
+        var index: usize = 0;
+        while (index < self.bytes.len) {
+            const length = self.bytes[index + 1];
+            if (@intFromEnum(field) == self.bytes[index]) {
+                return self.bytes[index + 2 ..][0..length];
+            }
+            index += 2 + length;
+        }
+        return null;
+    }
+
+    /// Whether `bytes` can be searched with `get` without going out of
+    /// bounds or running into invalid fields.
+    fn isValid(bytes: []const u8) bool {
+        var index: usize = 0;
+        while (index < bytes.len) {
+            if (bytes.len - index < 2) return false;
+            const field = bytes[index];
+            if (0 == field or @typeInfo(SongField).@"enum".fields.len <= field) return false;
+            const length = bytes[index + 1];
+            index += 2;
+            if (bytes.len - index < length) return false;
+            index += length;
+        }
+        return true;
+    }
+};
+
+/// Appends the tags found in the contents of an audio file to `bytes`, in
+/// the format of `SongTags`.
+const SongTagsBuilder = struct {
+    const Self = @This();
+
+    allocator: Allocator,
+    bytes: *ArrayListUnmanaged(u8),
+    /// The fields added so far. Only the first value of each is kept.
+    found: EnumSet(SongField) = EnumSet(SongField).initEmpty(),
+
+    const Encoding = enum {
+        latin1,
+        utf8,
+        utf16_le,
+        utf16_be,
+    };
+
+    const ParseError = Allocator.Error || error{InvalidTags};
+
+    /// Comments longer than this are cut, since matching does not need more
+    /// and the rest may be a large picture.
+    const vorbis_comment_head_size = 512;
+
+    const vorbis_comment_fields = std.StaticStringMapWithEql(
+        SongField,
+        std.static_string_map.eqlAsciiIgnoreCase,
+    ).initComptime(.{
+        .{ "ARTIST", .artist },
+        .{ "ALBUM", .album },
+        .{ "TITLE", .title },
+        .{ "GENRE", .genre },
+    });
+    const id3v2_frame_fields = StaticStringMap(SongField).initComptime(.{
+        .{ "TPE1", .artist },
+        .{ "TALB", .album },
+        .{ "TIT2", .title },
+        .{ "TCON", .genre },
+        .{ "TP1", .artist },
+        .{ "TAL", .album },
+        .{ "TT2", .title },
+        .{ "TCO", .genre },
+    });
+    const riff_info_fields = StaticStringMap(SongField).initComptime(.{
+        .{ "IART", .artist },
+        .{ "IPRD", .album },
+        .{ "INAM", .title },
+        .{ "IGNR", .genre },
+    });
+    /// The genres numbered by ID3v1, which ID3v2 genres may refer to.
+    const id3v1_genres = [_][]const u8{
+        "Blues",           "Classic Rock",  "Country",          "Dance",
+        "Disco",           "Funk",          "Grunge",           "Hip-Hop",
+        "Jazz",            "Metal",         "New Age",          "Oldies",
+        "Other",           "Pop",           "R&B",              "Rap",
+        "Reggae",          "Rock",          "Techno",           "Industrial",
+        "Alternative",     "Ska",           "Death Metal",      "Pranks",
+        "Soundtrack",      "Euro-Techno",   "Ambient",          "Trip-Hop",
+        "Vocal",           "Jazz+Funk",     "Fusion",           "Trance",
+        "Classical",       "Instrumental",  "Acid",             "House",
+        "Game",            "Sound Clip",    "Gospel",           "Noise",
+        "AlternRock",      "Bass",          "Soul",             "Punk",
+        "Space",           "Meditative",    "Instrumental Pop", "Instrumental Rock",
+        "Ethnic",          "Gothic",        "Darkwave",         "Techno-Industrial",
+        "Electronic",      "Pop-Folk",      "Eurodance",        "Dream",
+        "Southern Rock",   "Comedy",        "Cult",             "Gangsta",
+        "Top 40",          "Christian Rap", "Pop/Funk",         "Jungle",
+        "Native American", "Cabaret",       "New Wave",         "Psychadelic",
+        "Rave",            "Showtunes",     "Trailer",          "Lo-Fi",
+        "Tribal",          "Acid Punk",     "Acid Jazz",        "Polka",
+        "Retro",           "Musical",       "Rock & Roll",      "Hard Rock",
+    };
+
+    /// Parses ID3v2 tags at the start of the file, followed by FLAC, Ogg
+    /// (Opus, Vorbis and FLAC) or RIFF tags, and ID3v1 tags at the end if
+    /// fields are still missing. Broken tags are skipped.
+    fn parse(self: *Self, bytes: []const u8) Allocator.Error!void {
+        const audio = skipId3v2(bytes);
+        if (audio.len != bytes.len) try ignoreInvalid(self.parseId3v2(bytes));
+        if (mem.startsWith(u8, audio, "fLaC")) {
+            try ignoreInvalid(self.parseFlac(audio[4..]));
+        } else if (mem.startsWith(u8, audio, "OggS")) {
+            try ignoreInvalid(self.parseOgg(audio));
+        } else if (mem.startsWith(u8, audio, "RIFF")) {
+            try ignoreInvalid(self.parseRiff(audio));
+        }
+        if (!self.done() and 128 <= bytes.len) {
+            try ignoreInvalid(self.parseId3v1(bytes[bytes.len - 128 ..][0..128]));
+        }
+    }
+
+    fn ignoreInvalid(result: ParseError!void) Allocator.Error!void {
+        result catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+            error.InvalidTags => {},
+        };
+    }
+
+    /// Whether all fields have been added.
+    fn done(self: Self) bool {
+        return std.enums.values(SongField).len - 1 == self.found.count();
+    }
+
+    /// Adds the value of `field` unless it was added before. The value is
+    /// cut at the first NUL (which separates multiple values,) converted to
+    /// UTF-8 and cut to `SongTags.max_value_length` bytes. Trailing spaces
+    /// (which pad ID3v1 values) are removed, and empty values are ignored.
+    fn add(self: *Self, field: SongField, encoding: Encoding, value: []const u8) Allocator.Error!void {
+        debug.assert(.name != field);
+        if (self.found.contains(field)) return;
+
+        var buffer: [SongTags.max_value_length]u8 = undefined;
+        var length: usize = 0;
+        switch (encoding) {
+            .utf8 => {
+                const end = mem.indexOfScalar(u8, value, 0) orelse value.len;
+                length = @min(end, buffer.len);
+                // Code points are not cut in half.
+                while (0 < length and length < end and 0x80 == value[length] & 0xc0) length -= 1;
+                @memcpy(buffer[0..length], value[0..length]);
+            },
+            .latin1 => for (value) |byte| {
+                if (0 == byte or !appendCodePoint(&buffer, &length, byte)) break;
+            },
+            .utf16_le, .utf16_be => {
+                const endian: std.builtin.Endian = if (.utf16_le == encoding) .little else .big;
+                var index: usize = 0;
+                while (2 <= value.len - index) {
+                    var code_point: u21 = mem.readInt(u16, value[index..][0..2], endian);
+                    index += 2;
+                    if (0 == code_point) break;
+                    if (0xd800 <= code_point and code_point < 0xdc00 and 2 <= value.len - index) {
+                        const low = mem.readInt(u16, value[index..][0..2], endian);
+                        if (0xdc00 <= low and low < 0xe000) {
+                            index += 2;
+                            code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+                        }
+                    }
+                    // Unpaired surrogates.
+                    if (0xd800 <= code_point and code_point < 0xe000) code_point = 0xfffd;
+                    if (!appendCodePoint(&buffer, &length, code_point)) break;
+                }
+            },
+        }
+        while (0 < length and ' ' == buffer[length - 1]) length -= 1;
+        if (0 == length) return;
+
+        try self.bytes.ensureUnusedCapacity(self.allocator, 2 + length);
+        self.bytes.appendAssumeCapacity(@intFromEnum(field));
+        self.bytes.appendAssumeCapacity(@intCast(length));
+        self.bytes.appendSliceAssumeCapacity(buffer[0..length]);
+        self.found.insert(field);
+    }
+
+    /// Helper for `add`. Returns whether the code point fit.
+    fn appendCodePoint(buffer: *[SongTags.max_value_length]u8, length: *usize, code_point: u21) bool {
+        const size = std.unicode.utf8CodepointSequenceLength(code_point) catch unreachable;
+        if (buffer.len - length.* < size) return false;
+        _ = std.unicode.utf8Encode(code_point, buffer[length.*..][0..size]) catch unreachable;
+        length.* += size;
+        return true;
+    }
+
+    /// Values whose encoding is not stated are often UTF-8, despite the
+    /// formats asking for Latin-1.
+    fn guessEncoding(value: []const u8) Encoding {
+        const end = mem.indexOfScalar(u8, value, 0) orelse value.len;
+        return if (std.unicode.utf8ValidateSlice(value[0..end])) .utf8 else .latin1;
+    }
+
+    fn parseId3v2(self: *Self, bytes: []const u8) ParseError!void {
+        if (bytes.len < 10) return error.InvalidTags;
+        const version = bytes[3];
+        const flags = bytes[5];
+        if (version < 2 or 4 < version) return error.InvalidTags;
+        // Unsynchronization of the whole tag changes the bytes of values.
+        if (version < 4 and 0 != flags & 0x80) return;
+        // Or, in version 2.2, compression.
+        if (2 == version and 0 != flags & 0x40) return;
+
+        var frames = ByteReader{
+            .bytes = bytes[10..][0..@min(synchsafeInt(bytes[6..10]), bytes.len - 10)],
+        };
+        if (2 < version and 0 != flags & 0x40) {
+            const size_bytes = (try frames.take(4))[0..4];
+            if (3 == version) {
+                try frames.skip(mem.readInt(u32, size_bytes, .big));
+            } else {
+                // The size includes itself.
+                try frames.skip(math.sub(u32, synchsafeInt(size_bytes), 4) catch return error.InvalidTags);
+            }
+        }
+
+        const frame_header_size: usize = if (2 == version) 6 else 10;
+        while (frame_header_size <= frames.remaining() and !self.done()) {
+            const header = try frames.take(frame_header_size);
+            // Padding.
+            if (0 == header[0]) return;
+            const id = header[0..if (2 == version) 3 else 4];
+            const size: usize = switch (version) {
+                2 => mem.readInt(u24, header[3..6], .big),
+                3 => mem.readInt(u32, header[4..8], .big),
+                else => synchsafeInt(header[4..8]),
+            };
+            var frame = try frames.take(size);
+
+            if (2 < version) {
+                const format_flags = header[9];
+                if (3 == version) {
+                    // Compression and encryption.
+                    if (0 != format_flags & 0xc0) continue;
+                    // A group identifier.
+                    if (0 != format_flags & 0x20) frame = frame[@min(1, frame.len)..];
+                } else {
+                    // Compression, encryption and unsynchronization.
+                    if (0 != format_flags & 0x0e) continue;
+                    // A group identifier and the data length.
+                    if (0 != format_flags & 0x40) frame = frame[@min(1, frame.len)..];
+                    if (0 != format_flags & 0x01) frame = frame[@min(4, frame.len)..];
+                }
+            }
+
+            const field = id3v2_frame_fields.get(id) orelse continue;
+            if (0 == frame.len) continue;
+            var text = frame[1..];
+            const encoding: Encoding = switch (frame[0]) {
+                0 => guessEncoding(text),
+                1 => bom: {
+                    if (text.len < 2) continue;
+                    const big_endian = 0xfe == text[0] and 0xff == text[1];
+                    text = text[2..];
+                    break :bom if (big_endian) .utf16_be else .utf16_le;
+                },
+                2 => .utf16_be,
+                3 => .utf8,
+                else => continue,
+            };
+            if (.genre == field and (.latin1 == encoding or .utf8 == encoding)) {
+                if (numericGenre(text)) |genre| {
+                    try self.add(.genre, .utf8, genre);
+                    continue;
+                }
+            }
+            try self.add(field, encoding, text);
+        }
+    }
+
+    fn synchsafeInt(bytes: *const [4]u8) u32 {
+        // The size is stored in 7 bits per byte.
+        var value: u32 = 0;
+        for (bytes) |byte| value = value << 7 | (byte & 0x7f);
+        return value;
+    }
+
+    /// Returns the genre an ID3v2 genre refers to by number (i.e. `(17)` or
+    /// `17`,) if it does.
+    fn numericGenre(value: []const u8) ?[]const u8 {
+        var digits = value[0 .. mem.indexOfScalar(u8, value, 0) orelse value.len];
+        if (mem.startsWith(u8, digits, "(")) {
+            const end = mem.indexOfScalar(u8, digits, ')') orelse return null;
+            digits = digits[1..end];
+        }
+        const number = std.fmt.parseInt(u8, digits, 10) catch return null;
+        return if (number < id3v1_genres.len) id3v1_genres[number] else null;
+    }
+
+    fn parseId3v1(self: *Self, bytes: *const [128]u8) ParseError!void {
+        if (!mem.eql(u8, bytes[0..3], "TAG")) return;
+        try self.add(.title, guessEncoding(bytes[3..33]), bytes[3..33]);
+        try self.add(.artist, guessEncoding(bytes[33..63]), bytes[33..63]);
+        try self.add(.album, guessEncoding(bytes[63..93]), bytes[63..93]);
+        if (bytes[127] < id3v1_genres.len) try self.add(.genre, .utf8, id3v1_genres[bytes[127]]);
+    }
+
+    /// `bytes` starts after the `fLaC` marker, with the metadata blocks.
+    fn parseFlac(self: *Self, bytes: []const u8) ParseError!void {
+        var blocks = ByteReader{ .bytes = bytes };
+        while (true) {
+            const header = try blocks.take(4);
+            const block = try blocks.take(mem.readInt(u24, header[1..4], .big));
+            if (4 == header[0] & 0x7f) {
+                var comment = ByteReader{ .bytes = block };
+                return self.parseVorbisComment(&comment);
+            }
+            // The last block.
+            if (0 != header[0] & 0x80) return;
+        }
+    }
+
+    /// Parses the tags of the first logical stream.
+    fn parseOgg(self: *Self, bytes: []const u8) ParseError!void {
+        if (bytes.len < 27) return error.InvalidTags;
+        var packets = OggPacketReader{
+            .bytes = bytes,
+            .serial = mem.readInt(u32, bytes[14..18], .little),
+        };
+        try packets.nextPage();
+        // The identification header is alone on the first page, and the
+        // comment header starts on the second one.
+        const identification = packets.run;
+        packets.run = "";
+        packets.continues = true;
+
+        if (mem.startsWith(u8, identification, "OpusHead")) {
+            if (!mem.eql(u8, try packets.take(8), "OpusTags")) return;
+        } else if (mem.startsWith(u8, identification, "\x01vorbis")) {
+            if (!mem.eql(u8, try packets.take(7), "\x03vorbis")) return;
+        } else if (mem.startsWith(u8, identification, "\x7fFLAC")) {
+            // The header of a metadata block (see `parseFlac`.)
+            if (4 != (try packets.take(4))[0] & 0x7f) return;
+        } else return;
+        try self.parseVorbisComment(&packets);
+    }
+
+    /// `reader` is a `ByteReader` or an `OggPacketReader`.
+    fn parseVorbisComment(self: *Self, reader: anytype) ParseError!void {
+        // The vendor string.
+        try reader.skip(try takeLittleU32(reader));
+        const count = try takeLittleU32(reader);
+        for (0..count) |_| {
+            if (self.done()) return;
+            const length = try takeLittleU32(reader);
+            const head_length = @min(length, vorbis_comment_head_size);
+            const comment = try reader.take(head_length);
+            const equals = mem.indexOfScalar(u8, comment, '=');
+            if (equals) |e| {
+                if (vorbis_comment_fields.get(comment[0..e])) |field| {
+                    try self.add(field, .utf8, comment[e + 1 ..]);
+                }
+            }
+            try reader.skip(length - head_length);
+        }
+    }
+
+    fn takeLittleU32(reader: anytype) error{InvalidTags}!u32 {
+        return mem.readInt(u32, (try reader.take(4))[0..4], .little);
+    }
+
+    fn parseRiff(self: *Self, bytes: []const u8) ParseError!void {
+        var chunks = ByteReader{ .bytes = bytes };
+        // The RIFF header and the form type.
+        try chunks.skip(12);
+        while (8 <= chunks.remaining() and !self.done()) {
+            const header = try chunks.take(8);
+            const size = mem.readInt(u32, header[4..8], .little);
+            const chunk = try chunks.take(@min(size, chunks.remaining()));
+            // Chunks are padded to an even size.
+            try chunks.skip(@min(size % 2, chunks.remaining()));
+
+            if (mem.eql(u8, header[0..4], "LIST") and mem.startsWith(u8, chunk, "INFO")) {
+                try self.parseRiffInfo(chunk[4..]);
+            } else if (mem.eql(u8, header[0..4], "id3 ") or mem.eql(u8, header[0..4], "ID3 ")) {
+                try ignoreInvalid(self.parseId3v2(chunk));
+            }
+        }
+    }
+
+    fn parseRiffInfo(self: *Self, bytes: []const u8) ParseError!void {
+        var chunks = ByteReader{ .bytes = bytes };
+        while (8 <= chunks.remaining()) {
+            const header = try chunks.take(8);
+            const size = mem.readInt(u32, header[4..8], .little);
+            const value = try chunks.take(size);
+            try chunks.skip(@min(size % 2, chunks.remaining()));
+            const field = riff_info_fields.get(header[0..4]) orelse continue;
+            try self.add(field, guessEncoding(value), value);
+        }
+    }
+};
+
+/// Reads from memory without copying.
+const ByteReader = struct {
+    bytes: []const u8,
+    index: usize = 0,
+
+    fn remaining(self: ByteReader) usize {
+        return self.bytes.len - self.index;
+    }
+
+    fn take(self: *ByteReader, length: usize) error{InvalidTags}![]const u8 {
+        if (self.remaining() < length) return error.InvalidTags;
+        const result = self.bytes[self.index..][0..length];
+        self.index += length;
+        return result;
+    }
+
+    fn skip(self: *ByteReader, length: usize) error{InvalidTags}!void {
+        _ = try self.take(length);
+    }
+};
+
+/// Reads a packet of an Ogg stream that starts on a new page. Data is only
+/// copied if a read crosses into the next page, into `scratch`.
+const OggPacketReader = struct {
+    const Self = @This();
+
+    bytes: []const u8,
+    /// The index of the page after the current one in `bytes`.
+    next_page: usize = 0,
+    /// The serial number of the stream; pages of other streams are skipped.
+    serial: u32,
+    /// The unread part of the packet on the current page.
+    run: []const u8 = "",
+    /// Whether the packet continues on the next page.
+    continues: bool = true,
+    scratch: [SongTagsBuilder.vorbis_comment_head_size]u8 = undefined,
+
+    const page_header_size = 27;
+
+    fn nextPage(self: *Self) error{InvalidTags}!void {
+        while (true) {
+            var page = ByteReader{ .bytes = self.bytes, .index = self.next_page };
+            const header = try page.take(page_header_size);
+            if (!mem.eql(u8, header[0..4], "OggS")) return error.InvalidTags;
+            const segments = try page.take(header[26]);
+            var body_size: usize = 0;
+            for (segments) |segment| body_size += segment;
+            const body = try page.take(body_size);
+            self.next_page = page.index;
+            if (self.serial != mem.readInt(u32, header[14..18], .little)) continue;
+
+            // A packet ends with the first segment shorter than 255 bytes.
+            var run_size: usize = 0;
+            self.continues = true;
+            for (segments) |segment| {
+                run_size += segment;
+                if (segment < 255) {
+                    self.continues = false;
+                    break;
+                }
+            }
+            self.run = body[0..run_size];
+            return;
+        }
+    }
+
+    /// The result is only valid until the next call.
+    fn take(self: *Self, length: usize) error{InvalidTags}![]const u8 {
+        while (0 == self.run.len and self.continues) try self.nextPage();
+        if (length <= self.run.len) {
+            const result = self.run[0..length];
+            self.run = self.run[length..];
+            return result;
+        }
+
+        if (self.scratch.len < length) return error.InvalidTags;
+        var copied: usize = 0;
+        while (copied < length) {
+            if (0 == self.run.len) {
+                if (!self.continues) return error.InvalidTags;
+                try self.nextPage();
+                continue;
+            }
+            const size = @min(length - copied, self.run.len);
+            @memcpy(self.scratch[copied..][0..size], self.run[0..size]);
+            self.run = self.run[size..];
+            copied += size;
+        }
+        return self.scratch[0..length];
+    }
+
+    fn skip(self: *Self, length: usize) error{InvalidTags}!void {
+        var remaining = length;
+        while (self.run.len < remaining) {
+            remaining -= self.run.len;
+            self.run = "";
+            if (!self.continues) return error.InvalidTags;
+            try self.nextPage();
+        }
+        self.run = self.run[remaining..];
+    }
+};
+
+/// Reads the tags of songs with `--tags` (see `SongTagsBuilder`.) Files are
+/// memory-mapped and parsed in place, so only the parts holding tags are read
+/// from the disk, and values are copied once, into the tags. The files of a
+/// directory are read on a pool of threads, so that reads to the disk
+/// overlap.
+const TagReader = struct {
+    var initialized = false;
+    /// Only initialized with `--tags`.
+    var pool: Thread.Pool = undefined;
+
+    /// The amount of files read by each job.
+    const chunk_size = 8;
+
+    /// Deinitialize with `deinit`.
+    fn init(allocator: Allocator) !void {
+        debug.assert(!initialized);
+
+        if (ParsedArguments.tags) try pool.init(.{ .allocator = allocator });
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        if (ParsedArguments.tags) pool.deinit();
+
+        initialized = false;
+    }
+
+    /// Reads the tags of the files `names` in `directory`, into the list of
+    /// `tags` at the same index. Files that cannot be read get no tags.
+    fn readAll(
+        allocator: Allocator,
+        directory: fs.Dir,
+        names: []const [*:0]const u8,
+        tags: []ArrayListUnmanaged(u8),
+    ) Allocator.Error!void {
+        debug.assert(initialized and ParsedArguments.tags);
+        debug.assert(names.len == tags.len);
+
+        var wait_group = WaitGroup{};
+        var out_of_memory = std.atomic.Value(bool).init(false);
+        var start: usize = 0;
+        while (start < names.len) : (start += chunk_size) {
+            const end = @min(start + chunk_size, names.len);
+            pool.spawnWg(
+                &wait_group,
+                readChunk,
+                .{ allocator, directory, names[start..end], tags[start..end], &out_of_memory },
+            );
+        }
+        pool.waitAndWork(&wait_group);
+        if (out_of_memory.load(.acquire)) return error.OutOfMemory;
+    }
+
+    /// Helper for `readAll`.
+    fn readChunk(
+        allocator: Allocator,
+        directory: fs.Dir,
+        names: []const [*:0]const u8,
+        tags: []ArrayListUnmanaged(u8),
+        out_of_memory: *std.atomic.Value(bool),
+    ) void {
+        for (names, tags) |name, *file_tags| {
+            readFile(allocator, directory, mem.span(name), file_tags) catch |err| {
+                if (error.OutOfMemory != err) continue;
+                out_of_memory.store(true, .release);
+                return;
+            };
+        }
+    }
+
+    /// Appends the tags of the file at `path` in `directory` to `tags`.
+    fn readFile(
+        allocator: Allocator,
+        directory: fs.Dir,
+        path: []const u8,
+        tags: *ArrayListUnmanaged(u8),
+    ) !void {
+        const file = try directory.openFile(path, .{});
+        defer file.close();
+        const size = (try file.stat()).size;
+        if (0 == size) return;
+        const bytes = try posix.mmap(
+            null,
+            size,
+            posix.PROT.READ,
+            .{ .TYPE = .PRIVATE },
+            file.handle,
+            0,
+        );
+        defer posix.munmap(bytes);
+
+        var builder = SongTagsBuilder{ .allocator = allocator, .bytes = tags };
+        try builder.parse(bytes);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Daemon                                                                     //
+////////////////////////////////////////////////////////////////////////////////
+
+/// Accepts commands over a Unix socket with `--daemon` (see `printHelp`,) on
+/// a background thread. Commands act on the playlist and sound system that
+/// are already loaded; only `add` reads from the disk.
+const ControlServer = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var stderr: *ConsoleWriter = undefined;
+    var stdout: *ConsoleWriter = undefined;
+    var feed: *PlaylistFeed = undefined;
+    var path: []u8 = undefined;
+    var server: net.Server = undefined;
+    var thread: Thread = undefined;
+    /// Protects the fields below.
+    var mutex: Thread.Mutex = .{};
+    /// The connection being served, if any.
+    var client: ?Stream = undefined;
+    var stopping: bool = undefined;
+
+    /// Longer commands are rejected.
+    const max_command_length = fs.max_path_bytes + 16;
+
+    const socket_name = "play-music.sock";
+
+    /// Deinitialize with `deinit`.
+    fn init(
+        allocatorr: Allocator,
+        stderrr: *ConsoleWriter,
+        stdoutt: *ConsoleWriter,
+        feedd: *PlaylistFeed,
+    ) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        stderr = stderrr;
+        stdout = stdoutt;
+        feed = feedd;
+        path = if (ParsedArguments.socket_path) |socket_path|
+            try allocator.dupe(u8, socket_path)
+        else
+            try fs.path.join(allocator, &.{ posix.getenv("XDG_RUNTIME_DIR") orelse "/tmp", socket_name });
+        errdefer allocator.free(path);
+        client = null;
+        stopping = false;
+
+        const address = net.Address.initUnix(path) catch |err| {
+            try stderr.writer().print("ERROR: Socket path is too long: {s}\n", .{path});
+            return err;
+        };
+        server = address.listen(.{}) catch |err| switch (err) {
+            error.AddressInUse => listen: {
+                // Left behind if the last daemon did not exit cleanly.
+                if (net.connectUnixSocket(path)) |stream| {
+                    stream.close();
+                    try stderr.writer().print(
+                        "ERROR: Another daemon is already using the socket: {s}\n",
+                        .{path},
+                    );
+                    return err;
+                } else |_| {}
+                // Anything else at the path is not ours to delete.
+                const stat = try posix.fstatat(posix.AT.FDCWD, path, posix.AT.SYMLINK_NOFOLLOW);
+                if (!posix.S.ISSOCK(stat.mode)) {
+                    try stderr.writer().print(
+                        "ERROR: Path is already in use by something other than a socket: {s}\n",
+                        .{path},
+                    );
+                    return err;
+                }
+                try fs.cwd().deleteFile(path);
+                break :listen try address.listen(.{});
+            },
+            else => return err,
+        };
+        errdefer {
+            server.deinit();
+            fs.cwd().deleteFile(path) catch {};
+        }
+        thread = try Thread.spawn(.{}, serve, .{});
+
+        try stdout.writer().print("INFO: Listening for commands on: {s}\n", .{path});
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        {
+            mutex.lock();
+            defer mutex.unlock();
+            stopping = true;
+            // Wakes the thread up from `accept` or reading.
+            posix.shutdown(server.stream.handle, .both) catch {};
+            if (client) |stream| posix.shutdown(stream.handle, .both) catch {};
+        }
+        thread.join();
+        server.deinit();
+        fs.cwd().deleteFile(path) catch {};
+        allocator.free(path);
+
+        initialized = false;
+    }
+
+    /// Entry point of the thread. Serves one connection at a time.
+    fn serve() void {
+        var line = ArrayListUnmanaged(u8).empty;
+        defer line.deinit(allocator);
+
+        while (true) {
+            const connection = server.accept() catch |err| {
+                mutex.lock();
+                defer mutex.unlock();
+                if (stopping) return;
+                // Likely out of file descriptors.
+                if (error.ConnectionAborted != err) time.sleep(100 * time.ns_per_ms);
+                continue;
+            };
+            {
+                mutex.lock();
+                defer mutex.unlock();
+                if (stopping) {
+                    connection.stream.close();
+                    return;
+                }
+                client = connection.stream;
+            }
+            defer {
+                mutex.lock();
+                defer mutex.unlock();
+                client = null;
+                connection.stream.close();
+            }
+
+            var reader = io.bufferedReader(connection.stream.reader());
+            while (true) {
+                line.clearRetainingCapacity();
+                reader.reader().streamUntilDelimiter(
+                    line.writer(allocator),
+                    '\n',
+                    max_command_length,
+                ) catch |err| switch (err) {
+                    error.StreamTooLong => {
+                        connection.stream.writeAll("ERROR command too long\n") catch {};
+                        break;
+                    },
+                    // Including `error.EndOfStream`, once the client is done.
+                    else => break,
+                };
+                execute(connection.stream, mem.trimRight(u8, line.items, "\r")) catch break;
+            }
+        }
+    }
+
+    /// Runs the command and writes the reply to `stream`. Fails if the reply
+    /// could not be written.
+    fn execute(stream: Stream, command: []const u8) !void {
+        const writer = stream.writer();
+        const name_end = mem.indexOfScalar(u8, command, ' ') orelse command.len;
+        const name = command[0..name_end];
+        const argument = mem.trim(u8, command[name_end..], " ");
+
+        if (mem.eql(u8, name, "skip")) {
+            SoundSystem.skip();
+        } else if (mem.eql(u8, name, "pause")) {
+            SoundSystem.pause();
+        } else if (mem.eql(u8, name, "resume")) {
+            SoundSystem.unpause();
+        } else if (mem.eql(u8, name, "match")) {
+            const filter = compileMatch(argument) catch |err| {
+                return writer.print("ERROR invalid pattern: {s}\n", .{@errorName(err)});
+            };
+            if (filter) |f| {
+                if (f.usesTags() and !ParsedArguments.tags) {
+                    f.deinit();
+                    return writer.writeAll("ERROR tags are only read with --tags\n");
+                }
+            }
+            feed.setFilter(filter);
+        } else if (mem.eql(u8, name, "add")) {
+            if (0 == argument.len) return writer.writeAll("ERROR expected a directory\n");
+            const songs_loaded = add(argument) catch |err| {
+                return writer.print("ERROR {s}\n", .{@errorName(err)});
+            };
+            return writer.print("OK {d}\n", .{songs_loaded});
+        } else if (mem.eql(u8, name, "quit")) {
+            // Before the connection is closed by exiting.
+            try writer.writeAll("OK\n");
+            feed.quit();
+            SoundSystem.quit();
+            return;
+        } else {
+            return writer.writeAll("ERROR unknown command\n");
+        }
+        try writer.writeAll("OK\n");
+    }
+
+    /// Compiles the filter for `match`: `pattern` in place of the `--match`
+    /// patterns, if it is not empty, and the `--exclude` patterns. Returns
+    /// `null` if there are no patterns at all.
+    fn compileMatch(pattern: []const u8) !?SongFilter {
+        const exclude_patterns = ParsedArguments.patterns.items[ParsedArguments.match_count..];
+        var patterns = std.BoundedArray([]const u8, exre.max_set_patterns){};
+        if (0 < pattern.len) patterns.appendAssumeCapacity(pattern);
+        patterns.appendSlice(exclude_patterns) catch return error.RegexTooComplex;
+        if (0 == patterns.len) return null;
+        return try SongFilter.compile(allocator, patterns.constSlice(), @intFromBool(0 < pattern.len));
+    }
+
+    /// Appends the songs in `directory` to the playlist, and returns how
+    /// many.
+    fn add(directory: []const u8) !u64 {
+        // The library index and the scanner are not made for two loads at
+        // once, so this waits for the one in progress, if any.
+        try feed.beginLoad();
+        defer feed.endLoad();
+
+        const songs_loaded = try feed.playlist.appendFromDirectory(stderr, null, directory, feed);
+        const saved = LibraryIndex.save();
+
+        feed.mutex.lock();
+        defer feed.mutex.unlock();
+        try stdout.writer().print(
+            "INFO: {d} song(s) loaded from directory: {s}\n",
+            .{ songs_loaded, directory },
+        );
+        try EventLog.reportCoalesced(stderr.writer());
+        saved catch |err| try stderr.writer().print(
+            "WARN: Unable to save library index: {s}\n",
+            .{@errorName(err)},
+        );
+        try stderr.flush();
+        try stdout.flush();
+        return songs_loaded;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Sound System                                                               //
+////////////////////////////////////////////////////////////////////////////////
+
+const SoundSystem = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    /// The strategies for each format, in order of priority. If one fails to
+    /// play a song, the next one is tried.
+    var formats_play_strategies_map: AutoHashMapUnmanaged(
+        FileFormat,
+        PlayStrategies,
+    ) = undefined;
+
+    const PlayStrategies = std.BoundedArray(PlayStrategy, 3);
+
+    /// Protects the fields below, and the socket of `MpvIpc` while it is
+    /// written to.
+    var control_mutex: Thread.Mutex = .{};
+    /// Signaled when unpaused.
+    var unpaused: Thread.Condition = .{};
+    var paused = false;
+    /// Set by `quit`.
+    var quitting = false;
+    /// How the current song is being played, for `skip` and `pause`.
+    var current: Playback = .none;
+    /// Whether the current song was skipped, including by `quit`.
+    var skipped = false;
+
+    const Playback = union(enum) {
+        none,
+        /// A player started for the song.
+        child: Child.Id,
+        mpv_ipc,
+        native,
+    };
+
+    /// Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        formats_play_strategies_map = AutoHashMapUnmanaged(
+            FileFormat,
+            PlayStrategies,
+        ).empty;
+        errdefer formats_play_strategies_map.deinit(allocator);
+
+        try Programs.init(allocator);
+        errdefer Programs.deinit();
+
+        // Keeps a single mpv running in the background for all songs, if
+        // possible.
+        if (Programs.isAvailable(.mpv)) MpvIpc.init(allocator) catch {};
+        errdefer if (MpvIpc.initialized) MpvIpc.deinit();
+
+        if (NativePlayback.available) NativePlayback.init(allocator) catch {};
+        errdefer if (NativePlayback.initialized) NativePlayback.deinit();
+
+        // Per-format strategy selection. Each player is used once, through
+        // the best strategy available for it.
+        inline for (@typeInfo(FileFormat).@"enum".fields) |field| {
+            const format: FileFormat = @enumFromInt(field.value);
+
+            const native = switch (format) {
+                .flac, .wav => true,
+                .mp3, .opus, .vorbis => false,
+            };
+
+            var strategies = PlayStrategies{};
+            if (native and NativePlayback.initialized) {
+                strategies.appendAssumeCapacity(nativePlayStrategy);
+            }
+            if (MpvIpc.initialized) {
+                strategies.appendAssumeCapacity(mpvIpcPlayStrategy);
+            } else if (Programs.isAvailable(.mpv)) {
+                strategies.appendAssumeCapacity(mpvPlayStrategy);
+            }
+            if (Programs.isAvailable(.cvlc)) {
+                strategies.appendAssumeCapacity(cvlcPlayStrategy);
+            }
+            if (0 < strategies.len) {
+                try formats_play_strategies_map.put(allocator, format, strategies);
+            }
+        }
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        formats_play_strategies_map.deinit(allocator);
+        if (NativePlayback.initialized) NativePlayback.deinit();
+        if (MpvIpc.initialized) MpvIpc.deinit();
+        if (Programs.initialized) Programs.deinit();
+
+        initialized = false;
+    }
+
+    /// Like `init`, but plays every format with `strategy` alone instead of
+    /// looking for players, for `Benchmarks`. Deinitialize with `deinit`.
+    fn initWithStrategy(allocatorr: Allocator, strategy: PlayStrategy) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        formats_play_strategies_map = AutoHashMapUnmanaged(
+            FileFormat,
+            PlayStrategies,
+        ).empty;
+        errdefer formats_play_strategies_map.deinit(allocator);
+
+        for (std.enums.values(FileFormat)) |format| {
+            var strategies = PlayStrategies{};
+            strategies.appendAssumeCapacity(strategy);
+            try formats_play_strategies_map.put(allocator, format, strategies);
+        }
+
+        initialized = true;
+    }
+
+    fn isPlayable(format: FileFormat) bool {
+        debug.assert(initialized);
+
+        return formats_play_strategies_map.contains(format);
+    }
+
+    /// Returns whether the song was played. Falls back to the next strategy
+    /// for the format if one fails. Waits to start the song while paused.
+    fn playSong(path: []const u8, format: FileFormat) !bool {
+        debug.assert(initialized);
+
+        {
+            control_mutex.lock();
+            defer control_mutex.unlock();
+            while (paused) unpaused.wait(&control_mutex);
+            if (quitting) return true;
+        }
+        Stats.songRequested();
+
+        const strategies = formats_play_strategies_map.get(format) orelse
+            return error.UnplayableFormat;
+        for (strategies.constSlice()) |strategy| {
+            // Other players may not be able to open the sound card while the
+            // end of the last song is still playing on it.
+            if (NativePlayback.initialized and &nativePlayStrategy != strategy) {
+                NativePlayback.drain();
+            }
+            if (MpvIpc.initialized and &mpvIpcPlayStrategy != strategy) {
+                try MpvIpc.drain();
+            }
+            if (try strategy(allocator, path, format)) return true;
+        }
+        return false;
+    }
+
+    /// Called by the play strategies when they start and stop playing a
+    /// song.
+    fn setCurrent(playback: Playback) void {
+        const previous = swap: {
+            control_mutex.lock();
+            defer control_mutex.unlock();
+
+            const replaced = current;
+            current = playback;
+            skipped = false;
+            // Since `playSong` checked.
+            if (quitting) skipCurrent();
+            if (paused) pauseCurrent();
+            break :swap replaced;
+        };
+
+        // The other players are ready before they have loaded the song, and
+        // report it themselves (see `MpvIpc.play` and
+        // `NativePlayback.output`.)
+        switch (playback) {
+            .none => if (.child == previous) Stats.songEnded(),
+            .child => Stats.songStarted(),
+            .mpv_ipc, .native => {},
+        }
+    }
+
+    /// Waits for `child`, the current player (see `setCurrent`,) to exit.
+    /// It stops being the current one before it is reaped, so that `skip`
+    /// and `pause` cannot signal another process that got its ID since.
+    fn waitChild(child: *Child) Child.WaitError!Child.Term {
+        if (.linux == builtin.os.tag) {
+            var info: linux.siginfo_t = undefined;
+            while (true) {
+                const rc = linux.waitid(.PID, child.id, &info, linux.W.EXITED | linux.W.NOWAIT);
+                if (.INTR != posix.errno(rc)) break;
+            }
+        }
+        setCurrent(.none);
+        return child.wait();
+    }
+
+    /// Whether the current song was skipped, for the play strategies to tell
+    /// a player that was stopped from one that failed.
+    fn wasSkipped() bool {
+        control_mutex.lock();
+        defer control_mutex.unlock();
+
+        return skipped;
+    }
+
+    /// Stops the current song, which counts as played.
+    fn skip() void {
+        control_mutex.lock();
+        defer control_mutex.unlock();
+
+        skipCurrent();
+    }
+
+    /// Stops the current song, and makes `playSong` return right away from
+    /// now on.
+    fn quit() void {
+        {
+            control_mutex.lock();
+            defer control_mutex.unlock();
+            quitting = true;
+        }
+        unpause();
+        skip();
+    }
+
+    /// Must be called with `control_mutex` held.
+    fn skipCurrent() void {
+        skipped = true;
+        switch (current) {
+            // The end of the last song may still be playing.
+            .none => {
+                if (NativePlayback.initialized) NativePlayback.skip();
+                if (MpvIpc.initialized) MpvIpc.skip();
+            },
+            .child => |pid| {
+                posix.kill(pid, posix.SIG.TERM) catch {};
+                // Stopped processes only handle signals once they continue.
+                if (paused) posix.kill(pid, posix.SIG.CONT) catch {};
+            },
+            .mpv_ipc => MpvIpc.skip(),
+            .native => NativePlayback.skip(),
+        }
+    }
+
+    /// Pauses the current song, and holds off the next ones until `unpause`
+    /// is called.
+    fn pause() void {
+        control_mutex.lock();
+        defer control_mutex.unlock();
+
+        if (paused) return;
+        paused = true;
+        pauseCurrent();
+    }
+
+    fn unpause() void {
+        control_mutex.lock();
+        defer control_mutex.unlock();
+
+        if (!paused) return;
+        paused = false;
+        switch (current) {
+            .child => |pid| posix.kill(pid, posix.SIG.CONT) catch {},
+            .none, .mpv_ipc, .native => {},
+        }
+        // mpv stays paused between songs.
+        if (MpvIpc.initialized) MpvIpc.send("{\"command\":[\"set_property\",\"pause\",false]}\n");
+        if (NativePlayback.initialized) NativePlayback.setPaused(false);
+        unpaused.broadcast();
+    }
+
+    /// Must be called with `control_mutex` held.
+    fn pauseCurrent() void {
+        switch (current) {
+            .child => |pid| posix.kill(pid, posix.SIG.STOP) catch {},
+            .none, .mpv_ipc, .native => {},
+        }
+        // Also holds the end of the last song, which may still be playing.
+        if (MpvIpc.initialized) MpvIpc.send("{\"command\":[\"set_property\",\"pause\",true]}\n");
+        if (NativePlayback.initialized) NativePlayback.setPaused(true);
+    }
+};
+
+const Program = enum {
+    mpv,
+    cvlc,
+};
+
+/// Locates the programs used by the play strategies by searching `PATH`,
+/// rather than by trying to run them. Each program is looked up once, and the
+/// results are remembered in a cache file that is invalidated whenever `PATH`,
+/// or the contents of the directories in it, change.
+const Programs = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    /// `null` if the program is not available.
+    var paths: EnumArray(Program, ?[]u8) = undefined;
+
+    const cache_file_name = "programs";
+    const cache_header = "play-music programs 1";
+
+    /// Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        paths = EnumArray(Program, ?[]u8).initFill(null);
+        errdefer freePaths();
+
+        const path_variable = posix.getenv("PATH") orelse "";
+        const fingerprint = pathFingerprint(path_variable);
+
+        if (!ParsedArguments.cache or !try loadCache(fingerprint)) {
+            freePaths();
+            for (std.enums.values(Program)) |program| {
+                paths.set(program, try search(path_variable, @tagName(program)));
+            }
+            if (ParsedArguments.cache) saveCache(fingerprint) catch {};
+        }
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        freePaths();
+
+        initialized = false;
+    }
+
+    fn isAvailable(program: Program) bool {
+        return null != paths.get(program);
+    }
+
+    /// Asserts that the program is available.
+    fn path(program: Program) []const u8 {
+        return paths.get(program).?;
+    }
+
+    fn freePaths() void {
+        for (std.enums.values(Program)) |program| {
+            if (paths.get(program)) |program_path| allocator.free(program_path);
+            paths.set(program, null);
+        }
+    }
+
+    /// Caller owns returned memory.
+    fn search(path_variable: []const u8, name: []const u8) !?[]u8 {
+        var directories = mem.splitScalar(u8, path_variable, ':');
+        while (directories.next()) |directory| {
+            const program_path = try fs.path.join(allocator, &.{
+                // An empty entry refers to the current directory.
+                if (0 == directory.len) "." else directory,
+                name,
+            });
+            if (isExecutableFile(program_path)) return program_path;
+            allocator.free(program_path);
+        }
+        return null;
+    }
+
+    fn isExecutableFile(file_path: []const u8) bool {
+        posix.access(file_path, posix.X_OK) catch return false;
+        const stat = fs.cwd().statFile(file_path) catch return false;
+        return .directory != stat.kind;
+    }
+
+    /// Installing or removing a program changes the modification time of the
+    /// directory it is in.
+    fn pathFingerprint(path_variable: []const u8) u64 {
+        var hasher = Wyhash.init(0);
+        hasher.update(path_variable);
+        var directories = mem.splitScalar(u8, path_variable, ':');
+        while (directories.next()) |directory| {
+            const stat = fs.cwd().statFile(
+                if (0 == directory.len) "." else directory,
+            ) catch continue;
+            hasher.update(mem.asBytes(&stat.mtime));
+        }
+        return hasher.final();
+    }
+
+    /// Returns whether the cache was valid. May leave `paths` partially
+    /// filled if not.
+    fn loadCache(fingerprint: u64) Allocator.Error!bool {
+        var directory = openCacheDirectory(allocator) catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+            else => return false,
+        };
+        defer directory.close();
+        const contents = directory.readFileAlloc(
+            allocator,
+            cache_file_name,
+            4096,
+        ) catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+            else => return false,
+        };
+        defer allocator.free(contents);
+
+        var lines = mem.splitScalar(u8, contents, '\n');
+        if (!mem.eql(u8, lines.first(), cache_header)) return false;
+        const cached_fingerprint = std.fmt.parseInt(
+            u64,
+            lines.next() orelse return false,
+            16,
+        ) catch return false;
+        if (fingerprint != cached_fingerprint) return false;
+
+        var cached = EnumSet(Program).initEmpty();
+        while (lines.next()) |line| {
+            if (0 == line.len) continue;
+            var fields = mem.splitScalar(u8, line, '\t');
+            const program = std.meta.stringToEnum(Program, fields.first()) orelse
+                return false;
+            const program_path = fields.rest();
+            if (cached.contains(program)) return false;
+            cached.insert(program);
+
+            if (0 == program_path.len) continue;
+            paths.set(program, try allocator.dupe(u8, program_path));
+        }
+
+        return std.enums.values(Program).len == cached.count();
+    }
+
+    fn saveCache(fingerprint: u64) !void {
+        var directory = try openCacheDirectory(allocator);
+        defer directory.close();
+        var file = try directory.atomicFile(cache_file_name, .{});
+        defer file.deinit();
+
+        var writer = bufferedFileWriter(file.file.writer());
+        try writer.writer().print("{s}\n{x}\n", .{ cache_header, fingerprint });
+        for (std.enums.values(Program)) |program| {
+            try writer.writer().print("{s}\t{s}\n", .{
+                @tagName(program),
+                paths.get(program) orelse "",
+            });
+        }
+        try writer.flush();
+        try file.finish();
+    }
+};
+
+/// Opens the directory play-music keeps its cache files in, creating it if
+/// needed.
+fn openCacheDirectory(allocator: Allocator) !fs.Dir {
+    const path = blk: {
+        if (posix.getenv("XDG_CACHE_HOME")) |cache_home| {
+            if (0 < cache_home.len) {
+                break :blk try fs.path.join(allocator, &.{ cache_home, "play-music" });
+            }
+        }
+        if (posix.getenv("HOME")) |home| {
+            break :blk try fs.path.join(allocator, &.{ home, ".cache", "play-music" });
+        }
+        return error.NoCacheDirectory;
+    };
+    defer allocator.free(path);
+
+    return fs.cwd().makeOpenPath(path, .{});
+}
+
+/// Returns whether the song was played, `false` if the player failed to play
+/// it.
+const PlayStrategy = *const fn (
+    allocator: Allocator,
+    path: []const u8,
+    format: FileFormat,
+) PlayStrategyError!bool;
+
+const PlayStrategyError = Child.SpawnError || Allocator.Error || error{PlayerUnresponsive};
+
+fn mpvPlayStrategy(
+    allocator: Allocator,
+    path: []const u8,
+    format: FileFormat,
+) PlayStrategyError!bool {
+    switch (format) {
+        .flac, .mp3, .vorbis, .wav, .opus => {
+            var gain_buffer: [max_gain_argument_length]u8 = undefined;
+            var arguments = std.BoundedArray([]const u8, 4){};
+            arguments.appendSliceAssumeCapacity(&.{
+                Programs.path(.mpv),
+                "--no-audio-display", // Prevents display of cover art.
+            });
+            if (ParsedArguments.normalize) {
+                arguments.appendAssumeCapacity(mpvGainArgument(path, &gain_buffer));
+            }
+            arguments.appendAssumeCapacity(path);
+
+            var child = Child.init(arguments.constSlice(), allocator);
+            try child.spawn();
+            SoundSystem.setCurrent(.{ .child = child.id });
+            return switch (try SoundSystem.waitChild(&child)) {
+                // mpv exits with 4 when it is quit by a signal, which is not
+                // the song's fault.
+                .Exited => |code| 0 == code or 4 == code,
+                .Signal => |signal| isStopSignal(signal),
+                .Stopped, .Unknown => false,
+            };
+        },
+    }
+}
+
+fn cvlcPlayStrategy(
+    allocator: Allocator,
+    path: []const u8,
+    format: FileFormat,
+) PlayStrategyError!bool {
+    switch (format) {
+        .flac, .mp3, .vorbis, .wav, .opus => {
+            var gain_buffer: [max_gain_argument_length]u8 = undefined;
+            var arguments = std.BoundedArray([]const u8, 4){};
+            arguments.appendSliceAssumeCapacity(&.{
+                Programs.path(.cvlc),
+                "--play-and-exit", // Makes exit after the song ends.
+            });
+            if (ParsedArguments.normalize) {
+                arguments.appendAssumeCapacity(cvlcGainArgument(path, &gain_buffer));
+            }
+            arguments.appendAssumeCapacity(path);
+
+            var child = Child.init(arguments.constSlice(), allocator);
+            try child.spawn();
+            SoundSystem.setCurrent(.{ .child = child.id });
+            return switch (try SoundSystem.waitChild(&child)) {
+                .Exited => |code| 0 == code,
+                .Signal => |signal| isStopSignal(signal),
+                .Stopped, .Unknown => false,
+            };
+        },
+    }
+}
+
+/// Whether a player killed by `signal` was stopped on purpose, by skipping
+/// (see `SoundSystem.skip`) or by interrupting play-music, rather than
+/// crashing on the song.
+fn isStopSignal(signal: u32) bool {
+    return posix.SIG.TERM == signal or posix.SIG.INT == signal;
+}
+
+const max_gain_argument_length = 64;
+
+/// Returns the argument that makes mpv play the song at `path` at the
+/// loudness of `--normalize`: by the gain measured for it if there is one,
+/// otherwise by its ReplayGain tags.
+fn mpvGainArgument(path: []const u8, buffer: *[max_gain_argument_length]u8) []const u8 {
+    const gain = LoudnessAnalyzer.gain(path) orelse return "--replaygain=track";
+    return std.fmt.bufPrint(buffer, "--af=lavfi=[volume={d:.2}dB]", .{gain}) catch unreachable;
+}
+
+/// Like `mpvGainArgument`, for cvlc.
+fn cvlcGainArgument(path: []const u8, buffer: *[max_gain_argument_length]u8) []const u8 {
+    const gain = LoudnessAnalyzer.gain(path) orelse return "--audio-replay-gain-mode=track";
+    return std.fmt.bufPrint(buffer, "--gain={d:.4}", .{decibelsToFactor(gain)}) catch unreachable;
+}
+
+fn mpvIpcPlayStrategy(
+    allocator: Allocator,
+    path: []const u8,
+    format: FileFormat,
+) PlayStrategyError!bool {
+    _ = allocator;
+
+    switch (format) {
+        .flac, .mp3, .vorbis, .wav, .opus => {
+            SoundSystem.setCurrent(.mpv_ipc);
+            defer SoundSystem.setCurrent(.none);
+            return MpvIpc.play(path, LoudnessAnalyzer.gain(path));
+        },
+    }
+}
+
+/// A single mpv instance that is kept idling in the background and is fed
+/// songs through its JSON IPC interface
+/// <https://mpv.io/manual/stable/#json-ipc>, so that the cost of starting mpv
+/// and opening the audio device is not paid for every song. Each song is
+/// queued before the last one ends, and the songs played are removed from
+/// mpv's playlist as the next ones start.
+const MpvIpc = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var socket_path: []u8 = undefined;
+    var child: Child = undefined;
+    /// `null` if mpv is not running, i.e. if the user quit it.
+    var socket: ?Stream = undefined;
+    var reader: BufferedStreamReader = undefined;
+    var request_id: u32 = undefined;
+    var command: ArrayListUnmanaged(u8) = undefined;
+    var line: ArrayListUnmanaged(u8) = undefined;
+    /// The playlist entry of the song `play` last returned for, while mpv is
+    /// still playing the end of it.
+    var playing: ?i64 = undefined;
+
+    /// How long before the end of a song `play` returns, for the next one to
+    /// be queued in time. About as much as `NativePlayback` decodes ahead.
+    const queue_ahead_s = 2.0;
+    /// How long to wait for mpv to create its IPC socket.
+    const connect_timeout_ms = 5000;
+    const connect_interval_ms = 10;
+
+    /// Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        socket_path = try std.fmt.allocPrint(
+            allocator,
+            "{s}/play-music-mpv-{x}.sock",
+            .{ posix.getenv("XDG_RUNTIME_DIR") orelse "/tmp", std.crypto.random.int(u64) },
+        );
+        errdefer allocator.free(socket_path);
+        socket = null;
+        request_id = 0;
+        playing = null;
+        command = ArrayListUnmanaged(u8).empty;
+        errdefer command.deinit(allocator);
+        line = ArrayListUnmanaged(u8).empty;
+        errdefer line.deinit(allocator);
+
+        try start();
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        // Lets the end of the last song play out, even if paused, as
+        // `NativePlayback.deinit` does.
+        if (null != playing) {
+            {
+                SoundSystem.control_mutex.lock();
+                defer SoundSystem.control_mutex.unlock();
+                send("{\"command\":[\"set_property\",\"pause\",false]}\n");
+            }
+            drain() catch {};
+        }
+        if (socket) |stream| {
+            stream.writeAll("{\"command\":[\"quit\"]}\n") catch {};
+            stream.close();
+            _ = child.wait() catch {};
+        }
+        fs.cwd().deleteFile(socket_path) catch {};
+        allocator.free(socket_path);
+        command.deinit(allocator);
+        line.deinit(allocator);
+
+        initialized = false;
+    }
+
+    fn start() PlayStrategyError!void {
+        debug.assert(null == socket);
+
+        const ipc_argument = try std.fmt.allocPrint(
+            allocator,
+            "--input-ipc-server={s}",
+            .{socket_path},
+        );
+        defer allocator.free(ipc_argument);
+        var arguments = std.BoundedArray([]const u8, 6){};
+        arguments.appendSliceAssumeCapacity(&.{
+            Programs.path(.mpv),
+            "--idle=yes", // Waits for songs instead of exiting.
+            "--gapless-audio=yes", // Plays queued songs without a gap.
+            "--no-audio-display", // Prevents display of cover art.
+            ipc_argument,
+        });
+        // Songs without a measured gain (see `play`.)
+        if (ParsedArguments.normalize) arguments.appendAssumeCapacity("--replaygain=track");
+
+        child = Child.init(arguments.constSlice(), allocator);
+        try child.spawn();
+        errdefer _ = child.kill() catch {};
+
+        // mpv creates the socket some time after it starts.
+        var stream: Stream = undefined;
+        var waited_ms: u32 = 0;
+        while (true) : (waited_ms += connect_interval_ms) {
+            stream = net.connectUnixSocket(socket_path) catch {
+                if (connect_timeout_ms <= waited_ms) return error.PlayerUnresponsive;
+                time.sleep(connect_interval_ms * time.ns_per_ms);
+                continue;
+            };
+            break;
+        }
+        reader = .{ .unbuffered_reader = stream.reader() };
+
+        SoundSystem.control_mutex.lock();
+        defer SoundSystem.control_mutex.unlock();
+        socket = stream;
+    }
+
+    /// Called when mpv goes away, i.e. if the user quit it. It will be
+    /// restarted for the next song.
+    fn stop() void {
+        const was_playing = stopping: {
+            SoundSystem.control_mutex.lock();
+            defer SoundSystem.control_mutex.unlock();
+
+            socket.?.close();
+            socket = null;
+            _ = child.kill() catch {};
+            const had_song = null != playing;
+            playing = null;
+            break :stopping had_song;
+        };
+        if (was_playing) Stats.songEnded();
+    }
+
+    /// Sends a command without waiting for the reply, from any thread. Must
+    /// be called with `SoundSystem.control_mutex` held.
+    fn send(message: []const u8) void {
+        if (socket) |stream| stream.writeAll(message) catch {};
+    }
+
+    /// Stops the song mpv is playing, if any, from any thread: the one
+    /// `play` last returned for while it is still playing, otherwise the one
+    /// being played. Must be called with `SoundSystem.control_mutex` held.
+    fn skip() void {
+        if (null == playing and .mpv_ipc != SoundSystem.current) return;
+        // Also drops the song queued after it.
+        if (SoundSystem.quitting) return send("{\"command\":[\"stop\"]}\n");
+        // Moves on to the song queued after it, if there is one.
+        send("{\"command\":[\"playlist-next\",\"force\"]}\n");
+    }
+
+    /// Queues the song and blocks until mpv is about to finish playing it
+    /// (see `queue_ahead_s`,) so that the next one is queued while it is
+    /// still playing and mpv plays them without a gap. Returns whether mpv
+    /// was able to play it. If `gain` is not `null`, the song is played
+    /// louder by that many decibels, instead of by its ReplayGain tags.
+    fn play(path: []const u8, gain: ?f32) PlayStrategyError!bool {
+        debug.assert(initialized);
+
+        if (null == socket) try start();
+        const stream = socket.?;
+
+        request_id +%= 1;
+        const load_request = request_id;
+        command.clearRetainingCapacity();
+        const writer = command.writer(allocator);
+        if (gain) |g| {
+            // Named arguments, since the position of the options changed
+            // between versions of mpv. They only apply to this song.
+            try writer.writeAll("{\"command\":{\"name\":\"loadfile\",\"url\":");
+            try json.stringify(path, .{}, writer);
+            try writer.print(
+                ",\"flags\":\"append-play\",\"options\":{{\"replaygain\":\"no\"," ++
+                    "\"af\":\"lavfi=[volume={d:.2}dB]\"}}}},\"request_id\":{d}}}\n",
+                .{ g, request_id },
+            );
+        } else {
+            try writer.writeAll("{\"command\":[\"loadfile\",");
+            try json.stringify(path, .{}, writer);
+            try writer.print(
+                ",\"append-play\"],\"request_id\":{d}}}\n",
+                .{request_id},
+            );
+        }
+        const written = written: {
+            SoundSystem.control_mutex.lock();
+            defer SoundSystem.control_mutex.unlock();
+            break :written stream.writeAll(command.items);
+        };
+        written catch {
+            stop();
+            return SoundSystem.wasSkipped();
+        };
+
+        // Newer versions of mpv tell us the ID of the playlist entry, so we
+        // can ignore events for other entries. Older ones play each song to
+        // the end before the next one is queued.
+        var entry_id: ?i64 = null;
+        // Whether mpv started loading the song, and playing it.
+        var loading = false;
+        var started = false;
+        // Whether the end of the song is left playing (see `playing`.)
+        var queued_ahead = false;
+        defer if (started and !queued_ahead) Stats.songEnded();
+        // The request asking how much of the song is left, and when to ask
+        // again.
+        var remaining_request: ?u32 = null;
+        var deadline_ms: ?i64 = null;
+        while (true) {
+            if (deadline_ms) |deadline| {
+                if (!waitMessage(deadline - time.milliTimestamp())) {
+                    deadline_ms = null;
+                    remaining_request = requestRemaining() catch
+                        return SoundSystem.wasSkipped();
+                    continue;
+                }
+            }
+
+            const parsed = (receive() catch |err| switch (err) {
+                error.OutOfMemory => return error.OutOfMemory,
+                // Unless the song was being stopped anyway, the next
+                // strategy gets to try.
+                error.PlayerGone => return SoundSystem.wasSkipped(),
+            }) orelse continue;
+            defer parsed.deinit();
+            const message = parsed.value.object;
+
+            if (message.get("request_id")) |id| {
+                if (id != .integer) continue;
+                if (load_request == id.integer) {
+                    if (message.get("data")) |data| {
+                        if (data == .object) {
+                            if (data.object.get("playlist_entry_id")) |entry| {
+                                if (entry == .integer) entry_id = entry.integer;
+                            }
+                        }
+                    }
+                } else if (null != remaining_request and remaining_request.? == id.integer) {
+                    remaining_request = null;
+                    // Unknown for streams, which are played to the end.
+                    const remaining_s: f64 = switch (message.get("data") orelse continue) {
+                        .integer => |seconds| @floatFromInt(seconds),
+                        .float => |seconds| seconds,
+                        else => continue,
+                    };
+                    if (remaining_s <= queue_ahead_s) {
+                        SoundSystem.control_mutex.lock();
+                        defer SoundSystem.control_mutex.unlock();
+                        playing = entry_id;
+                        queued_ahead = true;
+                        return true;
+                    }
+                    // Asks again then, since the song may be paused or
+                    // sought in the meantime.
+                    deadline_ms = time.milliTimestamp() + math.lossyCast(
+                        i64,
+                        (remaining_s - queue_ahead_s) * time.ms_per_s,
+                    );
+                }
+                continue;
+            }
+
+            const event = message.get("event") orelse continue;
+            if (event != .string) continue;
+            if (playing) |playing_id| {
+                if (isForEntry(message, playing_id)) {
+                    if (mem.eql(u8, event.string, "end-file")) endPlaying();
+                    continue;
+                }
+            }
+            if (mem.eql(u8, event.string, "start-file")) {
+                if (isForEntry(message, entry_id)) {
+                    loading = true;
+                    // Removes the songs played before, which mpv keeps.
+                    SoundSystem.control_mutex.lock();
+                    defer SoundSystem.control_mutex.unlock();
+                    send("{\"command\":[\"playlist-clear\"]}\n");
+                }
+                continue;
+            }
+            // Has no entry ID, but only comes once the file is loaded.
+            if (mem.eql(u8, event.string, "playback-restart")) {
+                if (loading and !started) {
+                    started = true;
+                    Stats.songStarted();
+                    if (null != entry_id) {
+                        remaining_request = requestRemaining() catch
+                            return SoundSystem.wasSkipped();
+                    }
+                }
+                continue;
+            }
+            if (!mem.eql(u8, event.string, "end-file")) continue;
+            if (!isForEntry(message, entry_id)) continue;
+            const reason = message.get("reason") orelse return true;
+            return reason != .string or !mem.eql(u8, reason.string, "error");
+        }
+    }
+
+    /// Blocks until mpv has played the song `play` last returned for. Called
+    /// before songs are handed to other players, which may not be able to
+    /// open the sound card while mpv is using it.
+    fn drain() Allocator.Error!void {
+        debug.assert(initialized);
+
+        while (playing) |playing_id| {
+            const parsed = (receive() catch |err| switch (err) {
+                error.OutOfMemory => return error.OutOfMemory,
+                error.PlayerGone => return,
+            }) orelse continue;
+            defer parsed.deinit();
+            const message = parsed.value.object;
+
+            const event = message.get("event") orelse continue;
+            if (event != .string or !mem.eql(u8, event.string, "end-file")) continue;
+            if (isForEntry(message, playing_id)) endPlaying();
+        }
+    }
+
+    /// Helper for `play` and `drain`. Called when the song `play` last
+    /// returned for ends.
+    fn endPlaying() void {
+        {
+            SoundSystem.control_mutex.lock();
+            defer SoundSystem.control_mutex.unlock();
+            playing = null;
+        }
+        Stats.songEnded();
+    }
+
+    /// Helper for `play`. Asks mpv how much of the current song is left, and
+    /// returns the ID of the request.
+    fn requestRemaining() error{PlayerGone}!u32 {
+        request_id +%= 1;
+        var buffer: [96]u8 = undefined;
+        const message = std.fmt.bufPrint(
+            &buffer,
+            "{{\"command\":[\"get_property\",\"playtime-remaining\"],\"request_id\":{d}}}\n",
+            .{request_id},
+        ) catch unreachable;
+        const written = written: {
+            SoundSystem.control_mutex.lock();
+            defer SoundSystem.control_mutex.unlock();
+            break :written socket.?.writeAll(message);
+        };
+        written catch {
+            stop();
+            return error.PlayerGone;
+        };
+        return request_id;
+    }
+
+    /// Helper for `play`. Waits up to `timeout_ms` for a message from mpv,
+    /// and returns whether one came.
+    fn waitMessage(timeout_ms: i64) bool {
+        if (reader.start < reader.end) return true;
+        if (timeout_ms <= 0) return false;
+        var fds = [_]posix.pollfd{
+            .{ .fd = socket.?.handle, .events = posix.POLL.IN, .revents = 0 },
+        };
+        const ready = posix.poll(&fds, math.lossyCast(i32, timeout_ms)) catch return true;
+        return 0 < ready;
+    }
+
+    /// Helper for `play` and `drain`. Reads the next message from mpv, or
+    /// returns `null` if it is not a JSON object. Stops mpv (see `stop`) and
+    /// returns `error.PlayerGone` if it went away.
+    fn receive() (Allocator.Error || error{PlayerGone})!?json.Parsed(json.Value) {
+        line.clearRetainingCapacity();
+        reader.reader().streamUntilDelimiter(
+            line.writer(allocator),
+            '\n',
+            null,
+        ) catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+            else => {
+                stop();
+                return error.PlayerGone;
+            },
+        };
+
+        const parsed = json.parseFromSlice(
+            json.Value,
+            allocator,
+            line.items,
+            .{},
+        ) catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+            else => return null,
+        };
+        if (parsed.value != .object) {
+            parsed.deinit();
+            return null;
+        }
+        return parsed;
+    }
+
+    /// Helper for `play`. Whether the event `message` is about the playlist
+    /// entry `entry_id`, which is assumed if its ID is not known.
+    fn isForEntry(message: json.ObjectMap, entry_id: ?i64) bool {
+        const id = entry_id orelse return true;
+        const entry = message.get("playlist_entry_id") orelse return false;
+        return entry == .integer and entry.integer == id;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Native Playback                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+fn nativePlayStrategy(
+    allocator: Allocator,
+    path: []const u8,
+    format: FileFormat,
+) PlayStrategyError!bool {
+    _ = allocator;
+
+    switch (format) {
+        .flac, .wav => {
+            SoundSystem.setCurrent(.native);
+            defer SoundSystem.setCurrent(.none);
+            return NativePlayback.play(path, format, LoudnessAnalyzer.gain(path) orelse 0);
+        },
+        .mp3, .opus, .vorbis => return false,
+    }
+}
+
+/// Plays FLAC and WAV files in-process through ALSA, instead of starting a
+/// player for them. Requires building with `-Dalsa`.
+///
+/// Songs are decoded on the thread that plays them, converted to floating
+/// point at the output sample rate (see `Converter`,) and passed through a
+/// `SampleRing` to an output thread that writes them to the sound card.
+/// `play` returns once the whole song is decoded, so that the next song is
+/// decoded while the end of the last one is still playing, and there is no
+/// gap between them. Once there is nothing left to play, the sound card is
+/// drained and closed, so that other players can open it (see `drain`.)
+const NativePlayback = struct {
+    const available = build_options.alsa;
+
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var ring: SampleRing = undefined;
+    var output_thread: Thread = undefined;
+
+    /// Protects the fields below. `ring` itself needs no lock, but both
+    /// threads hold this while they use it, so that they can wait for each
+    /// other.
+    var mutex: Thread.Mutex = .{};
+    /// Signaled whenever `ring` or the fields below change.
+    var changed: Thread.Condition = .{};
+    /// The format of the samples in `ring` (see `StreamFormat.pack`,) or 0
+    /// before the first song. Only changed while `ring` is empty.
+    var stream_format: u64 = 0;
+    /// Whether `play` is decoding a song. The sound card is only closed
+    /// while not, as there are more samples to come otherwise.
+    var decoding = false;
+    /// Where in `ring` each song that was decoded ends (see
+    /// `SampleRing.written`,) oldest first. Removed by the output thread
+    /// once it gets there.
+    var song_ends: std.fifo.LinearFifo(usize, .{ .Static = max_queued_songs }) = undefined;
+    /// How many of `song_ends` are to be discarded rather than played (see
+    /// `skip`.)
+    var songs_skipped: usize = 0;
+    /// Whether the output thread has the sound card open, or is about to
+    /// open it for samples it took from `ring`.
+    var playing = false;
+    /// Tells the output thread to exit once there is nothing left to play.
+    var stopping = false;
+    /// Set by the output thread if the sound card fails. The samples in
+    /// `ring` are discarded from then on.
+    var failed = false;
+    /// Set to stop the song being decoded (see `skip`.)
+    var skipping = false;
+    /// Makes the output thread stop writing to the sound card.
+    var paused = false;
+
+    /// About 0.7 seconds of stereo audio at 44.1 kHz.
+    const ring_capacity = 1 << 17;
+    /// The most samples the output thread writes to the sound card at once.
+    const output_chunk_size = 4096;
+    /// Decoding waits for the output thread past this many songs in `ring`,
+    /// which only happens for very short ones.
+    const max_queued_songs = 8;
+
+    const StreamFormat = struct {
+        sample_rate: u32,
+        channels: u8,
+
+        fn pack(self: StreamFormat) u64 {
+            return @as(u64, self.sample_rate) << 8 | self.channels;
+        }
+
+        fn unpack(packed_format: u64) StreamFormat {
+            return .{
+                .sample_rate = @intCast(packed_format >> 8),
+                .channels = @truncate(packed_format),
+            };
+        }
+    };
+
+    /// Requires `available`. Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+        comptime debug.assert(available);
+
+        allocator = allocatorr;
+        // Makes sure there is a sound card before taking over from the other
+        // strategies.
+        Alsa.close(try Alsa.open(.{ .sample_rate = 44100, .channels = 2 }));
+
+        ring = try SampleRing.init(allocator, ring_capacity);
+        errdefer ring.deinit(allocator);
+        stream_format = 0;
+        decoding = false;
+        song_ends = @TypeOf(song_ends).init();
+        songs_skipped = 0;
+        playing = false;
+        stopping = false;
+        failed = false;
+        skipping = false;
+        paused = false;
+        output_thread = try Thread.spawn(.{}, output, .{});
+
+        initialized = true;
+    }
+
+    /// Waits for the songs that were decoded to finish playing.
+    fn deinit() void {
+        debug.assert(initialized);
+
+        {
+            mutex.lock();
+            defer mutex.unlock();
+            paused = false;
+            stopping = true;
+            changed.broadcast();
+        }
+        output_thread.join();
+        ring.deinit(allocator);
+
+        initialized = false;
+    }
+
+    /// Returns whether the song could be played. A song that can be decoded
+    /// in part is played up to the broken part and counts as played. `gain`
+    /// is in decibels.
+    fn play(path: []const u8, format: FileFormat, gain: f32) Allocator.Error!bool {
+        debug.assert(initialized);
+
+        {
+            mutex.lock();
+            defer mutex.unlock();
+            if (failed) return false;
+            decoding = true;
+        }
+        defer {
+            mutex.lock();
+            defer mutex.unlock();
+            while (0 == song_ends.writableLength()) changed.wait(&mutex);
+            song_ends.writeItemAssumeCapacity(ring.written.load(.monotonic));
+            // Including skips that came after the last sample was queued.
+            if (skipping) songs_skipped += 1;
+            skipping = false;
+            decoding = false;
+            changed.broadcast();
+        }
+
+        const file = fs.cwd().openFile(path, .{}) catch return false;
+        defer file.close();
+        const size = (file.stat() catch return false).size;
+        if (0 == size) return false;
+        const bytes = posix.mmap(
+            null,
+            size,
+            posix.PROT.READ,
+            .{ .TYPE = .PRIVATE },
+            file.handle,
+            0,
+        ) catch return false;
+        defer posix.munmap(bytes);
+
+        var queued = false;
+        const result = switch (format) {
+            .flac => decode(FlacDecoder, bytes, gain, &queued),
+            .wav => decode(WavDecoder, bytes, gain, &queued),
+            .mp3, .opus, .vorbis => unreachable,
+        };
+        result catch |err| switch (err) {
+            error.OutOfMemory => return error.OutOfMemory,
+            error.Skipped => return true,
+            else => return queued,
+        };
+        return true;
+    }
+
+    /// Stops the song that is playing, i.e. the oldest one in `ring`, which
+    /// may be done decoding already while the next one is being decoded.
+    /// Does nothing if there is no such song.
+    fn skip() void {
+        mutex.lock();
+        defer mutex.unlock();
+        if (songs_skipped < song_ends.count) {
+            songs_skipped += 1;
+        } else if (decoding) {
+            skipping = true;
+        } else return;
+        changed.broadcast();
+    }
+
+    fn setPaused(pause: bool) void {
+        mutex.lock();
+        defer mutex.unlock();
+        paused = pause;
+        changed.broadcast();
+    }
+
+    /// Blocks until the songs decoded so far have been played, and the sound
+    /// card is closed. Called before songs are handed to other players,
+    /// which may not be able to open the sound card while it is in use.
+    fn drain() void {
+        debug.assert(initialized);
+
+        mutex.lock();
+        defer mutex.unlock();
+        while (ring.writable() < ring.samples.len or playing) changed.wait(&mutex);
+    }
+
+    /// Helper for `play`. Sets `queued` once samples were handed to the
+    /// output thread.
+    fn decode(comptime Decoder: type, bytes: []const u8, gain: f32, queued: *bool) !void {
+        var decoder = try Decoder.init(allocator, bytes);
+        defer decoder.deinit(allocator);
+        var converter = try Converter.init(
+            allocator,
+            decoder.sample_rate,
+            decoder.channels,
+            decoder.max_frames,
+            decibelsToFactor(gain),
+        );
+        defer converter.deinit(allocator);
+
+        try beginStream(.{
+            .sample_rate = converter.output_rate,
+            .channels = decoder.channels,
+        });
+        while (try decoder.next()) |block| {
+            try queue(converter.convert(block));
+            queued.* = true;
+        }
+        try queue(converter.flush());
+    }
+
+    /// Samples yielded by the decoders.
+    const Block = struct {
+        frames: usize,
+        /// The samples of each channel, one after another, left-justified.
+        samples: []const i32,
+    };
+
+    /// Waits for the samples of the last song to be played if they are in a
+    /// different format.
+    fn beginStream(format: StreamFormat) !void {
+        mutex.lock();
+        defer mutex.unlock();
+
+        const packed_format = format.pack();
+        if (packed_format == stream_format) return;
+        while (ring.writable() < ring.samples.len) {
+            try checkInterrupted();
+            changed.wait(&mutex);
+        }
+        stream_format = packed_format;
+    }
+
+    /// Blocks until all `samples` are in `ring`. They must be interleaved.
+    fn queue(samples: []const f32) !void {
+        mutex.lock();
+        defer mutex.unlock();
+
+        var rest = samples;
+        while (0 < rest.len) {
+            try checkInterrupted();
+            const count = @min(rest.len, ring.writable());
+            if (0 == count) {
+                changed.wait(&mutex);
+                continue;
+            }
+            ring.write(rest[0..count]);
+            rest = rest[count..];
+            changed.broadcast();
+        }
+    }
+
+    /// Fails if the song should not be decoded any further. What was queued
+    /// of a skipped song is discarded once `play` marks its end. Must be
+    /// called with `mutex` held.
+    fn checkInterrupted() !void {
+        if (failed) return error.SoundCardFailed;
+        if (skipping) return error.Skipped;
+    }
+
+    /// Entry point of the output thread.
+    fn output() void {
+        var pcm: ?*Alsa.Pcm = null;
+        var pcm_format: u64 = 0;
+        // Whether samples of the oldest song in `ring` were written to the
+        // sound card yet (see `Stats`.)
+        var song_started = false;
+
+        var chunk: [output_chunk_size]f32 = undefined;
+        mutex.lock();
+        defer mutex.unlock();
+        while (true) {
+            const consumed = ring.consumed.load(.monotonic);
+            if (0 < songs_skipped) {
+                // Chunks never go past the end of a song, so what is on the
+                // sound card is of this song too.
+                ring.discard(song_ends.readItem().? -% consumed);
+                songs_skipped -= 1;
+                if (song_started) Stats.songEnded();
+                song_started = false;
+                if (pcm) |p| Alsa.drop(p);
+                changed.broadcast();
+                continue;
+            }
+            if (paused) {
+                changed.wait(&mutex);
+                continue;
+            }
+
+            var readable = ring.readable();
+            if (0 < song_ends.count) {
+                const song_end = song_ends.peekItem(0);
+                if (song_end == consumed) {
+                    song_ends.discard(1);
+                    if (song_started) Stats.songEnded();
+                    song_started = false;
+                    changed.broadcast();
+                    continue;
+                }
+                readable = @min(readable, song_end -% consumed);
+            }
+            if (0 == readable) {
+                if (null != pcm and !decoding) {
+                    // Out of the lock, as this blocks until the sound card
+                    // is done playing.
+                    mutex.unlock();
+                    Alsa.drain(pcm.?);
+                    Alsa.close(pcm.?);
+                    mutex.lock();
+                    pcm = null;
+                    pcm_format = 0;
+                    playing = false;
+                    changed.broadcast();
+                    continue;
+                }
+                if (stopping and null == pcm) return;
+                changed.wait(&mutex);
+                continue;
+            }
+
+            const packed_format = stream_format;
+            const format = StreamFormat.unpack(packed_format);
+            const count = @min(readable, chunk.len) / format.channels * format.channels;
+            if (0 == count) {
+                // The rest of a frame is still being written.
+                changed.wait(&mutex);
+                continue;
+            }
+            ring.read(chunk[0..count]);
+            changed.broadcast();
+            if (failed) continue;
+            playing = true;
+
+            mutex.unlock();
+            if (packed_format != pcm_format) {
+                if (pcm) |p| {
+                    Alsa.drain(p);
+                    Alsa.close(p);
+                }
+                pcm_format = packed_format;
+                pcm = Alsa.open(format) catch null;
+            }
+            const written = if (pcm) |device|
+                Alsa.write(device, chunk[0..count], format.channels)
+            else
+                error.SoundCardUnavailable;
+            if (written) |_| {
+                if (!song_started) Stats.songStarted();
+                song_started = true;
+            } else |_| {}
+            mutex.lock();
+
+            written catch {
+                failed = true;
+                playing = null != pcm;
+                changed.broadcast();
+            };
+        }
+    }
+};
+
+/// A lock-free queue of samples between a single producer thread and a single
+/// consumer thread.
+const SampleRing = struct {
+    const Self = @This();
+
+    /// The length is a power of two.
+    samples: []f32,
+    /// The amounts of samples written and read so far, wrapping around. Only
+    /// stored by the producer and the consumer respectively.
+    written: std.atomic.Value(usize) = .init(0),
+    consumed: std.atomic.Value(usize) = .init(0),
+
+    /// Deinitialize with `deinit`.
+    fn init(allocator: Allocator, capacity: usize) !Self {
+        debug.assert(math.isPowerOfTwo(capacity));
+        return .{ .samples = try allocator.alloc(f32, capacity) };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        allocator.free(self.samples);
+        self.* = undefined;
+    }
+
+    /// May only be called by the producer.
+    fn writable(self: *const Self) usize {
+        const used = self.written.load(.monotonic) -% self.consumed.load(.acquire);
+        return self.samples.len - used;
+    }
+
+    /// May only be called by the consumer.
+    fn readable(self: *const Self) usize {
+        return self.written.load(.acquire) -% self.consumed.load(.monotonic);
+    }
+
+    /// May only be called by the producer. Asserts that there is room.
+    fn write(self: *Self, samples: []const f32) void {
+        debug.assert(samples.len <= self.writable());
+
+        const position = self.written.load(.monotonic);
+        const start = position & (self.samples.len - 1);
+        const first = @min(samples.len, self.samples.len - start);
+        @memcpy(self.samples[start..][0..first], samples[0..first]);
+        @memcpy(self.samples[0 .. samples.len - first], samples[first..]);
+        self.written.store(position +% samples.len, .release);
+    }
+
+    /// May only be called by the consumer. Skips `count` samples, like
+    /// `read` without copying them. Asserts that there are enough samples.
+    fn discard(self: *Self, count: usize) void {
+        debug.assert(count <= self.readable());
+
+        self.consumed.store(self.consumed.load(.monotonic) +% count, .release);
+    }
+
+    /// May only be called by the consumer. Asserts that there are enough
+    /// samples.
+    fn read(self: *Self, samples: []f32) void {
+        debug.assert(samples.len <= self.readable());
+
+        const position = self.consumed.load(.monotonic);
+        const start = position & (self.samples.len - 1);
+        const first = @min(samples.len, self.samples.len - start);
+        @memcpy(samples[0..first], self.samples[start..][0..first]);
+        @memcpy(samples[first..], self.samples[0 .. samples.len - first]);
+        self.consumed.store(position +% samples.len, .release);
+    }
+};
+
+test "SampleRing" {
+    const testing = std.testing;
+    var ring = try SampleRing.init(testing.allocator, 8);
+    defer ring.deinit(testing.allocator);
+    // So that the counters wrap around too.
+    ring.written = .init(math.maxInt(usize) - 2);
+    ring.consumed = .init(math.maxInt(usize) - 2);
+    try testing.expectEqual(8, ring.writable());
+    try testing.expectEqual(0, ring.readable());
+
+    var output: [8]f32 = undefined;
+    ring.write(&.{ 1, 2, 3, 4, 5, 6 });
+    try testing.expectEqual(2, ring.writable());
+    try testing.expectEqual(6, ring.readable());
+    ring.read(output[0..4]);
+    try testing.expectEqualSlices(f32, &.{ 1, 2, 3, 4 }, output[0..4]);
+    ring.discard(1);
+
+    // Across the end of the samples.
+    ring.write(&.{ 7, 8, 9, 10, 11, 12, 13 });
+    try testing.expectEqual(0, ring.writable());
+    try testing.expectEqual(8, ring.readable());
+    ring.read(&output);
+    try testing.expectEqualSlices(f32, &.{ 6, 7, 8, 9, 10, 11, 12, 13 }, &output);
+    try testing.expectEqual(8, ring.writable());
+    try testing.expectEqual(0, ring.readable());
+}
+
+/// Turns the blocks of decoders into the interleaved floating point samples
+/// played, at the sample rate set with `--sample-rate`.
+const Converter = struct {
+    const Self = @This();
+
+    channels: u8,
+    /// What the samples are multiplied by (see `--normalize`.)
+    gain: f32,
+    output_rate: u32,
+    resampler: ?Resampler,
+    /// The samples of each channel of the current block, one after another.
+    floats: []f32,
+    /// The output of `resampler`, each channel `resampled_stride` apart.
+    resampled: []f32,
+    resampled_stride: usize,
+    interleaved: []f32,
+
+    /// Deinitialize with `deinit`.
+    fn init(allocator: Allocator, input_rate: u32, channels: u8, max_frames: usize, gain: f32) !Self {
+        const requested_rate = ParsedArguments.sample_rate;
+        var resampler: ?Resampler = null;
+        if (0 != requested_rate and requested_rate != input_rate) {
+            resampler = Resampler.init(
+                allocator,
+                input_rate,
+                requested_rate,
+                channels,
+                max_frames,
+                ParsedArguments.resample_quality,
+            ) catch |err| switch (err) {
+                error.OutOfMemory => return error.OutOfMemory,
+                // Left to ALSA instead.
+                error.UnsupportedRatio => null,
+            };
+        }
+        errdefer if (resampler) |*r| r.deinit(allocator);
+
+        const resampled_stride = if (resampler) |r| r.maxOutputFrames() else 0;
+        const floats = try allocator.alloc(f32, max_frames * channels);
+        errdefer allocator.free(floats);
+        const resampled = try allocator.alloc(f32, resampled_stride * channels);
+        errdefer allocator.free(resampled);
+        const interleaved = try allocator.alloc(f32, @max(max_frames, resampled_stride) * channels);
+
+        return .{
+            .channels = channels,
+            .gain = gain,
+            .output_rate = if (null == resampler) input_rate else requested_rate,
+            .resampler = resampler,
+            .floats = floats,
+            .resampled = resampled,
+            .resampled_stride = resampled_stride,
+            .interleaved = interleaved,
+        };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        if (self.resampler) |*r| r.deinit(allocator);
+        allocator.free(self.floats);
+        allocator.free(self.resampled);
+        allocator.free(self.interleaved);
+        self.* = undefined;
+    }
+
+    /// The samples are valid until the next call.
+    fn convert(self: *Self, block: NativePlayback.Block) []const f32 {
+        const floats = self.floats[0..block.samples.len];
+        samplesToFloats(block.samples, floats, self.gain);
+
+        if (self.resampler) |*r| {
+            const frames = r.process(floats, block.frames, self.resampled, self.resampled_stride);
+            return self.interleave(self.resampled, self.resampled_stride, frames);
+        }
+        return self.interleave(floats, block.frames, block.frames);
+    }
+
+    /// Returns the samples still held back by the resampler at the end of a
+    /// song.
+    fn flush(self: *Self) []const f32 {
+        if (self.resampler) |*r| {
+            const frames = r.flush(self.resampled, self.resampled_stride);
+            return self.interleave(self.resampled, self.resampled_stride, frames);
+        }
+        return &.{};
+    }
+
+    fn interleave(self: *Self, planes: []const f32, stride: usize, frames: usize) []const f32 {
+        const interleaved = self.interleaved[0 .. frames * self.channels];
+        interleaveSamples(planes, stride, self.channels, interleaved);
+        return interleaved;
+    }
+};
+
+/// The amount of samples processed at once by the conversion kernels.
+const sample_vector_size = 8;
+const FloatVector = @Vector(sample_vector_size, f32);
+const SampleVector = @Vector(sample_vector_size, i32);
+
+/// Converts left-justified samples to floating point samples between -1 and
+/// 1, multiplied by `gain`.
+fn samplesToFloats(samples: []const i32, floats: []f32, gain: f32) void {
+    debug.assert(samples.len == floats.len);
+
+    const scale = gain / 2147483648.0;
+    var i: usize = 0;
+    while (i + sample_vector_size <= samples.len) : (i += sample_vector_size) {
+        const vector: SampleVector = samples[i..][0..sample_vector_size].*;
+        floats[i..][0..sample_vector_size].* =
+            @as(FloatVector, @floatFromInt(vector)) * @as(FloatVector, @splat(scale));
+    }
+    for (samples[i..], floats[i..]) |sample, *float| {
+        float.* = @as(f32, @floatFromInt(sample)) * scale;
+    }
+}
+
+/// Interleaves the samples of each channel in `planes`, which start `stride`
+/// samples apart.
+fn interleaveSamples(planes: []const f32, stride: usize, channels: u8, interleaved: []f32) void {
+    const frames = interleaved.len / channels;
+
+    if (2 != channels) {
+        for (0..channels) |channel| {
+            for (planes[channel * stride ..][0..frames], 0..) |sample, frame| {
+                interleaved[frame * channels + channel] = sample;
+            }
+        }
+        return;
+    }
+
+    // Stereo is common enough to deserve its own kernel.
+    const stereo_mask = comptime mask: {
+        // Negative indices select from the second vector.
+        var indices: [2 * sample_vector_size]i32 = undefined;
+        for (0..sample_vector_size) |i| {
+            indices[2 * i] = i;
+            indices[2 * i + 1] = ~@as(i32, i);
+        }
+        break :mask indices;
+    };
+    const left = planes[0..frames];
+    const right = planes[stride..][0..frames];
+    var i: usize = 0;
+    while (i + sample_vector_size <= frames) : (i += sample_vector_size) {
+        const l: FloatVector = left[i..][0..sample_vector_size].*;
+        const r: FloatVector = right[i..][0..sample_vector_size].*;
+        interleaved[2 * i ..][0 .. 2 * sample_vector_size].* = @shuffle(f32, l, r, stereo_mask);
+    }
+    for (i..frames) |frame| {
+        interleaved[2 * frame] = left[frame];
+        interleaved[2 * frame + 1] = right[frame];
+    }
+}
+
+test "Converter" {
+    const testing = std.testing;
+    ParsedArguments.sample_rate = 0;
+    ParsedArguments.resample_quality = .low;
+
+    // More frames than fit in a vector, for both kernels.
+    inline for (.{ 1, 2, 3 }) |channels| {
+        const frames = sample_vector_size + 3;
+        var converter = try Converter.init(testing.allocator, 44100, channels, frames, 0.5);
+        defer converter.deinit(testing.allocator);
+        try testing.expectEqual(44100, converter.output_rate);
+
+        var samples: [frames * channels]i32 = undefined;
+        for (&samples, 0..) |*sample, i| {
+            sample.* = (@as(i32, @intCast(i)) - 16) << 24;
+        }
+        const output = converter.convert(.{ .frames = frames, .samples = &samples });
+        try testing.expectEqual(frames * channels, output.len);
+        for (output, 0..) |value, i| {
+            const channel = i % channels;
+            const frame = i / channels;
+            const sample: f32 = @floatFromInt(@as(i32, @intCast(channel * frames + frame)) - 16);
+            try testing.expectEqual(sample / 128 * 0.5, value);
+        }
+        try testing.expectEqual(0, converter.flush().len);
+    }
+
+    ParsedArguments.sample_rate = 48000;
+    var resampling = try Converter.init(testing.allocator, 44100, 2, 1024, 1);
+    defer resampling.deinit(testing.allocator);
+    try testing.expectEqual(48000, resampling.output_rate);
+    try testing.expect(null != resampling.resampler);
+}
+
+/// Converts the sample rate of planar samples with a polyphase windowed sinc
+/// filter. The output rate divided by the input rate is reduced to
+/// `up / down`, and every output sample is the dot product of the last `taps`
+/// input samples with one of `up` sets of coefficients.
+const Resampler = struct {
+    const Self = @This();
+
+    up: u32,
+    down: u32,
+    /// A multiple of `sample_vector_size`.
+    taps: usize,
+    /// The coefficients of each phase, one after another, in the order of
+    /// the input samples they are multiplied with.
+    coefficients: []f32,
+    channels: u8,
+    /// The last `taps - 1` input samples of each channel followed by the
+    /// current block, each channel `work_stride` apart.
+    work: []f32,
+    work_stride: usize,
+    /// The position of the next output sample in `work` is
+    /// `index + phase / up`.
+    index: usize,
+    phase: u32,
+
+    const Quality = enum { low, medium, high };
+
+    /// More phases than this make for coefficient tables that are too
+    /// large, and are left to ALSA.
+    const max_phases = 1024;
+
+    /// Deinitialize with `deinit`.
+    fn init(
+        allocator: Allocator,
+        input_rate: u32,
+        output_rate: u32,
+        channels: u8,
+        max_frames: usize,
+        quality: Quality,
+    ) !Self {
+        const divisor = math.gcd(input_rate, output_rate);
+        const up = output_rate / divisor;
+        const down = input_rate / divisor;
+        if (max_phases < up) return error.UnsupportedRatio;
+
+        // Wider and longer filters keep more of the treble and let less of
+        // the aliasing through.
+        const settings: struct { taps: usize, passband: f64, beta: f64 } = switch (quality) {
+            .low => .{ .taps = 16, .passband = 0.80, .beta = 5.0 },
+            .medium => .{ .taps = 32, .passband = 0.87, .beta = 7.0 },
+            .high => .{ .taps = 64, .passband = 0.92, .beta = 9.0 },
+        };
+        const taps = settings.taps;
+        debug.assert(0 == taps % sample_vector_size);
+
+        const coefficients = try allocator.alloc(f32, up * taps);
+        errdefer allocator.free(coefficients);
+        // When downsampling, the filter also has to remove what is above the
+        // new Nyquist frequency.
+        const ratio = @min(1.0, @as(f64, @floatFromInt(up)) / @as(f64, @floatFromInt(down)));
+        const cutoff = settings.passband * ratio / @as(f64, @floatFromInt(2 * up));
+        const length: f64 = @floatFromInt(up * taps);
+        for (0..up) |phase| {
+            const phase_coefficients = coefficients[phase * taps ..][0..taps];
+            var sum: f64 = 0;
+            for (phase_coefficients, 0..) |*coefficient, j| {
+                // Centered on `taps / 2` input samples ago.
+                const n: f64 = @floatFromInt(phase + (taps - 1 - j) * up);
+                const t = n - length / 2;
+                const x = 2 * t / length;
+                const window = besselI0(settings.beta * @sqrt(@max(0, 1 - x * x)));
+                const value = sinc(2 * cutoff * t) * window;
+                coefficient.* = @floatCast(value);
+                sum += value;
+            }
+            // Each phase keeps the level of constant signals.
+            for (phase_coefficients) |*coefficient| {
+                coefficient.* = @floatCast(coefficient.* / sum);
+            }
+        }
+
+        const work_stride = taps - 1 + @max(max_frames, taps);
+        const work = try allocator.alloc(f32, work_stride * channels);
+        @memset(work, 0);
+
+        return .{
+            .up = up,
+            .down = down,
+            .taps = taps,
+            .coefficients = coefficients,
+            .channels = channels,
+            .work = work,
+            .work_stride = work_stride,
+            // Makes up for the delay of the filter.
+            .index = taps - 1 + taps / 2,
+            .phase = 0,
+        };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        allocator.free(self.coefficients);
+        allocator.free(self.work);
+        self.* = undefined;
+    }
+
+    /// The most frames `process` and `flush` output at once.
+    fn maxOutputFrames(self: Self) usize {
+        const max_input = self.work_stride - (self.taps - 1);
+        return (max_input * self.up + self.down - 1) / self.down + 1;
+    }
+
+    /// Resamples `frames` frames of `input`, whose channels are `frames`
+    /// apart, into `output`, whose channels are `output_stride` apart.
+    /// Returns the amount of frames in `output`.
+    fn process(
+        self: *Self,
+        input: []const f32,
+        frames: usize,
+        output: []f32,
+        output_stride: usize,
+    ) usize {
+        const history = self.taps - 1;
+        for (0..self.channels) |channel| {
+            @memcpy(
+                self.work[channel * self.work_stride + history ..][0..frames],
+                input[channel * frames ..][0..frames],
+            );
+        }
+        return self.run(frames, output, output_stride);
+    }
+
+    /// Outputs what was still held back to make up for the delay of the
+    /// filter.
+    fn flush(self: *Self, output: []f32, output_stride: usize) usize {
+        const history = self.taps - 1;
+        const frames = self.taps / 2;
+        for (0..self.channels) |channel| {
+            @memset(self.work[channel * self.work_stride + history ..][0..frames], 0);
+        }
+        return self.run(frames, output, output_stride);
+    }
+
+    fn run(self: *Self, frames: usize, output: []f32, output_stride: usize) usize {
+        const history = self.taps - 1;
+        const end = history + frames;
+
+        var count: usize = 0;
+        while (self.index < end) : (count += 1) {
+            const coefficients = self.coefficients[self.phase * self.taps ..][0..self.taps];
+            const start = self.index - history;
+            for (0..self.channels) |channel| {
+                const window = self.work[channel * self.work_stride + start ..][0..self.taps];
+                output[channel * output_stride + count] = dot(coefficients, window);
+            }
+            self.phase += self.down;
+            self.index += self.phase / self.up;
+            self.phase %= self.up;
+        }
+
+        // Keeps the end of the block for the next one.
+        for (0..self.channels) |channel| {
+            const samples = self.work[channel * self.work_stride ..];
+            mem.copyForwards(f32, samples[0..history], samples[frames..][0..history]);
+        }
+        self.index -= frames;
+        return count;
+    }
+
+    fn dot(a: []const f32, b: []const f32) f32 {
+        var sum: FloatVector = @splat(0);
+        var i: usize = 0;
+        while (i < a.len) : (i += sample_vector_size) {
+            const x: FloatVector = a[i..][0..sample_vector_size].*;
+            const y: FloatVector = b[i..][0..sample_vector_size].*;
+            sum += x * y;
+        }
+        return @reduce(.Add, sum);
+    }
+
+    fn sinc(x: f64) f64 {
+        if (0 == x) return 1;
+        return @sin(math.pi * x) / (math.pi * x);
+    }
+
+    /// The modified Bessel function of the first kind of order 0, for the
+    /// Kaiser window.
+    fn besselI0(x: f64) f64 {
+        var sum: f64 = 1;
+        var term: f64 = 1;
+        var k: f64 = 1;
+        while (term > sum * 1e-12) : (k += 1) {
+            const half = x / (2 * k);
+            term *= half * half;
+            sum += term;
+        }
+        return sum;
+    }
+};
+
+test "Resampler" {
+    const testing = std.testing;
+    const block_frames = 1000;
+    const blocks = 4;
+    // The left channel at 1, the right one at -0.5.
+    var input: [2 * block_frames]f32 = undefined;
+    @memset(input[0..block_frames], 1);
+    @memset(input[block_frames..], -0.5);
+
+    const rates = [_][2]u32{ .{ 44100, 48000 }, .{ 48000, 44100 }, .{ 22050, 96000 } };
+    for (rates) |rate| {
+        for ([_]Resampler.Quality{ .low, .medium, .high }) |quality| {
+            var r = try Resampler.init(testing.allocator, rate[0], rate[1], 2, block_frames, quality);
+            defer r.deinit(testing.allocator);
+            const stride = r.maxOutputFrames();
+            const output = try testing.allocator.alloc(f32, 2 * stride);
+            defer testing.allocator.free(output);
+
+            // As many frames as the input lasts, rounded up.
+            const input_frames = blocks * block_frames;
+            const expected = (input_frames * r.up + r.down - 1) / r.down;
+            // Away from the silence before and after the input.
+            const margin = 2 * r.taps * r.up / r.down + 1;
+
+            var total: usize = 0;
+            for (0..blocks + 1) |block| {
+                const frames = if (block < blocks)
+                    r.process(&input, block_frames, output, stride)
+                else
+                    r.flush(output, stride);
+                try testing.expect(frames <= stride);
+                for (0..frames) |i| {
+                    const position = total + i;
+                    if (position < margin or expected < position + margin) continue;
+                    try testing.expectApproxEqAbs(1, output[i], 1e-4);
+                    try testing.expectApproxEqAbs(-0.5, output[stride + i], 1e-4);
+                }
+                total += frames;
+            }
+            try testing.expectEqual(expected, total);
+        }
+    }
+}
+
+/// The parts of libasound used by `NativePlayback`
+/// <https://www.alsa-project.org/alsa-doc/alsa-lib/pcm.html>.
+const Alsa = struct {
+    const Pcm = opaque {};
+
+    const stream_playback = 0;
+    const format_float_le = 14;
+    const access_rw_interleaved = 3;
+    /// The latency asked of the sound card, in microseconds.
+    const latency_us = 100 * time.us_per_ms;
+
+    extern "asound" fn snd_pcm_open(pcm: *?*Pcm, name: [*:0]const u8, stream: c_int, mode: c_int) c_int;
+    extern "asound" fn snd_pcm_set_params(
+        pcm: *Pcm,
+        format: c_int,
+        access: c_int,
+        channels: c_uint,
+        rate: c_uint,
+        soft_resample: c_int,
+        latency: c_uint,
+    ) c_int;
+    extern "asound" fn snd_pcm_writei(pcm: *Pcm, buffer: *const anyopaque, size: c_ulong) c_long;
+    extern "asound" fn snd_pcm_recover(pcm: *Pcm, err: c_int, silent: c_int) c_int;
+    extern "asound" fn snd_pcm_drain(pcm: *Pcm) c_int;
+    extern "asound" fn snd_pcm_drop(pcm: *Pcm) c_int;
+    extern "asound" fn snd_pcm_prepare(pcm: *Pcm) c_int;
+    extern "asound" fn snd_pcm_close(pcm: *Pcm) c_int;
+
+    /// Opens the default sound card for interleaved 32-bit floating point
+    /// samples. Close with `close`.
+    fn open(format: NativePlayback.StreamFormat) !*Pcm {
+        var pcm: ?*Pcm = null;
+        if (snd_pcm_open(&pcm, "default", stream_playback, 0) < 0) return error.SoundCardUnavailable;
+        errdefer close(pcm.?);
+        if (snd_pcm_set_params(
+            pcm.?,
+            format_float_le,
+            access_rw_interleaved,
+            format.channels,
+            format.sample_rate,
+            1, // Lets ALSA resample if the sound card does not support the rate.
+            latency_us,
+        ) < 0) return error.SoundCardUnsupportedFormat;
+        return pcm.?;
+    }
+
+    fn close(pcm: *Pcm) void {
+        _ = snd_pcm_close(pcm);
+    }
+
+    /// Blocks until the samples are played.
+    fn drain(pcm: *Pcm) void {
+        _ = snd_pcm_drain(pcm);
+    }
+
+    /// Discards the samples not yet played, and gets ready for more.
+    fn drop(pcm: *Pcm) void {
+        _ = snd_pcm_drop(pcm);
+        _ = snd_pcm_prepare(pcm);
+    }
+
+    /// Blocks until the samples are queued on the sound card. Recovers from
+    /// underruns, which happen when songs are not decoded fast enough.
+    fn write(pcm: *Pcm, samples: []const f32, channels: u8) !void {
+        var rest = samples;
+        while (0 < rest.len) {
+            const frames = snd_pcm_writei(pcm, rest.ptr, rest.len / channels);
+            if (frames < 0) {
+                if (snd_pcm_recover(pcm, @intCast(frames), 1) < 0) return error.SoundCardFailed;
+                continue;
+            }
+            rest = rest[@as(usize, @intCast(frames)) * channels ..];
+        }
+    }
+};
+
+/// Reads a stream of bits, most significant bit first.
+const BitReader = struct {
+    const Self = @This();
+
+    bytes: []const u8,
+    /// Position in bits.
+    position: usize = 0,
+
+    fn isAtEnd(self: Self) bool {
+        return self.bytes.len * 8 <= self.position;
+    }
+
+    /// Reads an unsigned integer of up to 57 bits.
+    fn read(self: *Self, bits: u6) !u64 {
+        if (0 == bits) return 0;
+        if (self.bytes.len * 8 - self.position < bits) return error.EndOfStream;
+
+        const start = self.position / 8;
+        var word: u64 = 0;
+        for (self.bytes[start..@min(self.bytes.len, start + 8)], 0..) |byte, i| {
+            word |= @as(u64, byte) << @intCast(56 - 8 * i);
+        }
+        word <<= @intCast(self.position % 8);
+        self.position += bits;
+        return word >> @intCast(64 - @as(u7, bits));
+    }
+
+    /// Reads a two's complement integer of up to 33 bits, as long as the
+    /// value fits in 32 bits.
+    fn readSigned(self: *Self, bits: u6) !i32 {
+        if (0 == bits) return 0;
+        const shift: u6 = @intCast(64 - @as(u7, bits));
+        const value: i64 = @bitCast(try self.read(bits) << shift);
+        return @truncate(value >> shift);
+    }
+
+    /// Reads the amount of zero bits before the next one bit, and the one
+    /// bit.
+    fn readUnary(self: *Self) !u32 {
+        var zeros: u32 = 0;
+        while (true) {
+            if (self.isAtEnd()) return error.EndOfStream;
+            const offset: u3 = @intCast(self.position % 8);
+            const byte = self.bytes[self.position / 8] << offset;
+            if (0 == byte) {
+                zeros +%= @as(u32, 8) - offset;
+                self.position += @as(usize, 8) - offset;
+                continue;
+            }
+            const leading = @clz(byte);
+            zeros +%= leading;
+            self.position += @as(usize, leading) + 1;
+            return zeros;
+        }
+    }
+
+    fn alignToByte(self: *Self) void {
+        self.position = mem.alignForward(usize, self.position, 8);
+    }
+};
+
+test "BitReader" {
+    const testing = std.testing;
+    {
+        var r = BitReader{ .bytes = &.{ 0b1010_1100, 0b0000_0001, 0xff, 0b1111_0000 } };
+        try testing.expectEqual(0b101, try r.read(3));
+        try testing.expectEqual(12, try r.readSigned(5));
+        try testing.expectEqual(7, try r.readUnary());
+        try testing.expectEqual(0x1ff, try r.read(9));
+        try testing.expectEqual(-2, try r.readSigned(4));
+        try testing.expect(!r.isAtEnd());
+        try testing.expectEqual(0, try r.read(0));
+        try testing.expectError(error.EndOfStream, r.read(4));
+        try testing.expectEqual(0, try r.read(3));
+        try testing.expect(r.isAtEnd());
+        try testing.expectError(error.EndOfStream, r.read(1));
+        try testing.expectError(error.EndOfStream, r.readUnary());
+    }
+    {
+        // Across whole bytes of zeros.
+        var r = BitReader{ .bytes = &.{ 0x00, 0x00, 0x20, 0x01 } };
+        try testing.expectEqual(18, try r.readUnary());
+        r.alignToByte();
+        try testing.expectEqual(7, try r.readUnary());
+        try testing.expect(r.isAtEnd());
+    }
+    {
+        // The widest reads, not starting on a byte.
+        var r = BitReader{ .bytes = &.{ 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
+        try testing.expectEqual(0, try r.read(4));
+        try testing.expectEqual((1 << 57) - 1, try r.read(57));
+        try testing.expectEqual(-1, try r.readSigned(2));
+        r.alignToByte();
+        try testing.expect(r.isAtEnd());
+    }
+    {
+        // Signed values of 33 bits, as side channels of 32-bit samples are.
+        var r = BitReader{ .bytes = &.{ 0xc0, 0x00, 0x00, 0x00, 0x00 } };
+        try testing.expectEqual(math.minInt(i32), try r.readSigned(33));
+    }
+}
+
+/// Returns `bytes` without the ID3v2 tag at its start, if any.
+fn skipId3v2(bytes: []const u8) []const u8 {
+    if (bytes.len < 10 or !mem.eql(u8, bytes[0..3], "ID3")) return bytes;
+    // The size is stored in 7 bits per byte.
+    var size: usize = 0;
+    for (bytes[6..10]) |byte| size = size << 7 | (byte & 0x7f);
+    size += 10;
+    if (0 != bytes[5] & 0x10) size += 10; // Footer.
+    return bytes[@min(size, bytes.len)..];
+}
+
+/// Decodes FLAC streams <https://www.rfc-editor.org/rfc/rfc9639> one block at
+/// a time.
+const FlacDecoder = struct {
+    const Self = @This();
+
+    reader: BitReader,
+    sample_rate: u32,
+    channels: u8,
+    bits_per_sample: u8,
+    /// The most frames in a block.
+    max_frames: u16,
+    blocks_decoded: usize,
+    /// The samples of each channel of the current block, one after another.
+    decoded: []i32,
+
+    const max_lpc_order = 32;
+
+    /// Does not take ownership of `bytes`. Deinitialize with `deinit`.
+    fn init(allocator: Allocator, bytes: []const u8) !Self {
+        const stream = skipId3v2(bytes);
+        if (!mem.startsWith(u8, stream, "fLaC")) return error.InvalidFlac;
+
+        var stream_info: ?*const [34]u8 = null;
+        var index: usize = 4;
+        while (true) {
+            if (stream.len - index < 4) return error.InvalidFlac;
+            const header = stream[index];
+            const length = mem.readInt(u24, stream[index + 1 ..][0..3], .big);
+            index += 4;
+            if (stream.len - index < length) return error.InvalidFlac;
+            if (0 == header & 0x7f and 34 <= length) stream_info = stream[index..][0..34];
+            index += length;
+            if (0 != header & 0x80) break;
+        }
+
+        // The first block of metadata is always the stream info.
+        const info = stream_info orelse return error.InvalidFlac;
+        const max_block_size = mem.readInt(u16, info[2..4], .big);
+        const packed_info = mem.readInt(u64, info[10..18], .big);
+        const sample_rate: u32 = @intCast(packed_info >> 44);
+        const channels: u8 = @intCast((packed_info >> 41 & 0x7) + 1);
+        const bits_per_sample: u8 = @intCast((packed_info >> 36 & 0x1f) + 1);
+        if (max_block_size < 16 or 0 == sample_rate or bits_per_sample < 4) {
+            return error.InvalidFlac;
+        }
+
+        const decoded = try allocator.alloc(i32, @as(usize, max_block_size) * channels);
+
+        return .{
+            .reader = .{ .bytes = stream[index..] },
+            .sample_rate = sample_rate,
+            .channels = channels,
+            .bits_per_sample = bits_per_sample,
+            .max_frames = max_block_size,
+            .blocks_decoded = 0,
+            .decoded = decoded,
+        };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        allocator.free(self.decoded);
+        self.* = undefined;
+    }
+
+    /// Returns the next block, or `null` at the end of the stream. The
+    /// samples are valid until the next call.
+    fn next(self: *Self) !?NativePlayback.Block {
+        const r = &self.reader;
+        r.alignToByte();
+        if (r.bytes.len * 8 - r.position < 16) return null;
+
+        // Anything but a frame after the frames, like an ID3v1 tag, ends the
+        // stream.
+        if (0x7ffc != try r.read(15)) {
+            return if (0 < self.blocks_decoded) null else error.InvalidFlac;
+        }
+        _ = try r.read(1); // Blocking strategy.
+        const block_size_code = try r.read(4);
+        const sample_rate_code = try r.read(4);
+        const channel_assignment = try r.read(4);
+        const sample_size_code = try r.read(3);
+        _ = try r.read(1);
+
+        // The number of the frame or first sample, UTF-8 style.
+        const first = try r.read(8);
+        for (0..@clz(~@as(u8, @intCast(first))) -| 1) |_| _ = try r.read(8);
+
+        const block_size: usize = switch (block_size_code) {
+            0 => return error.InvalidFlac,
+            1 => 192,
+            2...5 => @as(usize, 576) << @intCast(block_size_code - 2),
+            6 => try r.read(8) + 1,
+            7 => try r.read(16) + 1,
+            else => @as(usize, 256) << @intCast(block_size_code - 8),
+        };
+        switch (sample_rate_code) {
+            12 => _ = try r.read(8),
+            13, 14 => _ = try r.read(16),
+            15 => return error.InvalidFlac,
+            else => {},
+        }
+        _ = try r.read(8); // CRC-8 of the header.
+
+        const bits_per_sample: u6 = switch (sample_size_code) {
+            0 => @intCast(self.bits_per_sample),
+            1 => 8,
+            2 => 12,
+            4 => 16,
+            5 => 20,
+            6 => 24,
+            7 => 32,
+            else => return error.InvalidFlac,
+        };
+        const channels: usize = switch (channel_assignment) {
+            0...7 => channel_assignment + 1,
+            8...10 => 2,
+            else => return error.InvalidFlac,
+        };
+        if (channels != self.channels or self.max_frames < block_size) {
+            return error.InvalidFlac;
+        }
+
+        for (0..channels) |channel| {
+            // Side channels need an extra bit.
+            const is_side = switch (channel_assignment) {
+                8, 10 => 1 == channel,
+                9 => 0 == channel,
+                else => false,
+            };
+            const channel_bits = bits_per_sample + @intFromBool(is_side);
+            if (32 < channel_bits) return error.UnsupportedFlac;
+            try self.decodeSubframe(self.decoded[channel * block_size ..][0..block_size], channel_bits);
+        }
+        r.alignToByte();
+        _ = try r.read(16); // CRC-16 of the frame.
+
+        if (8 <= channel_assignment) {
+            const left = self.decoded[0..block_size];
+            const right = self.decoded[block_size..][0..block_size];
+            for (left, right) |*l, *r_| {
+                switch (channel_assignment) {
+                    8 => r_.* = l.* -% r_.*,
+                    9 => l.* = l.* +% r_.*,
+                    10 => {
+                        const side: i64 = r_.*;
+                        const mid = @as(i64, l.*) << 1 | (side & 1);
+                        l.* = @truncate((mid + side) >> 1);
+                        r_.* = @truncate((mid - side) >> 1);
+                    },
+                    else => unreachable,
+                }
+            }
+        }
+
+        const shift: u5 = @intCast(32 - @as(u6, bits_per_sample));
+        const samples = self.decoded[0 .. block_size * channels];
+        if (0 < shift) {
+            for (samples) |*sample| sample.* <<= shift;
+        }
+        self.blocks_decoded += 1;
+        return .{ .frames = block_size, .samples = samples };
+    }
+
+    fn decodeSubframe(self: *Self, samples: []i32, bits_per_sample: u6) !void {
+        const r = &self.reader;
+        if (0 != try r.read(1)) return error.InvalidFlac;
+        const kind = try r.read(6);
+        var wasted_bits: u6 = 0;
+        if (1 == try r.read(1)) {
+            const wasted = try r.readUnary() + 1;
+            if (bits_per_sample <= wasted) return error.InvalidFlac;
+            wasted_bits = @intCast(wasted);
+        }
+        const bits = bits_per_sample - wasted_bits;
+
+        switch (kind) {
+            0 => @memset(samples, try r.readSigned(bits)),
+            1 => for (samples) |*sample| {
+                sample.* = try r.readSigned(bits);
+            },
+            8...12 => {
+                const order: usize = @intCast(kind - 8);
+                if (samples.len < order) return error.InvalidFlac;
+                for (samples[0..order]) |*sample| sample.* = try r.readSigned(bits);
+                try self.decodeResidual(samples, order);
+                predictFixed(samples, order);
+            },
+            32...63 => {
+                const order: usize = @intCast(kind - 31);
+                if (samples.len < order) return error.InvalidFlac;
+                for (samples[0..order]) |*sample| sample.* = try r.readSigned(bits);
+                const precision = try r.read(4) + 1;
+                if (16 == precision) return error.InvalidFlac;
+                const shift = try r.readSigned(5);
+                if (shift < 0) return error.InvalidFlac;
+                var coefficients: [max_lpc_order]i32 = undefined;
+                for (coefficients[0..order]) |*coefficient| {
+                    coefficient.* = try r.readSigned(@intCast(precision));
+                }
+                try self.decodeResidual(samples, order);
+                predictLinear(samples, coefficients[0..order], @intCast(shift));
+            },
+            else => return error.InvalidFlac,
+        }
+
+        if (0 < wasted_bits) {
+            for (samples) |*sample| sample.* <<= @intCast(wasted_bits);
+        }
+    }
+
+    /// Reads the residual, the difference between the samples and their
+    /// predictions, into the samples after the first `order`.
+    fn decodeResidual(self: *Self, samples: []i32, order: usize) !void {
+        const r = &self.reader;
+        const parameter_bits: u6 = switch (try r.read(2)) {
+            0 => 4,
+            1 => 5,
+            else => return error.InvalidFlac,
+        };
+        const escape = (@as(u64, 1) << parameter_bits) - 1;
+        const partition_order: u6 = @intCast(try r.read(4));
+        const partition_size = samples.len >> partition_order;
+        if (partition_size << partition_order != samples.len or partition_size < order) {
+            return error.InvalidFlac;
+        }
+
+        var index = order;
+        for (0..@as(usize, 1) << partition_order) |partition| {
+            const end = (partition + 1) * partition_size;
+            const parameter = try r.read(parameter_bits);
+            if (escape == parameter) {
+                const bits: u6 = @intCast(try r.read(5));
+                for (samples[index..end]) |*sample| sample.* = try r.readSigned(bits);
+            } else {
+                const k: u6 = @intCast(parameter);
+                for (samples[index..end]) |*sample| {
+                    const quotient: u64 = try r.readUnary();
+                    const value: u32 = @truncate(quotient << k | try r.read(k));
+                    // Zigzag encoded.
+                    sample.* = @bitCast((value >> 1) ^ (0 -% (value & 1)));
+                }
+            }
+            index = end;
+        }
+    }
+
+    fn predictFixed(samples: []i32, order: usize) void {
+        for (order..samples.len) |i| {
+            const prediction: i64 = switch (order) {
+                0 => 0,
+                1 => samples[i - 1],
+                2 => 2 * @as(i64, samples[i - 1]) - samples[i - 2],
+                3 => 3 * @as(i64, samples[i - 1]) - 3 * @as(i64, samples[i - 2]) + samples[i - 3],
+                4 => 4 * @as(i64, samples[i - 1]) - 6 * @as(i64, samples[i - 2]) +
+                    4 * @as(i64, samples[i - 3]) - samples[i - 4],
+                else => unreachable,
+            };
+            samples[i] = @truncate(samples[i] + prediction);
+        }
+    }
+
+    fn predictLinear(samples: []i32, coefficients: []const i32, shift: u5) void {
+        for (coefficients.len..samples.len) |i| {
+            var sum: i64 = 0;
+            for (coefficients, 1..) |coefficient, j| {
+                sum +%= @as(i64, coefficient) * samples[i - j];
+            }
+            samples[i] = @truncate(samples[i] +% (sum >> shift));
+        }
+    }
+};
+
+test "FlacDecoder" {
+    const testing = std.testing;
+    // One frame for each channel assignment, all holding the same samples.
+    // The stream info of 16-bit stereo at 44.1 kHz, in blocks of 16 frames.
+    const header = [_]u8{
+        0x66, 0x4c, 0x61, 0x43, 0x80, 0x00, 0x00, 0x22, 0x00, 0x10, 0x00, 0x10,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0xc4, 0x42, 0xf0, 0x00, 0x00,
+        0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    // Fixed order 2 on the left, LPC order 2 on the right.
+    const independent = [_]u8{
+        0xff, 0xf8, 0x60, 0x10, 0x00, 0x0f, 0x65, 0x14, 0x00, 0x00, 0x0d, 0x74,
+        0x02, 0x48, 0x5c, 0x72, 0x21, 0xf1, 0x82, 0xb3, 0x0f, 0x8c, 0x72, 0x24,
+        0x2f, 0x00, 0x10, 0xc0, 0xe4, 0x83, 0xe4, 0x05, 0x68, 0x1f, 0x20, 0xe4,
+        0x90, 0xbb, 0x69, 0x3c, 0x10, 0xad, 0x4e, 0x11, 0x8f, 0x80, 0x52, 0xf2,
+        0x27, 0x26, 0xa8, 0x86, 0xfb, 0xc5, 0x34, 0x55, 0x3d, 0x13, 0xf0, 0x9c,
+        0xca, 0xf0, 0xca, 0xc8, 0xbc, 0x89, 0xc8, 0xbb, 0x9f,
+    };
+    // LPC order 2 on the left, fixed order 1 on the side.
+    const left_side = [_]u8{
+        0xff, 0xf8, 0x60, 0x80, 0x01, 0x0f, 0xd9, 0x42, 0x00, 0x00, 0x0d, 0x74,
+        0xc5, 0xae, 0xe3, 0x00, 0x00, 0x51, 0x94, 0x03, 0x85, 0x01, 0x38, 0x00,
+        0xdd, 0xc0, 0x4e, 0x00, 0xe1, 0x46, 0x50, 0x80, 0x06, 0x4d, 0x0e, 0x0e,
+        0x04, 0xdd, 0x03, 0x75, 0x81, 0x37, 0x43, 0x83, 0x89, 0x04, 0x97, 0x00,
+        0xc5, 0x6b, 0x31, 0x09, 0x44, 0x9f, 0x16, 0xa7, 0x4a, 0xa3, 0xca, 0x32,
+        0x7c, 0x9b, 0xba, 0xfc, 0xd1, 0xe1, 0xe3, 0x01, 0xd8, 0x0f, 0x43, 0xca,
+        0x69, 0x00, 0x24, 0x65,
+    };
+    // Fixed order 3 on the side, verbatim on the right.
+    const side_right = [_]u8{
+        0xff, 0xf8, 0x60, 0x90, 0x02, 0x0f, 0x44, 0x16, 0x09, 0x2e, 0x07, 0x4c,
+        0x84, 0x2e, 0x80, 0x5c, 0x2d, 0x57, 0x56, 0x36, 0x65, 0x25, 0xdd, 0x50,
+        0x94, 0x22, 0x49, 0x1c, 0xe0, 0xcc, 0x0c, 0x4b, 0xc4, 0xc4, 0xc1, 0x01,
+        0x76, 0xd2, 0x78, 0x21, 0x7b, 0xb4, 0x00, 0x96, 0x05, 0x78, 0x09, 0x0b,
+        0x0a, 0x5a, 0x09, 0x0b, 0x05, 0x78, 0x00, 0x96, 0x7b, 0xb4, 0x78, 0x21,
+        0x76, 0xd2, 0x78, 0x21, 0x7b, 0xb4, 0x00, 0x96, 0x00, 0x26, 0xbc,
+    };
+    // Fixed order 2 on the mid channel, LPC order 2 on the side.
+    const mid_side = [_]u8{
+        0xff, 0xf8, 0x60, 0xa0, 0x03, 0x0f, 0xb0, 0x14, 0xf6, 0xd2, 0xfe, 0xdb,
+        0x02, 0x53, 0xe6, 0x56, 0x5d, 0xe3, 0xf9, 0x0d, 0xdc, 0x30, 0x51, 0x49,
+        0xa9, 0xd4, 0x18, 0x26, 0x60, 0xdf, 0x01, 0x4a, 0x06, 0xf8, 0x26, 0x64,
+        0x20, 0x92, 0xe0, 0x74, 0xca, 0xd4, 0xd4, 0x9a, 0x88, 0x05, 0xe7, 0x6a,
+        0x22, 0x53, 0x8a, 0x8c, 0xfe, 0x5d, 0xb6, 0x18, 0xcd, 0x8b, 0xc9, 0x14,
+        0x88, 0xa8, 0x3f, 0x89, 0x58, 0x16, 0x9e, 0x00, 0x0d, 0x8f,
+    };
+    const left = [_]i32{ 0, 3444, 6364, 8315, 9000, 8315, 6364, 3444, 0, -3444, -6364, -8315, -9000, -8315, -6364, -3444 };
+    const right = [_]i32{ -4700, -4030, -2200, 300, 2800, 4630, 5300, 4630, 2800, 300, -2200, -4030, -4700, -4030, -2200, 300 };
+
+    const stream = header ++ independent ++ left_side ++ side_right ++ mid_side;
+    var decoder = try FlacDecoder.init(testing.allocator, &stream);
+    defer decoder.deinit(testing.allocator);
+    try testing.expectEqual(44100, decoder.sample_rate);
+    try testing.expectEqual(2, decoder.channels);
+    try testing.expectEqual(16, decoder.bits_per_sample);
+
+    var expected: [2 * left.len]i32 = undefined;
+    for (left, right, 0..) |l, r, i| {
+        expected[i] = l << 16;
+        expected[left.len + i] = r << 16;
+    }
+    for (0..4) |_| {
+        const block = try decoder.next() orelse return error.TestUnexpectedResult;
+        try testing.expectEqual(left.len, block.frames);
+        try testing.expectEqualSlices(i32, &expected, block.samples);
+    }
+    try testing.expect(null == try decoder.next());
+
+    try testing.expectError(error.InvalidFlac, FlacDecoder.init(testing.allocator, "fLaC"));
+    try testing.expectError(error.InvalidFlac, FlacDecoder.init(testing.allocator, "RIFF"));
+}
+
+/// Decodes WAV files holding integer or floating point PCM a chunk at a time.
+const WavDecoder = struct {
+    const Self = @This();
+
+    data: []const u8,
+    sample_rate: u32,
+    channels: u8,
+    bytes_per_sample: u8,
+    is_float: bool,
+    position: usize,
+    /// The most frames in a chunk.
+    max_frames: usize,
+    /// The samples of each channel of the current chunk, one after another.
+    samples: []i32,
+
+    /// The most samples in a chunk.
+    const chunk_size = 4096;
+
+    const format_pcm = 1;
+    const format_float = 3;
+    const format_extensible = 0xfffe;
+
+    /// Does not take ownership of `bytes`. Deinitialize with `deinit`.
+    fn init(allocator: Allocator, bytes: []const u8) !Self {
+        if (bytes.len < 12 or !mem.eql(u8, bytes[0..4], "RIFF") or
+            !mem.eql(u8, bytes[8..12], "WAVE"))
+        {
+            return error.InvalidWav;
+        }
+
+        var format: ?[]const u8 = null;
+        var data: ?[]const u8 = null;
+        var index: usize = 12;
+        while (8 <= bytes.len - index) {
+            const id = bytes[index..][0..4];
+            const size = mem.readInt(u32, bytes[index + 4 ..][0..4], .little);
+            index += 8;
+            const body = bytes[index..][0..@min(size, bytes.len - index)];
+            if (mem.eql(u8, id, "fmt ")) format = body;
+            if (mem.eql(u8, id, "data")) data = body;
+            // Chunks are padded to an even size.
+            index += @min(body.len + (size & 1), bytes.len - index);
+        }
+
+        const fmt = format orelse return error.InvalidWav;
+        if (fmt.len < 16) return error.InvalidWav;
+        var tag = mem.readInt(u16, fmt[0..2], .little);
+        const channels = mem.readInt(u16, fmt[2..4], .little);
+        const sample_rate = mem.readInt(u32, fmt[4..8], .little);
+        const bits = mem.readInt(u16, fmt[14..16], .little);
+        if (format_extensible == tag) {
+            if (fmt.len < 26) return error.InvalidWav;
+            // The first bytes of the sub-format GUID are the actual tag.
+            tag = mem.readInt(u16, fmt[24..26], .little);
+        }
+
+        const is_float = switch (tag) {
+            format_pcm => false,
+            format_float => true,
+            else => return error.UnsupportedWav,
+        };
+        const valid_bits = if (is_float) 32 == bits else switch (bits) {
+            8, 16, 24, 32 => true,
+            else => false,
+        };
+        if (!valid_bits or 0 == channels or math.maxInt(u8) < channels or 0 == sample_rate) {
+            return error.UnsupportedWav;
+        }
+
+        return .{
+            .data = data orelse return error.InvalidWav,
+            .sample_rate = sample_rate,
+            .channels = @intCast(channels),
+            .bytes_per_sample = @intCast(bits / 8),
+            .is_float = is_float,
+            .position = 0,
+            .max_frames = chunk_size / channels,
+            .samples = try allocator.alloc(i32, chunk_size / channels * channels),
+        };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        allocator.free(self.samples);
+        self.* = undefined;
+    }
+
+    /// Returns the next chunk, or `null` at the end of the data. The samples
+    /// are valid until the next call.
+    fn next(self: *Self) !?NativePlayback.Block {
+        const frame_size = @as(usize, self.bytes_per_sample) * self.channels;
+        const frames = @min((self.data.len - self.position) / frame_size, self.max_frames);
+        if (0 == frames) return null;
+
+        const count = frames * self.channels;
+        const bytes = self.data[self.position..][0 .. count * self.bytes_per_sample];
+        self.position += bytes.len;
+        const samples = self.samples[0..count];
+        for (0..count) |i| {
+            const at = bytes[i * self.bytes_per_sample ..];
+            // The file is interleaved, the chunk is not.
+            samples[i % self.channels * frames + i / self.channels] = switch (self.bytes_per_sample) {
+                // 8-bit samples are unsigned.
+                1 => @as(i32, @as(i8, @bitCast(at[0] ^ 0x80))) << 24,
+                2 => @as(i32, mem.readInt(i16, at[0..2], .little)) << 16,
+                3 => @as(i32, mem.readInt(i24, at[0..3], .little)) << 8,
+                4 => if (self.is_float)
+                    floatToSample(@bitCast(mem.readInt(u32, at[0..4], .little)))
+                else
+                    mem.readInt(i32, at[0..4], .little),
+                else => unreachable,
+            };
+        }
+        return .{ .frames = frames, .samples = samples };
+    }
+
+    fn floatToSample(value: f32) i32 {
+        if (math.isNan(value)) return 0;
+        // In 64 bits, since `maxInt(i32)` rounds up past itself in 32 bits.
+        return @intFromFloat(@as(f64, math.clamp(value, -1.0, 1.0)) * math.maxInt(i32));
+    }
+};
+
+test "WavDecoder" {
+    const testing = std.testing;
+    const le = struct {
+        fn bytes(comptime T: type, comptime value: T) [@sizeOf(T)]u8 {
+            return mem.toBytes(mem.nativeToLittle(T, value));
+        }
+    }.bytes;
+    // Two stereo frames of each format, as they are stored and as they are
+    // decoded.
+    const cases = .{
+        .{ WavDecoder.format_pcm, 8, [_]u8{ 0x00, 0xff, 0x80, 0x81 }, [_]i32{ math.minInt(i32), 0, 0x7f << 24, 1 << 24 } },
+        .{ WavDecoder.format_pcm, 16, [_]u8{ 0x00, 0x80, 0xff, 0x7f, 0x01, 0x00, 0xff, 0xff }, [_]i32{ math.minInt(i32), 1 << 16, 0x7fff << 16, -1 << 16 } },
+        .{ WavDecoder.format_pcm, 24, [_]u8{ 0x56, 0x34, 0x12, 0xfe, 0xff, 0xff, 0x00, 0x00, 0x80, 0xff, 0xff, 0x7f }, [_]i32{ 0x123456 << 8, math.minInt(i32), -2 << 8, 0x7fffff << 8 } },
+        .{ WavDecoder.format_pcm, 32, [_]u8{ 0x00, 0x00, 0x00, 0x80, 0xff, 0xff, 0xff, 0x7f, 0x04, 0x03, 0x02, 0x01, 0xff, 0xff, 0xff, 0xff }, [_]i32{ math.minInt(i32), 0x01020304, math.maxInt(i32), -1 } },
+        // 1, -1, 0.5 and 2, which is clipped.
+        .{ WavDecoder.format_float, 32, [_]u8{ 0x00, 0x00, 0x80, 0x3f, 0x00, 0x00, 0x80, 0xbf, 0x00, 0x00, 0x00, 0x3f, 0x00, 0x00, 0x00, 0x40 }, [_]i32{ math.maxInt(i32), math.maxInt(i32) / 2, -math.maxInt(i32), math.maxInt(i32) } },
+    };
+    inline for (cases) |case| {
+        const tag, const bits, const data, const expected = case;
+        const channels = 2;
+        const block_align = channels * bits / 8;
+        const format = le(u16, tag) ++ le(u16, channels) ++ le(u32, 44100) ++
+            le(u32, 44100 * block_align) ++ le(u16, block_align) ++ le(u16, bits);
+        const bytes = "RIFF" ++ le(u32, 4 + 8 + format.len + 8 + data.len) ++ "WAVE" ++
+            "fmt " ++ le(u32, format.len) ++ format ++ "data" ++ le(u32, data.len) ++ data;
+
+        var decoder = try WavDecoder.init(testing.allocator, bytes);
+        defer decoder.deinit(testing.allocator);
+        try testing.expectEqual(44100, decoder.sample_rate);
+        try testing.expectEqual(channels, decoder.channels);
+        const block = try decoder.next() orelse return error.TestUnexpectedResult;
+        try testing.expectEqual(2, block.frames);
+        try testing.expectEqualSlices(i32, &expected, block.samples);
+        try testing.expect(null == try decoder.next());
+    }
+
+    try testing.expectError(error.InvalidWav, WavDecoder.init(testing.allocator, "RIFF"));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loudness                                                                   //
+////////////////////////////////////////////////////////////////////////////////
+
+/// The loudness of a song, as measured by `LoudnessMeter`.
+const Loudness = struct {
+    /// In LUFS. Negative infinity for songs that are too short or quiet to
+    /// have one.
+    integrated: f32,
+    /// The highest absolute sample value, between 0 and 1.
+    peak: f32,
+
+    const size = 4 + 4;
+    /// The loudness songs are brought to, in LUFS. That of ReplayGain 2.0,
+    /// which mpv and cvlc use for songs that are not measured.
+    const target = -18.0;
+
+    /// Returns the gain in decibels that brings the song to `target`, as far
+    /// as it does not clip, or `null` for songs without a loudness.
+    fn gain(self: Loudness) ?f32 {
+        if (!math.isFinite(self.integrated) or 0 == self.peak) return null;
+        return @min(target - self.integrated, -20 * math.log10(self.peak));
+    }
+
+    fn toBytes(self: Loudness) [size]u8 {
+        var bytes: [size]u8 = undefined;
+        mem.writeInt(u32, bytes[0..4], @bitCast(self.integrated), .little);
+        mem.writeInt(u32, bytes[4..8], @bitCast(self.peak), .little);
+        return bytes;
+    }
+
+    fn fromBytes(bytes: *const [size]u8) Loudness {
+        return .{
+            .integrated = @bitCast(mem.readInt(u32, bytes[0..4], .little)),
+            .peak = @bitCast(mem.readInt(u32, bytes[4..8], .little)),
+        };
+    }
+};
+
+fn decibelsToFactor(decibels: f32) f32 {
+    return math.pow(f32, 10, decibels / 20);
+}
+
+/// Measures the loudness of the songs coming up with `--normalize` (see
+/// `LoudnessMeter`,) on a background thread. On Linux, the thread only gets
+/// processor time and disk bandwidth that nothing else wants, so it never
+/// holds up playback. Only FLAC and WAV files are measured, since they are
+/// the ones that can be decoded natively. The results are cached in the
+/// library index (see `LibraryIndex`.)
+///
+/// Since the songs measured are about to be played, measuring them also reads
+/// them into the page cache.
+const LoudnessAnalyzer = struct {
+    var initialized = false;
+    var allocator: Allocator = undefined;
+
+    var thread: ?Thread = undefined;
+    /// Checked while measuring a song, without holding `mutex`.
+    var stopping = std.atomic.Value(bool).init(false);
+    /// Protects the fields below.
+    var mutex: Thread.Mutex = .{};
+    /// Signaled when `requests` is replaced or when stopping.
+    var condition: Thread.Condition = .{};
+    /// The songs to measure, in order. Replaced by each request.
+    var requests: ArrayListUnmanaged(Request) = undefined;
+    /// The loudness of the songs measured or looked up in this run, keyed by
+    /// their path. Owns its keys. `null` for songs that could not be
+    /// measured, so that they are not tried again.
+    var results: StringHashMapUnmanaged(?Loudness) = undefined;
+    /// Whether there are results in the library index that are not saved.
+    var unsaved: bool = undefined;
+    var last_save_ms: i64 = undefined;
+
+    const Request = struct {
+        /// Owned.
+        path: []u8,
+        format: FileFormat,
+    };
+
+    /// How many songs from the one playing on are measured.
+    const lookahead = 8;
+    /// How often the library index is saved at most while running. It is
+    /// written out whole, and is also saved when exiting.
+    const save_interval_ms = time.ms_per_min;
+
+    /// Requires the library index to be initialized (see `LibraryIndex`.)
+    /// Deinitialize with `deinit`.
+    fn init(allocatorr: Allocator) !void {
+        debug.assert(!initialized);
+
+        allocator = allocatorr;
+        stopping.store(false, .monotonic);
+        requests = ArrayListUnmanaged(Request).empty;
+        results = StringHashMapUnmanaged(?Loudness).empty;
+        unsaved = false;
+        last_save_ms = time.milliTimestamp();
+        thread = null;
+        if (ParsedArguments.normalize) thread = try Thread.spawn(.{}, work, .{});
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        debug.assert(initialized);
+
+        if (thread) |t| {
+            {
+                mutex.lock();
+                defer mutex.unlock();
+                stopping.store(true, .monotonic);
+                condition.signal();
+            }
+            t.join();
+        }
+        // Only a cache, so errors are ignored.
+        if (unsaved) LibraryIndex.save() catch {};
+        freeRequests();
+        requests.deinit(allocator);
+        var iterator = results.keyIterator();
+        while (iterator.next()) |key| allocator.free(key.*);
+        results.deinit(allocator);
+
+        initialized = false;
+    }
+
+    /// Asks for the songs from position `first` in `order` on to be
+    /// measured, superseding earlier requests (see `UpcomingSongs`.) Must be
+    /// called with the playlist protected from changes.
+    fn request(
+        playlist: *const Playlist,
+        order: PlayOrder,
+        next_order: ?PlayOrder,
+        first: usize,
+    ) !void {
+        debug.assert(initialized);
+        if (null == thread) return;
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        freeRequests();
+        var songs = UpcomingSongs{
+            .songs = playlist.songs.slice(),
+            .order = order,
+            .next_order = next_order,
+            .position = first,
+        };
+        var path_buffer: [fs.max_path_bytes]u8 = undefined;
+        for (0..lookahead) |_| {
+            const song = songs.next() orelse break;
+            switch (song.format) {
+                .flac, .wav => {},
+                .mp3, .opus, .vorbis => continue,
+            }
+            const path = try playlist.songPath(song, &path_buffer);
+            if (results.contains(path)) continue;
+
+            const path_copy = try allocator.dupe(u8, path);
+            errdefer allocator.free(path_copy);
+            try requests.append(allocator, .{ .path = path_copy, .format = song.format });
+        }
+        condition.signal();
+    }
+
+    /// Returns the gain in decibels to play the song at `path` with, or
+    /// `null` if it was not measured (yet.) Can be called without
+    /// `--normalize`.
+    fn gain(path: []const u8) ?f32 {
+        debug.assert(initialized);
+        if (null == thread) return null;
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        const loudness = results.get(path) orelse return null;
+        return (loudness orelse return null).gain();
+    }
+
+    fn freeRequests() void {
+        for (requests.items) |r| allocator.free(r.path);
+        requests.clearRetainingCapacity();
+    }
+
+    /// Entry point of the thread.
+    fn work() void {
+        lowerPriority();
+
+        mutex.lock();
+        defer mutex.unlock();
+
+        while (!stopping.load(.monotonic)) {
+            if (0 == requests.items.len) {
+                condition.wait(&mutex);
+                continue;
+            }
+            // The next song first.
+            const next = requests.orderedRemove(0);
+
+            mutex.unlock();
+            const loudness = measureFile(next.path, next.format);
+            mutex.lock();
+
+            // The song may have been requested again while it was measured.
+            const entry = results.getOrPut(allocator, next.path) catch {
+                allocator.free(next.path);
+                continue;
             };
+            if (entry.found_existing) allocator.free(next.path);
+            entry.value_ptr.* = loudness;
+
+            if (0 == requests.items.len and unsaved and
+                save_interval_ms <= time.milliTimestamp() - last_save_ms)
+            {
+                unsaved = false;
+                last_save_ms = time.milliTimestamp();
+                mutex.unlock();
+                defer mutex.lock();
+                LibraryIndex.save() catch {};
+            }
+        }
+    }
 
-            var child = Child.init(&arguments, allocator);
-            // TODO: handle exit code.
-            _ = try child.spawnAndWait();
-        },
+    /// Makes the calling thread only run, and only read from the disk, when
+    /// nothing else wants to. Only on Linux, and disk priorities are only
+    /// honored by some I/O schedulers (i.e. BFQ.)
+    fn lowerPriority() void {
+        if (.linux != builtin.os.tag) return;
+
+        const sched_idle = 5;
+        const priority: c_int = 0;
+        _ = linux.syscall3(.sched_setscheduler, 0, sched_idle, @intFromPtr(&priority));
+
+        const ioprio_who_process = 1;
+        const ioprio_class_idle = 3;
+        const ioprio_class_shift = 13;
+        _ = linux.syscall3(.ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift);
+    }
+
+    /// Returns the loudness of the song, from the library index if it was
+    /// measured before, or `null` if it cannot be measured.
+    fn measureFile(path: []const u8, format: FileFormat) ?Loudness {
+        const file = fs.cwd().openFile(path, .{}) catch return null;
+        defer file.close();
+        const stat = file.stat() catch return null;
+        var key_buffer: [fs.max_path_bytes]u8 = undefined;
+        const key = fs.cwd().realpath(path, &key_buffer) catch return null;
+        if (LibraryIndex.lookupLoudness(key, stat)) |loudness| return loudness;
+
+        if (0 == stat.size) return null;
+        const bytes = posix.mmap(
+            null,
+            stat.size,
+            posix.PROT.READ,
+            .{ .TYPE = .PRIVATE },
+            file.handle,
+            0,
+        ) catch return null;
+        defer posix.munmap(bytes);
+
+        const loudness = switch (format) {
+            .flac => measure(FlacDecoder, bytes),
+            .wav => measure(WavDecoder, bytes),
+            .mp3, .opus, .vorbis => unreachable,
+        } catch return null;
+        LibraryIndex.updateLoudness(key, stat, loudness) catch return loudness;
+        mutex.lock();
+        defer mutex.unlock();
+        unsaved = true;
+        return loudness;
+    }
+
+    /// Helper for `measureFile`. Stops early when stopping.
+    fn measure(comptime Decoder: type, bytes: []const u8) !Loudness {
+        var decoder = try Decoder.init(allocator, bytes);
+        defer decoder.deinit(allocator);
+        var meter = try LoudnessMeter.init(allocator, decoder.sample_rate, decoder.channels);
+        defer meter.deinit(allocator);
+
+        while (try decoder.next()) |block| {
+            if (stopping.load(.monotonic)) return error.Stopped;
+            try meter.process(allocator, block);
+        }
+        return meter.result();
+    }
+};
+
+/// Measures the integrated loudness of a song, as defined by ITU-R BS.1770-4
+/// (which EBU R128 builds on,) along with its sample peak.
+///
+/// The samples are K-weighted (see `KWeighting`,) and the mean square of each
+/// 100 ms step of them is kept. Each four consecutive steps make a block, and
+/// the loudness is that of the blocks above an absolute and a relative gate.
+const LoudnessMeter = struct {
+    const Self = @This();
+
+    channels: u8,
+    /// One for each channel.
+    filters: []KWeighting,
+    step_frames: usize,
+    /// The frames of the current step so far.
+    step_position: usize = 0,
+    /// The weighted sum of squares of the current step so far.
+    step_energy: f64 = 0,
+    /// The mean squares of the last steps, by their number modulo 3.
+    last_steps: [3]f64 = undefined,
+    steps: usize = 0,
+    /// The mean squares of the blocks.
+    blocks: ArrayListUnmanaged(f64) = .empty,
+    peak: f32 = 0,
+
+    /// Blocks quieter than this, in LUFS, are silence.
+    const absolute_gate = -70.0;
+    /// Blocks quieter than this many LU below the loudness of the blocks
+    /// that are not silence are left out too.
+    const relative_gate = -10.0;
+
+    /// Deinitialize with `deinit`.
+    fn init(allocator: Allocator, sample_rate: u32, channels: u8) !Self {
+        const filters = try allocator.alloc(KWeighting, channels);
+        @memset(filters, KWeighting.init(@floatFromInt(sample_rate)));
+        return .{
+            .channels = channels,
+            .filters = filters,
+            .step_frames = @max(1, sample_rate / 10),
+        };
+    }
+
+    fn deinit(self: *Self, allocator: Allocator) void {
+        allocator.free(self.filters);
+        self.blocks.deinit(allocator);
+        self.* = undefined;
+    }
+
+    fn process(self: *Self, allocator: Allocator, block: NativePlayback.Block) !void {
+        var start: usize = 0;
+        while (start < block.frames) {
+            const end = @min(block.frames, start + self.step_frames - self.step_position);
+            for (self.filters, 0..) |*filter, channel| {
+                const samples = block.samples[channel * block.frames ..][start..end];
+                var peak: f32 = self.peak;
+                var energy: f64 = 0;
+                for (samples) |sample| {
+                    const value = @as(f64, @floatFromInt(sample)) * (1.0 / 2147483648.0);
+                    peak = @max(peak, @abs(@as(f32, @floatCast(value))));
+                    const weighted = filter.apply(value);
+                    energy += weighted * weighted;
+                }
+                self.peak = peak;
+                self.step_energy += channelWeight(self.channels, channel) * energy;
+            }
+            self.step_position += end - start;
+            start = end;
+            if (self.step_frames == self.step_position) try self.endStep(allocator);
+        }
+    }
+
+    fn endStep(self: *Self, allocator: Allocator) !void {
+        const energy = self.step_energy / @as(f64, @floatFromInt(self.step_frames));
+        self.step_energy = 0;
+        self.step_position = 0;
+        if (3 <= self.steps) {
+            var block_energy = energy;
+            for (self.last_steps) |step| block_energy += step;
+            try self.blocks.append(allocator, block_energy / 4);
+        }
+        self.last_steps[self.steps % 3] = energy;
+        self.steps += 1;
+    }
+
+    /// The weight of the loudness of each channel. Surround channels count
+    /// more, and the low-frequency effects channel not at all. The channel
+    /// orders are those of FLAC and WAV.
+    fn channelWeight(channels: u8, channel: usize) f64 {
+        return switch (channels) {
+            0...3 => 1.0,
+            4 => if (2 <= channel) 1.41 else 1.0,
+            5 => if (3 <= channel) 1.41 else 1.0,
+            else => switch (channel) {
+                3 => 0.0,
+                0...2 => 1.0,
+                else => 1.41,
+            },
+        };
+    }
+
+    fn result(self: Self) Loudness {
+        const absolute_threshold = energyOf(absolute_gate);
+        const absolute_mean = meanAbove(self.blocks.items, absolute_threshold) orelse
+            return .{ .integrated = -math.inf(f32), .peak = self.peak };
+        const relative_threshold = absolute_mean * math.pow(f64, 10, relative_gate / 10);
+        const threshold = @max(absolute_threshold, relative_threshold);
+        const mean = meanAbove(self.blocks.items, threshold) orelse absolute_mean;
+        return .{ .integrated = @floatCast(loudnessOf(mean)), .peak = self.peak };
+    }
+
+    fn meanAbove(energies: []const f64, threshold: f64) ?f64 {
+        var sum: f64 = 0;
+        var count: usize = 0;
+        for (energies) |energy| {
+            if (energy <= threshold) continue;
+            sum += energy;
+            count += 1;
+        }
+        if (0 == count) return null;
+        return sum / @as(f64, @floatFromInt(count));
+    }
+
+    fn loudnessOf(energy: f64) f64 {
+        return -0.691 + 10 * math.log10(energy);
+    }
+
+    fn energyOf(loudness: f64) f64 {
+        return math.pow(f64, 10, (loudness + 0.691) / 10);
+    }
+};
+
+/// The filter BS.1770 weights samples with before measuring them: a high
+/// shelf, for the effect of the head, followed by a high-pass filter. The
+/// coefficients are derived for each sample rate, like libebur128 does.
+const KWeighting = struct {
+    shelf: Biquad,
+    high_pass: Biquad,
+
+    fn init(sample_rate: f64) KWeighting {
+        const shelf_frequency = 1681.974450955533;
+        const shelf_gain = 3.999843853973347;
+        const shelf_q = 0.7071752369554196;
+        const k = @tan(math.pi * shelf_frequency / sample_rate);
+        const vh = math.pow(f64, 10, shelf_gain / 20);
+        const vb = math.pow(f64, vh, 0.4996667741545416);
+        const a0 = 1 + k / shelf_q + k * k;
+
+        const high_pass_frequency = 38.13547087602444;
+        const high_pass_q = 0.5003270373238773;
+        const kh = @tan(math.pi * high_pass_frequency / sample_rate);
+        const ah0 = 1 + kh / high_pass_q + kh * kh;
+
+        return .{
+            .shelf = .{
+                .b0 = (vh + vb * k / shelf_q + k * k) / a0,
+                .b1 = 2 * (k * k - vh) / a0,
+                .b2 = (vh - vb * k / shelf_q + k * k) / a0,
+                .a1 = 2 * (k * k - 1) / a0,
+                .a2 = (1 - k / shelf_q + k * k) / a0,
+            },
+            .high_pass = .{
+                .b0 = 1,
+                .b1 = -2,
+                .b2 = 1,
+                .a1 = 2 * (kh * kh - 1) / ah0,
+                .a2 = (1 - kh / high_pass_q + kh * kh) / ah0,
+            },
+        };
+    }
+
+    fn apply(self: *KWeighting, sample: f64) f64 {
+        return self.high_pass.apply(self.shelf.apply(sample));
+    }
+
+    /// In transposed direct form II.
+    const Biquad = struct {
+        b0: f64,
+        b1: f64,
+        b2: f64,
+        a1: f64,
+        a2: f64,
+        z1: f64 = 0,
+        z2: f64 = 0,
+
+        fn apply(self: *Biquad, x: f64) f64 {
+            const y = self.b0 * x + self.z1;
+            self.z1 = self.b1 * x - self.a1 * y + self.z2;
+            self.z2 = self.b2 * x - self.a2 * y;
+            return y;
+        }
+    };
+};
+
+test "LoudnessMeter" {
+    const testing = std.testing;
+    // A 1 kHz sine at -20 dBFS on one channel, which BS.1770 puts at about
+    // -23 LUFS.
+    const sample_rate = 48000;
+    var meter = try LoudnessMeter.init(testing.allocator, sample_rate, 1);
+    defer meter.deinit(testing.allocator);
+    var samples: [4096]i32 = undefined;
+    var position: usize = 0;
+    while (position < 3 * sample_rate) : (position += samples.len) {
+        for (&samples, position..) |*sample, i| {
+            const t = @as(f64, @floatFromInt(i)) / sample_rate;
+            sample.* = @intFromFloat(@round(0.1 * @sin(2 * math.pi * 1000 * t) * 2147483648.0));
+        }
+        try meter.process(testing.allocator, .{ .frames = samples.len, .samples = &samples });
     }
+    const loudness = meter.result();
+    try testing.expectApproxEqAbs(-23.0, loudness.integrated, 0.1);
+    try testing.expectApproxEqAbs(0.1, loudness.peak, 1e-3);
+
+    var silent = try LoudnessMeter.init(testing.allocator, sample_rate, 2);
+    defer silent.deinit(testing.allocator);
+    @memset(&samples, 0);
+    for (0..10) |_| {
+        try silent.process(testing.allocator, .{ .frames = samples.len / 2, .samples = &samples });
+    }
+    try testing.expect(math.isNegativeInf(silent.result().integrated));
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// Statistics                                                                 //
+////////////////////////////////////////////////////////////////////////////////
+
+/// Timings and counters of where play-music spends its time, reported with
+/// `--stats` as lines on standard error, and with `--trace` as JSON lines in
+/// a file. Each report is written as it happens. Only built in with
+/// `-Dstats`; otherwise every function here compiles to nothing.
+const Stats = struct {
+    const enabled = build_options.stats;
+
+    var initialized = false;
+    /// Whether anything is reported, i.e. `--stats` or `--trace` was passed.
+    var active = false;
+    /// Started by `init`. Only read afterwards, so it can be used from
+    /// multiple threads.
+    var timer: time.Timer = undefined;
+    var trace: ?File = undefined;
+    var counting_allocator: CountingAllocator = undefined;
+    var counters = EnumArray(Counter, std.atomic.Value(u64)).initFill(std.atomic.Value(u64).init(0));
+    var phase_totals = EnumArray(Phase, std.atomic.Value(u64)).initFill(std.atomic.Value(u64).init(0));
+
+    /// Serializes reports, and protects the fields below.
+    var mutex: Thread.Mutex = .{};
+    /// When the song being started was asked for (see `songRequested`.)
+    var song_requested: ?u64 = null;
+    var song_ended: ?u64 = null;
+
+    const Counter = enum {
+        directories_read,
+        /// Directories whose listing was taken from the library index.
+        directories_cached,
+        /// Songs and subdirectories gone through while scanning, and entries
+        /// of playlist files.
+        entries_scanned,
+        /// Files that are not songs, by their extension or, with `--sniff`,
+        /// their contents.
+        rejected_format,
+        /// Songs rejected by `--match` or `--exclude`.
+        rejected_pattern,
+        /// Songs that no player can play.
+        unplayable,
+        allocations,
+        /// Includes memory that was freed again.
+        allocated_bytes,
+    };
+
+    const Phase = enum {
+        /// Looking for players (see `SoundSystem.init`.)
+        players,
+        patterns,
+        index,
+        /// Loading the songs from directories and playlist files.
+        scan,
+        shuffle,
+    };
+
+    /// What a song count passed to `loaded` was loaded from.
+    const Source = enum { directory, playlist };
+
+    /// A point in time, from `begin`. Empty without `-Dstats`.
+    const Mark = if (enabled) u64 else void;
+
+    /// Requires the command line to be parsed (see `ParsedArguments`.)
+    /// Deinitialize with `deinit`.
+    fn init(stderr: *ConsoleWriter) !void {
+        if (!enabled) return;
+        debug.assert(!initialized);
+
+        timer = try time.Timer.start();
+        trace = null;
+        if (ParsedArguments.trace_path) |path| {
+            trace = fs.cwd().createFile(path, .{}) catch |err| {
+                try stderr.writer().print(
+                    "ERROR: Unable to open trace file ({s}): {s}\n",
+                    .{ @errorName(err), path },
+                );
+                return err;
+            };
+        }
+        active = ParsedArguments.stats or null != trace;
+
+        initialized = true;
+    }
+
+    fn deinit() void {
+        if (!enabled) return;
+        debug.assert(initialized);
+
+        reportTotals();
+        active = false;
+        if (trace) |file| file.close();
+
+        initialized = false;
+    }
+
+    /// Returns an allocator that allocates with `child`, counting what it
+    /// allocates. Only one may be in use.
+    fn countAllocations(child: Allocator) Allocator {
+        counting_allocator = .{ .child = child };
+        return counting_allocator.allocator();
+    }
+
+    fn add(counter: Counter, amount: u64) void {
+        if (!enabled) return;
+        _ = counters.getPtr(counter).fetchAdd(amount, .monotonic);
+    }
+
+    fn begin() Mark {
+        if (!enabled) return {};
+        return if (active) timer.read() else 0;
+    }
+
+    /// Reports the time since `mark` as spent in `phase`.
+    fn end(phase: Phase, mark: Mark) void {
+        if (!enabled or !active) return;
+        const duration = timer.read() -| mark;
+        _ = phase_totals.getPtr(phase).fetchAdd(duration, .monotonic);
+        emit(
+            "Phase '{s}' took {d:.3} ms",
+            .{ @tagName(phase), milliseconds(duration) },
+            "\"event\":\"phase\",\"phase\":\"{s}\",\"ms\":{d:.3}",
+            .{ @tagName(phase), milliseconds(duration) },
+        );
+    }
+
+    /// Like `end`, but only counts the time towards the totals, for phases
+    /// that happen in many small steps.
+    fn accumulate(phase: Phase, mark: Mark) void {
+        if (!enabled or !active) return;
+        _ = phase_totals.getPtr(phase).fetchAdd(timer.read() -| mark, .monotonic);
+    }
+
+    /// Reports that `song_count` songs were loaded from `path` since `mark`.
+    fn loaded(source: Source, path: []const u8, song_count: u64, mark: Mark) void {
+        if (!enabled or !active) return;
+        const duration = milliseconds(timer.read() -| mark);
+        emit(
+            "Loaded {d} song(s) in {d:.3} ms from {s}: {s}",
+            .{ song_count, duration, @tagName(source), path },
+            "\"event\":\"{s}\",\"path\":{},\"songs\":{d},\"ms\":{d:.3}",
+            .{ @tagName(source), json.fmt(path, .{}), song_count, duration },
+        );
+    }
+
+    /// Called by `SoundSystem.playSong` when it is about to play a song.
+    fn songRequested() void {
+        if (!enabled or !active) return;
+        mutex.lock();
+        defer mutex.unlock();
+        song_requested = timer.read();
+    }
+
+    /// Called when a song starts playing: when a player is started for it,
+    /// when mpv starts playing it, or when its first samples are written to
+    /// the sound card natively. Reports how long it took since it was
+    /// requested, which for players that are started for each song includes
+    /// starting them, and how long there was no song playing.
+    fn songStarted() void {
+        if (!enabled or !active) return;
+        const now = timer.read();
+        mutex.lock();
+        const requested = song_requested orelse now;
+        const ended = song_ended;
+        mutex.unlock();
+
+        const start = milliseconds(now -| requested);
+        const gap = if (ended) |e| milliseconds(now -| e) else null;
+        if (gap) |g| {
+            emit(
+                "Song started in {d:.3} ms, {d:.3} ms after the last one ended",
+                .{ start, g },
+                "\"event\":\"song\",\"start_ms\":{d:.3},\"gap_ms\":{d:.3}",
+                .{ start, g },
+            );
+        } else {
+            emit(
+                "First song started in {d:.3} ms, {d:.3} ms after starting up",
+                .{ start, milliseconds(now) },
+                "\"event\":\"song\",\"start_ms\":{d:.3},\"gap_ms\":null",
+                .{start},
+            );
+        }
+    }
+
+    /// Called when a song stops playing, at the same points `songStarted`
+    /// is.
+    fn songEnded() void {
+        if (!enabled or !active) return;
+        mutex.lock();
+        defer mutex.unlock();
+        song_ended = timer.read();
+    }
+
+    /// Reports the counters, and the time spent in each phase so far.
+    fn reportTotals() void {
+        if (!enabled or !active) return;
+        var human_buffer: [1024]u8 = undefined;
+        var json_buffer: [1024]u8 = undefined;
+        var human_stream = io.fixedBufferStream(&human_buffer);
+        var json_stream = io.fixedBufferStream(&json_buffer);
+        const human_writer = human_stream.writer();
+        const json_writer = json_stream.writer();
+
+        human_writer.writeAll("Totals:") catch return;
+        json_writer.writeAll("\"event\":\"totals\"") catch return;
+        for (std.enums.values(Counter)) |counter| {
+            const value = counters.getPtrConst(counter).load(.monotonic);
+            human_writer.print(" {s}={d}", .{ @tagName(counter), value }) catch return;
+            json_writer.print(",\"{s}\":{d}", .{ @tagName(counter), value }) catch return;
+        }
+        for (std.enums.values(Phase)) |phase| {
+            const duration = milliseconds(phase_totals.getPtrConst(phase).load(.monotonic));
+            human_writer.print(" {s}={d:.3}ms", .{ @tagName(phase), duration }) catch return;
+            json_writer.print(",\"{s}_ms\":{d:.3}", .{ @tagName(phase), duration }) catch return;
+        }
+        write(human_stream.getWritten(), json_stream.getWritten());
+    }
+
+    fn milliseconds(nanoseconds: u64) f64 {
+        return @as(f64, @floatFromInt(nanoseconds)) / time.ns_per_ms;
+    }
+
+    /// Reports an event, as a line for `--stats` and as the fields of a JSON
+    /// object for `--trace`.
+    fn emit(
+        comptime human_format: []const u8,
+        human_arguments: anytype,
+        comptime json_format: []const u8,
+        json_arguments: anytype,
+    ) void {
+        var human_buffer: [line_size]u8 = undefined;
+        var json_buffer: [line_size]u8 = undefined;
+        const human = std.fmt.bufPrint(&human_buffer, human_format, human_arguments) catch return;
+        const json_fields = std.fmt.bufPrint(&json_buffer, json_format, json_arguments) catch return;
+        write(human, json_fields);
+    }
+
+    /// Enough for reports naming a path, even with escapes in JSON.
+    const line_size = 2 * fs.max_path_bytes;
+
+    /// Each line is written at once, so that lines from multiple threads, and
+    /// from the rest of the program, are not mixed up. Lines on standard
+    /// error go through `EventLog` like the rest of the output.
+    fn write(human: []const u8, json_fields: []const u8) void {
+        var buffer: [line_size + 64]u8 = undefined;
+        mutex.lock();
+        defer mutex.unlock();
+
+        if (ParsedArguments.stats) {
+            if (std.fmt.bufPrint(&buffer, "STATS: {s}\n", .{human})) |line| {
+                EventLog.append(.stderr, line);
+            } else |_| {}
+        }
+        if (trace) |file| {
+            const at = milliseconds(timer.read());
+            if (std.fmt.bufPrint(&buffer, "{{\"at_ms\":{d:.3},{s}}}\n", .{ at, json_fields })) |line| {
+                file.writeAll(line) catch {};
+            } else |_| {}
+        }
+    }
+
+    /// Counts the allocations made through `child` (see
+    /// `Counter.allocations`.)
+    const CountingAllocator = struct {
+        child: Allocator,
+
+        fn allocator(self: *CountingAllocator) Allocator {
+            return .{
+                .ptr = self,
+                .vtable = &.{
+                    .alloc = alloc,
+                    .resize = resize,
+                    .remap = remap,
+                    .free = free,
+                },
+            };
+        }
+
+        fn alloc(
+            context: *anyopaque,
+            length: usize,
+            alignment: mem.Alignment,
+            return_address: usize,
+        ) ?[*]u8 {
+            const self: *CountingAllocator = @ptrCast(@alignCast(context));
+            const memory = self.child.rawAlloc(length, alignment, return_address) orelse return null;
+            add(.allocations, 1);
+            add(.allocated_bytes, length);
+            return memory;
+        }
+
+        fn resize(
+            context: *anyopaque,
+            memory: []u8,
+            alignment: mem.Alignment,
+            new_length: usize,
+            return_address: usize,
+        ) bool {
+            const self: *CountingAllocator = @ptrCast(@alignCast(context));
+            if (!self.child.rawResize(memory, alignment, new_length, return_address)) return false;
+            add(.allocated_bytes, new_length -| memory.len);
+            return true;
+        }
+
+        fn remap(
+            context: *anyopaque,
+            memory: []u8,
+            alignment: mem.Alignment,
+            new_length: usize,
+            return_address: usize,
+        ) ?[*]u8 {
+            const self: *CountingAllocator = @ptrCast(@alignCast(context));
+            const remapped = self.child.rawRemap(memory, alignment, new_length, return_address) orelse return null;
+            add(.allocated_bytes, new_length -| memory.len);
+            return remapped;
+        }
+
+        fn free(
+            context: *anyopaque,
+            memory: []u8,
+            alignment: mem.Alignment,
+            return_address: usize,
+        ) void {
+            const self: *CountingAllocator = @ptrCast(@alignCast(context));
+            self.child.rawFree(memory, alignment, return_address);
+        }
+    };
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks                                                                 //
+////////////////////////////////////////////////////////////////////////////////
+
+/// The benchmarks run by `zig build bench`, which builds the program with
+/// `build_options.bench` set. Each case is run once to warm up and then
+/// `repetitions` times, and the median and fastest times are printed. Inputs
+/// are generated from fixed seeds, so that runs are comparable.
+///
+/// The names of the benchmarks to run may be passed, as in
+/// `zig build bench -- scan regex`; all of them are run otherwise.
+const Benchmarks = struct {
+    const repetitions = 5;
+    const seed = 0x706c61792d6d7573;
+
+    const Benchmark = enum { scan, regex, playlist, strategies };
+
+    /// The synthetic trees scanned, put in `$TMPDIR/play-music-bench`. They
+    /// are kept between runs, since creating them takes far longer than
+    /// scanning them.
+    const scan_file_counts = [_]usize{ 1_000, 100_000, 1_000_000 };
+    const files_per_directory = 250;
+    const regex_name_count = 100_000;
+    const playlist_song_count = 1_000_000;
+    /// The song that the play strategies play, which is silent.
+    const silence_sample_rate = 44100;
+    const silence_frames = silence_sample_rate / 4;
+
+    /// Representative `--match` patterns, matched like them (see
+    /// `regex_match_config`.)
+    const patterns = [_][]const u8{
+        "radiohead",
+        "live|remix|demo|acoustic",
+        "(disc|cd) *[123456789]",
+        "love.*you",
+        "portishead|burial|massive attack|boards of canada|aphex twin|" ++
+            "autechre|bjork|the knife|four tet|caribou|jon hopkins|" ++
+            "bonobo|moderat|apparat|kiasmos",
+    };
+    const artists = [_][]const u8{
+        "Radiohead",  "Portishead", "Burial",   "The Knife",  "Four Tet",
+        "Aphex Twin", "Caribou",    "Autechre", "Bonobo",     "Kiasmos",
+        "Bjork",      "Moderat",    "Apparat",  "Jon Hopkins", "Massive Attack",
+    };
+    const words = [_][]const u8{
+        "Love",  "You",   "Night", "Live",   "Remix", "Demo", "Disc 2",
+        "River", "Glass", "Light", "Stereo", "Cd1",   "Dawn", "Acoustic",
+    };
+    /// The file extensions of the generated files, including some that are
+    /// not songs.
+    const extensions = [_][]const u8{
+        ".flac", ".mp3", ".ogg", ".opus", ".wav",
+        ".jpg",  ".flac", ".mp3", ".txt", ".flac",
+    };
+
+    /// Entry point of `zig build bench`.
+    fn run() !void {
+        // Output is written right away, without `EventLog`.
+        var stderr = ConsoleWriter{ .stream = .stderr };
+        defer stderr.flush() catch {};
+        var stdout = ConsoleWriter{ .stream = .stdout };
+        defer stdout.flush() catch {};
+
+        var gpa = GeneralPurposeAllocator(.{}){};
+        const allocator = gpa.allocator();
+        defer _ = gpa.deinit();
+
+        var selected = EnumSet(Benchmark).initEmpty();
+        var arguments = try process.argsWithAllocator(allocator);
+        defer arguments.deinit();
+        _ = arguments.next();
+        while (arguments.next()) |argument| {
+            const benchmark = std.meta.stringToEnum(Benchmark, argument) orelse {
+                try stderr.writer().print(
+                    "ERROR: Unknown benchmark '{s}', expected 'scan', 'regex', 'playlist' or 'strategies'\n",
+                    .{argument},
+                );
+                return error.UnknownBenchmark;
+            };
+            selected.insert(benchmark);
+        }
+        if (0 == selected.count()) selected = EnumSet(Benchmark).initFull();
+
+        // Results must not depend on earlier runs or the machine's players.
+        ParsedArguments.initDefaults(allocator);
+        defer ParsedArguments.deinit();
+        ParsedArguments.cache = false;
+        ParsedArguments.recursive = true;
+        try LibraryIndex.init(allocator);
+        defer LibraryIndex.deinit();
+        try LoudnessAnalyzer.init(allocator);
+        defer LoudnessAnalyzer.deinit();
+
+        const base = try fs.path.join(
+            allocator,
+            &.{ posix.getenv("TMPDIR") orelse "/tmp", "play-music-bench" },
+        );
+        defer allocator.free(base);
+
+        {
+            try SoundSystem.initWithStrategy(allocator, skipPlayStrategy);
+            defer SoundSystem.deinit();
+            if (selected.contains(.scan)) try benchmarkScan(allocator, &stderr, &stdout, base);
+            if (selected.contains(.regex)) try benchmarkRegex(allocator, &stdout);
+            if (selected.contains(.playlist)) try benchmarkPlaylist(allocator, &stdout);
+        }
+        if (selected.contains(.strategies)) {
+            try SoundSystem.init(allocator);
+            defer SoundSystem.deinit();
+            try benchmarkStrategies(allocator, &stdout, base);
+        }
+    }
+
+    /// Runs `function` with `arguments`, which returns a value that is kept
+    /// from being optimized away, and prints how long it takes and how many
+    /// `unit`s it handles per second, given that it handles `count` of them.
+    fn measure(
+        stdout: *ConsoleWriter,
+        name: []const u8,
+        count: usize,
+        unit: []const u8,
+        comptime function: anytype,
+        arguments: anytype,
+    ) !void {
+        mem.doNotOptimizeAway(try @call(.auto, function, arguments));
+        var samples: [repetitions]u64 = undefined;
+        for (&samples) |*sample| {
+            var timer = try time.Timer.start();
+            mem.doNotOptimizeAway(try @call(.auto, function, arguments));
+            sample.* = timer.read();
+        }
+        mem.sort(u64, &samples, {}, std.sort.asc(u64));
+
+        const median = samples[repetitions / 2];
+        const per_second = @as(f64, @floatFromInt(count)) /
+            (@as(f64, @floatFromInt(@max(median, 1))) / time.ns_per_s);
+        try stdout.writer().print(
+            "{s:<40} {d:>10.3} ms median {d:>10.3} ms min {d:>14.0} {s}/s\n",
+            .{ name, milliseconds(median), milliseconds(samples[0]), per_second, unit },
+        );
+        try stdout.flush();
+    }
+
+    fn milliseconds(nanoseconds: u64) f64 {
+        return @as(f64, @floatFromInt(nanoseconds)) / time.ns_per_ms;
+    }
+
+    fn skipPlayStrategy(
+        allocator: Allocator,
+        path: []const u8,
+        format: FileFormat,
+    ) PlayStrategyError!bool {
+        _ = allocator;
+        _ = path;
+        _ = format;
+        return true;
+    }
+
+    /// Writes the name of the `index`th generated song to `buffer`.
+    fn songName(buffer: []u8, index: usize) ![]u8 {
+        return std.fmt.bufPrint(buffer, "{d:0>7} - {s} - {s} {d}{s}", .{
+            index,
+            artists[index % artists.len],
+            words[(index / artists.len) % words.len],
+            index % 1000,
+            extensions[index % extensions.len],
+        });
+    }
+
+    // Directory scanning.
+
+    fn benchmarkScan(
+        allocator: Allocator,
+        stderr: *ConsoleWriter,
+        stdout: *ConsoleWriter,
+        base: []const u8,
+    ) !void {
+        for (scan_file_counts) |file_count| {
+            var count_buffer: [32]u8 = undefined;
+            const count_name = try std.fmt.bufPrint(&count_buffer, "{d}", .{file_count});
+            const path = try fs.path.join(allocator, &.{ base, "tree", count_name });
+            defer allocator.free(path);
+            try makeTree(stdout, path, file_count);
+
+            var name_buffer: [64]u8 = undefined;
+            try measure(
+                stdout,
+                try std.fmt.bufPrint(&name_buffer, "scan/{d} files", .{file_count}),
+                file_count,
+                "files",
+                scanTree,
+                .{ allocator, stderr, path },
+            );
+        }
+    }
+
+    /// Creates `file_count` empty files in directories of
+    /// `files_per_directory` under `path`, unless an earlier run did.
+    fn makeTree(stdout: *ConsoleWriter, path: []const u8, file_count: usize) !void {
+        const complete_name = ".complete";
+        var directory = try fs.cwd().makeOpenPath(path, .{});
+        defer directory.close();
+        if (directory.access(complete_name, .{})) |_| return else |_| {}
+
+        try stdout.writer().print("INFO: Creating {d} files in: {s}\n", .{ file_count, path });
+        try stdout.flush();
+        var name_buffer: [128]u8 = undefined;
+        const directory_count = math.divCeil(usize, file_count, files_per_directory) catch unreachable;
+        for (0..directory_count) |directory_index| {
+            var subdirectory_buffer: [32]u8 = undefined;
+            const subdirectory_path = try std.fmt.bufPrint(
+                &subdirectory_buffer,
+                "{d:0>3}/{d:0>3}",
+                .{ directory_index / 64, directory_index % 64 },
+            );
+            var subdirectory = try directory.makeOpenPath(subdirectory_path, .{});
+            defer subdirectory.close();
+
+            const first = directory_index * files_per_directory;
+            for (first..@min(first + files_per_directory, file_count)) |index| {
+                const file = try subdirectory.createFile(try songName(&name_buffer, index), .{});
+                file.close();
+            }
+        }
+        const complete = try directory.createFile(complete_name, .{});
+        complete.close();
+    }
+
+    fn scanTree(allocator: Allocator, stderr: *ConsoleWriter, path: []const u8) !u64 {
+        var playlist = Playlist.init(allocator);
+        defer playlist.deinit();
+        return Scanner.run(&playlist, stderr, null, path, null);
+    }
+
+    // Regular expressions.
+
+    fn benchmarkRegex(allocator: Allocator, stdout: *ConsoleWriter) !void {
+        var strings = ArrayListUnmanaged(u8).empty;
+        defer strings.deinit(allocator);
+        const ends = try allocator.alloc(usize, regex_name_count);
+        defer allocator.free(ends);
+        var name_buffer: [128]u8 = undefined;
+        for (ends, 0..) |*end, index| {
+            try strings.appendSlice(allocator, try songName(&name_buffer, index));
+            end.* = strings.items.len;
+        }
+        const names = try allocator.alloc([]const u8, regex_name_count);
+        defer allocator.free(names);
+        for (names, ends, 0..) |*name, end, index| {
+            name.* = strings.items[if (0 == index) 0 else ends[index - 1]..end];
+        }
+
+        for (patterns) |pattern| {
+            const regex = try Regex.compile(allocator, pattern);
+            defer regex.deinit();
+            var case_buffer: [64]u8 = undefined;
+            const shown = pattern[0..@min(pattern.len, 24)];
+            try measure(
+                stdout,
+                try std.fmt.bufPrint(&case_buffer, "regex/match '{s}'", .{shown}),
+                names.len,
+                "names",
+                matchNames,
+                .{ regex, names },
+            );
+            try measure(
+                stdout,
+                try std.fmt.bufPrint(&case_buffer, "regex/matchCached '{s}'", .{shown}),
+                names.len,
+                "names",
+                matchNamesCached,
+                .{ allocator, regex, names },
+            );
+        }
+    }
+
+    fn matchNames(regex: Regex, names: []const []const u8) !u64 {
+        var matched: u64 = 0;
+        for (names) |name| {
+            if (regex.match(regex_match_config, name)) matched += 1;
+        }
+        return matched;
+    }
+
+    /// Includes building the DFA, like each scan does.
+    fn matchNamesCached(allocator: Allocator, regex: Regex, names: []const []const u8) !u64 {
+        var cache = regex.initCache(regex_match_config, Regex.Cache.default_max_states);
+        defer cache.deinit(allocator);
+        var matched: u64 = 0;
+        for (names) |name| {
+            if (regex.matchCached(&cache, name)) matched += 1;
+        }
+        return matched;
+    }
+
+    // Playlists.
+
+    fn benchmarkPlaylist(allocator: Allocator, stdout: *ConsoleWriter) !void {
+        var playlist = Playlist.init(allocator);
+        defer playlist.deinit();
+        var name_buffer: [128]u8 = undefined;
+        var directory_index: u32 = undefined;
+        for (0..playlist_song_count) |index| {
+            if (0 == index % files_per_directory) {
+                var directory_buffer: [64]u8 = undefined;
+                directory_index = try playlist.appendDirectory(try std.fmt.bufPrint(
+                    &directory_buffer,
+                    "/music/{d:0>3}/{d:0>3}",
+                    .{ index / files_per_directory / 64, index / files_per_directory % 64 },
+                ));
+            }
+            const name = try songName(&name_buffer, index);
+            const format = FileFormat.fromFile(name) orelse .flac;
+            try playlist.appendSongTo(directory_index, name, .{}, format);
+        }
+
+        var prng = RandomPrng.init(seed);
+        try measure(stdout, "playlist/order", playlist_song_count, "songs", iterateOrder, .{
+            &playlist,
+            null,
+        });
+        try measure(stdout, "playlist/order shuffled", playlist_song_count, "songs", iterateOrder, .{
+            &playlist,
+            prng.random(),
+        });
+        try measure(stdout, "playlist/paths shuffled", playlist_song_count, "songs", iteratePaths, .{
+            &playlist,
+            prng.random(),
+        });
+        try measure(stdout, "playlist/stream shuffled", playlist_song_count, "songs", shuffleFeed, .{
+            &playlist,
+            prng.random(),
+        });
+    }
+
+    /// Goes through a cycle of play, like `main`.
+    fn iterateOrder(playlist: *const Playlist, random: ?Random) !u64 {
+        const songs = playlist.songs.slice();
+        const formats = songs.items(.format);
+        const order = PlayOrder.init(songs.len, random);
+        var checksum: u64 = 0;
+        for (0..songs.len) |position| {
+            checksum +%= @intFromEnum(formats[order.at(position)]);
+        }
+        return checksum;
+    }
+
+    fn iteratePaths(playlist: *const Playlist, random: ?Random) !u64 {
+        const songs = playlist.songs.slice();
+        const order = PlayOrder.init(songs.len, random);
+        var path_buffer: [fs.max_path_bytes]u8 = undefined;
+        var checksum: u64 = 0;
+        for (0..songs.len) |position| {
+            checksum +%= (try playlist.songPath(songs.get(order.at(position)), &path_buffer)).len;
+        }
+        return checksum;
+    }
+
+    /// Shuffles the indices of the songs into a feed, as `--stream` does.
+    fn shuffleFeed(playlist: *Playlist, random: Random) !u64 {
+        var feed = PlaylistFeed{ .playlist = playlist, .random = random };
+        defer feed.deinit();
+        try feed.appended(0);
+        return feed.indices.items[0];
+    }
+
+    // Play strategies.
+
+    fn benchmarkStrategies(
+        allocator: Allocator,
+        stdout: *ConsoleWriter,
+        base: []const u8,
+    ) !void {
+        try fs.cwd().makePath(base);
+        const path = try fs.path.join(allocator, &.{ base, "silence.wav" });
+        defer allocator.free(path);
+        try writeSilence(path);
+        const duration_ns = silence_frames * time.ns_per_s / silence_sample_rate;
+
+        const Candidate = struct { name: []const u8, strategy: PlayStrategy, available: bool };
+        const candidates = [_]Candidate{
+            .{ .name = "native", .strategy = nativePlayStrategy, .available = NativePlayback.initialized },
+            .{ .name = "mpv-ipc", .strategy = mpvIpcPlayStrategy, .available = MpvIpc.initialized },
+            .{ .name = "mpv", .strategy = mpvPlayStrategy, .available = Programs.isAvailable(.mpv) },
+            .{ .name = "cvlc", .strategy = cvlcPlayStrategy, .available = Programs.isAvailable(.cvlc) },
+        };
+        for (candidates) |candidate| {
+            if (!candidate.available) {
+                try stdout.writer().print("strategy/{s:<31} unavailable\n", .{candidate.name});
+                continue;
+            }
+
+            // The first song includes starting the player and opening the
+            // sound card, the rest are transitions from the last one.
+            var samples: [repetitions + 1]u64 = undefined;
+            const played = for (&samples) |*sample| {
+                var timer = try time.Timer.start();
+                const song_played = try candidate.strategy(allocator, path, .wav);
+                // Native playback returns once the song is decoded, and mpv
+                // shortly before the end of it, and they keep the sound card
+                // busy until then.
+                if (NativePlayback.initialized) NativePlayback.drain();
+                if (MpvIpc.initialized) try MpvIpc.drain();
+                if (!song_played) break false;
+                sample.* = timer.read() -| duration_ns;
+            } else true;
+            if (!played) {
+                try stdout.writer().print("strategy/{s:<31} failed\n", .{candidate.name});
+                continue;
+            }
+            const transitions = samples[1..];
+            mem.sort(u64, transitions, {}, std.sort.asc(u64));
+            try stdout.writer().print(
+                "strategy/{s:<31} {d:>10.3} ms first  {d:>10.3} ms median {d:>10.3} ms min\n",
+                .{
+                    candidate.name,
+                    milliseconds(samples[0]),
+                    milliseconds(transitions[transitions.len / 2]),
+                    milliseconds(transitions[0]),
+                },
+            );
+            try stdout.flush();
+        }
+    }
+
+    /// Writes a short silent WAV file, 16-bit stereo.
+    fn writeSilence(path: []const u8) !void {
+        const file = try fs.cwd().createFile(path, .{});
+        defer file.close();
+        var buffered_writer = bufferedFileWriter(file.writer());
+        const writer = buffered_writer.writer();
+        const block_align = 2 * 2;
+        const data_size: u32 = silence_frames * block_align;
+        try writer.writeAll("RIFF");
+        try writer.writeInt(u32, 36 + data_size, .little);
+        try writer.writeAll("WAVEfmt ");
+        try writer.writeInt(u32, 16, .little);
+        try writer.writeInt(u16, 1, .little); // PCM.
+        try writer.writeInt(u16, 2, .little);
+        try writer.writeInt(u32, silence_sample_rate, .little);
+        try writer.writeInt(u32, silence_sample_rate * block_align, .little);
+        try writer.writeInt(u16, block_align, .little);
+        try writer.writeInt(u16, 16, .little);
+        try writer.writeAll("data");
+        try writer.writeInt(u32, data_size, .little);
+        try writer.writeByteNTimes(0, data_size);
+        try buffered_writer.flush();
+    }
+};
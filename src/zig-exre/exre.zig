@@ -16,13 +16,23 @@ pub const RegexMatchConfig = struct {
 };
 
 pub const RegexTypeConfig = struct {
-    state_bits: u8 = 64,
+    state_bits: u16 = 64,
 };
 
+/// The most states an expression may have. Expressions are compiled with this
+/// many state bits first, and narrowed to the configured amount once
+/// redundant states are removed.
+pub const max_state_bits = 1024;
+const WideT = @Type(.{ .int = .{ .bits = max_state_bits, .signedness = .unsigned } });
+
+/// The most expressions that can be compiled into one set.
+pub const max_set_patterns = 64;
+
 pub fn Regex(comptime cfg: RegexTypeConfig) type {
     const RU = RegexUnmanaged(cfg);
     return struct {
         const Self = @This();
+        pub const Cache = RU.Cache;
 
         alloc: mem.Allocator,
         r: RU,
@@ -34,6 +44,13 @@ pub fn Regex(comptime cfg: RegexTypeConfig) type {
             };
         }
 
+        pub fn compileSet(a: mem.Allocator, rexs: []const []const u8) !Self {
+            return .{
+                .alloc = a,
+                .r = try RU.compileSet(a, rexs),
+            };
+        }
+
         pub fn deinit(self: Self) void {
             self.r.deinit(self.alloc);
         }
@@ -42,6 +59,18 @@ pub fn Regex(comptime cfg: RegexTypeConfig) type {
             return self.r.match(c, str);
         }
 
+        pub fn matchCached(self: Self, cache: *Cache, str: []const u8) bool {
+            return self.r.matchCached(self.alloc, cache, str);
+        }
+
+        pub fn matchSet(self: Self, c: RegexMatchConfig, str: []const u8) u64 {
+            return self.r.matchSet(c, str);
+        }
+
+        pub fn matchSetCached(self: Self, cache: *Cache, str: []const u8) u64 {
+            return self.r.matchSetCached(self.alloc, cache, str);
+        }
+
         pub fn dumpDot(self: Self, writer: anytype) !void {
             try self.r.dumpDot(writer);
         }
@@ -50,141 +79,432 @@ pub fn Regex(comptime cfg: RegexTypeConfig) type {
 
 pub fn RegexUnmanaged(comptime cfg: RegexTypeConfig) type {
     if (cfg.state_bits <= 2) @compileError("At least 3 bits are required.");
+    if (cfg.state_bits > max_state_bits) @compileError("At most 1024 bits are supported.");
     // Integer type that encodes states as a bitfield.
     const T = @Type(.{ .int = .{ .bits = cfg.state_bits, .signedness = .unsigned } });
     return struct {
         const Self = @This();
+        pub const state_bits = cfg.state_bits;
 
         /// The first bit is hardcoded as the start/entry state. The last
-        /// state is hardcoded as the final/exit state.
+        /// state is hardcoded as the final/exit state. With compileSet(),
+        /// the states below it are the exit states of the other expressions,
+        /// in order.
         const start_state = 1;
         const end_state = 1 << (cfg.state_bits - 1);
         const empty_state = 0;
 
-        /// Rules. Behold: Two possible values for when are reserved: 0
-        /// is for always actionable rules and 1 is for matching any one
-        /// literal except for newlines.
+        /// Rules. Behold: One possible value for when is reserved: 0 is for
+        /// always actionable rules. The `.` selector is compiled to rules
+        /// for the bytes of UTF-8 encoded codepoints.
         from: []T,
         to: []T,
         when: []u8,
 
-        pub fn compile(a: mem.Allocator, rex: []const u8) !Self {
-            var cmp = try Compiler(T).new(a);
-            defer cmp.deinit(a);
-
-            var it = Tokenizer.from(rex);
-            while (try it.next()) |token| {
-                switch (token) {
-                    .literal => |l| try cmp.addLiteral(a, l),
-                    .multibyte_literal => |l| try cmp.addMultiByteLiteral(a, l),
-                    .literal_array => |ar| try cmp.addLiteralArray(a, ar),
-                    .modifier => |m| try cmp.addModifier(a, m),
-                    .@"or" => try cmp.addOr(a),
-                    .open_block => try cmp.openSubblock(a),
-                    .close_block => try cmp.closeSubblock(a),
+        /// The rules, except for always actionable rules, indexed by input
+        /// byte. Derived from the rules in compile().
+        tables: *const Tables,
+
+        const Tables = struct {
+            exact: ByteTable,
+            /// For matching with `.case = .ignore`. Built from lowercase
+            /// rules and indexed by lowercase input.
+            folded: ByteTable,
+            /// The exit states of all expressions.
+            ends: T,
+            /// The amount of expressions.
+            patterns: u8,
+            /// `closure[i]` holds the states reachable from state bit `i`
+            /// through always actionable rules alone, including the state
+            /// itself.
+            closure: [cfg.state_bits]T,
+            /// One for each expression.
+            literals: []Literal,
+        };
+
+        const Literal = struct {
+            /// Bytes every string matching the expression contains in this
+            /// order, or an empty string if none are known (see
+            /// requiredLiteral().)
+            exact: []u8,
+            /// `exact` with ASCII letters lowercased.
+            folded: []u8,
+        };
+
+        /// `sources[b]` holds the states that have a rule matching byte `b`.
+        /// The states reached from them are in `targets`, starting at
+        /// `offsets[b]`, with one entry for each bit set in `sources[b]` in
+        /// ascending order. Stepping over a byte then takes a few bitwise
+        /// operations per active state, rather than a pass over all rules.
+        const ByteTable = struct {
+            sources: [256]T,
+            offsets: [256]u32,
+            targets: []T,
+
+            fn build(a: mem.Allocator, from: []const T, to: []const T, when: []const u8, fold: bool) !ByteTable {
+                var table: ByteTable = .{
+                    .sources = undefined,
+                    .offsets = undefined,
+                    .targets = undefined,
+                };
+                var targets: std.ArrayListUnmanaged(T) = .{};
+                errdefer targets.deinit(a);
+
+                var by_source: [cfg.state_bits]T = undefined;
+                for (0..256) |b| {
+                    const byte: u8 = @intCast(b);
+                    @memset(&by_source, empty_state);
+                    var sources: T = empty_state;
+                    for (from, to, when) |f, t, _w| {
+                        const w = if (fold) foldCase(_w) else _w;
+                        if (w == 0 or w != byte) continue;
+                        sources |= f;
+                        var bits = f;
+                        while (bits > 0) : (bits &= bits - 1) by_source[@ctz(bits)] |= t;
+                    }
+
+                    table.sources[b] = sources;
+                    table.offsets[b] = @intCast(targets.items.len);
+                    var bits = sources;
+                    while (bits > 0) : (bits &= bits - 1) try targets.append(a, by_source[@ctz(bits)]);
                 }
+
+                table.targets = try targets.toOwnedSlice(a);
+                return table;
+            }
+        };
+
+        /// A lazily built DFA for matchCached(), for one match
+        /// configuration. Each DFA state is a set of states of the rules as
+        /// reached by match(), and its transitions are only worked out the
+        /// first time they are taken. Once `max_states` sets are known the
+        /// cache is cleared and built up again. Not thread safe, each thread
+        /// needs a cache of its own.
+        pub const Cache = struct {
+            config: RegexMatchConfig,
+            max_states: u32,
+
+            sets: std.ArrayListUnmanaged(T) = .{},
+            /// Index of each set in `sets`.
+            indices: std.AutoHashMapUnmanaged(T, u32) = .{},
+            /// `next[i][b]` is one more than the index of the set reached
+            /// from `sets[i]` over byte `b`, or 0 if not known yet.
+            next: std.ArrayListUnmanaged([256]u32) = .{},
+
+            /// Every state takes a little over 1KiB.
+            pub const default_max_states = 128;
+
+            pub fn init(c: RegexMatchConfig, max_states: u32) Cache {
+                return .{ .config = c, .max_states = max_states };
+            }
+
+            pub fn deinit(self: *Cache, a: mem.Allocator) void {
+                self.sets.deinit(a);
+                self.indices.deinit(a);
+                self.next.deinit(a);
+                self.* = undefined;
+            }
+
+            fn clear(self: *Cache) void {
+                self.sets.clearRetainingCapacity();
+                self.indices.clearRetainingCapacity();
+                self.next.clearRetainingCapacity();
+            }
+
+            /// Returns the index of `set`, adding it if is not known yet.
+            /// Returns null if there is no room for it.
+            fn find(self: *Cache, a: mem.Allocator, set: T) ?u32 {
+                if (self.indices.get(set)) |index| return index;
+                if (self.sets.items.len >= self.max_states) return null;
+
+                const index: u32 = @intCast(self.sets.items.len);
+                self.sets.ensureUnusedCapacity(a, 1) catch return null;
+                self.next.ensureUnusedCapacity(a, 1) catch return null;
+                self.indices.put(a, set, index) catch return null;
+                self.sets.appendAssumeCapacity(set);
+                self.next.appendAssumeCapacity([_]u32{0} ** 256);
+                return index;
+            }
+        };
+
+        pub fn compile(a: mem.Allocator, rex: []const u8) !Self {
+            return compileSet(a, &.{rex});
+        }
+
+        /// Compiles up to max_set_patterns expressions into a single set of
+        /// rules, so that matchSet() can find all of them matching a string
+        /// in one pass over it.
+        pub fn compileSet(a: mem.Allocator, rexs: []const []const u8) !Self {
+            const rules = try compileSetRules(a, rexs);
+            defer rules.deinit(a);
+            return fromRules(a, rules, rexs);
+        }
+
+        /// Helper for compileSet() and WideRegexUnmanaged. Renumbers the
+        /// states of `rules` into T, in the same order, and derives the
+        /// tables. Returns error.RegexTooComplex if they do not fit.
+        fn fromRules(a: mem.Allocator, rules: WideRules, rexs: []const []const u8) !Self {
+            debug.assert(rules.patterns == rexs.len);
+            if (rules.stateCount() > cfg.state_bits) return error.RegexTooComplex;
+            const others = rules.usedStates() & ~(WideRules.start_state | rules.endStates());
+
+            var rules_owned: struct { from: []T, to: []T, when: []u8 } = undefined;
+            rules_owned.from = try a.alloc(T, rules.from.len);
+            errdefer a.free(rules_owned.from);
+            rules_owned.to = try a.alloc(T, rules.to.len);
+            errdefer a.free(rules_owned.to);
+            rules_owned.when = try a.dupe(u8, rules.when);
+            errdefer a.free(rules_owned.when);
+            for (rules_owned.from, rules.from) |*f, w| f.* = narrowState(others, rules.patterns, w);
+            for (rules_owned.to, rules.to) |*t, w| t.* = narrowState(others, rules.patterns, w);
+
+            const tables = try a.create(Tables);
+            errdefer a.destroy(tables);
+            tables.exact = try ByteTable.build(a, rules_owned.from, rules_owned.to, rules_owned.when, false);
+            errdefer a.free(tables.exact.targets);
+            tables.folded = try ByteTable.build(a, rules_owned.from, rules_owned.to, rules_owned.when, true);
+            errdefer a.free(tables.folded.targets);
+            tables.patterns = @intCast(rules.patterns);
+            tables.ends = empty_state;
+            for (0..rules.patterns) |i| tables.ends |= @as(T, end_state) >> @intCast(i);
+            buildClosure(&tables.closure, rules_owned.from, rules_owned.to, rules_owned.when);
+
+            tables.literals = try a.alloc(Literal, rexs.len);
+            var literals_done: usize = 0;
+            errdefer {
+                for (tables.literals[0..literals_done]) |literal| freeLiteral(a, literal);
+                a.free(tables.literals);
+            }
+            for (tables.literals, rexs) |*literal, rex| {
+                literal.exact = try requiredLiteral(a, rex);
+                errdefer a.free(literal.exact);
+                literal.folded = try a.alloc(u8, literal.exact.len);
+                for (literal.folded, literal.exact) |*f, l| f.* = foldCase(l);
+                literals_done += 1;
             }
 
-            const rules_owned = try cmp.getOwned(a);
             return .{
                 .from = rules_owned.from,
                 .to = rules_owned.to,
                 .when = rules_owned.when,
+                .tables = tables,
             };
         }
 
+        /// Helper for fromRules(). Maps a single state of WideRules, where
+        /// `others` holds all of their states but the start and end states.
+        fn narrowState(others: WideT, patterns: usize, state: WideT) T {
+            debug.assert(@popCount(state) == 1);
+            if (state == WideRules.start_state) return start_state;
+            if (@clz(state) < patterns) return @as(T, end_state) >> @intCast(@clz(state));
+            return @as(T, 1) << @intCast(1 + @popCount(others & (state - 1)));
+        }
+
+        fn freeLiteral(a: mem.Allocator, literal: Literal) void {
+            a.free(literal.exact);
+            a.free(literal.folded);
+        }
+
         pub fn deinit(self: Self, a: mem.Allocator) void {
             a.free(self.from);
             a.free(self.to);
             a.free(self.when);
+            a.free(self.tables.exact.targets);
+            a.free(self.tables.folded.targets);
+            for (self.tables.literals) |literal| freeLiteral(a, literal);
+            a.free(self.tables.literals);
+            a.destroy(self.tables);
         }
 
         pub fn match(self: Self, c: RegexMatchConfig, str: []const u8) bool {
-            var states = self.applyAlwaysActionableRules(c, start_state, str.len == 0) orelse return true;
-            var skip: usize = 0;
-            for (str, 0..) |ch, index| {
-                if (skip > 0) {
-                    skip -= 1;
-                    continue;
+            return self.matchSet(c, str) != 0;
+        }
+
+        /// Returns which of the expressions given to compileSet() match
+        /// `str`, with bit `i` set if the expression at index `i` does.
+        pub fn matchSet(self: Self, c: RegexMatchConfig, str: []const u8) u64 {
+            const possible = self.possiblePatterns(c, str);
+            if (possible == 0) return 0;
+            const initial = self.closureOf(start_state);
+            return self.matchFrom(c, initial, self.reachedEnds(c, initial), str, 0, possible);
+        }
+
+        /// Helper for matchSet() and matchSetCached(). Continues matching at
+        /// `str[start]` from `initial`, with the exit states in `reached`
+        /// already reached. Only the expressions in `possible` are reported.
+        fn matchFrom(
+            self: Self,
+            c: RegexMatchConfig,
+            initial: T,
+            reached: T,
+            str: []const u8,
+            start: usize,
+            possible: u64,
+        ) u64 {
+            const ends = self.tables.ends;
+            var states = initial;
+            var matched = reached;
+            for (str[start..]) |ch| {
+                // In substring mode there is nothing left to find once every
+                // expression matched, and in exact mode once nothing can.
+                if (matched == ends) break;
+                states = self.nextStates(c, states, ch);
+                switch (c.mode) {
+                    .substring => matched |= states & ends,
+                    .exact => if (states == empty_state) break,
                 }
-                const reached_end = index == str.len - 1;
-                states = self.applyRules(c, states, ch, reached_end, &skip) orelse return true;
-                if (c.mode == .substring) states |= start_state;
-                states = self.applyAlwaysActionableRules(c, states, reached_end) orelse return true;
-                if (c.mode == .exact and states == empty_state) return false;
+            } else {
+                if (c.mode == .exact) matched |= states & ends;
             }
-            return false;
+            return self.patternsOf(matched) & possible;
         }
 
-        /// Helper for match(). Applies rules, except for always actionable
-        /// rules. Returns null if end_state is reached.
-        fn applyRules(self: Self, c: RegexMatchConfig, current: T, _ch: u8, reached_end: bool, skip: *usize) ?T {
-            debug.assert(skip.* == 0);
-            const ch = if (c.case == .ignore and ascii.isAlphabetic(_ch)) ascii.toLower(_ch) else _ch;
-            var states: T = empty_state;
-            for (self.from, self.to, self.when) |f, t, _w| {
-                const w = if (c.case == .ignore and ascii.isAlphabetic(_w)) ascii.toLower(_w) else _w;
-                if ((w == ch or (w == 1 and ch != '\n')) and (f & current) > 0) {
-                    states |= t;
-
-                    // If we encounter the end state we may only return null
-                    // if we either do not care whether the rest of the string
-                    // matches the rules (meaning we are _not_ in exact matching mode)
-                    // or when we have reached the end of the input string.
-                    if ((states & end_state) > 0 and (c.mode == .substring or reached_end)) {
-                        return null;
-                    }
+        pub fn matchCached(self: Self, a: mem.Allocator, cache: *Cache, str: []const u8) bool {
+            return self.matchSetCached(a, cache, str) != 0;
+        }
 
-                    // Make . selector correctly skip multi-byte codepoints.
-                    if (w == 1) {
-                        const bytelen = unicode.utf8ByteSequenceLength(ch) catch 1;
-                        skip.* = bytelen - 1;
+        /// Same as matchSet() with the configuration of `cache`, but steps
+        /// through the DFA in `cache`, adding the states and transitions it
+        /// is missing along the way. Falls back to matchSet() on the rest of
+        /// the string if the cache runs out of room twice.
+        pub fn matchSetCached(self: Self, a: mem.Allocator, cache: *Cache, str: []const u8) u64 {
+            const c = cache.config;
+            const possible = self.possiblePatterns(c, str);
+            if (possible == 0) return 0;
+
+            const ends = self.tables.ends;
+            const initial = self.closureOf(start_state);
+            var matched = self.reachedEnds(c, initial);
+            var current = cache.find(a, initial) orelse
+                return self.matchFrom(c, initial, matched, str, 0, possible);
+            var cleared = false;
+            for (str, 0..) |ch, index| {
+                if (matched == ends) break;
+                var next = cache.next.items[current][ch];
+                if (next == 0) {
+                    const set = cache.sets.items[current];
+                    const target = self.nextStates(c, set, ch);
+                    var found = cache.find(a, target);
+                    if (found == null and !cleared) {
+                        cleared = true;
+                        cache.clear();
+                        current = cache.find(a, set) orelse
+                            return self.matchFrom(c, set, matched, str, index, possible);
+                        found = cache.find(a, target);
                     }
+                    next = 1 + (found orelse
+                        return self.matchFrom(c, set, matched, str, index, possible));
+                    cache.next.items[current][ch] = next;
+                }
+                current = next - 1;
+
+                const states = cache.sets.items[current];
+                switch (c.mode) {
+                    .substring => matched |= states & ends,
+                    .exact => if (states == empty_state) break,
+                }
+            } else {
+                if (c.mode == .exact) matched |= cache.sets.items[current] & ends;
+            }
+            return self.patternsOf(matched) & possible;
+        }
+
+        /// Helper for matchSet() and matchSetCached(). Returns the
+        /// expressions that can match `str`, ruling out those lacking their
+        /// required literal. This rejects most strings a lot faster than the
+        /// rules would.
+        fn possiblePatterns(self: Self, c: RegexMatchConfig, str: []const u8) u64 {
+            var possible: u64 = 0;
+            for (self.tables.literals, 0..) |literal, i| {
+                const found = literal.exact.len == 0 or switch (c.case) {
+                    .exact => findLiteral(str, literal.exact, false),
+                    .ignore => findLiteral(str, literal.folded, true),
+                };
+                if (found) possible |= @as(u64, 1) << @intCast(i);
+            }
+            return possible;
+        }
+
+        /// Returns the exit states in `initial` that count as reached before
+        /// any input. In exact mode they only count at the end of the input.
+        fn reachedEnds(self: Self, c: RegexMatchConfig, initial: T) T {
+            return if (c.mode == .substring) initial & self.tables.ends else empty_state;
+        }
+
+        /// Turns the exit states in `ends` into the matching expressions.
+        fn patternsOf(self: Self, ends: T) u64 {
+            var patterns: u64 = 0;
+            for (0..self.tables.patterns) |i| {
+                if ((ends & (@as(T, end_state) >> @intCast(i))) > 0) {
+                    patterns |= @as(u64, 1) << @intCast(i);
                 }
             }
+            return patterns;
+        }
+
+        /// Returns the states after one step over `ch`.
+        fn nextStates(self: Self, c: RegexMatchConfig, current: T, ch: u8) T {
+            var states = self.ruleTargets(c, current, ch);
+            if (c.mode == .substring) states |= start_state;
+            return self.closureOf(states);
+        }
+
+        /// Returns the states reached from `current` over `_ch` by rules,
+        /// except for always actionable rules.
+        fn ruleTargets(self: Self, c: RegexMatchConfig, current: T, _ch: u8) T {
+            const ch = if (c.case == .ignore) foldCase(_ch) else _ch;
+            const table = if (c.case == .ignore) &self.tables.folded else &self.tables.exact;
+
+            const sources = table.sources[ch];
+            const targets = table.targets[table.offsets[ch]..];
+            var states: T = empty_state;
+            var active = current & sources;
+            while (active > 0) : (active &= active - 1) {
+                // The targets of the lowest active state come after those of
+                // the sources below it.
+                const lowest = active & (0 -% active);
+                states |= targets[@popCount(sources & (lowest - 1))];
+            }
             return states;
         }
 
-        /// Helper for match().  Applies always actionable rules, which act
-        /// "immediately". Returns null if end_state is reached.
-        fn applyAlwaysActionableRules(self: Self, c: RegexMatchConfig, current: T, reached_end: bool) ?T {
-            var states: T = current;
-            var check_again: bool = true;
-            while (check_again) {
-                for (self.from, self.to, self.when) |f, t, w| {
-                    // Is rule always actionable, matches our state and has
-                    // not been applied yet?
-                    if (w == 0 and (f & states) > 0 and (t & states) == 0) {
-                        states |= t;
-                        check_again = true;
-
-                        // If we have encountered the end state, we may return
-                        // null only if we are not in exact match mode and as such
-                        // do not care whether the rest of the string matches,
-                        // or if we have reached the end of the string.
-                        if ((states & end_state) > 0 and
-                            (c.mode == .substring or reached_end))
-                        {
-                            return null;
+        /// Returns `current` and the states reached from it by always
+        /// actionable rules.
+        fn closureOf(self: Self, current: T) T {
+            var states: T = empty_state;
+            var bits = current;
+            while (bits > 0) : (bits &= bits - 1) states |= self.tables.closure[@ctz(bits)];
+            return states;
+        }
+
+        /// Helper for compile(). Computes the closure of every single state
+        /// over the always actionable rules, repeating until nothing changes
+        /// since rules may point back to states handled earlier.
+        fn buildClosure(closure: *[cfg.state_bits]T, from: []const T, to: []const T, when: []const u8) void {
+            for (closure, 0..) |*states, i| states.* = @as(T, 1) << @intCast(i);
+            var changed = true;
+            while (changed) {
+                changed = false;
+                for (closure) |*states| {
+                    for (from, to, when) |f, t, w| {
+                        if (w == 0 and (f & states.*) > 0 and (t & ~states.*) > 0) {
+                            states.* |= t;
+                            changed = true;
                         }
-                    } else {
-                        check_again = false;
                     }
                 }
             }
-            return states;
         }
 
         pub fn dumpDot(self: Self, writer: anytype) !void {
             try writer.writeAll("digraph exre {\n");
             for (self.from, self.to, self.when) |f, t, w| {
                 try writer.writeByte('\t');
-                try writeDotStateName(writer, f);
+                try self.writeDotStateName(writer, f);
                 try writer.writeAll(" -> ");
-                try writeDotStateName(writer, t);
+                try self.writeDotStateName(writer, t);
                 switch (w) {
                     0 => try writer.writeByte('\n'),
-                    1 => try writer.writeAll(" [label=\".\"]\n"),
                     else => {
                         if (ascii.isAlphanumeric(w)) {
                             try writer.print(" [label=\"{c}\"]\n", .{w});
@@ -197,23 +517,160 @@ pub fn RegexUnmanaged(comptime cfg: RegexTypeConfig) type {
             try writer.writeAll("}\n");
         }
 
-        fn writeDotStateName(writer: anytype, s: T) !void {
+        fn writeDotStateName(self: Self, writer: anytype, s: T) !void {
             if (s == start_state) {
                 try writer.writeAll("start");
-            } else if (s == end_state) {
+            } else if (s == end_state and self.tables.patterns == 1) {
                 try writer.writeAll("end");
+            } else if ((s & self.tables.ends) > 0) {
+                try writer.print("end{}", .{@clz(s)});
             } else {
-                var i: u8 = 0;
-                var y: T = s;
-                while (y > 0) : (i += 1) {
-                    y >>= 1;
-                }
-                try writer.print("s{}", .{i - 1});
+                try writer.print("s{}", .{@ctz(s)});
             }
         }
     };
 }
 
+/// Like Regex(), but the width of the state bitfield is picked at runtime,
+/// as the narrowest one from 64 to max_state_bits bits that fits the compiled
+/// expression. Large expressions are supported, while small ones match just
+/// as fast as with Regex(.{}).
+pub const WideRegex = struct {
+    const Self = @This();
+    pub const Cache = WideRegexUnmanaged.Cache;
+
+    alloc: mem.Allocator,
+    r: WideRegexUnmanaged,
+
+    pub fn compile(a: mem.Allocator, rex: []const u8) !Self {
+        return .{
+            .alloc = a,
+            .r = try WideRegexUnmanaged.compile(a, rex),
+        };
+    }
+
+    pub fn compileSet(a: mem.Allocator, rexs: []const []const u8) !Self {
+        return .{
+            .alloc = a,
+            .r = try WideRegexUnmanaged.compileSet(a, rexs),
+        };
+    }
+
+    pub fn deinit(self: Self) void {
+        self.r.deinit(self.alloc);
+    }
+
+    pub fn match(self: Self, c: RegexMatchConfig, str: []const u8) bool {
+        return self.r.match(c, str);
+    }
+
+    pub fn initCache(self: Self, c: RegexMatchConfig, max_states: u32) Cache {
+        return self.r.initCache(c, max_states);
+    }
+
+    pub fn matchCached(self: Self, cache: *Cache, str: []const u8) bool {
+        return self.r.matchCached(self.alloc, cache, str);
+    }
+
+    pub fn matchSet(self: Self, c: RegexMatchConfig, str: []const u8) u64 {
+        return self.r.matchSet(c, str);
+    }
+
+    pub fn matchSetCached(self: Self, cache: *Cache, str: []const u8) u64 {
+        return self.r.matchSetCached(self.alloc, cache, str);
+    }
+
+    pub fn dumpDot(self: Self, writer: anytype) !void {
+        try self.r.dumpDot(writer);
+    }
+};
+
+pub const WideRegexUnmanaged = struct {
+    const Self = @This();
+
+    const Variant = union(enum) {
+        @"64": RegexUnmanaged(.{ .state_bits = 64 }),
+        @"128": RegexUnmanaged(.{ .state_bits = 128 }),
+        @"256": RegexUnmanaged(.{ .state_bits = 256 }),
+        @"512": RegexUnmanaged(.{ .state_bits = 512 }),
+        @"1024": RegexUnmanaged(.{ .state_bits = 1024 }),
+    };
+
+    /// Can only be used with the regex it was made for by initCache().
+    pub const Cache = union(enum) {
+        @"64": RegexUnmanaged(.{ .state_bits = 64 }).Cache,
+        @"128": RegexUnmanaged(.{ .state_bits = 128 }).Cache,
+        @"256": RegexUnmanaged(.{ .state_bits = 256 }).Cache,
+        @"512": RegexUnmanaged(.{ .state_bits = 512 }).Cache,
+        @"1024": RegexUnmanaged(.{ .state_bits = 1024 }).Cache,
+
+        pub const default_max_states = RegexUnmanaged(.{}).Cache.default_max_states;
+
+        pub fn deinit(self: *Cache, a: mem.Allocator) void {
+            switch (self.*) {
+                inline else => |*cache| cache.deinit(a),
+            }
+        }
+    };
+
+    r: Variant,
+
+    pub fn compile(a: mem.Allocator, rex: []const u8) !Self {
+        return compileSet(a, &.{rex});
+    }
+
+    pub fn compileSet(a: mem.Allocator, rexs: []const []const u8) !Self {
+        const rules = try compileSetRules(a, rexs);
+        defer rules.deinit(a);
+        const states = rules.stateCount();
+        inline for (@typeInfo(Variant).@"union".fields) |field| {
+            if (states <= field.type.state_bits) {
+                const r = try field.type.fromRules(a, rules, rexs);
+                return .{ .r = @unionInit(Variant, field.name, r) };
+            }
+        }
+        return error.RegexTooComplex;
+    }
+
+    pub fn deinit(self: Self, a: mem.Allocator) void {
+        switch (self.r) {
+            inline else => |r| r.deinit(a),
+        }
+    }
+
+    pub fn match(self: Self, c: RegexMatchConfig, str: []const u8) bool {
+        return self.matchSet(c, str) != 0;
+    }
+
+    pub fn initCache(self: Self, c: RegexMatchConfig, max_states: u32) Cache {
+        return switch (self.r) {
+            inline else => |_, tag| @unionInit(Cache, @tagName(tag), .init(c, max_states)),
+        };
+    }
+
+    pub fn matchCached(self: Self, a: mem.Allocator, cache: *Cache, str: []const u8) bool {
+        return self.matchSetCached(a, cache, str) != 0;
+    }
+
+    pub fn matchSet(self: Self, c: RegexMatchConfig, str: []const u8) u64 {
+        return switch (self.r) {
+            inline else => |r| r.matchSet(c, str),
+        };
+    }
+
+    pub fn matchSetCached(self: Self, a: mem.Allocator, cache: *Cache, str: []const u8) u64 {
+        return switch (self.r) {
+            inline else => |r, tag| r.matchSetCached(a, &@field(cache, @tagName(tag)), str),
+        };
+    }
+
+    pub fn dumpDot(self: Self, writer: anytype) !void {
+        switch (self.r) {
+            inline else => |r| try r.dumpDot(writer),
+        }
+    }
+};
+
 test "Regex" {
     const testing = std.testing;
     {
@@ -362,11 +819,31 @@ test "Regex" {
         try testing.expect(r.match(.{ .case = .ignore }, "Aa"));
         try testing.expect(r.match(.{ .case = .ignore }, "aA"));
     }
+    {
+        var r = try Regex(.{}).compile(testing.allocator, "x[Bc]+Ä");
+        defer r.deinit();
+        try testing.expect(!r.match(.{ .case = .exact }, "xbcÄ"));
+        try testing.expect(r.match(.{ .case = .exact }, "xBcÄ"));
+        try testing.expect(r.match(.{ .case = .ignore }, "XbCÄ"));
+        try testing.expect(!r.match(.{ .case = .ignore }, "XbCä"));
+        try testing.expect(r.match(.{ .mode = .substring, .case = .ignore }, "..XBBCCÄ.."));
+    }
     {
         var r = try Regex(.{}).compile(testing.allocator, "a.b");
         defer r.deinit();
         try testing.expect(r.match(.{}, "acb"));
         try testing.expect(r.match(.{}, "aµb"));
+        try testing.expect(!r.match(.{}, "a\nb"));
+        try testing.expect(!r.match(.{ .mode = .substring }, "a\nbab"));
+    }
+    {
+        var r = try Regex(.{}).compile(testing.allocator, "(ab|ac|b.d)+e");
+        defer r.deinit();
+        try testing.expect(r.match(.{}, "abe"));
+        try testing.expect(r.match(.{}, "acabbxde"));
+        try testing.expect(!r.match(.{}, "ade"));
+        try testing.expect(r.match(.{ .mode = .substring }, "xxbxdexx"));
+        try testing.expect(!r.match(.{ .mode = .substring }, "xxbxxexx"));
     }
     {
         var r = try Regex(.{}).compile(testing.allocator, "a.?b");
@@ -391,6 +868,245 @@ test "Regex" {
         try testing.expect(r.match(.{}, "aµµöäüb"));
         try testing.expect(r.match(.{}, "ab"));
     }
+    {
+        var r = try Regex(.{}).compile(testing.allocator, "a*|c*b");
+        defer r.deinit();
+        try testing.expect(r.match(.{}, ""));
+        try testing.expect(r.match(.{}, "aa"));
+        try testing.expect(r.match(.{}, "ccb"));
+        try testing.expect(!r.match(.{}, "c"));
+        try testing.expect(!r.match(.{}, "acb"));
+    }
+    {
+        var r = try Regex(.{}).compile(testing.allocator, "(ab)*c|a");
+        defer r.deinit();
+        try testing.expect(r.match(.{}, "ababc"));
+        try testing.expect(r.match(.{}, "a"));
+        try testing.expect(!r.match(.{}, "ab"));
+        try testing.expect(!r.match(.{}, "aba"));
+    }
+}
+
+/// Rules as compiled from one or more expressions, with max_state_bits wide
+/// states. The highest `patterns` states are the exit states of the
+/// expressions, the last one belonging to the first expression.
+const WideRules = struct {
+    const start_state: WideT = 1;
+    const end_state: WideT = 1 << (max_state_bits - 1);
+
+    from: []WideT,
+    to: []WideT,
+    when: []u8,
+    patterns: usize = 1,
+
+    fn deinit(self: WideRules, a: mem.Allocator) void {
+        a.free(self.from);
+        a.free(self.to);
+        a.free(self.when);
+    }
+
+    fn endStates(self: WideRules) WideT {
+        var states: WideT = 0;
+        for (0..self.patterns) |i| states |= end_state >> @intCast(i);
+        return states;
+    }
+
+    fn usedStates(self: WideRules) WideT {
+        var states: WideT = start_state | self.endStates();
+        for (self.from, self.to) |f, t| states |= f | t;
+        return states;
+    }
+
+    /// Returns how many state bits the rules need, counting the start and
+    /// end states even if they are unused.
+    fn stateCount(self: WideRules) usize {
+        return @popCount(self.usedStates());
+    }
+};
+
+fn compileRules(a: mem.Allocator, rex: []const u8) !WideRules {
+    var cmp = try Compiler(WideT).new(a);
+    defer cmp.deinit(a);
+
+    var it = Tokenizer.from(rex);
+    while (try it.next()) |token| {
+        switch (token) {
+            .literal => |l| if (l == 1) try cmp.addAny(a) else try cmp.addLiteral(a, l),
+            .multibyte_literal => |l| try cmp.addMultiByteLiteral(a, l),
+            .literal_array => |ar| try cmp.addLiteralArray(a, ar),
+            .modifier => |m| try cmp.addModifier(a, m),
+            .@"or" => try cmp.addOr(a),
+            .open_block => try cmp.openSubblock(a),
+            .close_block => try cmp.closeSubblock(a),
+        }
+    }
+
+    const rules_owned = try cmp.getOwned(a);
+    return .{
+        .from = rules_owned.from,
+        .to = rules_owned.to,
+        .when = rules_owned.when,
+    };
+}
+
+/// Compiles every expression on its own and merges the results. All of them
+/// share the start state, which no rule leads back into.
+fn compileSetRules(a: mem.Allocator, rexs: []const []const u8) !WideRules {
+    if (rexs.len == 0) return error.RegexInvalid;
+    if (rexs.len > max_set_patterns) return error.RegexTooComplex;
+    if (rexs.len == 1) return compileRules(a, rexs[0]);
+
+    var from: std.ArrayListUnmanaged(WideT) = .{};
+    errdefer from.deinit(a);
+    var to: std.ArrayListUnmanaged(WideT) = .{};
+    errdefer to.deinit(a);
+    var when: std.ArrayListUnmanaged(u8) = .{};
+    errdefer when.deinit(a);
+
+    // The next free state, counting from the start state.
+    var next_state: usize = 1;
+    for (rexs, 0..) |rex, i| {
+        const rules = try compileRules(a, rex);
+        defer rules.deinit(a);
+
+        const others = rules.usedStates() & ~(WideRules.start_state | WideRules.end_state);
+        const count = @popCount(others);
+        if (next_state + count + rexs.len > max_state_bits) return error.RegexTooComplex;
+
+        const end = WideRules.end_state >> @intCast(i);
+        for (rules.from, rules.to, rules.when) |f, t, w| {
+            try from.append(a, setState(others, next_state, end, f));
+            try to.append(a, setState(others, next_state, end, t));
+            try when.append(a, w);
+        }
+        next_state += count;
+    }
+
+    const from_owned = try from.toOwnedSlice(a);
+    errdefer a.free(from_owned);
+    const to_owned = try to.toOwnedSlice(a);
+    errdefer a.free(to_owned);
+    const when_owned = try when.toOwnedSlice(a);
+    return .{
+        .from = from_owned,
+        .to = to_owned,
+        .when = when_owned,
+        .patterns = rexs.len,
+    };
+}
+
+/// Helper for compileSetRules(). Moves a single state of an expression to
+/// its place in the set, where its states other than the start and end state,
+/// `others`, start at state bit `first`.
+fn setState(others: WideT, first: usize, end: WideT, state: WideT) WideT {
+    if (state == WideRules.start_state) return state;
+    if (state == WideRules.end_state) return end;
+    return @as(WideT, 1) << @intCast(first + @popCount(others & (state - 1)));
+}
+
+/// Lowercases ASCII letters. The reserved values for `when` are left alone.
+fn foldCase(ch: u8) u8 {
+    return if (ascii.isAlphabetic(ch)) ascii.toLower(ch) else ch;
+}
+
+/// Returns the longest run of literals outside of blocks, which any string
+/// matching `rex` must contain. Returns an empty string if there is no such
+/// run, for example when `rex` has an or outside of blocks.
+fn requiredLiteral(a: mem.Allocator, rex: []const u8) ![]u8 {
+    var best: std.ArrayListUnmanaged(u8) = .{};
+    errdefer best.deinit(a);
+    var run: std.ArrayListUnmanaged(u8) = .{};
+    defer run.deinit(a);
+    // Length of the last literal in run, or 0 if something else came after.
+    var last_len: usize = 0;
+    var depth: usize = 0;
+
+    var it = Tokenizer.from(rex);
+    while (try it.next()) |token| {
+        if (depth > 0) {
+            switch (token) {
+                .open_block => depth += 1,
+                .close_block => depth -= 1,
+                else => {},
+            }
+            continue;
+        }
+
+        switch (token) {
+            .literal => |l| if (l > 1) {
+                try run.append(a, l);
+                last_len = 1;
+                continue;
+            },
+            .multibyte_literal => |l| {
+                try run.appendSlice(a, l);
+                last_len = l.len;
+                continue;
+            },
+            // The last literal is optional, or following copies of it may
+            // come in between it and the next literal.
+            .modifier => |m| if (m != '+') run.shrinkRetainingCapacity(run.items.len - last_len),
+            .@"or" => {
+                best.clearRetainingCapacity();
+                return best.toOwnedSlice(a);
+            },
+            .open_block => depth += 1,
+            .literal_array, .close_block => {},
+        }
+
+        if (run.items.len > best.items.len) mem.swap(std.ArrayListUnmanaged(u8), &run, &best);
+        run.clearRetainingCapacity();
+        last_len = 0;
+    }
+    if (run.items.len > best.items.len) mem.swap(std.ArrayListUnmanaged(u8), &run, &best);
+    return best.toOwnedSlice(a);
+}
+
+/// Returns whether `haystack` contains `needle`. With `fold`, ASCII letters
+/// in `haystack` are lowercased before comparing and `needle` must be
+/// lowercased already. Candidates are found by comparing the first and last
+/// byte of `needle` against a vector of positions at once.
+fn findLiteral(haystack: []const u8, needle: []const u8, fold: bool) bool {
+    debug.assert(needle.len > 0);
+    if (haystack.len < needle.len) return false;
+
+    const len = std.simd.suggestVectorLength(u8) orelse 16;
+    const V = @Vector(len, u8);
+    const Mask = std.meta.Int(.unsigned, len);
+    const first: V = @splat(needle[0]);
+    const last: V = @splat(needle[needle.len - 1]);
+    const positions = haystack.len - needle.len + 1;
+
+    var start: usize = 0;
+    while (start + len <= positions) : (start += len) {
+        const firsts = foldVector(V, haystack[start..][0..len].*, fold);
+        const lasts = foldVector(V, haystack[start + needle.len - 1 ..][0..len].*, fold);
+        const first_mask: Mask = @bitCast(firsts == first);
+        const last_mask: Mask = @bitCast(lasts == last);
+        var candidates = first_mask & last_mask;
+        while (candidates > 0) : (candidates &= candidates - 1) {
+            const position = start + @ctz(candidates);
+            if (eqlLiteral(haystack[position..][0..needle.len], needle, fold)) return true;
+        }
+    }
+    for (start..positions) |position| {
+        if (eqlLiteral(haystack[position..][0..needle.len], needle, fold)) return true;
+    }
+    return false;
+}
+
+fn foldVector(comptime V: type, v: V, fold: bool) V {
+    if (!fold) return v;
+    const upper = (v -% @as(V, @splat('A'))) < @as(V, @splat(26));
+    return v | @select(u8, upper, @as(V, @splat(0x20)), @as(V, @splat(0)));
+}
+
+fn eqlLiteral(bytes: []const u8, needle: []const u8, fold: bool) bool {
+    if (!fold) return mem.eql(u8, bytes, needle);
+    for (bytes, needle) |b, n| {
+        if (foldCase(b) != n) return false;
+    }
+    return true;
 }
 
 fn Compiler(comptime T: type) type {
@@ -403,6 +1119,8 @@ fn Compiler(comptime T: type) type {
             start: T,
             end: T,
             before_last_subblock: T,
+            /// Index of the first rule added for the last subblock.
+            last_subblock_rule: usize,
         };
 
         blocks: std.ArrayListUnmanaged(Block) = .{},
@@ -420,6 +1138,7 @@ fn Compiler(comptime T: type) type {
                 .start = start_state,
                 .end = end_state,
                 .before_last_subblock = start_state,
+                .last_subblock_rule = 0,
             });
             return cmp;
         }
@@ -439,6 +1158,7 @@ fn Compiler(comptime T: type) type {
         } {
             if (self.blocks.items.len != 1) return error.RegexInvalid;
             try self.closeSubblock(a);
+            self.removeRedundantStates();
             const from_owned = try self.from.toOwnedSlice(a);
             errdefer a.free(from_owned);
             const to_owned = try self.to.toOwnedSlice(a);
@@ -453,14 +1173,73 @@ fn Compiler(comptime T: type) type {
         }
 
         fn nextState(self: *Self) !T {
-            debug.assert(self.state_counter < math.maxInt(T));
-            self.state_counter <<= 1;
-            if (self.current_state == end_state) {
+            if (self.state_counter << 1 == end_state) {
                 return error.RegexTooComplex;
             }
+            self.state_counter <<= 1;
             return self.state_counter;
         }
 
+        /// Removes states which are only left through a single always
+        /// actionable rule, like the ends of blocks and ors, by leading the
+        /// rules into such a state to its target instead. Repeats until
+        /// nothing changes, as that can leave self-loops or duplicate rules
+        /// behind, whose removal exposes more such states.
+        fn removeRedundantStates(self: *Self) void {
+            var changed = true;
+            while (changed) {
+                changed = false;
+
+                var index: usize = 0;
+                while (index < self.from.items.len) {
+                    const f = self.from.items[index];
+                    const t = self.to.items[index];
+                    if (f == start_state or f == end_state or f == t or
+                        self.when.items[index] != 0 or
+                        mem.count(T, self.from.items, &.{f}) != 1)
+                    {
+                        index += 1;
+                        continue;
+                    }
+                    for (self.to.items) |*to| {
+                        if (to.* == f) to.* = t;
+                    }
+                    self.removeRule(index);
+                    changed = true;
+                }
+
+                index = 0;
+                while (index < self.from.items.len) {
+                    if (self.isRedundantRule(index)) {
+                        self.removeRule(index);
+                        changed = true;
+                    } else {
+                        index += 1;
+                    }
+                }
+            }
+        }
+
+        /// Helper for removeRedundantStates(). Returns whether the rule at
+        /// `index` is an always actionable self-loop or a copy of an
+        /// earlier rule.
+        fn isRedundantRule(self: *Self, index: usize) bool {
+            const f = self.from.items[index];
+            const t = self.to.items[index];
+            const w = self.when.items[index];
+            if (w == 0 and f == t) return true;
+            for (self.from.items[0..index], self.to.items[0..index], self.when.items[0..index]) |ef, et, ew| {
+                if (ef == f and et == t and ew == w) return true;
+            }
+            return false;
+        }
+
+        fn removeRule(self: *Self, index: usize) void {
+            _ = self.from.orderedRemove(index);
+            _ = self.to.orderedRemove(index);
+            _ = self.when.orderedRemove(index);
+        }
+
         fn currentBlock(self: *Self) *Block {
             return &self.blocks.items[self.blocks.items.len - 1];
         }
@@ -474,14 +1253,50 @@ fn Compiler(comptime T: type) type {
         pub fn addLiteral(self: *Self, a: mem.Allocator, l: u8) !void {
             const cb = self.currentBlock();
             cb.before_last_subblock = self.current_state;
+            cb.last_subblock_rule = self.from.items.len;
             const new_state = try self.nextState();
             try self.rule(a, self.current_state, new_state, l);
             self.current_state = new_state;
         }
 
+        /// Adds the `.` selector, which matches any one codepoint except for
+        /// newlines, byte by byte. Bytes which can not start a UTF-8
+        /// sequence match on their own.
+        pub fn addAny(self: *Self, a: mem.Allocator) !void {
+            const cb = self.currentBlock();
+            cb.before_last_subblock = self.current_state;
+            cb.last_subblock_rule = self.from.items.len;
+            const after = try self.nextState();
+
+            // Reached after a leading byte, with `n` continuation bytes left.
+            var continuations: [4]T = undefined;
+            continuations[0] = after;
+            for (1..continuations.len) |n| {
+                continuations[n] = try self.nextState();
+                for (0x80..0xC0) |byte| {
+                    try self.rule(a, continuations[n], continuations[n - 1], @intCast(byte));
+                }
+            }
+
+            // Byte 0 is reserved for always actionable rules.
+            for (1..256) |b| {
+                const byte: u8 = @intCast(b);
+                if (byte == '\n') continue;
+                const left: usize = switch (byte) {
+                    0xC0...0xDF => 1,
+                    0xE0...0xEF => 2,
+                    0xF0...0xF7 => 3,
+                    else => 0,
+                };
+                try self.rule(a, self.current_state, continuations[left], byte);
+            }
+            self.current_state = after;
+        }
+
         pub fn addMultiByteLiteral(self: *Self, a: mem.Allocator, mbl: []const u8) !void {
             const cb = self.currentBlock();
             cb.before_last_subblock = self.current_state;
+            cb.last_subblock_rule = self.from.items.len;
             var next_state: T = self.current_state;
             for (mbl) |byte| {
                 next_state = try self.nextState();
@@ -494,6 +1309,7 @@ fn Compiler(comptime T: type) type {
             const cb = self.currentBlock();
 
             cb.before_last_subblock = self.current_state;
+            cb.last_subblock_rule = self.from.items.len;
             const after = try self.nextState();
 
             var escape: bool = false;
@@ -550,12 +1366,13 @@ fn Compiler(comptime T: type) type {
             switch (mod) {
                 // Block matches zero or more.
                 '*' => {
+                    const loop = try self.loopState(a);
+                    try self.rule(a, self.current_state, loop, 0);
                     try self.rule(a, cb.before_last_subblock, self.current_state, 0);
-                    try self.rule(a, self.current_state, cb.before_last_subblock, 0);
                 },
 
                 // Block matches one or more.
-                '+' => try self.rule(a, self.current_state, cb.before_last_subblock, 0),
+                '+' => try self.rule(a, self.current_state, try self.loopState(a), 0),
 
                 // Block matches zero or one.
                 '?' => try self.rule(a, cb.before_last_subblock, self.current_state, 0),
@@ -564,13 +1381,29 @@ fn Compiler(comptime T: type) type {
             }
         }
 
+        /// Helper for addModifier(). Returns a new state that enters the last
+        /// subblock again, by copying the rules leading into it. Looping back
+        /// to before_last_subblock itself would also take the rules of
+        /// whatever else starts there, like the other branches of an or.
+        fn loopState(self: *Self, a: mem.Allocator) !T {
+            const cb = self.currentBlock();
+            const loop = try self.nextState();
+            for (cb.last_subblock_rule..self.from.items.len) |index| {
+                if (self.from.items[index] != cb.before_last_subblock) continue;
+                try self.rule(a, loop, self.to.items[index], self.when.items[index]);
+            }
+            return loop;
+        }
+
         pub fn openSubblock(self: *Self, a: mem.Allocator) !void {
             const cb = self.currentBlock();
             cb.before_last_subblock = self.current_state;
+            cb.last_subblock_rule = self.from.items.len;
             const end = try self.nextState();
             try self.blocks.append(a, .{
                 .start = self.current_state,
                 .before_last_subblock = self.current_state,
+                .last_subblock_rule = self.from.items.len,
                 .end = end,
             });
         }
@@ -691,6 +1524,134 @@ const Tokenizer = struct {
     }
 };
 
+test "Regex cache" {
+    const testing = std.testing;
+    const patterns = [_][]const u8{ "ab*c", "a(b|c)d", "a.+b", "x[Bc]+Ä", "(ab|ac|b.d)+e", "a*|c*b" };
+    const strings = [_][]const u8{ "", "abc", "ac", "abbbbc", "acd", "abd", "aµb", "aµ", "xBcÄ", "xbCä", "abacbxde", "ccb", "acb", "a\nb", "vvabcvv" };
+    const configs = [_]RegexMatchConfig{
+        .{},
+        .{ .mode = .substring },
+        .{ .case = .ignore },
+        .{ .mode = .substring, .case = .ignore },
+    };
+    for (patterns) |pattern| {
+        var r = try Regex(.{}).compile(testing.allocator, pattern);
+        defer r.deinit();
+        for (configs) |c| {
+            // A budget of two states forces clearing and falling back.
+            for ([_]u32{ 2, Regex(.{}).Cache.default_max_states }) |max_states| {
+                var cache = Regex(.{}).Cache.init(c, max_states);
+                defer cache.deinit(testing.allocator);
+                for (0..2) |_| {
+                    for (strings) |str| {
+                        try testing.expectEqual(r.match(c, str), r.matchCached(&cache, str));
+                    }
+                }
+            }
+        }
+    }
+}
+
+test "Required literal" {
+    const testing = std.testing;
+    const cases = [_][2][]const u8{
+        .{ "ab*c", "a" },
+        .{ "ab+c", "ab" },
+        .{ "foo(bar)?bazz", "bazz" },
+        .{ "x[Bc]+Ä", "Ä" },
+        .{ "a.Äb", "Äb" },
+        .{ "ab\\.c", "ab.c" },
+        .{ "(a|b)cd", "cd" },
+        .{ "a|bcd", "" },
+        .{ ".*", "" },
+    };
+    for (cases) |case| {
+        const literal = try requiredLiteral(testing.allocator, case[0]);
+        defer testing.allocator.free(literal);
+        try testing.expectEqualStrings(case[1], literal);
+    }
+
+    const haystack = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    try testing.expect(findLiteral(haystack, "0", false));
+    try testing.expect(findLiteral(haystack, "XYZ", false));
+    try testing.expect(findLiteral(haystack, "opqrstuvwxyzA", false));
+    try testing.expect(!findLiteral(haystack, "xyz0", false));
+    try testing.expect(!findLiteral(haystack, "wxyzabc", false));
+    try testing.expect(findLiteral(haystack, "wxyzabc", true));
+    try testing.expect(!findLiteral("ab", "abc", false));
+}
+
+test "Wide regex" {
+    const testing = std.testing;
+    {
+        // Each name needs a state per letter, so 64 bits are not enough.
+        const rex = "Radiohead|Portishead|Massive Attack|Bjork|Aphex Twin|Boards of Canada|Burial|Four Tet|Autechre|Squarepusher";
+        try testing.expectError(error.RegexTooComplex, Regex(.{}).compile(testing.allocator, rex));
+        var r = try WideRegex.compile(testing.allocator, rex);
+        defer r.deinit();
+        try testing.expect(r.r == .@"128");
+        try testing.expect(r.match(.{}, "Four Tet"));
+        try testing.expect(!r.match(.{}, "Four"));
+        try testing.expect(r.match(.{ .mode = .substring, .case = .ignore }, "03 - burial - archangel.flac"));
+
+        var cache = r.initCache(.{ .mode = .substring }, WideRegex.Cache.default_max_states);
+        defer cache.deinit(testing.allocator);
+        try testing.expect(r.matchCached(&cache, "Aphex Twin - Xtal.mp3"));
+        try testing.expect(!r.matchCached(&cache, "Xtal.mp3"));
+    }
+    {
+        var r = try WideRegex.compile(testing.allocator, "a(b|c)*d");
+        defer r.deinit();
+        try testing.expect(r.r == .@"64");
+        try testing.expect(r.match(.{}, "abcbd"));
+        try testing.expect(!r.match(.{}, "abca"));
+    }
+    {
+        // Without the states for ends of blocks this fits in two states.
+        var r = try Regex(.{ .state_bits = 3 }).compile(testing.allocator, "((a))");
+        defer r.deinit();
+        try testing.expect(r.match(.{}, "a"));
+        try testing.expect(!r.match(.{}, "aa"));
+    }
+}
+
+test "Regex set" {
+    const testing = std.testing;
+    {
+        var r = try Regex(.{}).compileSet(testing.allocator, &.{ "a.c", "ä", "b+" });
+        defer r.deinit();
+        try testing.expectEqual(@as(u64, 0b001), r.matchSet(.{}, "abc"));
+        try testing.expectEqual(@as(u64, 0b001), r.matchSet(.{}, "aäc"));
+        try testing.expectEqual(@as(u64, 0b010), r.matchSet(.{}, "ä"));
+        try testing.expectEqual(@as(u64, 0b100), r.matchSet(.{}, "bbb"));
+        try testing.expectEqual(@as(u64, 0b000), r.matchSet(.{}, "abbc"));
+        try testing.expectEqual(@as(u64, 0b111), r.matchSet(.{ .mode = .substring }, "xaäc bb"));
+        try testing.expectEqual(@as(u64, 0b010), r.matchSet(.{ .mode = .substring }, "ä"));
+        try testing.expectEqual(@as(u64, 0b000), r.matchSet(.{ .mode = .substring }, ""));
+        try testing.expectEqual(@as(u64, 0b101), r.matchSet(.{ .mode = .substring, .case = .ignore }, "ABC"));
+        try testing.expect(r.match(.{ .mode = .substring }, "xbx"));
+        try testing.expect(!r.match(.{ .mode = .substring }, "xyz"));
+
+        var cache = Regex(.{}).Cache.init(.{ .mode = .substring }, Regex(.{}).Cache.default_max_states);
+        defer cache.deinit(testing.allocator);
+        try testing.expectEqual(@as(u64, 0b111), r.matchSetCached(&cache, "xaäc bb"));
+        try testing.expectEqual(@as(u64, 0b110), r.matchSetCached(&cache, "äb"));
+        try testing.expectEqual(@as(u64, 0b000), r.matchSetCached(&cache, "xyz"));
+    }
+    {
+        var r = try WideRegex.compileSet(testing.allocator, &.{ "Radiohead|Portishead", "Massive Attack|Bjork", "Burial|Four Tet" });
+        defer r.deinit();
+        try testing.expect(r.r == .@"64");
+        try testing.expectEqual(@as(u64, 0b100), r.matchSet(.{ .mode = .substring }, "Four Tet - Two Thousand and Seventeen.flac"));
+        try testing.expectEqual(@as(u64, 0b011), r.matchSet(.{ .mode = .substring }, "Bjork & Portishead"));
+    }
+    {
+        try testing.expectError(error.RegexInvalid, Regex(.{}).compileSet(testing.allocator, &.{}));
+        const rexs = [_][]const u8{"a"} ** (max_set_patterns + 1);
+        try testing.expectError(error.RegexTooComplex, WideRegex.compileSet(testing.allocator, &rexs));
+    }
+}
+
 test "Tokenizer" {
     const testing = std.testing;
     {